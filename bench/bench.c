@@ -0,0 +1,530 @@
+// Benchmark harness: generates a reproducible synthetic corpus and grammar from a features .csv
+// file, then times each phase of deriving the corpus
+// See project README.md for details
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "structures.h"
+#include "parsing.h"
+#include "derive.h"
+#include "fst.h"
+#include "util.h"
+
+#define USAGE \
+    "Usage: bench [options] features-file\n" \
+    "  --seed n             seed for every random choice (default 1)\n" \
+    "  --words n            words in the corpus (default 1000000)\n" \
+    "  --types n            distinct words the corpus is drawn from (default 20000)\n" \
+    "  --zipf s             Zipf exponent for how often each type is drawn; 0 is uniform\n" \
+    "                       (default 1)\n" \
+    "  --min-length n       fewest segments in a word (default 2)\n" \
+    "  --max-length n       most segments in a word (default 10)\n" \
+    "  --rules n            rules in the grammar (default 100)\n" \
+    "  --max-context n      longest rule context, including the focus (default 4)\n" \
+    "  --max-features n     most features specified by each feature matrix in a rule (default 3)\n" \
+    "  --right-rules p      fraction of rules applied right-to-left (default 0.5)\n" \
+    "  --fst                apply rules with transducers, as phonologen --fst does\n" \
+    "  --batch n            also apply rules rule by rule to batches of n words at a time, as\n" \
+    "                       phonologen --batch does, and time that against word by word\n" \
+    "  --write-corpus file  also write the corpus to a file\n" \
+    "  --write-rules file   also write the grammar to a file\n"
+
+// Bytes of output buffered before it's thrown away, as much as phonologen buffers before writing
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+// Probability that a position in a rule is a segment from the chart rather than a feature matrix
+#define SEGMENT_PROBABILITY 0.3
+
+// Settings for one benchmark run
+struct bench_options {
+    uint64_t seed;
+    unsigned long words;
+    unsigned long types;
+    double zipf;
+    unsigned long min_length;
+    unsigned long max_length;
+    unsigned long rules;
+    unsigned long max_context;
+    unsigned long max_features;
+    double right_rules;
+    char fst;
+    unsigned long batch;
+    const char *corpus_file;
+    const char *rules_file;
+};
+
+// State of the random number generator (splitmix64, so runs are reproducible everywhere)
+static uint64_t random_state;
+
+// Returns a uniformly random 64-bit number
+static uint64_t random_next(void) {
+    uint64_t z = (random_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Returns a uniformly random number below bound, which must not be 0
+static unsigned long random_below(unsigned long bound) {
+    return random_next() % bound;
+}
+
+// Returns a uniformly random number in [0, 1)
+static double random_unit(void) {
+    return (random_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Returns seconds on a monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a whole number option, exiting with an error if it isn't one
+static unsigned long parse_count(const char *arg) {
+    char *end;
+    unsigned long value = strtoul(arg, &end, 10);
+    fail_if(end == arg || *end, "Error: invalid number %s\n", arg);
+    return value;
+}
+
+// Parses a real number option, exiting with an error if it isn't one
+static double parse_real(const char *arg) {
+    char *end;
+    double value = strtod(arg, &end);
+    fail_if(end == arg || *end, "Error: invalid number %s\n", arg);
+    return value;
+}
+
+// Writes a random segment name, from an array of count of them, to a byte buffer
+static void append_segment(struct byte_buffer *out, const char **segments, unsigned int count) {
+    const char *name = segments[random_below(count)];
+    byte_buffer_append(out, name, strlen(name));
+}
+
+// Writes a random feature matrix specifying between 1 and max_features of the features in usable
+// (an array of count feature indices) to a byte buffer
+static void append_fmatrix(
+        struct byte_buffer *out,
+        const struct grammar *g,
+        const unsigned int *usable,
+        unsigned int count,
+        unsigned long max_features) {
+    unsigned long specified = 1 + random_below(max_features);
+    byte_buffer_append(out, "[", 1);
+    // Pick distinct features by partially shuffling a copy of usable
+    unsigned int picks[count];
+    memcpy(picks, usable, sizeof(picks));
+    for (unsigned long x = 0; x < specified && x < count; x++) {
+        unsigned long y = x + random_below(count - x);
+        unsigned int swap = picks[x];
+        picks[x] = picks[y];
+        picks[y] = swap;
+        byte_buffer_append(out, random_below(2) ? " +" : " -", 2);
+        const char *name = g->feature_names[picks[x]];
+        byte_buffer_append(out, name, strlen(name));
+    }
+    byte_buffer_append(out, " ]", 2);
+}
+
+// Writes a random segment or feature matrix to a byte buffer
+static void append_position(
+        struct byte_buffer *out,
+        const struct grammar *g,
+        const char **segments,
+        unsigned int segment_count,
+        const unsigned int *usable,
+        unsigned int usable_count,
+        unsigned long max_features) {
+    if (random_unit() < SEGMENT_PROBABILITY) {
+        append_segment(out, segments, segment_count);
+    } else {
+        append_fmatrix(out, g, usable, usable_count, max_features);
+    }
+}
+
+// Generates a random grammar in the rules .txt format for a grammar's chart, one rule per line
+static void generate_rules(
+        const struct bench_options *options,
+        const struct grammar *g,
+        const char **segments,
+        unsigned int segment_count,
+        struct byte_buffer *out) {
+    // Feature names with spaces in them can't be written in a rule, since rules split on spaces
+    unsigned int usable[g->feature_count + 1];
+    unsigned int usable_count = 0;
+    for (unsigned int f = 0; f < g->feature_count; f++) {
+        if (!strpbrk(g->feature_names[f], " \t")) {
+            usable[usable_count++] = f;
+        }
+    }
+    fail_if(!usable_count, "Error: no feature names usable in rules\n");
+    for (unsigned long x = 0; x < options->rules; x++) {
+        byte_buffer_append(out, random_unit() < options->right_rules ? "R " : "L ", 2);
+        append_position(
+            out, g, segments, segment_count, usable, usable_count, options->max_features);
+        byte_buffer_append(out, " > ", 3);
+        // Outputs change just a feature or two
+        append_fmatrix(out, g, usable, usable_count, 2);
+        byte_buffer_append(out, " /", 2);
+        unsigned long context_length = 1 + random_below(options->max_context);
+        unsigned long focus = random_below(context_length);
+        for (unsigned long y = 0; y < context_length; y++) {
+            byte_buffer_append(out, " ", 1);
+            if (y == focus) {
+                byte_buffer_append(out, "_", 1);
+            } else {
+                append_position(
+                    out, g, segments, segment_count, usable, usable_count,
+                    options->max_features);
+            }
+        }
+        byte_buffer_append(out, "\n", 1);
+    }
+}
+
+// Generates a random corpus: options->types random words made of chart segments, from which
+// options->words tokens are drawn with Zipfian frequencies, separated by spaces and newlines
+static void generate_corpus(
+        const struct bench_options *options,
+        const char **segments,
+        unsigned int segment_count,
+        struct byte_buffer *out) {
+    // Every type, one after another, with its start offset
+    struct byte_buffer types = {0};
+    size_t *type_start = malloc((options->types + 1) * sizeof(*type_start));
+    // Cumulative weight of every type, for sampling by binary search
+    double *cumulative = malloc(options->types * sizeof(*cumulative));
+    fail_if(!type_start || !cumulative, "Error: unable to allocate memory\n");
+    double total = 0;
+    for (unsigned long x = 0; x < options->types; x++) {
+        type_start[x] = types.length;
+        unsigned long length = options->min_length
+            + random_below(options->max_length - options->min_length + 1);
+        for (unsigned long y = 0; y < length; y++) {
+            append_segment(&types, segments, segment_count);
+        }
+        total += pow(x + 1, -options->zipf);
+        cumulative[x] = total;
+    }
+    type_start[options->types] = types.length;
+    for (unsigned long x = 0; x < options->words; x++) {
+        double target = random_unit() * total;
+        unsigned long low = 0;
+        unsigned long high = options->types - 1;
+        while (low < high) {
+            unsigned long middle = (low + high) / 2;
+            if (cumulative[middle] <= target) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        byte_buffer_append(out, types.data + type_start[low], type_start[low + 1] - type_start[low]);
+        byte_buffer_append(out, x % 16 == 15 ? "\n" : " ", 1);
+    }
+    free(types.data);
+    free(type_start);
+    free(cumulative);
+}
+
+// Writes a byte buffer to a file
+static void write_file(const char *path, const struct byte_buffer *buffer) {
+    FILE *fp = fopen(path, "wb");
+    fail_if(!fp, "Error opening %s for writing\n", path);
+    fwrite(buffer->data, 1, buffer->length, fp);
+    fail_if(fclose(fp), "Error writing %s\n", path);
+}
+
+// Parses command-line arguments, generates a workload, and times every phase of deriving it
+// Returns EXIT_SUCCESS on success, EXIT_FAILURE on failure
+int main(int argc, char *argv[]) {
+    struct bench_options options = {
+        .seed = 1,
+        .words = 1000000,
+        .types = 20000,
+        .zipf = 1,
+        .min_length = 2,
+        .max_length = 10,
+        .rules = 100,
+        .max_context = 4,
+        .max_features = 3,
+        .right_rules = 0.5,
+    };
+    int arg;
+    for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+        char has_value = arg + 1 < argc;
+        if (!strcmp(argv[arg], "--seed") && has_value) {
+            options.seed = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--words") && has_value) {
+            options.words = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--types") && has_value) {
+            options.types = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--zipf") && has_value) {
+            options.zipf = parse_real(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--min-length") && has_value) {
+            options.min_length = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--max-length") && has_value) {
+            options.max_length = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--rules") && has_value) {
+            options.rules = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--max-context") && has_value) {
+            options.max_context = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--max-features") && has_value) {
+            options.max_features = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--right-rules") && has_value) {
+            options.right_rules = parse_real(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--fst")) {
+            options.fst = 1;
+        } else if (!strcmp(argv[arg], "--batch") && has_value) {
+            options.batch = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--write-corpus") && has_value) {
+            options.corpus_file = argv[++arg];
+        } else if (!strcmp(argv[arg], "--write-rules") && has_value) {
+            options.rules_file = argv[++arg];
+        } else {
+            fail_if(1, USAGE);
+        }
+    }
+    fail_if(argc - arg != 1, USAGE);
+    fail_if(!options.types, "Error: --types must be at least 1\n");
+    fail_if(
+        !options.min_length || options.min_length > options.max_length,
+        "Error: word lengths must be at least 1, with --min-length at most --max-length\n");
+    fail_if(
+        !options.rules || !options.max_context,
+        "Error: there must be at least one rule, with contexts at least 1 long\n");
+    fail_if(!options.max_features, "Error: --max-features must be at least 1\n");
+    random_state = options.seed;
+
+    struct grammar grammar;
+    grammar_init(&grammar);
+
+    // Feature parse
+    double start = now();
+    FILE *fp = fopen(argv[arg], "rb");
+    fail_if(!fp, "Error opening features .csv file %s\n", argv[arg]);
+    parse_features(&grammar, fp);
+    fclose(fp);
+    double features_seconds = now() - start;
+
+    unsigned int segment_count = grammar.segment_lookup_table.count;
+    fail_if(!segment_count, "Error: no segments in %s\n", argv[arg]);
+    const char **segments = malloc(segment_count * sizeof(*segments));
+    fail_if(!segments, "Error: unable to allocate memory\n");
+    // The table is in no particular order, so sort it to keep workloads reproducible
+    segment_count = 0;
+    for (size_t x = 0; x < grammar.segment_lookup_table.capacity; x++) {
+        if (grammar.segment_lookup_table.slots[x].key) {
+            segments[segment_count++] = grammar.segment_lookup_table.slots[x].key;
+        }
+    }
+    for (unsigned int x = 1; x < segment_count; x++) {
+        for (unsigned int y = x; y && strcmp(segments[y - 1], segments[y]) > 0; y--) {
+            const char *swap = segments[y];
+            segments[y] = segments[y - 1];
+            segments[y - 1] = swap;
+        }
+    }
+
+    struct byte_buffer rules_text = {0};
+    generate_rules(&options, &grammar, segments, segment_count, &rules_text);
+    struct byte_buffer corpus = {0};
+    generate_corpus(&options, segments, segment_count, &corpus);
+    free(segments);
+    if (options.rules_file) {
+        write_file(options.rules_file, &rules_text);
+    }
+    if (options.corpus_file) {
+        write_file(options.corpus_file, &corpus);
+    }
+
+    // Rule parse, from a temporary file since parse_rules reads from a FILE *
+    fp = tmpfile();
+    fail_if(!fp, "Error: unable to create a temporary file\n");
+    fwrite(rules_text.data, 1, rules_text.length, fp);
+    rewind(fp);
+    start = now();
+    parse_rules(&grammar, fp);
+    double rules_seconds = now() - start;
+    fclose(fp);
+    free(rules_text.data);
+
+    // Segmentation of every word, into one array of IDs with the offset each word starts at
+    struct word word = {0};
+    struct byte_buffer ids = {0};
+    size_t *word_start = malloc((options.words + 1) * sizeof(*word_start));
+    fail_if(!word_start, "Error: unable to allocate memory\n");
+    unsigned long word_count = 0;
+    start = now();
+    const char *text = corpus.data;
+    const char *end = corpus.data + corpus.length;
+    while (text < end) {
+        const char *word_end = text;
+        while (word_end < end && *word_end != ' ' && *word_end != '\n') {
+            word_end++;
+        }
+        parse_word(&grammar, text, word_end - text, &word);
+        word_start[word_count++] = ids.length / sizeof(fmatrix_id_t);
+        byte_buffer_append(&ids, word.ids, word.length * sizeof(*word.ids));
+        text = word_end + 1;
+    }
+    word_start[word_count] = ids.length / sizeof(fmatrix_id_t);
+    double segmentation_seconds = now() - start;
+    size_t segment_total = word_start[word_count];
+
+    // Rule application, word by word in place
+    struct derivation derivation;
+    derivation_init(&derivation, &grammar);
+    if (options.fst) {
+        derivation_use_fst(&derivation, FST_DEFAULT_TRANSITIONS);
+    }
+    fmatrix_id_t *all_ids = (fmatrix_id_t *) ids.data;
+    // Batched derivation needs its own copy of the underlying forms
+    fmatrix_id_t *underlying = NULL;
+    if (options.batch) {
+        underlying = malloc((segment_total ? segment_total : 1) * sizeof(*underlying));
+        fail_if(!underlying, "Error: unable to allocate memory\n");
+        memcpy(underlying, all_ids, segment_total * sizeof(*underlying));
+    }
+    start = now();
+    for (unsigned long x = 0; x < word_count; x++) {
+        // Generated rules never insert or delete segments, so every word stays where it is
+        long length = word_start[x + 1] - word_start[x];
+        struct word derived = {all_ids + word_start[x], length, length};
+        derive_word(&derivation, &derived);
+    }
+    double derive_seconds = now() - start;
+
+    // Rule application again, rule by rule over batches of words, which must come out the same
+    double batch_seconds = 0;
+    if (options.batch) {
+        struct derivation batched;
+        derivation_init(&batched, &grammar);
+        // Each batch is copied into a block of its own first, just as phonologen gathers them
+        size_t batch_capacity = 0;
+        fmatrix_id_t *batch_ids = NULL;
+        size_t *batch_starts = malloc((options.batch + 1) * sizeof(*batch_starts));
+        fail_if(!batch_starts, "Error: unable to allocate memory\n");
+        for (unsigned long x = 0; x < word_count; x += options.batch) {
+            unsigned long count = word_count - x < options.batch ? word_count - x : options.batch;
+            size_t first = word_start[x];
+            size_t size = word_start[x + count] - first;
+            if (size > batch_capacity) {
+                free(batch_ids);
+                batch_capacity = size * 2;
+                batch_ids = malloc(batch_capacity * sizeof(*batch_ids));
+                fail_if(!batch_ids, "Error: unable to allocate memory\n");
+            }
+            memcpy(batch_ids, underlying + first, size * sizeof(*batch_ids));
+            for (unsigned long y = 0; y <= count; y++) {
+                batch_starts[y] = word_start[x + y] - first;
+            }
+            start = now();
+            derive_batch(&batched, &batch_ids, &batch_capacity, batch_starts, count);
+            batch_seconds += now() - start;
+            fail_if(
+                batch_starts[count] != size
+                    || memcmp(batch_ids, all_ids + first, size * sizeof(*batch_ids)),
+                "Error: batched rule application came out differently\n");
+        }
+        derivation_free(&batched);
+        free(batch_ids);
+        free(batch_starts);
+        free(underlying);
+    }
+
+    // Output, spelled into a buffer that's emptied every OUTPUT_BUFFER_SIZE bytes just as phonologen
+    // writes it, short of writing it anywhere
+    struct byte_buffer output = {0};
+    size_t output_bytes = 0;
+    start = now();
+    for (unsigned long x = 0; x < word_count; x++) {
+        for (size_t y = word_start[x]; y < word_start[x + 1]; y++) {
+            unsigned int length;
+            const char *spelling = fmatrix_spelling(&grammar, all_ids[y], &length);
+            byte_buffer_append(&output, spelling, length);
+        }
+        byte_buffer_append(&output, " ", 1);
+        if (output.length >= OUTPUT_BUFFER_SIZE) {
+            output_bytes += output.length;
+            output.length = 0;
+        }
+    }
+    output_bytes += output.length;
+    double output_seconds = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf(
+        "workload: seed %llu, %lu words (%lu types, zipf %g, %lu-%lu segments), %lu rules "
+        "(contexts up to %lu, up to %lu features, %g right-to-left)%s",
+        (unsigned long long) options.seed,
+        options.words,
+        options.types,
+        options.zipf,
+        options.min_length,
+        options.max_length,
+        options.rules,
+        options.max_context,
+        options.max_features,
+        options.right_rules,
+        options.fst ? ", with transducers" : "");
+    if (options.batch) {
+        printf(", batches of %lu words", options.batch);
+    }
+    printf("\n");
+    printf(
+        "corpus: %zu bytes, %zu segments; output: %zu bytes\n",
+        corpus.length,
+        segment_total,
+        output_bytes);
+    printf("%-16s %12s %14s %12s\n", "phase", "seconds", "words/s", "ns/segment");
+    const char *phases[] = {
+        "feature parse", "rule parse", "segmentation", "rule application", "output"
+    };
+    double seconds[] = {
+        features_seconds, rules_seconds, segmentation_seconds, derive_seconds, output_seconds
+    };
+    for (unsigned int x = 0; x < sizeof(phases) / sizeof(*phases); x++) {
+        printf("%-16s %12.6f", phases[x], seconds[x]);
+        // Words/s and ns/segment only mean anything for phases that go through the corpus
+        if (x >= 2 && seconds[x] > 0 && segment_total) {
+            printf(" %14.0f %12.2f\n", word_count / seconds[x], seconds[x] * 1e9 / segment_total);
+        } else {
+            printf(" %14s %12s\n", "-", "-");
+        }
+    }
+    if (options.batch && batch_seconds > 0 && segment_total) {
+        printf(
+            "%-16s %12.6f %14.0f %12.2f\n",
+            "batched rules",
+            batch_seconds,
+            word_count / batch_seconds,
+            batch_seconds * 1e9 / segment_total);
+    }
+    double corpus_seconds = segmentation_seconds + derive_seconds + output_seconds;
+    printf(
+        "%-16s %12.6f %14.0f %12.2f\n",
+        "total (corpus)",
+        corpus_seconds,
+        corpus_seconds > 0 ? word_count / corpus_seconds : 0.0,
+        segment_total ? corpus_seconds * 1e9 / segment_total : 0.0);
+    // ru_maxrss is in kilobytes on Linux (and bytes on macOS)
+    printf("peak RSS: %ld KB\n", usage.ru_maxrss);
+
+    free(output.data);
+    derivation_free(&derivation);
+    free(word_start);
+    free(ids.data);
+    free(word.ids);
+    free(corpus.data);
+    grammar_free(&grammar);
+    return EXIT_SUCCESS;
+}
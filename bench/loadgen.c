@@ -0,0 +1,295 @@
+// Load generator for phonologen --serve: sends requests made of words from a corpus over several
+// connections at once, and reports throughput and latency percentiles
+// See project README.md for details
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "util.h"
+
+#define USAGE \
+    "Usage: loadgen [options] socket-path corpus-file\n" \
+    "  --connections n  connections to the server, each from its own thread (default 4)\n" \
+    "  --requests n     requests sent on each connection (default 10000)\n" \
+    "  --words n        words from the corpus in each request (default 16)\n" \
+    "  --pipeline n     requests each connection keeps in flight at once (default 1, so each\n" \
+    "                   waits for the last response)\n"
+
+// Number of bytes read from the server at a time
+#define READ_BYTES (64 << 10)
+
+// Settings for one run, and the corpus requests are made from
+struct loadgen_options {
+    const char *path;
+    unsigned long connections;
+    unsigned long requests;
+    unsigned long words;
+    unsigned long pipeline;
+    // Every word in the corpus, as offsets into its text
+    const char *text;
+    size_t *word_start;
+    size_t *word_end;
+    size_t word_count;
+};
+
+// One connection and its thread
+struct client {
+    pthread_t thread;
+    const struct loadgen_options *options;
+    // Which connection this is, so each starts at a different place in the corpus
+    unsigned long index;
+    // When every request was sent, and seconds from then until its response arrived
+    double *sent;
+    double *latency;
+};
+
+// Returns seconds on a monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a positive count, or exits with the usage message
+static unsigned long parse_count(const char *arg) {
+    char *end;
+    unsigned long count = strtoul(arg, &end, 10);
+    fail_if(*end || !count, USAGE);
+    return count;
+}
+
+// Appends request number id of a client to a byte buffer, header and all
+static void append_request(const struct client *client, uint32_t id, struct byte_buffer *out) {
+    const struct loadgen_options *options = client->options;
+    size_t header = out->length;
+    unsigned char fields[SERVER_REQUEST_HEADER] = {0};
+    byte_buffer_append(out, fields, sizeof(fields));
+    size_t first = (client->index * 7919 + (size_t) id * options->words) % options->word_count;
+    for (unsigned long x = 0; x < options->words; x++) {
+        size_t word = (first + x) % options->word_count;
+        if (x) {
+            byte_buffer_append(out, " ", 1);
+        }
+        byte_buffer_append(
+            out,
+            options->text + options->word_start[word],
+            options->word_end[word] - options->word_start[word]);
+    }
+    server_put32(fields, out->length - header - SERVER_REQUEST_HEADER);
+    server_put32(fields + 4, id);
+    memcpy(out->data + header, fields, sizeof(fields));
+}
+
+// Sends every request of a client over its own connection, keeping up to options->pipeline in
+// flight, and records the latency of each
+static void *client_run(void *arg) {
+    struct client *client = arg;
+    const struct loadgen_options *options = client->options;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    fail_if(fd < 0, "Error creating socket\n");
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    fail_if(strlen(options->path) >= sizeof(address.sun_path), "Error: socket path too long\n");
+    strcpy(address.sun_path, options->path);
+    fail_if(
+        connect(fd, (struct sockaddr *) &address, sizeof(address)),
+        "Error connecting to %s\n",
+        options->path);
+    fail_if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK), "Error setting up socket\n");
+
+    // Requests not yet written, from output_position on, and responses not yet read in full
+    struct byte_buffer output = {0};
+    size_t output_position = 0;
+    struct byte_buffer input = {0};
+    char buffer[READ_BYTES];
+    unsigned long sent = 0;
+    unsigned long received = 0;
+    while (received < options->requests) {
+        while (sent < options->requests && sent - received < options->pipeline) {
+            append_request(client, sent, &output);
+            client->sent[sent++] = now();
+        }
+        struct pollfd p = {fd, POLLIN | (output_position < output.length ? POLLOUT : 0), 0};
+        fail_if(poll(&p, 1, -1) < 0 && errno != EINTR, "Error waiting for the server\n");
+        if (p.revents & POLLOUT) {
+            ssize_t n = send(
+                fd, output.data + output_position, output.length - output_position, MSG_NOSIGNAL);
+            fail_if(n < 0 && errno != EAGAIN && errno != EINTR, "Error writing to the server\n");
+            if (n > 0) {
+                output_position += n;
+            }
+            if (output_position == output.length) {
+                output.length = output_position = 0;
+            }
+        }
+        if (!(p.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        fail_if(n < 0 && errno != EAGAIN && errno != EINTR, "Error reading from the server\n");
+        fail_if(!n, "Error: the server hung up\n");
+        if (n < 0) {
+            continue;
+        }
+        byte_buffer_append(&input, buffer, n);
+        const unsigned char *data = (const unsigned char *) input.data;
+        size_t position = 0;
+        while (input.length - position >= SERVER_RESPONSE_HEADER) {
+            uint32_t length = server_get32(data + position);
+            if (input.length - position - SERVER_RESPONSE_HEADER < length) {
+                break;
+            }
+            uint32_t id = server_get32(data + position + 4);
+            uint32_t status = server_get32(data + position + 8);
+            fail_if(
+                status,
+                "Error: request %lu failed: %.*s\n",
+                (unsigned long) id,
+                (int) length,
+                input.data + position + SERVER_RESPONSE_HEADER);
+            fail_if(
+                id >= sent || client->latency[id] >= 0,
+                "Error: unexpected response to request %lu\n",
+                (unsigned long) id);
+            client->latency[id] = now() - client->sent[id];
+            received++;
+            position += SERVER_RESPONSE_HEADER + length;
+        }
+        memmove(input.data, input.data + position, input.length - position);
+        input.length -= position;
+    }
+    close(fd);
+    free(output.data);
+    free(input.data);
+    return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Parses command-line arguments, reads the corpus, runs every client, and prints the results
+// Returns EXIT_SUCCESS on success, EXIT_FAILURE on failure
+int main(int argc, char *argv[]) {
+    struct loadgen_options options = {0};
+    options.connections = 4;
+    options.requests = 10000;
+    options.words = 16;
+    options.pipeline = 1;
+    int arg;
+    for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+        fail_if(arg + 1 >= argc, USAGE);
+        if (!strcmp(argv[arg], "--connections")) {
+            options.connections = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--requests")) {
+            options.requests = parse_count(argv[++arg]);
+            fail_if(options.requests > UINT32_MAX, "Error: too many requests\n");
+        } else if (!strcmp(argv[arg], "--words")) {
+            options.words = parse_count(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--pipeline")) {
+            options.pipeline = parse_count(argv[++arg]);
+        } else {
+            fail_if(1, USAGE);
+        }
+    }
+    fail_if(argc - arg != 2, USAGE);
+    options.path = argv[arg];
+
+    // The corpus, split into words
+    FILE *fp = fopen(argv[arg + 1], "rb");
+    fail_if(!fp, "Error opening corpus file %s\n", argv[arg + 1]);
+    struct byte_buffer corpus = {0};
+    char buffer[READ_BYTES];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp))) {
+        byte_buffer_append(&corpus, buffer, n);
+    }
+    fclose(fp);
+    struct byte_buffer starts = {0};
+    struct byte_buffer ends = {0};
+    for (size_t x = 0; x < corpus.length;) {
+        while (x < corpus.length && strchr(" \t\r\n", corpus.data[x])) {
+            x++;
+        }
+        if (x == corpus.length) {
+            break;
+        }
+        byte_buffer_append(&starts, &x, sizeof(x));
+        while (x < corpus.length && !strchr(" \t\r\n", corpus.data[x])) {
+            x++;
+        }
+        byte_buffer_append(&ends, &x, sizeof(x));
+    }
+    options.text = corpus.data;
+    options.word_start = (size_t *) starts.data;
+    options.word_end = (size_t *) ends.data;
+    options.word_count = starts.length / sizeof(size_t);
+    fail_if(!options.word_count, "Error: no words in %s\n", argv[arg + 1]);
+
+    struct client *clients = calloc(options.connections, sizeof(*clients));
+    fail_if(!clients, "Error: unable to allocate memory\n");
+    size_t total = options.connections * options.requests;
+    double *latencies = malloc(total * sizeof(*latencies));
+    double *sent = malloc(total * sizeof(*sent));
+    fail_if(!latencies || !sent, "Error: unable to allocate memory\n");
+    for (size_t x = 0; x < total; x++) {
+        latencies[x] = -1;
+    }
+    double start = now();
+    for (unsigned long x = 0; x < options.connections; x++) {
+        clients[x].options = &options;
+        clients[x].index = x;
+        clients[x].sent = sent + x * options.requests;
+        clients[x].latency = latencies + x * options.requests;
+        fail_if(
+            pthread_create(&clients[x].thread, NULL, client_run, clients + x),
+            "Error: unable to start thread\n");
+    }
+    for (unsigned long x = 0; x < options.connections; x++) {
+        pthread_join(clients[x].thread, NULL);
+    }
+    double seconds = now() - start;
+
+    qsort(latencies, total, sizeof(*latencies), compare_doubles);
+    printf(
+        "%lu connections, %lu requests each of %lu words, pipeline depth %lu\n",
+        options.connections,
+        options.requests,
+        options.words,
+        options.pipeline);
+    printf(
+        "%zu requests in %.6f s: %.0f requests/s, %.0f words/s\n",
+        total,
+        seconds,
+        total / seconds,
+        total * options.words / seconds);
+    printf("latency (us):");
+    const double percentiles[] = {50, 90, 99, 99.9};
+    for (unsigned int x = 0; x < sizeof(percentiles) / sizeof(*percentiles); x++) {
+        size_t rank = (size_t) (percentiles[x] / 100 * (total - 1) + 0.5);
+        printf(" p%g %.1f,", percentiles[x], latencies[rank] * 1e6);
+    }
+    printf(" max %.1f\n", latencies[total - 1] * 1e6);
+
+    free(latencies);
+    free(sent);
+    free(clients);
+    free(starts.data);
+    free(ends.data);
+    free(corpus.data);
+    return EXIT_SUCCESS;
+}
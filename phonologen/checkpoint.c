@@ -0,0 +1,661 @@
+// Checkpoint files of every word's form after each rule, for deriving a corpus again incrementally
+// while its grammar is being edited
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include "structures.h"
+#include "parsing.h"
+#include "derive.h"
+#include "stream.h"
+#include "checkpoint.h"
+#include "util.h"
+
+// Number of bytes of input derived at a time
+#define CHECKPOINT_CHUNK_SIZE (1 << 20)
+// Smallest number of slots in the table of words
+#define MIN_WORD_SLOTS 1024
+
+// First bytes of every checkpoint file
+static const char CHECKPOINT_MAGIC[8] = {'P', 'H', 'O', 'N', 'C', 'K', 'P', 'T'};
+
+// Start of every checkpoint file, written natively
+// It's followed by a hash of every rule, every interned feature matrix of the run that wrote it (so
+// its IDs can be mapped to those of the next run), and then every word
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t fmatrix_length;
+    // Hash of the feature chart; checkpoints of another chart are no use
+    uint64_t chart_hash;
+    uint32_t rule_count;
+    uint32_t fmatrix_count;
+    uint64_t word_count;
+};
+// Start of every word in a checkpoint file, followed by its text and then its stages
+struct checkpoint_word_header {
+    uint32_t text_length;
+    uint32_t through;
+    uint64_t stages_size;
+};
+
+// One distinct word of the corpus
+struct checkpoint_word {
+    uint64_t hash;
+    // Where its text is in the texts, and how long it is
+    size_t text;
+    uint32_t text_length;
+    // Number of rules its stages are known through
+    uint32_t through;
+    // Where its stages are in the stage pool, and how many uint32_ts they take up
+    // Every stage is the number of rules applied to the word, its length after them and then its
+    // IDs; there's one for stage 0 (the word as segmented) and one for every rule that changed it
+    size_t stages;
+    size_t stages_size;
+    // Where its surface form from the last run is in the stage pool (as a length and IDs), and
+    // whether it has one
+    size_t surface;
+    char had_surface;
+    // Whether it's been derived yet this run, and if so, where its surface form is in the stage
+    // pool (as a length and IDs)
+    char derived;
+    size_t form;
+};
+
+// Everything derive_checkpointed sets up, so it can all be freed whether or not deriving succeeds
+struct checkpoint_state {
+    struct grammar *grammar;
+    struct derivation derivation;
+    // Reused for every word
+    struct word word;
+    struct input_reader reader;
+    struct input_chunk chunk;
+    struct byte_buffer output;
+    // Every word, and an open-addressing hash table of them by text holding index + 1 (0 for empty
+    // slots)
+    struct checkpoint_word *words;
+    size_t word_count;
+    size_t word_capacity;
+    size_t *slots;
+    size_t slot_count;
+    // Text of every word, back to back, and the stages of every word, as uint32_ts
+    struct byte_buffer texts;
+    struct byte_buffer stages;
+    // Hash of every rule
+    uint64_t *rule_hashes;
+    // Checkpoint file as read, and the ID in this run of every feature matrix in it
+    struct byte_buffer file;
+    fmatrix_id_t *fmatrix_map;
+    // Number of rules, from the first, that are the same as in the last run
+    uint32_t unchanged;
+    // Spellings for reporting a change
+    struct byte_buffer old_spelling;
+    struct byte_buffer new_spelling;
+    // Counts for the summary
+    size_t resumed;
+    size_t started;
+    size_t changed;
+};
+
+// Returns a hash of every feature and segment of the grammar's chart
+static uint64_t chart_hash(const struct grammar *g) {
+    uint64_t hash = hash_mix(g->feature_count);
+    for (unsigned int f = 0; f < g->feature_count; f++) {
+        hash = hash_mix(hash ^ hash_string(g->feature_names[f], strlen(g->feature_names[f])));
+    }
+    // Segments are the named matrices; derived ones have no name, and always come after them
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count && fmatrix_name(g, id); id++) {
+        const char *name = fmatrix_name(g, id);
+        hash = hash_mix(hash ^ hash_string(name, strlen(name)));
+        hash = hash_mix(hash ^ hash_fmatrix(fmatrix_of(g, id), g->fmatrix_length));
+    }
+    return hash;
+}
+
+// Returns a hash of everything about the rule_index-th rule of the grammar but its line number
+static uint64_t rule_hash(const struct grammar *g, unsigned int rule_index) {
+    const struct rule_set *r = &g->rules;
+    uint64_t hash = hash_mix(
+        (uint64_t) r->context_lengths[rule_index] << 32
+        ^ (uint64_t) r->focus_positions[rule_index] << 8
+        ^ (unsigned char) r->directions[rule_index]);
+    hash = hash_mix(hash ^ r->pass_limits[rule_index]);
+    // Rules that change segments in place hash just as they did before there were other kinds
+    if (r->kinds[rule_index] != 'C') {
+        hash = hash_mix(hash ^ (unsigned char) r->kinds[rule_index]);
+    }
+    for (uint32_t x = r->matrix_starts[rule_index]; x < r->matrix_starts[rule_index + 1]; x++) {
+        hash = hash_mix(
+            hash ^ hash_fmatrix(r->matrices + (size_t) x * g->fmatrix_length, g->fmatrix_length));
+    }
+    return hash;
+}
+
+// Appends a uint32_t to a byte buffer
+static inline void append_uint32(struct byte_buffer *b, size_t value) {
+    uint32_t field = value;
+    byte_buffer_append(b, &field, sizeof(field));
+}
+
+// Returns the uint32_t at an index of the stage pool
+static inline uint32_t stage_get(const struct checkpoint_state *s, size_t index) {
+    uint32_t value;
+    memcpy(&value, s->stages.data + index * sizeof(value), sizeof(value));
+    return value;
+}
+
+// Appends a word's IDs to the stage pool, as its length and then the IDs
+static void stage_append(struct checkpoint_state *s, const fmatrix_id_t *ids, long len) {
+    append_uint32(&s->stages, len);
+    byte_buffer_append(&s->stages, ids, len * sizeof(*ids));
+}
+
+// Returns whether len IDs are the same as those of a form in the stage pool, given as the index of
+// its length
+static char stage_equals(
+        const struct checkpoint_state *s, size_t index, const fmatrix_id_t *ids, long len) {
+    return stage_get(s, index) == (uint32_t) len
+        && !memcmp(s->stages.data + (index + 1) * sizeof(uint32_t), ids, len * sizeof(*ids));
+}
+
+// Returns the index of the word with the given text, or s->word_count if there is none, in which
+// case the slot it would go in is written to the last parameter
+static size_t word_find(
+        const struct checkpoint_state *s,
+        const char *text,
+        size_t length,
+        uint64_t hash,
+        size_t *slot) {
+    if (!s->slot_count) {
+        *slot = 0;
+        return s->word_count;
+    }
+    size_t mask = s->slot_count - 1;
+    for (size_t x = hash & mask;; x = (x + 1) & mask) {
+        if (!s->slots[x]) {
+            *slot = x;
+            return s->word_count;
+        }
+        const struct checkpoint_word *w = s->words + s->slots[x] - 1;
+        if (w->hash == hash && w->text_length == length
+                && !memcmp(s->texts.data + w->text, text, length)) {
+            return s->slots[x] - 1;
+        }
+    }
+}
+
+// Adds a word with the given text and no stages, returning its index
+// Prints errors to stderr and exits on failure
+static size_t word_add(struct checkpoint_state *s, const char *text, size_t length, uint64_t hash) {
+    fail_if(length > UINT32_MAX, "Error: word too long for checkpoints\n");
+    // Keep the table at most half full
+    if ((s->word_count + 1) * 2 > s->slot_count) {
+        size_t slot_count = s->slot_count ? s->slot_count * 2 : MIN_WORD_SLOTS;
+        size_t *slots = calloc(slot_count, sizeof(*slots));
+        fail_if(!slots, "Error: unable to allocate memory\n");
+        for (size_t x = 0; x < s->word_count; x++) {
+            size_t y = s->words[x].hash & (slot_count - 1);
+            while (slots[y]) {
+                y = (y + 1) & (slot_count - 1);
+            }
+            slots[y] = x + 1;
+        }
+        free(s->slots);
+        s->slots = slots;
+        s->slot_count = slot_count;
+    }
+    if (s->word_count == s->word_capacity) {
+        size_t capacity = s->word_capacity ? s->word_capacity * 2 : 256;
+        struct checkpoint_word *words = realloc(s->words, capacity * sizeof(*words));
+        fail_if(!words, "Error: unable to allocate memory\n");
+        s->words = words;
+        s->word_capacity = capacity;
+    }
+    size_t slot;
+    word_find(s, text, length, hash, &slot);
+    struct checkpoint_word *w = s->words + s->word_count;
+    memset(w, 0, sizeof(*w));
+    w->hash = hash;
+    w->text = s->texts.length;
+    w->text_length = length;
+    byte_buffer_append(&s->texts, text, length);
+    s->slots[slot] = ++s->word_count;
+    return s->word_count - 1;
+}
+
+// Checkpoint file being loaded, read one field at a time
+struct checkpoint_reader {
+    const char *data;
+    size_t size;
+    size_t position;
+    const char *path;
+};
+
+// Copies the next size bytes of a checkpoint file to the given space
+// Prints errors to stderr and exits on failure
+static void checkpoint_read(struct checkpoint_reader *reader, void *space, size_t size) {
+    fail_if(
+        size > reader->size - reader->position,
+        "Error: checkpoint file %s is truncated; delete it to start over\n",
+        reader->path);
+    memcpy(space, reader->data + reader->position, size);
+    reader->position += size;
+}
+
+// Reads one word of a checkpoint file, keeping its stages up to the first rule that changed since
+// (with IDs mapped to this run's), and its surface form if it had one
+// old_rules and old_fmatrices are the rule and matrix counts of the run that wrote it
+// Prints errors to stderr and exits on failure
+static void checkpoint_load_word(
+        struct checkpoint_state *s,
+        struct checkpoint_reader *reader,
+        uint32_t old_rules,
+        uint32_t old_fmatrices) {
+    struct checkpoint_word_header header;
+    checkpoint_read(reader, &header, sizeof(header));
+    fail_if(
+        header.through > old_rules || header.text_length > reader->size - reader->position
+            || header.stages_size > (reader->size - reader->position) / sizeof(uint32_t),
+        "Error: checkpoint file %s is malformed; delete it to start over\n",
+        reader->path);
+    const char *text = reader->data + reader->position;
+    reader->position += header.text_length;
+    uint64_t hash = hash_string(text, header.text_length);
+    size_t slot;
+    fail_if(
+        word_find(s, text, header.text_length, hash, &slot) != s->word_count,
+        "Error: checkpoint file %s lists a word twice; delete it to start over\n",
+        reader->path);
+    size_t index = word_add(s, text, header.text_length, hash);
+    uint32_t through = header.through < s->unchanged ? header.through : s->unchanged;
+
+    // Read every stage onto the end of the pool, then cut it down to the ones still good
+    size_t stages = s->stages.length / sizeof(uint32_t);
+    size_t kept = stages;
+    size_t last = stages;
+    for (uint64_t left = header.stages_size; left;) {
+        uint32_t fields[2];
+        fail_if(
+            left < 2, "Error: checkpoint file %s is malformed; delete it to start over\n",
+            reader->path);
+        checkpoint_read(reader, fields, sizeof(fields));
+        left -= 2;
+        // Stages go up from 0 (the segmented word), and words are never empty
+        size_t position = s->stages.length / sizeof(uint32_t);
+        fail_if(
+            (position == stages ? fields[0] != 0 : fields[0] <= stage_get(s, last))
+                || fields[0] > header.through || !fields[1] || fields[1] > left,
+            "Error: checkpoint file %s is malformed; delete it to start over\n",
+            reader->path);
+        left -= fields[1];
+        last = position;
+        append_uint32(&s->stages, fields[0]);
+        append_uint32(&s->stages, fields[1]);
+        for (uint32_t x = 0; x < fields[1]; x++) {
+            fmatrix_id_t id;
+            checkpoint_read(reader, &id, sizeof(id));
+            fail_if(
+                id >= old_fmatrices,
+                "Error: checkpoint file %s is malformed; delete it to start over\n",
+                reader->path);
+            append_uint32(&s->stages, s->fmatrix_map[id]);
+        }
+        if (fields[0] <= through) {
+            kept = s->stages.length / sizeof(uint32_t);
+        }
+    }
+    fail_if(
+        kept == stages,
+        "Error: checkpoint file %s is malformed; delete it to start over\n",
+        reader->path);
+    struct checkpoint_word *w = s->words + index;
+    w->through = through;
+    w->stages = stages;
+    w->stages_size = kept - stages;
+    size_t end = kept;
+    if (header.through == old_rules) {
+        // Its last stage is its surface form, which goes right after the stages kept
+        w->had_surface = 1;
+        w->surface = kept;
+        if (last >= kept) {
+            size_t size = 1 + stage_get(s, last + 1);
+            memmove(
+                s->stages.data + kept * sizeof(uint32_t),
+                s->stages.data + (last + 1) * sizeof(uint32_t),
+                size * sizeof(uint32_t));
+            end = kept + size;
+        } else {
+            w->surface = last + 1;
+        }
+    }
+    s->stages.length = end * sizeof(uint32_t);
+}
+
+// Reads the checkpoint file at the given path, if there is one, finding how many rules are the same
+// as in the run that wrote it and keeping every word's stages up to there
+// A file of another version or feature chart is reported and ignored, since it will be replaced
+// Prints errors to stderr and exits on failure
+static void checkpoint_load(struct checkpoint_state *s, const char *path, FILE *report) {
+    struct grammar *g = s->grammar;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        if (report) {
+            fprintf(report, "checkpoints: no %s yet, so every word is derived\n", path);
+        }
+        return;
+    }
+    char buffer[1 << 16];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), fp))) {
+        byte_buffer_append(&s->file, buffer, read);
+    }
+    char failed = ferror(fp);
+    fclose(fp);
+    fail_if(failed, "Error reading checkpoint file %s\n", path);
+    struct checkpoint_reader reader = {s->file.data, s->file.length, 0, path};
+    struct checkpoint_header header;
+    fail_if(
+        s->file.length < sizeof(header) || memcmp(s->file.data, CHECKPOINT_MAGIC, 8),
+        "Error: %s is not a checkpoint file\n",
+        path);
+    checkpoint_read(&reader, &header, sizeof(header));
+    if (header.version != CHECKPOINT_VERSION || header.fmatrix_length != g->fmatrix_length
+            || header.chart_hash != chart_hash(g)) {
+        if (report) {
+            fprintf(
+                report,
+                "checkpoints: %s is from another version or feature chart, so every word is "
+                    "derived\n",
+                path);
+        }
+        return;
+    }
+    while (s->unchanged < header.rule_count && s->unchanged < g->rules.count) {
+        uint64_t hash;
+        checkpoint_read(&reader, &hash, sizeof(hash));
+        if (hash != s->rule_hashes[s->unchanged]) {
+            break;
+        }
+        s->unchanged++;
+    }
+    reader.position = sizeof(header) + header.rule_count * sizeof(uint64_t);
+    fail_if(
+        reader.position > reader.size,
+        "Error: checkpoint file %s is truncated; delete it to start over\n",
+        path);
+    s->fmatrix_map = malloc((header.fmatrix_count + 1) * sizeof(*s->fmatrix_map));
+    fail_if(!s->fmatrix_map, "Error: unable to allocate memory\n");
+    for (uint32_t x = 0; x < header.fmatrix_count; x++) {
+        fword_t fmatrix[g->fmatrix_length];
+        checkpoint_read(&reader, fmatrix, sizeof(fmatrix));
+        s->fmatrix_map[x] = fmatrix_intern(g, fmatrix);
+    }
+    for (uint64_t x = 0; x < header.word_count; x++) {
+        checkpoint_load_word(s, &reader, header.rule_count, header.fmatrix_count);
+    }
+    fail_if(
+        reader.position != reader.size,
+        "Error: checkpoint file %s is malformed; delete it to start over\n",
+        path);
+}
+
+// Appends the spelling of a form in the stage pool, given as the index of its length, to a byte
+// buffer, followed by a NUL
+static void stage_spell(
+        const struct checkpoint_state *s, size_t index, struct byte_buffer *out) {
+    uint32_t len = stage_get(s, index);
+    for (uint32_t x = 0; x < len; x++) {
+        unsigned int length;
+        const char *spelling = fmatrix_spelling(s->grammar, stage_get(s, index + 1 + x), &length);
+        byte_buffer_append(out, spelling, length);
+    }
+    byte_buffer_append(out, "", 1);
+}
+
+// Derives a word of the given length that hasn't been derived yet this run, from its last stage
+// that's still good (or from scratch, if it wasn't in the checkpoint file), adding a stage for
+// every rule that changes it
+// Reports it if its surface form changed
+// Prints errors to stderr and exits on failure
+static void checkpoint_derive(struct checkpoint_state *s, size_t index, FILE *report) {
+    struct derivation *d = &s->derivation;
+    struct word *word = &s->word;
+    struct checkpoint_word *w = s->words + index;
+    unsigned int rule_count = s->grammar->rules.count;
+    // Find where the last stage is, and start from it
+    size_t last = w->stages;
+    for (size_t x = w->stages; x < w->stages + w->stages_size; x += 2 + stage_get(s, x + 1)) {
+        last = x;
+    }
+    long len = stage_get(s, last + 1);
+    if ((size_t) len > word->capacity) {
+        free(word->ids);
+        word->ids = malloc(len * sizeof(*word->ids));
+        fail_if(!word->ids, "Error: unable to allocate memory\n");
+        word->capacity = len;
+    }
+    memcpy(word->ids, s->stages.data + (last + 2) * sizeof(uint32_t), len * sizeof(*word->ids));
+    word->length = len;
+    for (unsigned int rule = w->through; rule < rule_count; rule++) {
+        char applied = derive_word_rules(d, word, rule, 1, rule == w->through);
+        // Rules may insert or delete segments
+        len = word->length;
+        if (!applied || stage_equals(s, last + 1, word->ids, len)) {
+            continue;
+        }
+        // New stages go right after the old ones, so those are moved to the end of the pool if
+        // anything else is there; the pool is grown first, so they aren't copied from a block
+        // that's been moved
+        if (s->stages.length != (w->stages + w->stages_size) * sizeof(uint32_t)) {
+            size_t size = w->stages_size * sizeof(uint32_t);
+            byte_buffer_reserve(&s->stages, size);
+            size_t stages = s->stages.length / sizeof(uint32_t);
+            byte_buffer_append(&s->stages, s->stages.data + w->stages * sizeof(uint32_t), size);
+            w->stages = stages;
+        }
+        last = s->stages.length / sizeof(uint32_t);
+        append_uint32(&s->stages, rule + 1);
+        stage_append(s, word->ids, len);
+        w->stages_size = last + 2 + len - w->stages;
+    }
+    w->through = rule_count;
+    w->derived = 1;
+    w->form = last + 1;
+    if (w->had_surface && !stage_equals(s, w->surface, word->ids, len)) {
+        s->changed++;
+        if (!report) {
+            return;
+        }
+        s->old_spelling.length = 0;
+        s->new_spelling.length = 0;
+        stage_spell(s, w->surface, &s->old_spelling);
+        stage_spell(s, last + 1, &s->new_spelling);
+        fprintf(
+            report,
+            "changed: %.*s: %s -> %s\n",
+            (int) w->text_length,
+            s->texts.data + w->text,
+            s->old_spelling.data,
+            s->new_spelling.data);
+    }
+}
+
+// Derives every word in text of the given length, appending that text to the output with every word
+// replaced by its surface form, as derive_text does
+// Prints errors to stderr and exits on failure
+static void checkpoint_derive_text(
+        struct checkpoint_state *s, const char *text, size_t length, FILE *report) {
+    struct byte_buffer *out = &s->output;
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    const char *end = text + length;
+    while (text < end) {
+        // Whitespace, copied as is
+        const char *start = text;
+        while (text < end && is_separator(*text)) {
+            text++;
+        }
+        byte_buffer_append(out, start, text - start);
+        if (text == end) {
+            break;
+        }
+        // Then a word, replaced by its surface form
+        start = text;
+        while (text < end && !is_separator(*text)) {
+            text++;
+        }
+        s->derivation.words++;
+        uint64_t hash = hash_string(start, text - start);
+        size_t slot;
+        size_t index = word_find(s, start, text - start, hash, &slot);
+        if (index == s->word_count) {
+            // Not seen before, so it starts from the segmented word
+            parse_word(s->grammar, start, text - start, &s->word);
+            index = word_add(s, start, text - start, hash);
+            s->words[index].stages = s->stages.length / sizeof(uint32_t);
+            append_uint32(&s->stages, 0);
+            stage_append(s, s->word.ids, s->word.length);
+            s->words[index].stages_size = 2 + s->word.length;
+            s->started++;
+        } else if (!s->words[index].derived) {
+            s->resumed++;
+        }
+        if (!s->words[index].derived) {
+            checkpoint_derive(s, index, report);
+        }
+        const struct checkpoint_word *w = s->words + index;
+        uint32_t len = stage_get(s, w->form);
+        for (uint32_t x = 0; x < len; x++) {
+            unsigned int spelling_length;
+            const char *spelling = fmatrix_spelling(
+                s->grammar, stage_get(s, w->form + 1 + x), &spelling_length);
+            byte_buffer_append(out, spelling, spelling_length);
+        }
+    }
+    derivation_add_time(&s->derivation, &start_time);
+}
+
+// Writes every word's stages to the checkpoint file at the given path, by way of a temporary file
+// that then replaces it, so a failure never leaves it half written
+// Prints errors to stderr and exits on failure
+static void checkpoint_save(const struct checkpoint_state *s, const char *path) {
+    const struct grammar *g = s->grammar;
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.fmatrix_length = g->fmatrix_length;
+    header.chart_hash = chart_hash(g);
+    header.rule_count = g->rules.count;
+    header.fmatrix_count = g->fmatrix_count;
+    header.word_count = s->word_count;
+    size_t path_length = strlen(path);
+    char temporary[path_length + 5];
+    memcpy(temporary, path, path_length);
+    memcpy(temporary + path_length, ".tmp", 5);
+    FILE *fp = fopen(temporary, "wb");
+    fail_if(!fp, "Error writing checkpoint file %s\n", temporary);
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(s->rule_hashes, sizeof(*s->rule_hashes), g->rules.count, fp);
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count; id++) {
+        fwrite(fmatrix_of(g, id), sizeof(fword_t), g->fmatrix_length, fp);
+    }
+    for (size_t x = 0; x < s->word_count; x++) {
+        const struct checkpoint_word *w = s->words + x;
+        struct checkpoint_word_header word_header;
+        memset(&word_header, 0, sizeof(word_header));
+        word_header.text_length = w->text_length;
+        word_header.through = w->through;
+        word_header.stages_size = w->stages_size;
+        fwrite(&word_header, sizeof(word_header), 1, fp);
+        fwrite(s->texts.data + w->text, 1, w->text_length, fp);
+        fwrite(s->stages.data + w->stages * sizeof(uint32_t), sizeof(uint32_t), w->stages_size, fp);
+    }
+    char failed = fflush(fp) || ferror(fp);
+    failed |= fclose(fp) != 0;
+    if (failed || rename(temporary, path)) {
+        remove(temporary);
+        fail_if(1, "Error writing checkpoint file %s\n", path);
+    }
+}
+
+// Frees everything derive_checkpointed set up
+static void checkpoint_state_free(struct checkpoint_state *s) {
+    input_chunk_free(&s->chunk);
+    input_reader_free(&s->reader);
+    free(s->output.data);
+    free(s->word.ids);
+    free(s->words);
+    free(s->slots);
+    free(s->texts.data);
+    free(s->stages.data);
+    free(s->rule_hashes);
+    free(s->file.data);
+    free(s->fmatrix_map);
+    free(s->old_spelling.data);
+    free(s->new_spelling.data);
+    derivation_free(&s->derivation);
+    free(s);
+}
+
+void derive_checkpointed(
+        struct grammar *g,
+        FILE *in,
+        FILE *out,
+        const char *path,
+        FILE *report,
+        FILE *warnings,
+        struct derivation_stats *derivation_totals) {
+    struct checkpoint_state *s = calloc(1, sizeof(*s));
+    fail_if(!s, "Error: unable to allocate memory\n");
+    s->grammar = g;
+    input_reader_init(&s->reader, in, CHECKPOINT_CHUNK_SIZE);
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        // Everything derived before the failure is still written out
+        byte_buffer_write(&s->output, out);
+        checkpoint_state_free(s);
+        fail_rethrow(&trap);
+    }
+    s->rule_hashes = malloc((g->rules.count + 1) * sizeof(*s->rule_hashes));
+    fail_if(!s->rule_hashes, "Error: unable to allocate memory\n");
+    for (unsigned int x = 0; x < g->rules.count; x++) {
+        s->rule_hashes[x] = rule_hash(g, x);
+    }
+    checkpoint_load(s, path, report);
+    // The file isn't needed once every word is read out of it
+    free(s->file.data);
+    memset(&s->file, 0, sizeof(s->file));
+    // Only now that every matrix in the file is interned, so the tables have room for them all
+    derivation_init(&s->derivation, g);
+    s->derivation.warnings = warnings;
+    while (input_reader_next(&s->reader, &s->chunk)) {
+        checkpoint_derive_text(s, s->chunk.text, s->chunk.length, report);
+        input_chunk_free(&s->chunk);
+        s->chunk.block = NULL;
+        if (s->output.length >= CHECKPOINT_CHUNK_SIZE) {
+            byte_buffer_write(&s->output, out);
+        }
+    }
+    byte_buffer_write(&s->output, out);
+    checkpoint_save(s, path);
+    if (report) {
+        fprintf(
+            report,
+            "checkpoints: the first %lu of %u rules are unchanged; %zu words resumed from "
+                "checkpoints, %zu derived from the start, %zu surface forms changed\n",
+            (unsigned long) s->unchanged,
+            g->rules.count,
+            s->resumed,
+            s->started,
+            s->changed);
+    }
+    derivation_stats_add(derivation_totals, &s->derivation);
+    fail_trap_clear(&trap);
+    checkpoint_state_free(s);
+}
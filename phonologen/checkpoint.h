@@ -0,0 +1,29 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+
+#include "structures.h"
+#include "derive.h"
+
+// Format version of checkpoint files; files of any other version are started over, so this must be
+// bumped whenever what gets written changes
+#define CHECKPOINT_VERSION 2
+
+// Development mode, for rerunning a corpus while editing its grammar: a checkpoint file keeps every
+// distinct word of the corpus along with its form after each rule that changed it, and a hash of
+// every rule, so the next run only derives each word again from the first rule that differs from
+// the last run's (or wherever the word's checkpoints end, if it wasn't in the last run's input)
+// Derives every word read from one file on the calling thread, writing surface forms to another in
+// input order, resuming from the checkpoint file at the given path if there is one and it was
+// written with the same feature chart, and then writing the checkpoint file again
+// Reports every word whose surface form differs from the last run, followed by a summary, to the
+// second to last file given, unless it's NULL, and words still changing when a rule reaches the
+// pass limit its line gives to the last, unless it's NULL
+// Adds the statistics of the derivation to the totals given
+// Prints errors to stderr and exits on failure, having freed everything it set up (the checkpoint
+// file is only replaced once everything has been derived)
+void derive_checkpointed(
+    struct grammar *, FILE *, FILE *, const char *, FILE *, FILE *, struct derivation_stats *);
+
+#endif
@@ -0,0 +1,1089 @@
+// Application of phonological rules to words of interned feature matrices
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "structures.h"
+#include "derive.h"
+#include "fst.h"
+#include "util.h"
+
+#ifdef RULE_STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+// Reads the CPU's cycle counter
+#define rule_cycles() __rdtsc()
+#else
+// Reads a monotonic clock in nanoseconds, for lack of a cycle counter
+static inline unsigned long long rule_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+// Counters of the rule_index-th rule
+#define RULE_STATS_OF(d, rule_index) ((d)->rule_stats + (rule_index))
+// Adds n to a rule's counter
+#define RULE_STAT(stats, counter, n) ((stats)->counter += (n))
+#else
+// Without RULE_STATS, none of this does anything
+#define rule_cycles() 0ULL
+#define RULE_STATS_OF(d, rule_index) ((struct rule_stats *) NULL)
+#define RULE_STAT(stats, counter, n) ((void) (stats), (void) (n))
+#endif
+
+// Match table values; 0 means not known yet
+#define MATCH_NO 1
+#define MATCH_YES 2
+// Furthest a rule's scan moves on at once, so skip table entries fit in a byte
+#define SKIP_MAX 127
+
+// Grows every table so IDs below count can index them, marking new entries unknown
+static void derivation_reserve(struct derivation *d, fmatrix_id_t count) {
+    if (count <= d->capacity) {
+        return;
+    }
+    fmatrix_id_t old_capacity = d->capacity;
+    fmatrix_id_t capacity = old_capacity;
+    while (capacity < count) {
+        capacity = capacity ? capacity * 2 : 256;
+    }
+    // Tables are only ever bigger than the capacity says, so the derivation stays usable if this
+    // fails partway
+    const uint32_t *context_lengths = d->grammar->rules.context_lengths;
+    for (unsigned int x = 0; x < d->rule_count; x++) {
+        size_t length = context_lengths[x];
+        unsigned char *matches = realloc(d->matches[x], capacity * length);
+        fail_if(!matches, "Error: unable to allocate memory\n");
+        d->matches[x] = matches;
+        fmatrix_id_t *applied = realloc(d->applied[x], capacity * sizeof(*applied));
+        fail_if(!applied, "Error: unable to allocate memory\n");
+        d->applied[x] = applied;
+        unsigned char *skips = realloc(d->skips[x], capacity);
+        fail_if(!skips, "Error: unable to allocate memory\n");
+        d->skips[x] = skips;
+        memset(matches + old_capacity * length, 0, (capacity - old_capacity) * length);
+        memset(skips + old_capacity, 0, capacity - old_capacity);
+        // FMATRIX_NONE is all ones
+        memset(applied + old_capacity, 0xff, (capacity - old_capacity) * sizeof(*applied));
+    }
+    d->capacity = capacity;
+}
+
+void derivation_init(struct derivation *d, struct grammar *g) {
+    // Everything starts out empty, so the derivation can be freed however far this gets
+    memset(d, 0, sizeof(*d));
+    d->grammar = g;
+    unsigned int rule_count = g->rules.count;
+    d->matches = calloc(rule_count ? rule_count : 1, sizeof(*d->matches));
+    d->applied = calloc(rule_count ? rule_count : 1, sizeof(*d->applied));
+    d->skips = calloc(rule_count ? rule_count : 1, sizeof(*d->skips));
+    d->insertions = malloc((rule_count ? rule_count : 1) * sizeof(*d->insertions));
+    fail_if(
+        !d->matches || !d->applied || !d->skips || !d->insertions,
+        "Error: unable to allocate memory\n");
+    // FMATRIX_NONE is all ones
+    memset(d->insertions, 0xff, rule_count * sizeof(*d->insertions));
+    d->rule_count = rule_count;
+    d->summary = malloc(g->fmatrix_length * sizeof(*d->summary));
+    fail_if(!d->summary, "Error: unable to allocate memory\n");
+#ifdef RULE_STATS
+    d->rule_stats = calloc(d->rule_count ? d->rule_count : 1, sizeof(*d->rule_stats));
+    fail_if(!d->rule_stats, "Error: unable to allocate memory\n");
+#endif
+    // Other threads may be interning matrices, so the count is read under their lock
+    pthread_mutex_lock(&g->fmatrix_lock);
+    fmatrix_id_t count = g->fmatrix_count;
+    pthread_mutex_unlock(&g->fmatrix_lock);
+    derivation_reserve(d, count);
+}
+
+// Returns whether context position x of a rule matches the feature matrix with the given ID,
+// filling in the match table on the first lookup
+// The rule's context is length positions long, and op_starts is where its first matrix's entry is
+// in the grammar's op_starts
+// A match means the rule's matrix is equal to or a superset of the word's (the rule is less
+// specific than the de facto environment)
+static inline char context_matches(
+        const struct grammar *g,
+        uint32_t length,
+        const uint32_t *op_starts,
+        unsigned char *matches,
+        uint32_t x,
+        fmatrix_id_t id) {
+    unsigned char *entry = matches + (size_t) id * length + x;
+    if (!*entry) {
+        const struct fmatrix_op *ops = g->rules.ops + op_starts[x];
+        unsigned int count = op_starts[x + 1] - op_starts[x];
+        *entry = fmatrix_ops_match(ops, count, fmatrix_of(g, id)) ? MATCH_YES : MATCH_NO;
+    }
+    return *entry == MATCH_YES;
+}
+
+// Returns whether context positions from up to (but not including) to of the rule_index-th rule of
+// the grammar match (apply to) the feature matrix IDs given by environment
+// Assumes environment points to an array of IDs exactly as long as the rule's context
+// Thus, this must be called a number of times proportional to the length of the input string per
+// rule application
+// Also counts the call and the positions compared in stats
+static inline char rule_matches(
+        const struct grammar *g,
+        unsigned int rule_index,
+        unsigned char *matches,
+        const fmatrix_id_t *environment,
+        uint32_t from,
+        uint32_t to,
+        struct rule_stats *stats) {
+    const struct rule_set *r = &g->rules;
+    uint32_t length = r->context_lengths[rule_index];
+    const uint32_t *op_starts = r->op_starts + r->matrix_starts[rule_index];
+    RULE_STAT(stats, match_calls, 1);
+    for (register uint32_t x = from; x < to; x++) {
+        RULE_STAT(stats, slots_compared, 1);
+        if (!context_matches(g, length, op_starts, matches, x, environment[x])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns the skip table entry of the rule_index-th rule for a feature matrix ID, filling it in on
+// the first lookup
+// This is the bad character rule of Boyer-Moore-Horspool, for classes of feature matrices rather
+// than characters: the scan moves on from a window to the nearest one that puts some position of
+// the rule that matches the ID where the ID is, since every window in between has a position that
+// can't match
+static inline unsigned char rule_skip(
+        struct derivation *d, unsigned int rule_index, fmatrix_id_t id) {
+    unsigned char *entry = d->skips[rule_index] + id;
+    if (!*entry) {
+        const struct grammar *g = d->grammar;
+        const struct rule_set *r = &g->rules;
+        uint32_t length = r->context_lengths[rule_index];
+        const uint32_t *op_starts = r->op_starts + r->matrix_starts[rule_index];
+        unsigned char *matches = d->matches[rule_index];
+        // Windows are scanned towards the key position's end of the rule, so each one further on
+        // puts the key position's ID one position further from it in the rule
+        char reversed = r->directions[rule_index] == 'R';
+        uint32_t key = reversed ? 0 : length - 1;
+        uint32_t shift = 1;
+        for (; shift < length && shift < SKIP_MAX; shift++) {
+            uint32_t x = reversed ? shift : length - 1 - shift;
+            if (context_matches(g, length, op_starts, matches, x, id)) {
+                break;
+            }
+        }
+        *entry = shift << 1 | context_matches(g, length, op_starts, matches, key, id);
+    }
+    return *entry;
+}
+
+// Returns the ID of the feature matrix with the given ID after the rule_index-th rule's output is
+// applied to it, filling in the apply table (and interning the result) on the first lookup
+static inline fmatrix_id_t rule_apply(
+        struct derivation *d, unsigned int rule_index, fmatrix_id_t id) {
+    fmatrix_id_t result = d->applied[rule_index][id];
+    if (result == FMATRIX_NONE) {
+        const struct rule_set *r = &d->grammar->rules;
+        fword_t changed[d->grammar->fmatrix_length];
+        memcpy(changed, fmatrix_of(d->grammar, id), sizeof(changed));
+        // The output is the matrix after the context
+        const uint32_t *op_starts =
+            r->op_starts + r->matrix_starts[rule_index] + r->context_lengths[rule_index];
+        fmatrix_ops_apply(r->ops + op_starts[0], op_starts[1] - op_starts[0], changed);
+        result = fmatrix_intern(d->grammar, changed);
+        // The result may be brand new, so every table needs to have room for it
+        derivation_reserve(d, result + 1);
+        d->applied[rule_index][id] = result;
+    }
+    return result;
+}
+
+// Sets a feature summary to that of len feature matrix IDs
+static void summarize_ids(
+        const struct grammar *g, fword_t *summary, const fmatrix_id_t *word, long len) {
+    memset(summary, 0, g->fmatrix_length * sizeof(*summary));
+    for (long x = 0; x < len; x++) {
+        fmatrix_summarize(fmatrix_of(g, word[x]), g->fmatrix_length, summary);
+    }
+}
+
+char derivation_matches(
+        struct derivation *d, unsigned int rule_index, const fmatrix_id_t *window, char reversed) {
+    const struct rule_set *r = &d->grammar->rules;
+    uint32_t length = r->context_lengths[rule_index];
+    const uint32_t *op_starts = r->op_starts + r->matrix_starts[rule_index];
+    unsigned char *matches = d->matches[rule_index];
+    struct rule_stats *stats = RULE_STATS_OF(d, rule_index);
+    RULE_STAT(stats, match_calls, 1);
+    for (uint32_t x = 0; x < length; x++) {
+        RULE_STAT(stats, slots_compared, 1);
+        fmatrix_id_t id = window[reversed ? length - 1 - x : x];
+        if (!context_matches(d->grammar, length, op_starts, matches, x, id)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+fmatrix_id_t derivation_apply(struct derivation *d, unsigned int rule_index, fmatrix_id_t id) {
+    RULE_STAT(RULE_STATS_OF(d, rule_index), applications, 1);
+    return rule_apply(d, rule_index, id);
+}
+
+// Returns whether the rule_index-th rule could possibly apply to len feature matrix IDs, judging by
+// their length and feature summary, which is brought up to date first if it's stale
+static inline char rule_may_apply(
+        struct derivation *d, unsigned int rule_index, const fmatrix_id_t *word, long len) {
+    const struct grammar *g = d->grammar;
+    if (g->rules.context_lengths[rule_index] > (unsigned long) len) {
+        return 0;
+    }
+    if (d->summary_stale) {
+        summarize_ids(g, d->summary, word, len);
+        d->summary_stale = 0;
+    }
+    const fword_t *requirement = g->rules.requirements + (size_t) rule_index * g->fmatrix_length;
+    return summary_covers(d->summary, requirement, g->fmatrix_length);
+}
+
+// Applies the rule_index-th rule of the grammar to len feature matrix IDs at least as many as its
+// context is long, scanning them once in the rule's direction
+// Windows of longer contexts are checked at their key position first, and the skip table says how
+// many of the windows after it can be passed over; that's worked out from the word as it is once
+// the window has been applied to (if it was), so every window is still checked against everything
+// applied before it
+// Returns whether it applied
+static inline char rule_scan(
+        struct derivation *d,
+        unsigned int rule_index,
+        fmatrix_id_t *word,
+        long len,
+        struct rule_stats *stats) {
+    const struct grammar *g = d->grammar;
+    const struct rule_set *r = &g->rules;
+    char applied = 0;
+    uint32_t length = r->context_lengths[rule_index];
+    // Use long rather than size_t so it can become negative
+    long last = len - (long) length;
+    long focus_position = r->focus_positions[rule_index];
+    // Only valid until the next rule_apply, which may grow the tables
+    unsigned char *matches = d->matches[rule_index];
+    if (length == 1) {
+        // Nothing to skip, and scanning every position without waiting on the skip table to know
+        // which is next is much faster
+        if (r->directions[rule_index] == 'L') {
+            for (long x = 0; x <= last; x++) {
+                RULE_STAT(stats, positions, 1);
+                if (rule_matches(g, rule_index, matches, word + x, 0, 1, stats)) {
+                    word[x] = rule_apply(d, rule_index, word[x]);
+                    matches = d->matches[rule_index];
+                    applied = 1;
+                    RULE_STAT(stats, applications, 1);
+                }
+            }
+        } else {
+            for (long x = last; x >= 0; x--) {
+                RULE_STAT(stats, positions, 1);
+                if (rule_matches(g, rule_index, matches, word + x, 0, 1, stats)) {
+                    word[x] = rule_apply(d, rule_index, word[x]);
+                    matches = d->matches[rule_index];
+                    applied = 1;
+                    RULE_STAT(stats, applications, 1);
+                }
+            }
+        }
+        return applied;
+    }
+    if (r->directions[rule_index] == 'L') {
+        for (long x = 0; x <= last;) {
+            RULE_STAT(stats, positions, 1);
+            fmatrix_id_t *window = word + x;
+            unsigned char skip = rule_skip(d, rule_index, window[length - 1]);
+            if ((skip & 1) && rule_matches(g, rule_index, matches, window, 0, length - 1, stats)) {
+                fmatrix_id_t *focus = window + focus_position;
+                *focus = rule_apply(d, rule_index, *focus);
+                matches = d->matches[rule_index];
+                applied = 1;
+                RULE_STAT(stats, applications, 1);
+                skip = rule_skip(d, rule_index, window[length - 1]);
+            }
+            x += skip >> 1;
+        }
+    } else {
+        // Direction is 'R'
+        for (long x = last; x >= 0;) {
+            RULE_STAT(stats, positions, 1);
+            fmatrix_id_t *window = word + x;
+            unsigned char skip = rule_skip(d, rule_index, window[0]);
+            if ((skip & 1) && rule_matches(g, rule_index, matches, window, 1, length, stats)) {
+                fmatrix_id_t *focus = window + focus_position;
+                *focus = rule_apply(d, rule_index, *focus);
+                matches = d->matches[rule_index];
+                applied = 1;
+                RULE_STAT(stats, applications, 1);
+                skip = rule_skip(d, rule_index, window[0]);
+            }
+            x -= skip >> 1;
+        }
+    }
+    return applied;
+}
+
+// Marks the windows of a rule that overlap position p of a word, other than window x, whose focus
+// is there, to be examined again
+// Windows run from 0 to last, and the rule is length positions long; those the rule's direction
+// puts behind window x are added to the range from lo to hi, for the next pass, and those ahead of
+// it to the range ending at end, for the pass that's examining window x, unless end is NULL
+// Window x needn't be examined again, since applying the rule's output twice does nothing more
+static inline void rule_mark(
+        unsigned char *dirty,
+        long p,
+        long x,
+        long length,
+        long last,
+        char reversed,
+        long *lo,
+        long *hi,
+        long *end) {
+    long first = p - length + 1 > 0 ? p - length + 1 : 0;
+    long final = p < last ? p : last;
+    // Behind window x
+    long from = reversed ? x + 1 : first;
+    long to = reversed ? final : x - 1;
+    if (from <= to) {
+        memset(dirty + from, 1, to - from + 1);
+        *lo = from < *lo ? from : *lo;
+        *hi = to > *hi ? to : *hi;
+    }
+    if (!end) {
+        return;
+    }
+    // Ahead of window x
+    from = reversed ? first : x + 1;
+    to = reversed ? x - 1 : final;
+    if (from <= to) {
+        memset(dirty + from, 1, to - from + 1);
+        *end = reversed ? (from < *end ? from : *end) : (to > *end ? to : *end);
+    }
+}
+
+// Writes the spelling of len feature matrix IDs to a buffer of size bytes, NUL-terminated and cut
+// short with ... if it doesn't fit, for messages
+static void spell_ids(
+        const struct grammar *g, const fmatrix_id_t *word, long len, char *buffer, size_t size) {
+    size_t used = 0;
+    for (long x = 0; x < len; x++) {
+        unsigned int spelling_length;
+        const char *spelling = fmatrix_spelling(g, word[x], &spelling_length);
+        if (used + spelling_length + 4 > size) {
+            memcpy(buffer + used, "...", 3);
+            used += 3;
+            break;
+        }
+        memcpy(buffer + used, spelling, spelling_length);
+        used += spelling_length;
+    }
+    buffer[used] = '\0';
+}
+
+// Returns whether examining the windows of the rule_index-th rule marked in dirty, from lo to hi,
+// would change a word any further
+// Whichever of them would change the word first does so on the word as it is, so they can all be
+// checked without applying any
+static char rule_still_changing(
+        struct derivation *d,
+        unsigned int rule_index,
+        const fmatrix_id_t *word,
+        long lo,
+        long hi,
+        struct rule_stats *stats) {
+    const struct rule_set *r = &d->grammar->rules;
+    long length = r->context_lengths[rule_index];
+    long focus_position = r->focus_positions[rule_index];
+    for (long x = lo; x <= hi; x++) {
+        if (d->dirty[x]
+                && rule_matches(
+                    d->grammar, rule_index, d->matches[rule_index], word + x, 0, length, stats)
+                && rule_apply(d, rule_index, word[x + focus_position]) != word[x + focus_position]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Applies the rule_index-th rule of the grammar to len feature matrix IDs just as rule_scan does,
+// and then again and again until the word stops changing, as rules with a pass limit are
+// Rather than scanning the whole word again, each pass only examines the windows that overlap a
+// position changed since they were last examined, in the rule's direction; windows a change marks
+// further along are examined in the same pass, and those behind it in the next one
+// Applying a rule's output twice is the same as applying it once, so every position changes at
+// most once and there are at most len passes after the first, unless the rule's line gives a lower
+// limit; a word the next pass would still change then is left as it is and reported to the
+// derivation's warnings
+// Returns whether it applied
+// Prints errors to stderr and exits on failure
+static char rule_iterate(
+        struct derivation *d,
+        unsigned int rule_index,
+        fmatrix_id_t *word,
+        long len,
+        struct rule_stats *stats) {
+    const struct grammar *g = d->grammar;
+    const struct rule_set *r = &g->rules;
+    if ((size_t) len > d->dirty_capacity) {
+        free(d->previous);
+        free(d->dirty);
+        d->dirty_capacity = 0;
+        d->previous = malloc(len * 2 * sizeof(*d->previous));
+        d->dirty = malloc(len * 2);
+        fail_if(!d->previous || !d->dirty, "Error: unable to allocate memory\n");
+        d->dirty_capacity = len * 2;
+    }
+    memcpy(d->previous, word, len * sizeof(*word));
+    if (!rule_scan(d, rule_index, word, len, stats)) {
+        return 0;
+    }
+    long length = r->context_lengths[rule_index];
+    long last = len - length;
+    long focus_position = r->focus_positions[rule_index];
+    char reversed = r->directions[rule_index] == 'R';
+    unsigned char *dirty = d->dirty;
+    memset(dirty, 0, last + 1);
+    // Windows to examine in the next pass are all between lo and hi
+    long lo = last + 1;
+    long hi = -1;
+    // The first pass examined every window after each change, so only those behind need another
+    for (long p = focus_position; p <= last + focus_position; p++) {
+        if (word[p] != d->previous[p]) {
+            rule_mark(dirty, p, p - focus_position, length, last, reversed, &lo, &hi, NULL);
+        }
+    }
+    for (uint32_t passes = 1; lo <= hi; passes++) {
+        if (passes >= r->pass_limits[rule_index]) {
+            if (!rule_still_changing(d, rule_index, word, lo, hi, stats)) {
+                break;
+            }
+            d->pass_limited++;
+            if (d->warnings) {
+                char spelling[64];
+                spell_ids(g, word, len, spelling, sizeof(spelling));
+                fprintf(
+                    d->warnings,
+                    "Warning: rule on line %u was still changing %s after %u passes\n",
+                    r->line_numbers[rule_index],
+                    spelling,
+                    passes);
+            }
+            break;
+        }
+        RULE_STAT(stats, passes, 1);
+        long x = reversed ? hi : lo;
+        long end = reversed ? lo : hi;
+        lo = last + 1;
+        hi = -1;
+        for (; reversed ? x >= end : x <= end; x += reversed ? -1 : 1) {
+            if (!dirty[x]) {
+                continue;
+            }
+            dirty[x] = 0;
+            RULE_STAT(stats, positions, 1);
+            fmatrix_id_t *window = word + x;
+            if (!rule_matches(g, rule_index, d->matches[rule_index], window, 0, length, stats)) {
+                continue;
+            }
+            fmatrix_id_t *focus = window + focus_position;
+            fmatrix_id_t result = rule_apply(d, rule_index, *focus);
+            RULE_STAT(stats, applications, 1);
+            if (result != *focus) {
+                *focus = result;
+                rule_mark(dirty, x + focus_position, x, length, last, reversed, &lo, &hi, &end);
+            }
+        }
+    }
+    return 1;
+}
+
+// Applies the rule_index-th rule of the grammar to len feature matrix IDs at least as many as its
+// context is long, once or until the word stops changing, whichever the rule calls for
+// Returns whether it applied
+static inline char rule_run(
+        struct derivation *d,
+        unsigned int rule_index,
+        fmatrix_id_t *word,
+        long len,
+        struct rule_stats *stats) {
+    if (d->grammar->rules.pass_limits[rule_index]) {
+        return rule_iterate(d, rule_index, word, len, stats);
+    }
+    return rule_scan(d, rule_index, word, len, stats);
+}
+
+// Returns the ID of the segment the rule_index-th rule inserts, interning it on the first lookup
+static inline fmatrix_id_t rule_inserted(struct derivation *d, unsigned int rule_index) {
+    fmatrix_id_t result = d->insertions[rule_index];
+    if (result == FMATRIX_NONE) {
+        const struct grammar *g = d->grammar;
+        const struct rule_set *r = &g->rules;
+        // The output is the matrix after the context
+        const fword_t *output = r->matrices
+            + ((size_t) r->matrix_starts[rule_index] + r->context_lengths[rule_index])
+                * g->fmatrix_length;
+        result = fmatrix_intern(d->grammar, output);
+        derivation_reserve(d, result + 1);
+        d->insertions[rule_index] = result;
+    }
+    return result;
+}
+
+// Applies the rule_index-th rule of the grammar, which inserts or deletes segments, to len feature
+// matrix IDs at least as many as its context is long, scanning them once in the rule's direction
+// The word is copied into a gap buffer, with the gap kept right at the edge of the window being
+// examined (before it, for rules applied left to right, and after it for right to left), so the
+// window is always in one piece and an insertion or deletion only moves the segments of the window
+// on one side of the focus; moving on to the next window moves one segment across the gap
+// Every window is checked against the word as everything before it left it: after a deletion the
+// scan goes on with the window that brings in the next segment, and after an insertion it goes on
+// from the next place in the word as it was, so nothing is inserted on either side of a segment
+// the rule just inserted
+// Returns the word as the rule leaves it, which stays valid until the next call, and sets
+// *edited_len to its length, or returns NULL if the rule didn't apply
+// Prints errors to stderr and exits on failure
+static const fmatrix_id_t *rule_edit(
+        struct derivation *d,
+        unsigned int rule_index,
+        const fmatrix_id_t *word,
+        long len,
+        long *edited_len,
+        struct rule_stats *stats) {
+    const struct grammar *g = d->grammar;
+    const struct rule_set *r = &g->rules;
+    long length = r->context_lengths[rule_index];
+    long focus_position = r->focus_positions[rule_index];
+    char insert = r->kinds[rule_index] == 'I';
+    fmatrix_id_t inserted = insert ? rule_inserted(d, rule_index) : FMATRIX_NONE;
+    // Every window inserts at most one segment, and there are at most len windows
+    size_t capacity = (size_t) len * 2 + 2;
+    if (capacity > d->gap_capacity) {
+        free(d->gap);
+        d->gap_capacity = 0;
+        d->gap = malloc(capacity * 2 * sizeof(*d->gap));
+        fail_if(!d->gap, "Error: unable to allocate memory\n");
+        d->gap_capacity = capacity * 2;
+    }
+    fmatrix_id_t *gap = d->gap;
+    // Only valid until rule_inserted, which may grow the tables, is called again
+    unsigned char *matches = d->matches[rule_index];
+    char applied = 0;
+    // Segments before the gap run from 0 up to front, and those after it from back up to capacity
+    long front;
+    long back;
+    if (r->directions[rule_index] == 'L') {
+        // The window starts right after the gap
+        front = 0;
+        back = capacity - len;
+        memcpy(gap + back, word, len * sizeof(*word));
+        while ((long) capacity - back >= length) {
+            RULE_STAT(stats, positions, 1);
+            fmatrix_id_t *window = gap + back;
+            long step = 1;
+            if (rule_matches(g, rule_index, matches, window, 0, length, stats)) {
+                applied = 1;
+                RULE_STAT(stats, applications, 1);
+                if (insert) {
+                    memmove(window - 1, window, focus_position * sizeof(*window));
+                    back--;
+                    gap[back + focus_position] = inserted;
+                    step = 2;
+                } else {
+                    memmove(window + 1, window, focus_position * sizeof(*window));
+                    back++;
+                    step = 0;
+                }
+            }
+            memmove(gap + front, gap + back, step * sizeof(*gap));
+            front += step;
+            back += step;
+        }
+        // Whatever's after the gap is shorter than a window by now
+        memmove(gap + front, gap + back, (capacity - back) * sizeof(*gap));
+        *edited_len = front + (capacity - back);
+    } else {
+        // Direction is 'R', and the window ends right before the gap
+        front = len;
+        back = capacity;
+        memcpy(gap, word, len * sizeof(*word));
+        while (front >= length) {
+            RULE_STAT(stats, positions, 1);
+            fmatrix_id_t *window = gap + front - length;
+            long step = 1;
+            if (rule_matches(g, rule_index, matches, window, 0, length, stats)) {
+                applied = 1;
+                RULE_STAT(stats, applications, 1);
+                fmatrix_id_t *focus = window + focus_position;
+                if (insert) {
+                    memmove(focus + 1, focus, (length - focus_position) * sizeof(*focus));
+                    *focus = inserted;
+                    front++;
+                    step = 2;
+                } else {
+                    memmove(focus, focus + 1, (length - focus_position - 1) * sizeof(*focus));
+                    front--;
+                    step = 0;
+                }
+            }
+            back -= step;
+            front -= step;
+            memmove(gap + back, gap + front, step * sizeof(*gap));
+        }
+        // Whatever's before the gap is shorter than a window by now
+        memmove(gap + back - front, gap, front * sizeof(*gap));
+        *edited_len = front + (capacity - back);
+        gap += back - front;
+    }
+    return applied ? gap : NULL;
+}
+
+// Applies count rules in order, starting from the rule_index-th rule of the grammar, to a word,
+// scanning it once per rule (or until it stops changing)
+// Returns whether any of them applied
+static char derive_rules(
+        struct derivation *d, unsigned int rule_index, unsigned int count, struct word *w) {
+    const struct rule_set *r = &d->grammar->rules;
+    char applied = 0;
+    for (unsigned int end = rule_index + count; rule_index < end; rule_index++) {
+        struct rule_stats *stats = RULE_STATS_OF(d, rule_index);
+        unsigned long long start = rule_cycles();
+        RULE_STAT(stats, checked, 1);
+        d->rules_checked++;
+        if (!rule_may_apply(d, rule_index, w->ids, w->length)) {
+            d->rules_skipped++;
+            RULE_STAT(stats, skipped, 1);
+        } else if (r->kinds[rule_index] == 'C') {
+            if (rule_run(d, rule_index, w->ids, w->length, stats)) {
+                d->summary_stale = 1;
+                applied = 1;
+            }
+        } else {
+            long len;
+            const fmatrix_id_t *edited = rule_edit(d, rule_index, w->ids, w->length, &len, stats);
+            if (edited) {
+                if ((size_t) len > w->capacity) {
+                    fmatrix_id_t *ids = realloc(w->ids, len * 2 * sizeof(*ids));
+                    fail_if(!ids, "Error: unable to allocate memory\n");
+                    w->ids = ids;
+                    w->capacity = len * 2;
+                }
+                memcpy(w->ids, edited, len * sizeof(*edited));
+                w->length = len;
+                d->summary_stale = 1;
+                applied = 1;
+            }
+        }
+        RULE_STAT(stats, cycles, rule_cycles() - start);
+    }
+    return applied;
+}
+
+void derive_word(struct derivation *d, struct word *w) {
+    unsigned int rule_index = 0;
+    // The summary is only brought up to date when a rule needs it after another rule has applied,
+    // since a segment that changes can lose feature values as well as gain them
+    d->summary_stale = 1;
+    for (unsigned int x = 0; x < d->fst_count; x++) {
+        struct fst *f = d->fsts + x;
+        derive_rules(d, rule_index, f->first_index - rule_index, w);
+        // Unless at least two of the rules could apply, scanning for them one at a time is cheaper
+        // than a pass through the transducer
+        unsigned int may_apply = 0;
+        for (unsigned int y = 0; y < f->rule_count && may_apply < 2; y++) {
+            may_apply += rule_may_apply(d, f->first_index + y, w->ids, w->length);
+        }
+        if (may_apply >= 2) {
+            fst_run(f, d, w->ids, w->length);
+            d->summary_stale = 1;
+        } else {
+            derive_rules(d, f->first_index, f->rule_count, w);
+        }
+        rule_index = f->first_index + f->rule_count;
+    }
+    derive_rules(d, rule_index, d->rule_count - rule_index, w);
+}
+
+char derive_word_rules(
+        struct derivation *d,
+        struct word *w,
+        unsigned int rule_index,
+        unsigned int count,
+        char new_word) {
+    // Otherwise the summary is still that of the word as the last call left it
+    d->summary_stale |= new_word;
+    return derive_rules(d, rule_index, count, w);
+}
+
+// Appends len IDs to the block where derive_batch packs words again, at the given position
+// Prints errors to stderr and exits on failure
+static void batch_pack(
+        struct derivation *d, size_t position, const fmatrix_id_t *word, long len) {
+    if (position + len > d->batch_id_capacity) {
+        size_t capacity = d->batch_id_capacity ? d->batch_id_capacity : 4096;
+        while (position + len > capacity) {
+            capacity *= 2;
+        }
+        fmatrix_id_t *ids = realloc(d->batch_ids, capacity * sizeof(*ids));
+        fail_if(!ids, "Error: unable to allocate memory\n");
+        d->batch_ids = ids;
+        d->batch_id_capacity = capacity;
+    }
+    memcpy(d->batch_ids + position, word, len * sizeof(*word));
+}
+
+void derive_batch(
+        struct derivation *d, fmatrix_id_t **ids, size_t *capacity, size_t *starts, size_t count) {
+    const struct grammar *g = d->grammar;
+    const struct rule_set *r = &g->rules;
+    unsigned int length = g->fmatrix_length;
+    if (count > d->batch_capacity) {
+        fword_t *summaries = realloc(d->batch_summaries, count * length * sizeof(*summaries));
+        fail_if(!summaries, "Error: unable to allocate memory\n");
+        d->batch_summaries = summaries;
+        char *stale = realloc(d->batch_stale, count);
+        fail_if(!stale, "Error: unable to allocate memory\n");
+        d->batch_stale = stale;
+        d->batch_capacity = count;
+    }
+    // Just as for single words, summaries are only worked out once a rule needs them
+    memset(d->batch_stale, 1, count);
+    for (unsigned int rule_index = 0; rule_index < d->rule_count; rule_index++) {
+        struct rule_stats *stats = RULE_STATS_OF(d, rule_index);
+        unsigned long long start = rule_cycles();
+        unsigned long context_length = r->context_lengths[rule_index];
+        const fword_t *requirement = r->requirements + (size_t) rule_index * length;
+        // Rules that insert or delete segments leave every word packed again in batch_ids, with
+        // starts changed as they go
+        char edit = r->kinds[rule_index] != 'C';
+        size_t packed = 0;
+        RULE_STAT(stats, checked, count);
+        d->rules_checked += count;
+        for (size_t x = 0; x < count; x++) {
+            fmatrix_id_t *word = *ids + starts[x];
+            long len = starts[x + 1] - starts[x];
+            fword_t *summary = d->batch_summaries + x * length;
+            const fmatrix_id_t *result = word;
+            long result_len = len;
+            char may_apply = 0;
+            if (context_length <= (unsigned long) len) {
+                if (d->batch_stale[x]) {
+                    summarize_ids(g, summary, word, len);
+                    d->batch_stale[x] = 0;
+                }
+                may_apply = summary_covers(summary, requirement, length);
+            }
+            if (!may_apply) {
+                d->rules_skipped++;
+                RULE_STAT(stats, skipped, 1);
+            } else if (!edit) {
+                d->batch_stale[x] = rule_run(d, rule_index, word, len, stats);
+            } else {
+                const fmatrix_id_t *edited =
+                    rule_edit(d, rule_index, word, len, &result_len, stats);
+                if (edited) {
+                    result = edited;
+                    d->batch_stale[x] = 1;
+                } else {
+                    result_len = len;
+                }
+            }
+            if (edit) {
+                // The word's old end is still needed for the next word
+                batch_pack(d, packed, result, result_len);
+                starts[x] = packed;
+                packed += result_len;
+            }
+        }
+        if (edit) {
+            starts[count] = packed;
+            if (packed > *capacity) {
+                fmatrix_id_t *grown = realloc(*ids, packed * 2 * sizeof(*grown));
+                fail_if(!grown, "Error: unable to allocate memory\n");
+                *ids = grown;
+                *capacity = packed * 2;
+            }
+            memcpy(*ids, d->batch_ids, packed * sizeof(**ids));
+        }
+        RULE_STAT(stats, cycles, rule_cycles() - start);
+    }
+}
+
+// Returns whether the rule_index-th rule is context-free: it changes a single segment, with no
+// context around it, in one pass
+static char rule_context_free(const struct rule_set *r, unsigned int rule_index) {
+    return r->context_lengths[rule_index] == 1 && r->kinds[rule_index] == 'C'
+        && !r->pass_limits[rule_index];
+}
+
+// Returns the index of the rule after the run of rules starting at the first-th that one
+// transducer would apply: every context-free rule from there on, or only the first-th if it isn't
+// context-free
+static unsigned int fst_run_end(const struct rule_set *r, unsigned int first) {
+    unsigned int end = first;
+    while (end < r->count && rule_context_free(r, end)) {
+        end++;
+    }
+    return end > first ? end : first + 1;
+}
+
+void derivation_use_fst(struct derivation *d, uint32_t transition_budget) {
+    const struct rule_set *r = &d->grammar->rules;
+    // Count the runs first
+    unsigned int runs = 0;
+    for (unsigned int x = 0, end; x < r->count; x = end) {
+        end = fst_run_end(r, x);
+        runs += end - x > 1;
+    }
+    d->fsts = calloc(runs ? runs : 1, sizeof(*d->fsts));
+    fail_if(!d->fsts, "Error: unable to allocate memory\n");
+    for (unsigned int x = 0, end; x < r->count; x = end) {
+        end = fst_run_end(r, x);
+        // A transducer for a single rule would only make as many passes as the rule does on its own
+        if (end - x > 1) {
+            fst_init(d->fsts + d->fst_count++, r, x, end - x, transition_budget);
+        }
+    }
+}
+
+void derivation_stats_add(struct derivation_stats *totals, const struct derivation *d) {
+    totals->words += d->words;
+    totals->seconds += d->seconds;
+    totals->rules_checked += d->rules_checked;
+    totals->rules_skipped += d->rules_skipped;
+    totals->pass_limited += d->pass_limited;
+    // Every derivation has the same transducers, just built up differently
+    totals->fst_count = d->fst_count;
+    totals->fst_rules = 0;
+    for (unsigned int x = 0; x < d->fst_count; x++) {
+        const struct fst *f = d->fsts + x;
+        totals->fst_rules += f->rule_count;
+        totals->fst_transitions += f->transition_count;
+        totals->fst_bytes += fst_bytes(f);
+        totals->fst_words += f->words;
+        totals->fst_fallbacks += f->fallbacks;
+    }
+#ifdef RULE_STATS
+    if (!totals->rules) {
+        totals->rule_count = d->rule_count;
+        totals->rules = calloc(d->rule_count ? d->rule_count : 1, sizeof(*totals->rules));
+        fail_if(!totals->rules, "Error: unable to allocate memory\n");
+    }
+    for (unsigned int x = 0; x < d->rule_count; x++) {
+        struct rule_stats *sum = totals->rules + x;
+        const struct rule_stats *add = d->rule_stats + x;
+        sum->checked += add->checked;
+        sum->skipped += add->skipped;
+        sum->positions += add->positions;
+        sum->match_calls += add->match_calls;
+        sum->slots_compared += add->slots_compared;
+        sum->applications += add->applications;
+        sum->passes += add->passes;
+        sum->cycles += add->cycles;
+    }
+#endif
+}
+
+// Index of a rule with the cycles spent on it, for sorting rules by cycles
+struct rule_order {
+    unsigned long long cycles;
+    unsigned int index;
+};
+
+// Orders rules by cycles spent, most first, and then by index
+static int compare_cycles(const void *a, const void *b) {
+    const struct rule_order *order_a = a;
+    const struct rule_order *order_b = b;
+    if (order_a->cycles != order_b->cycles) {
+        return order_a->cycles < order_b->cycles ? 1 : -1;
+    }
+    return (order_a->index > order_b->index) - (order_a->index < order_b->index);
+}
+
+void derivation_stats_print(
+        const struct derivation_stats *stats, const struct grammar *g, FILE *fp) {
+    fprintf(
+        fp,
+        "derivation: %llu words in %.3f s (%.0f words/s)\n",
+        stats->words,
+        stats->seconds,
+        stats->seconds > 0 ? stats->words / stats->seconds : 0.0);
+    fprintf(
+        fp,
+        "rules: %llu checked against words, %llu skipped without scanning (%.1f%% skip rate)\n",
+        stats->rules_checked,
+        stats->rules_skipped,
+        stats->rules_checked ? 100.0 * stats->rules_skipped / stats->rules_checked : 0.0);
+    if (stats->fst_count) {
+        fprintf(
+            fp,
+            "fst: %u transducers for %u rules, %llu transitions, %zu bytes; %llu passes, %llu "
+            "segments past the budget taken through single rules\n",
+            stats->fst_count,
+            stats->fst_rules,
+            stats->fst_transitions,
+            stats->fst_bytes,
+            stats->fst_words,
+            stats->fst_fallbacks);
+    }
+    if (stats->pass_limited) {
+        fprintf(
+            fp,
+            "pass limits: %llu words left still changing by rules that reached their limits\n",
+            stats->pass_limited);
+    }
+    if (!stats->rules) {
+        return;
+    }
+    struct rule_order *order = malloc(
+        (stats->rule_count ? stats->rule_count : 1) * sizeof(*order));
+    fail_if(!order, "Error: unable to allocate memory\n");
+    unsigned long long total_cycles = 0;
+    for (unsigned int x = 0; x < stats->rule_count; x++) {
+        order[x].cycles = stats->rules[x].cycles;
+        order[x].index = x;
+        total_cycles += stats->rules[x].cycles;
+    }
+    qsort(order, stats->rule_count, sizeof(*order), compare_cycles);
+    fprintf(
+        fp,
+        "%6s %5s %3s %12s %12s %14s %14s %14s %12s %12s %16s %6s\n",
+        "rule",
+        "line",
+        "dir",
+        "checked",
+        "skipped",
+        "positions",
+        "matches",
+        "slots",
+        "applied",
+        "passes",
+        "cycles",
+        "share");
+    for (unsigned int x = 0; x < stats->rule_count; x++) {
+        unsigned int index = order[x].index;
+        const struct rule_stats *rs = stats->rules + index;
+        fprintf(
+            fp,
+            "%6u %5u %2c%c %12llu %12llu %14llu %14llu %14llu %12llu %12llu %16llu %5.1f%%\n",
+            index,
+            g->rules.line_numbers[index],
+            g->rules.directions[index],
+            g->rules.pass_limits[index] ? '*' : ' ',
+            rs->checked,
+            rs->skipped,
+            rs->positions,
+            rs->match_calls,
+            rs->slots_compared,
+            rs->applications,
+            rs->passes,
+            rs->cycles,
+            total_cycles ? 100.0 * rs->cycles / total_cycles : 0.0);
+    }
+    free(order);
+}
+
+void derivation_stats_print_json(
+        const struct derivation_stats *stats, const struct grammar *g, FILE *fp) {
+    fprintf(
+        fp,
+        "{\"words\": %llu, \"seconds\": %.6f, \"rules_checked\": %llu, \"rules_skipped\": %llu, "
+        "\"pass_limited\": %llu, ",
+        stats->words,
+        stats->seconds,
+        stats->rules_checked,
+        stats->rules_skipped,
+        stats->pass_limited);
+    if (stats->fst_count) {
+        fprintf(
+            fp,
+            "\"fst\": {\"transducers\": %u, \"rules\": %u, \"transitions\": %llu, "
+            "\"bytes\": %zu, \"passes\": %llu, \"fallbacks\": %llu}, ",
+            stats->fst_count,
+            stats->fst_rules,
+            stats->fst_transitions,
+            stats->fst_bytes,
+            stats->fst_words,
+            stats->fst_fallbacks);
+    } else {
+        fputs("\"fst\": null, ", fp);
+    }
+    if (!stats->rules) {
+        fputs("\"rules\": null}", fp);
+        return;
+    }
+    fputs("\"rules\": [", fp);
+    for (unsigned int x = 0; x < stats->rule_count; x++) {
+        const struct rule_stats *rs = stats->rules + x;
+        // Rules applied until the word stops changing, with no limit of their own, have null
+        char pass_limit[16] = "null";
+        if (g->rules.pass_limits[x] != RULE_DEFAULT_PASS_LIMIT) {
+            snprintf(pass_limit, sizeof(pass_limit), "%u", g->rules.pass_limits[x]);
+        }
+        fprintf(
+            fp,
+            "%s\n    {\"rule\": %u, \"line\": %u, \"direction\": \"%c\", \"pass_limit\": %s, "
+            "\"checked\": %llu, \"skipped\": %llu, \"positions\": %llu, \"match_calls\": %llu, "
+            "\"slots_compared\": %llu, \"applications\": %llu, \"passes\": %llu, "
+            "\"cycles\": %llu}",
+            x ? "," : "",
+            x,
+            g->rules.line_numbers[x],
+            g->rules.directions[x],
+            pass_limit,
+            rs->checked,
+            rs->skipped,
+            rs->positions,
+            rs->match_calls,
+            rs->slots_compared,
+            rs->applications,
+            rs->passes,
+            rs->cycles);
+    }
+    fputs("\n  ]}", fp);
+}
+
+void derivation_add_time(struct derivation *d, const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    d->seconds += (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void derivation_stats_free(struct derivation_stats *stats) {
+    free(stats->rules);
+}
+
+void derivation_free(struct derivation *d) {
+#ifdef RULE_STATS
+    free(d->rule_stats);
+#endif
+    for (unsigned int x = 0; x < d->fst_count; x++) {
+        fst_free(d->fsts + x);
+    }
+    free(d->fsts);
+    free(d->summary);
+    free(d->batch_summaries);
+    free(d->batch_stale);
+    free(d->batch_ids);
+    free(d->gap);
+    free(d->insertions);
+    free(d->previous);
+    free(d->dirty);
+    for (unsigned int x = 0; x < d->rule_count; x++) {
+        free(d->matches[x]);
+        free(d->applied[x]);
+        free(d->skips[x]);
+    }
+    free(d->matches);
+    free(d->applied);
+    free(d->skips);
+}
@@ -0,0 +1,178 @@
+#ifndef DERIVE_H
+#define DERIVE_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "structures.h"
+#include "fst.h"
+
+// Counters for one rule, kept only when compiled with RULE_STATS defined (make STATS=1), so the
+// default build's hot path has no instrumentation at all
+struct rule_stats {
+    // Words the rule was checked against, and how many of those it was skipped for
+    unsigned long long checked;
+    unsigned long long skipped;
+    // Windows scanned (those skipped over aren't counted), calls to match a window, and context
+    // positions compared in them (up to and including the first one that doesn't match)
+    unsigned long long positions;
+    unsigned long long match_calls;
+    unsigned long long slots_compared;
+    // Windows the rule applied to
+    unsigned long long applications;
+    // Passes over words after the first, for rules applied until the word stops changing
+    unsigned long long passes;
+    // Time spent on the rule, in CPU cycles where there's a cycle counter (or else nanoseconds)
+    unsigned long long cycles;
+};
+
+// Lazily filled lookup tables describing how every rule of a grammar treats its interned feature
+// matrices, so applying rules to a word takes table lookups rather than loops over features
+// Tables are indexed by fmatrix_id_t, and grow as more matrices are interned
+// Every thread needs its own, since they're filled in as they're used, though any number of them
+// can share one grammar
+struct derivation {
+    // Grammar whose rules are applied, and whose feature matrices are interned as they're derived
+    struct grammar *grammar;
+    // One table per rule, in the order of the grammar's rules
+    // For every ID, context_length bytes, one per context position: 0 if not known yet, 1 if the
+    // matrix doesn't match that position, 2 if it does
+    unsigned char **matches;
+    // One table per rule, in the order of the grammar's rules
+    // For every ID, 0 if not known yet, or else how far the rule's scan can move on from a window
+    // with the ID at its key position (the last position for rules applied left to right, the
+    // first for right to left) shifted left once, with the lowest bit set if the ID matches the
+    // rule there
+    unsigned char **skips;
+    // One table per rule, in the order of the grammar's rules
+    // For every ID, the ID of the matrix after the rule's output is applied to it, or FMATRIX_NONE
+    // if not known yet
+    fmatrix_id_t **applied;
+    // For every rule that inserts segments, the ID of the segment it inserts, or FMATRIX_NONE if
+    // not known yet
+    fmatrix_id_t *insertions;
+    unsigned int rule_count;
+    // Number of IDs every table has room for
+    fmatrix_id_t capacity;
+    // Feature summary (see fmatrix_summarize) of the word being derived, checked against each
+    // rule's requirement to skip rules that can't apply without scanning the word
+    fword_t *summary;
+    // Set when the word has changed since the summary was last brought up to date
+    char summary_stale;
+    // Feature summaries of every word of the batch derive_batch is deriving, fmatrix_length
+    // fword_ts each, and whether each one is stale; there's room for batch_capacity words
+    fword_t *batch_summaries;
+    char *batch_stale;
+    size_t batch_capacity;
+    // Where derive_batch packs the words of a batch again when a rule inserts or deletes segments
+    fmatrix_id_t *batch_ids;
+    size_t batch_id_capacity;
+    // Gap buffer that rules inserting or deleting segments are applied in, with room for
+    // gap_capacity IDs
+    fmatrix_id_t *gap;
+    size_t gap_capacity;
+    // Word as it was before an iterative rule's first pass, and a flag for every window of the word
+    // saying whether it needs to be examined again; there's room for dirty_capacity positions
+    fmatrix_id_t *previous;
+    unsigned char *dirty;
+    size_t dirty_capacity;
+    // Number of times rules were checked against a word, and how many of those were skipped
+    // because the word was too short or its summary lacked something the rule needs
+    unsigned long long rules_checked;
+    unsigned long long rules_skipped;
+    // Transducers for every run of two or more consecutive context-free rules, in order, if
+    // derivation_use_fst was called
+    struct fst *fsts;
+    unsigned int fst_count;
+    // Number of words of text derived (memoized ones included), and seconds spent deriving that
+    // text, which callers time a whole chunk at a time rather than reading the clock for every word
+    unsigned long long words;
+    double seconds;
+    // Number of times a word was still changing when a rule reached the pass limit its line gives,
+    // and where each of them is reported, or NULL for nowhere
+    unsigned long long pass_limited;
+    FILE *warnings;
+#ifdef RULE_STATS
+    // Counters for every rule, in the order of the grammar's rules
+    struct rule_stats *rule_stats;
+#endif
+};
+
+// Totals of a derivation's statistics, possibly summed over several derivations
+struct derivation_stats {
+    unsigned long long words;
+    double seconds;
+    unsigned long long rules_checked;
+    unsigned long long rules_skipped;
+    unsigned int fst_count;
+    unsigned int fst_rules;
+    unsigned long long fst_transitions;
+    size_t fst_bytes;
+    unsigned long long fst_words;
+    unsigned long long fst_fallbacks;
+    unsigned long long pass_limited;
+    // Counters for every rule, in the order of the grammar's rules, or NULL if not compiled in
+    // Owned by the totals
+    struct rule_stats *rules;
+    unsigned int rule_count;
+};
+
+// Sets up empty tables for every rule in a grammar, which must already be parsed
+// Words still changing at a rule's pass limit aren't reported anywhere until warnings is set
+// Prints errors to stderr and exits on failure, leaving the derivation safe to free
+void derivation_init(struct derivation *, struct grammar *);
+// Makes the derivation apply runs of consecutive context-free rules with transducers, each allowed
+// to grow to the given number of transitions
+// Prints errors to stderr and exits on failure
+void derivation_use_fst(struct derivation *, uint32_t);
+// Returns whether the rule_index-th rule of the grammar matches as many IDs in a window as its
+// context is long, read backwards (the last ID against the first context position) if reversed
+// is set
+char derivation_matches(struct derivation *, unsigned int, const fmatrix_id_t *, char);
+// Returns the ID of a feature matrix after the output of the rule_index-th rule of the grammar is
+// applied to it
+// Prints errors to stderr and exits on failure
+fmatrix_id_t derivation_apply(struct derivation *, unsigned int, fmatrix_id_t);
+// Applies every rule of the grammar, in order, to a word, modifying it in place, using transducers
+// for the runs of rules that have them
+// Rules may insert or delete segments, so the word's length may change, and its IDs may be moved to
+// a bigger block (which must be a heap block of the word's capacity)
+// Prints errors to stderr and exits on failure
+void derive_word(struct derivation *, struct word *);
+// Applies count rules of the grammar in order, from the rule_index-th on, to a word, modifying it
+// in place just as derive_word does, one rule at a time and without transducers
+// new_word must be set unless the word is just as the last call left it, so rules can be skipped by
+// its feature summary without working it out again for every call
+// Returns whether any of them applied (which needn't have changed the word)
+// Prints errors to stderr and exits on failure
+char derive_word_rules(struct derivation *, struct word *, unsigned int, unsigned int, char);
+// Applies every rule of the grammar to count words at once, rule by rule rather than word by word,
+// modifying them in place, so each rule's tables stay in cache while it goes through every word
+// The words' IDs are all in one heap block of *capacity IDs, with the x-th word from starts[x] up
+// to starts[x + 1] (starts has count + 1 entries, starting from 0); transducers aren't used
+// Words end up just as derive_word would leave them; if rules insert or delete segments, they're
+// packed again, changing starts, and the block may be moved to a bigger one
+// Prints errors to stderr and exits on failure
+void derive_batch(struct derivation *, fmatrix_id_t **, size_t *, size_t *, size_t);
+// Adds a derivation's statistics to totals, which start zeroed
+// Prints errors to stderr and exits on failure
+void derivation_stats_add(struct derivation_stats *, const struct derivation *);
+// Prints how fast words were derived, how many rules were checked and skipped, and how big
+// transducers got and how often they fell back to applying rules one at a time, to a file
+// Then prints a table of every rule's counters, if compiled in, busiest rules first, with the lines
+// of the grammar's rules they're for
+// Prints errors to stderr and exits on failure
+void derivation_stats_print(const struct derivation_stats *, const struct grammar *, FILE *);
+// Prints the same statistics to a file as a JSON object (with no trailing newline)
+// Prints errors to stderr and exits on failure
+void derivation_stats_print_json(const struct derivation_stats *, const struct grammar *, FILE *);
+// Adds the time since start, read from CLOCK_MONOTONIC, to the seconds a derivation has spent
+// deriving text; callers read the clock once for a whole chunk of text rather than for every word,
+// which would add up
+void derivation_add_time(struct derivation *, const struct timespec *);
+// Frees what totals own
+void derivation_stats_free(struct derivation_stats *);
+// Frees all of the tables
+void derivation_free(struct derivation *);
+
+#endif
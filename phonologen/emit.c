@@ -0,0 +1,926 @@
+// C source generation, turning a grammar into a standalone program specialized to it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "structures.h"
+#include "emit.h"
+#include "util.h"
+
+// Entries of the segmentation trie's tables per line of generated source
+#define EMIT_ROW 12
+
+// Every generated program's code between its tables and its rules: words, spelling, feature
+// summaries, and the loops shared by rules applied until the word stops changing and rules that
+// insert or delete segments, which each such rule calls with its own constants and functions
+static const char *const RUNTIME_SUPPORT[] = {
+    "// Segments of one word being derived, as feature matrices",
+    "// The buffer is reused from word to word, and only ever grows",
+    "struct word {",
+    "    struct segment *segments;",
+    "    long length;",
+    "    size_t capacity;",
+    "};",
+    "",
+    "// Resizes a heap block, exiting on failure",
+    "static void *allocate(void *block, size_t size) {",
+    "    block = realloc(block, size ? size : 1);",
+    "    if (!block) {",
+    "        fputs(\"Error: unable to allocate memory\\n\", stderr);",
+    "        exit(EXIT_FAILURE);",
+    "    }",
+    "    return block;",
+    "}",
+    "",
+    "// Makes room for at least count segments in a word, keeping those already there",
+    "static void word_reserve(struct word *w, size_t count) {",
+    "    if (count > w->capacity) {",
+    "        w->capacity = count * 2;",
+    "        w->segments = allocate(w->segments, w->capacity * sizeof(*w->segments));",
+    "    }",
+    "}",
+    "",
+    "// Spelling of a feature matrix, in an open-addressing table of every matrix spelled so far",
+    "struct spelling {",
+    "    struct segment matrix;",
+    "    // NULL for empty slots",
+    "    const char *text;",
+    "    size_t length;",
+    "};",
+    "",
+    "static struct spelling *spellings;",
+    "static size_t spelling_count;",
+    "static size_t spelling_capacity;",
+    "",
+    "static uint64_t hash_segment(const struct segment *s) {",
+    "    uint64_t hash = 0x9e3779b97f4a7c15ull;",
+    "    for (int x = 0; x < FMATRIX_LENGTH; x++) {",
+    "        hash = (hash ^ s->w[x]) * 0xff51afd7ed558ccdull;",
+    "        hash ^= hash >> 32;",
+    "    }",
+    "    return hash;",
+    "}",
+    "",
+    "// Adds a feature matrix that isn't in the table yet",
+    "static void spelling_add(const struct segment *s, const char *text, size_t length) {",
+    "    if ((spelling_count + 1) * 2 > spelling_capacity) {",
+    "        struct spelling *old = spellings;",
+    "        size_t old_capacity = spelling_capacity;",
+    "        spelling_capacity = old_capacity ? old_capacity * 2 : 256;",
+    "        spellings = allocate(NULL, spelling_capacity * sizeof(*spellings));",
+    "        memset(spellings, 0, spelling_capacity * sizeof(*spellings));",
+    "        spelling_count = 0;",
+    "        for (size_t x = 0; x < old_capacity; x++) {",
+    "            if (old[x].text) {",
+    "                spelling_add(&old[x].matrix, old[x].text, old[x].length);",
+    "            }",
+    "        }",
+    "        free(old);",
+    "    }",
+    "    size_t slot = hash_segment(s) & (spelling_capacity - 1);",
+    "    while (spellings[slot].text) {",
+    "        slot = (slot + 1) & (spelling_capacity - 1);",
+    "    }",
+    "    spellings[slot].matrix = *s;",
+    "    spellings[slot].text = text;",
+    "    spellings[slot].length = length;",
+    "    spelling_count++;",
+    "}",
+    "",
+    "// Returns how a feature matrix is written in output, setting *length to the length of that:",
+    "// the name of the chart segment with exactly that matrix, or else the matrix in [ ... ]",
+    "// notation",
+    "static const char *spell(const struct segment *s, size_t *length) {",
+    "    size_t slot = hash_segment(s) & (spelling_capacity - 1);",
+    "    for (; spellings[slot].text; slot = (slot + 1) & (spelling_capacity - 1)) {",
+    "        if (!memcmp(&spellings[slot].matrix, s, sizeof(*s))) {",
+    "            *length = spellings[slot].length;",
+    "            return spellings[slot].text;",
+    "        }",
+    "    }",
+    "    // \"[ \", then value, name and ' ' for every feature, then \"]\"",
+    "    size_t size = 3;",
+    "    for (int f = 0; f < FEATURE_COUNT; f++) {",
+    "        size += 2 + strlen(feature_names[f]);",
+    "    }",
+    "    char *text = allocate(NULL, size + 1);",
+    "    char *end = text;",
+    "    *end++ = '[';",
+    "    *end++ = ' ';",
+    "    for (int f = 0; f < FEATURE_COUNT; f++) {",
+    "        fword_t bit = (fword_t) 1 << (f % 64);",
+    "        const fword_t *pair = s->w + f / 64 * 2;",
+    "        *end++ = (pair[0] & bit) ? ((pair[1] & bit) ? '+' : '-') : '0';",
+    "        strcpy(end, feature_names[f]);",
+    "        end += strlen(end);",
+    "        *end++ = ' ';",
+    "    }",
+    "    *end++ = ']';",
+    "    *end = '\\0';",
+    "    spelling_add(s, text, end - text);",
+    "    *length = end - text;",
+    "    return text;",
+    "}",
+    "",
+    "// Writes the spelling of a word to a buffer of size bytes, NUL-terminated and cut short with",
+    "// ... if it doesn't fit, for messages",
+    "static void spell_short(const struct word *w, char *buffer, size_t size) {",
+    "    size_t used = 0;",
+    "    for (long x = 0; x < w->length; x++) {",
+    "        size_t length;",
+    "        const char *text = spell(w->segments + x, &length);",
+    "        if (used + length + 4 > size) {",
+    "            memcpy(buffer + used, \"...\", 3);",
+    "            used += 3;",
+    "            break;",
+    "        }",
+    "        memcpy(buffer + used, text, length);",
+    "        used += length;",
+    "    }",
+    "    buffer[used] = '\\0';",
+    "}",
+    "",
+    "// Brings a word's feature summary up to date if it's stale: the features seen as MINUS",
+    "// followed by those seen as PLUS, for every 64 features; a rule can't apply to a word whose",
+    "// summary lacks any feature value its context needs",
+    "static inline void summarize(const struct word *w, fword_t summary[], char *stale) {",
+    "    if (!*stale) {",
+    "        return;",
+    "    }",
+    "    memset(summary, 0, FMATRIX_LENGTH * sizeof(*summary));",
+    "    for (long x = 0; x < w->length; x++) {",
+    "        const fword_t *matrix = w->segments[x].w;",
+    "        for (int y = 0; y < FMATRIX_LENGTH; y += 2) {",
+    "            summary[y] |= matrix[y] & ~matrix[y + 1];",
+    "            summary[y + 1] |= matrix[y + 1];",
+    "        }",
+    "    }",
+    "    *stale = 0;",
+    "}",
+    "",
+    "// Copy of the word before a rule applied until it stops changing, and which of its windows",
+    "// are to be examined again",
+    "static struct segment *previous;",
+    "static unsigned char *dirty;",
+    "static size_t dirty_capacity;",
+    "",
+    "// Marks the windows of a rule that overlap position p of a word, other than window x, whose",
+    "// focus is there, to be examined again",
+    "// Windows run from 0 to last, and the rule is length positions long; those the rule's",
+    "// direction puts behind window x are added to the range from lo to hi, for the next pass,",
+    "// and those ahead of it to the range ending at end, for the pass that's examining window x,",
+    "// unless end is NULL",
+    "static inline void mark(",
+    "        long p,",
+    "        long x,",
+    "        long length,",
+    "        long last,",
+    "        char reversed,",
+    "        long *lo,",
+    "        long *hi,",
+    "        long *end) {",
+    "    long first = p - length + 1 > 0 ? p - length + 1 : 0;",
+    "    long final = p < last ? p : last;",
+    "    long from = reversed ? x + 1 : first;",
+    "    long to = reversed ? final : x - 1;",
+    "    if (from <= to) {",
+    "        memset(dirty + from, 1, to - from + 1);",
+    "        *lo = from < *lo ? from : *lo;",
+    "        *hi = to > *hi ? to : *hi;",
+    "    }",
+    "    if (!end) {",
+    "        return;",
+    "    }",
+    "    from = reversed ? first : x + 1;",
+    "    to = reversed ? x - 1 : final;",
+    "    if (from <= to) {",
+    "        memset(dirty + from, 1, to - from + 1);",
+    "        *end = reversed ? (from < *end ? from : *end) : (to > *end ? to : *end);",
+    "    }",
+    "}",
+    "",
+    "// Applies a rule to a word with its single pass, scan, and then again and again until the",
+    "// word stops changing, examining only the windows that overlap a segment changed since they",
+    "// were last examined; the rule is length positions long, with its focus at focus_position,",
+    "// and matches and apply are what it checks windows for and does to their focus",
+    "// Every call passes constants and the rule's own functions, so compilers specialize it per",
+    "// rule",
+    "// Returns whether the rule applied",
+    "// A word the next pass would still change after limit passes is left as it is, with a",
+    "// warning on stderr",
+    "static inline char iterate(",
+    "        struct word *w,",
+    "        char (*scan)(struct word *),",
+    "        char (*matches)(const struct segment *),",
+    "        void (*apply)(struct segment *),",
+    "        long length,",
+    "        long focus_position,",
+    "        char reversed,",
+    "        uint32_t limit,",
+    "        unsigned int line) {",
+    "    long len = w->length;",
+    "    if ((size_t) len > dirty_capacity) {",
+    "        dirty_capacity = len * 2;",
+    "        previous = allocate(previous, dirty_capacity * sizeof(*previous));",
+    "        dirty = allocate(dirty, dirty_capacity);",
+    "    }",
+    "    struct segment *word = w->segments;",
+    "    memcpy(previous, word, len * sizeof(*word));",
+    "    if (!scan(w)) {",
+    "        return 0;",
+    "    }",
+    "    long last = len - length;",
+    "    memset(dirty, 0, last + 1);",
+    "    long lo = last + 1;",
+    "    long hi = -1;",
+    "    for (long p = focus_position; p <= last + focus_position; p++) {",
+    "        if (memcmp(word + p, previous + p, sizeof(*word))) {",
+    "            mark(p, p - focus_position, length, last, reversed, &lo, &hi, NULL);",
+    "        }",
+    "    }",
+    "    for (uint32_t passes = 1; lo <= hi; passes++) {",
+    "        if (passes >= limit) {",
+    "            // Whichever window would change the word first does so on the word as it is",
+    "            char changing = 0;",
+    "            for (long x = lo; x <= hi && !changing; x++) {",
+    "                if (dirty[x] && matches(word + x)) {",
+    "                    struct segment result = word[x + focus_position];",
+    "                    apply(&result);",
+    "                    changing = memcmp(&result, word + x + focus_position, sizeof(result)) != 0;",
+    "                }",
+    "            }",
+    "            if (!changing) {",
+    "                break;",
+    "            }",
+    "            char spelling[64];",
+    "            spell_short(w, spelling, sizeof(spelling));",
+    "            fprintf(",
+    "                stderr,",
+    "                \"Warning: rule on line %u was still changing %s after %u passes\\n\",",
+    "                line,",
+    "                spelling,",
+    "                passes);",
+    "            break;",
+    "        }",
+    "        long x = reversed ? hi : lo;",
+    "        long end = reversed ? lo : hi;",
+    "        lo = last + 1;",
+    "        hi = -1;",
+    "        for (; reversed ? x >= end : x <= end; x += reversed ? -1 : 1) {",
+    "            if (!dirty[x]) {",
+    "                continue;",
+    "            }",
+    "            dirty[x] = 0;",
+    "            if (!matches(word + x)) {",
+    "                continue;",
+    "            }",
+    "            struct segment *focus = word + x + focus_position;",
+    "            struct segment result = *focus;",
+    "            apply(&result);",
+    "            if (memcmp(&result, focus, sizeof(result))) {",
+    "                *focus = result;",
+    "                mark(x + focus_position, x, length, last, reversed, &lo, &hi, &end);",
+    "            }",
+    "        }",
+    "    }",
+    "    return 1;",
+    "}",
+    "",
+    "// Gap buffer for rules that insert or delete segments",
+    "static struct segment *gap;",
+    "static size_t gap_capacity;",
+    "",
+    "// Applies a rule that inserts or deletes segments to a word, scanning it once in the rule's",
+    "// direction with the gap kept right at the edge of the window being examined; the rule's",
+    "// context is length positions long, with its focus (or where it inserts) at focus_position,",
+    "// matches is what it checks windows for, and inserted is the segment it inserts, or NULL if",
+    "// it deletes",
+    "// Every window is checked against the word as everything before it left it: after a deletion",
+    "// the scan goes on with the window that brings in the next segment, and after an insertion",
+    "// it goes on from the next place in the word as it was",
+    "// Returns whether the rule applied",
+    "static inline char edit(",
+    "        struct word *w,",
+    "        char (*matches)(const struct segment *),",
+    "        long length,",
+    "        long focus_position,",
+    "        char reversed,",
+    "        const struct segment *inserted) {",
+    "    long len = w->length;",
+    "    size_t capacity = (size_t) len * 2 + 2;",
+    "    if (capacity > gap_capacity) {",
+    "        gap_capacity = capacity * 2;",
+    "        gap = allocate(gap, gap_capacity * sizeof(*gap));",
+    "    }",
+    "    char applied = 0;",
+    "    long front;",
+    "    long back;",
+    "    long edited_len;",
+    "    struct segment *edited = gap;",
+    "    if (!reversed) {",
+    "        front = 0;",
+    "        back = capacity - len;",
+    "        memcpy(gap + back, w->segments, len * sizeof(*gap));",
+    "        while ((long) capacity - back >= length) {",
+    "            struct segment *window = gap + back;",
+    "            long step = 1;",
+    "            if (matches(window)) {",
+    "                applied = 1;",
+    "                if (inserted) {",
+    "                    memmove(window - 1, window, focus_position * sizeof(*window));",
+    "                    back--;",
+    "                    gap[back + focus_position] = *inserted;",
+    "                    step = 2;",
+    "                } else {",
+    "                    memmove(window + 1, window, focus_position * sizeof(*window));",
+    "                    back++;",
+    "                    step = 0;",
+    "                }",
+    "            }",
+    "            memmove(gap + front, gap + back, step * sizeof(*gap));",
+    "            front += step;",
+    "            back += step;",
+    "        }",
+    "        memmove(gap + front, gap + back, (capacity - back) * sizeof(*gap));",
+    "        edited_len = front + (capacity - back);",
+    "    } else {",
+    "        front = len;",
+    "        back = capacity;",
+    "        memcpy(gap, w->segments, len * sizeof(*gap));",
+    "        while (front >= length) {",
+    "            struct segment *window = gap + front - length;",
+    "            long step = 1;",
+    "            if (matches(window)) {",
+    "                applied = 1;",
+    "                struct segment *focus = window + focus_position;",
+    "                if (inserted) {",
+    "                    memmove(focus + 1, focus, (length - focus_position) * sizeof(*focus));",
+    "                    *focus = *inserted;",
+    "                    front++;",
+    "                    step = 2;",
+    "                } else {",
+    "                    long after = length - focus_position - 1;",
+    "                    memmove(focus, focus + 1, after * sizeof(*focus));",
+    "                    front--;",
+    "                    step = 0;",
+    "                }",
+    "            }",
+    "            back -= step;",
+    "            front -= step;",
+    "            memmove(gap + back, gap + front, step * sizeof(*gap));",
+    "        }",
+    "        memmove(gap + back - front, gap, front * sizeof(*gap));",
+    "        edited_len = front + (capacity - back);",
+    "        edited += back - front;",
+    "    }",
+    "    if (applied) {",
+    "        word_reserve(w, edited_len);",
+    "        memcpy(w->segments, edited, edited_len * sizeof(*edited));",
+    "        w->length = edited_len;",
+    "    }",
+    "    return applied;",
+    "}",
+    "",
+    "// A rule, with the context length and feature summary (see summarize) a word needs for it to",
+    "// possibly apply, and the function that applies it and returns whether it did",
+    "struct rule {",
+    "    long length;",
+    "    struct segment requirement;",
+    "    char (*run)(struct word *);",
+    "};",
+    NULL};
+
+// Every generated program's code after its rules: memoizing words, segmenting them, and reading
+// and writing text
+static const char *const RUNTIME_MAIN[] = {
+    "// Applies every rule in order to a word, skipping those it's too short for or whose context",
+    "// needs feature values it lacks",
+    "static void derive(struct word *w) {",
+    "    fword_t summary[FMATRIX_LENGTH];",
+    "    char stale = 1;",
+    "    for (int x = 0; x < RULE_COUNT; x++) {",
+    "        const struct rule *r = rules + x;",
+    "        if (w->length < r->length) {",
+    "            continue;",
+    "        }",
+    "        summarize(w, summary, &stale);",
+    "        fword_t missing = 0;",
+    "        for (int y = 0; y < FMATRIX_LENGTH; y++) {",
+    "            missing |= r->requirement.w[y] & ~summary[y];",
+    "        }",
+    "        if (!missing) {",
+    "            stale |= r->run(w);",
+    "        }",
+    "    }",
+    "}",
+    "",
+    "// Growable run of bytes",
+    "struct buffer {",
+    "    char *data;",
+    "    size_t length;",
+    "    size_t capacity;",
+    "};",
+    "",
+    "static void buffer_reserve(struct buffer *b, size_t length) {",
+    "    if (b->length + length > b->capacity) {",
+    "        b->capacity = (b->length + length) * 2;",
+    "        b->data = allocate(b->data, b->capacity);",
+    "    }",
+    "}",
+    "",
+    "static inline void buffer_append(struct buffer *b, const char *data, size_t length) {",
+    "    buffer_reserve(b, length);",
+    "    memcpy(b->data + b->length, data, length);",
+    "    b->length += length;",
+    "}",
+    "",
+    "// Memoized derivation of a whole word, in an open-addressing table keyed by its text",
+    "struct memo {",
+    "    uint64_t hash;",
+    "    // The word's text followed by its surface form, or NULL for empty slots",
+    "    char *text;",
+    "    size_t length;",
+    "    size_t surface_length;",
+    "};",
+    "",
+    "static struct memo *memos;",
+    "static size_t memo_count;",
+    "static size_t memo_capacity;",
+    "// Bytes of text memoized so far; words stop being added at CACHE_SIZE",
+    "static size_t memo_bytes;",
+    "",
+    "static uint64_t hash_text(const char *text, size_t length) {",
+    "    uint64_t hash = 0xcbf29ce484222325ull;",
+    "    for (size_t x = 0; x < length; x++) {",
+    "        hash = (hash ^ (unsigned char) text[x]) * 0x100000001b3ull;",
+    "    }",
+    "    return hash;",
+    "}",
+    "",
+    "// Returns the memo for a word, or the empty slot it would go in",
+    "static struct memo *memo_find(uint64_t hash, const char *text, size_t length) {",
+    "    size_t slot = hash & (memo_capacity - 1);",
+    "    for (; memos[slot].text; slot = (slot + 1) & (memo_capacity - 1)) {",
+    "        if (memos[slot].hash == hash && memos[slot].length == length",
+    "                && !memcmp(memos[slot].text, text, length)) {",
+    "            break;",
+    "        }",
+    "    }",
+    "    return memos + slot;",
+    "}",
+    "",
+    "// Memoizes a word's surface form, unless that would go over CACHE_SIZE bytes",
+    "static void memo_add(",
+    "        uint64_t hash, const char *text, size_t length, const char *surface,",
+    "        size_t surface_length) {",
+    "    if (memo_bytes + length + surface_length > CACHE_SIZE) {",
+    "        return;",
+    "    }",
+    "    if ((memo_count + 1) * 2 > memo_capacity) {",
+    "        struct memo *old = memos;",
+    "        size_t old_capacity = memo_capacity;",
+    "        memo_capacity = old_capacity * 2;",
+    "        memos = allocate(NULL, memo_capacity * sizeof(*memos));",
+    "        memset(memos, 0, memo_capacity * sizeof(*memos));",
+    "        for (size_t x = 0; x < old_capacity; x++) {",
+    "            if (old[x].text) {",
+    "                *memo_find(old[x].hash, old[x].text, old[x].length) = old[x];",
+    "            }",
+    "        }",
+    "        free(old);",
+    "    }",
+    "    struct memo *m = memo_find(hash, text, length);",
+    "    m->hash = hash;",
+    "    m->text = allocate(NULL, length + surface_length);",
+    "    memcpy(m->text, text, length);",
+    "    memcpy(m->text + length, surface, surface_length);",
+    "    m->length = length;",
+    "    m->surface_length = surface_length;",
+    "    memo_count++;",
+    "    memo_bytes += length + surface_length;",
+    "}",
+    "",
+    "// Parses a word of text into segments, each the longest chart segment name that matches",
+    "// where it starts",
+    "static void parse(const char *text, size_t length, struct word *w) {",
+    "    word_reserve(w, length);",
+    "    w->length = 0;",
+    "    const char *end = text + length;",
+    "    while (text < end) {",
+    "        int32_t segment = -1;",
+    "        size_t match = 0;",
+    "        uint32_t node = 0;",
+    "        size_t rest = end - text;",
+    "        for (size_t x = 0; x < rest",
+    "                && (node = trie_transitions[node * TRIE_CLASSES",
+    "                    + trie_classes[(unsigned char) text[x]]]); x++) {",
+    "            if (trie_values[node] >= 0) {",
+    "                match = x + 1;",
+    "                segment = trie_values[node];",
+    "            }",
+    "        }",
+    "        if (!match) {",
+    "            fprintf(",
+    "                stderr,",
+    "                \"Error parsing word: nothing matches the start of %.*s\\n\",",
+    "                (int) rest,",
+    "                text);",
+    "            exit(EXIT_FAILURE);",
+    "        }",
+    "        w->segments[w->length++] = segments[segment];",
+    "        text += match;",
+    "    }",
+    "}",
+    "",
+    "// Returns whether a byte separates words; these are the bytes scanf's %s skips in the C",
+    "// locale",
+    "static inline char is_separator(char c) {",
+    "    return c == ' ' || c == '\\t' || c == '\\n' || c == '\\v' || c == '\\f' || c == '\\r';",
+    "}",
+    "",
+    "// Appends the surface form of every word in text to the output buffer, copying the",
+    "// whitespace between words as is",
+    "static void derive_text(",
+    "        const char *text, size_t length, struct word *w, struct buffer *out) {",
+    "    const char *end = text + length;",
+    "    while (text < end) {",
+    "        const char *start = text;",
+    "        while (text < end && is_separator(*text)) {",
+    "            text++;",
+    "        }",
+    "        buffer_append(out, start, text - start);",
+    "        start = text;",
+    "        while (text < end && !is_separator(*text)) {",
+    "            text++;",
+    "        }",
+    "        if (text == start) {",
+    "            break;",
+    "        }",
+    "        size_t word_length = text - start;",
+    "        uint64_t hash = hash_text(start, word_length);",
+    "        struct memo *m = memo_find(hash, start, word_length);",
+    "        if (m->text) {",
+    "            buffer_append(out, m->text + word_length, m->surface_length);",
+    "            continue;",
+    "        }",
+    "        parse(start, word_length, w);",
+    "        derive(w);",
+    "        size_t surface_start = out->length;",
+    "        for (long x = 0; x < w->length; x++) {",
+    "            size_t spelling_length;",
+    "            const char *spelling = spell(w->segments + x, &spelling_length);",
+    "            buffer_append(out, spelling, spelling_length);",
+    "        }",
+    "        size_t surface_length = out->length - surface_start;",
+    "        memo_add(hash, start, word_length, out->data + surface_start, surface_length);",
+    "    }",
+    "}",
+    "",
+    "// Derives every word on stdin, writing surface forms to stdout with the whitespace between",
+    "// words copied as is, so output lines match input lines",
+    "// Returns EXIT_SUCCESS on success; prints errors to stderr and exits on failure",
+    "int main(void) {",
+    "    for (int x = 0; x < SEGMENT_COUNT; x++) {",
+    "        spelling_add(segments + x, segment_names[x], strlen(segment_names[x]));",
+    "    }",
+    "    memo_capacity = 1024;",
+    "    memos = allocate(NULL, memo_capacity * sizeof(*memos));",
+    "    memset(memos, 0, memo_capacity * sizeof(*memos));",
+    "    struct buffer in = {0};",
+    "    struct buffer out = {0};",
+    "    struct word w = {0};",
+    "    char eof = 0;",
+    "    while (!eof) {",
+    "        buffer_reserve(&in, BLOCK_SIZE);",
+    "        size_t read = fread(in.data + in.length, 1, BLOCK_SIZE, stdin);",
+    "        in.length += read;",
+    "        if (read < BLOCK_SIZE) {",
+    "            if (ferror(stdin)) {",
+    "                fputs(\"Error reading input\\n\", stderr);",
+    "                return EXIT_FAILURE;",
+    "            }",
+    "            eof = 1;",
+    "        }",
+    "        // Leave any word cut off at the end of the block for the next one",
+    "        size_t end = in.length;",
+    "        while (!eof && end && !is_separator(in.data[end - 1])) {",
+    "            end--;",
+    "        }",
+    "        derive_text(in.data, end, &w, &out);",
+    "        if (out.length && fwrite(out.data, 1, out.length, stdout) != out.length) {",
+    "            fputs(\"Error writing output\\n\", stderr);",
+    "            return EXIT_FAILURE;",
+    "        }",
+    "        out.length = 0;",
+    "        memmove(in.data, in.data + end, in.length - end);",
+    "        in.length -= end;",
+    "    }",
+    "    if (fflush(stdout) || ferror(stdout)) {",
+    "        fputs(\"Error writing output\\n\", stderr);",
+    "        return EXIT_FAILURE;",
+    "    }",
+    "    return EXIT_SUCCESS;",
+    "}",
+    NULL};
+
+static void emit_lines(FILE *fp, const char *const lines[]) {
+    for (; *lines; lines++) {
+        fputs(*lines, fp);
+        fputc('\n', fp);
+    }
+}
+
+// Writes a string as a C string literal, escaping every byte that isn't printable ASCII so the
+// generated source is too
+static void emit_string(FILE *fp, const char *string) {
+    fputc('"', fp);
+    for (; *string; string++) {
+        unsigned char c = *string;
+        if (c == '"' || c == '\\') {
+            fprintf(fp, "\\%c", c);
+        } else if (c < ' ' || c > '~') {
+            // Three octal digits, so the next character can't be taken as part of the escape
+            fprintf(fp, "\\%03o", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+// Writes a feature matrix of the given length as an initializer of struct segment
+static void emit_fmatrix(FILE *fp, const fword_t fmatrix[], unsigned int length) {
+    fputs("{{", fp);
+    for (unsigned int w = 0; w < length; w++) {
+        fprintf(fp, "%s0x%llxull", w ? ", " : "", (unsigned long long) fmatrix[w]);
+    }
+    fputs("}}", fp);
+}
+
+// Writes the chart segments and feature names, and the segmentation trie with its values
+// renumbered to index the segments
+// Prints errors to stderr and exits on failure
+static void emit_tables(const struct grammar *g, FILE *fp) {
+    // Index among the chart segments of every named feature matrix, or -1
+    int32_t *indices = malloc(g->fmatrix_count * sizeof(*indices));
+    fail_if(!indices, "Error: unable to allocate memory\n");
+    int32_t segment_count = 0;
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count; id++) {
+        indices[id] = fmatrix_name(g, id) ? segment_count++ : -1;
+    }
+    fprintf(fp, "#define SEGMENT_COUNT %d\n\n", segment_count);
+    fputs("// Feature matrix of every chart segment, and its name\n", fp);
+    fputs("static const struct segment segments[SEGMENT_COUNT] = {\n", fp);
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count; id++) {
+        if (indices[id] >= 0) {
+            fputs("    ", fp);
+            emit_fmatrix(fp, fmatrix_of(g, id), g->fmatrix_length);
+            fputs(",\n", fp);
+        }
+    }
+    fputs("};\n", fp);
+    fputs("static const char *const segment_names[SEGMENT_COUNT] = {\n", fp);
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count; id++) {
+        if (indices[id] >= 0) {
+            fputs("    ", fp);
+            emit_string(fp, fmatrix_name(g, id));
+            fputs(",\n", fp);
+        }
+    }
+    fputs("};\n", fp);
+    fputs("static const char *const feature_names[FEATURE_COUNT] = {\n", fp);
+    for (unsigned int f = 0; f < g->feature_count; f++) {
+        fputs("    ", fp);
+        emit_string(fp, g->feature_names[f]);
+        fputs(",\n", fp);
+    }
+    fputs("};\n\n", fp);
+
+    const struct segment_trie *t = &g->segment_trie;
+    fprintf(fp, "#define TRIE_CLASSES %u\n", t->class_count);
+    fputs(
+        "// Segment names as a trie: the class of every byte value, the next node from every node\n"
+        "// for every class (0 for none, since nothing leads back to the root), and the segment\n"
+        "// whose name ends at every node, or -1\n",
+        fp);
+    fputs("static const unsigned char trie_classes[256] = {", fp);
+    for (unsigned int x = 0; x < 256; x++) {
+        fprintf(fp, "%s%u,", x % EMIT_ROW ? " " : "\n    ", t->byte_class[x]);
+    }
+    fputs("\n};\n", fp);
+    fprintf(fp, "static const uint32_t trie_transitions[%u] = {", t->node_count * t->class_count);
+    for (unsigned int x = 0; x < t->node_count * t->class_count; x++) {
+        fprintf(fp, "%s%u,", x % EMIT_ROW ? " " : "\n    ", t->transitions[x]);
+    }
+    fputs("\n};\n", fp);
+    fprintf(fp, "static const int32_t trie_values[%u] = {", t->node_count);
+    for (unsigned int x = 0; x < t->node_count; x++) {
+        fmatrix_id_t id = t->values[x];
+        fprintf(fp, "%s%d,", x % EMIT_ROW ? " " : "\n    ", id == FMATRIX_NONE ? -1 : indices[id]);
+    }
+    fputs("\n};\n\n", fp);
+    free(indices);
+}
+
+// Writes the bits of a compiled feature matrix's features that don't match the one at operand,
+// which are unspecified there or have the other value, ORed together for all of its ops on lines of
+// their own after the first written of all
+// Returns how many ops have been written
+static unsigned int emit_mismatch(
+        FILE *fp, const struct fmatrix_op *ops, unsigned int count, const char *operand,
+        unsigned int written) {
+    for (unsigned int x = 0; x < count; x++) {
+        fprintf(
+            fp,
+            "%s((~%s.w[%u] | (%s.w[%u] ^ 0x%llxull)) & 0x%llxull)",
+            written++ ? "\n        | " : "",
+            operand,
+            ops[x].word,
+            operand,
+            ops[x].word + 1,
+            (unsigned long long) ops[x].value,
+            (unsigned long long) ops[x].specified);
+    }
+    return written;
+}
+
+// Writes the functions of the x-th rule of a grammar: whether a window matches, what the rule does
+// to the focus (for rules that change it), and the rule itself, which applies it to a word and
+// returns whether it did
+static void emit_rule(const struct grammar *g, FILE *fp, unsigned int x) {
+    const struct rule_set *r = &g->rules;
+    uint32_t length = r->context_lengths[x];
+    uint32_t focus_position = r->focus_positions[x];
+    char reversed = r->directions[x] == 'R';
+    char kind = r->kinds[x];
+    const uint32_t *op_starts = r->op_starts + r->matrix_starts[x];
+    fprintf(fp, "// Line %u of the rules: %c", r->line_numbers[x], r->directions[x]);
+    if (r->pass_limits[x]) {
+        fputc('*', fp);
+    }
+    if (r->pass_limits[x] && r->pass_limits[x] != RULE_DEFAULT_PASS_LIMIT) {
+        fprintf(fp, "%u", r->pass_limits[x]);
+    }
+    if (kind == 'I') {
+        fprintf(
+            fp, ", inserting a segment after %u of %u context positions\n", focus_position, length);
+    } else {
+        fprintf(
+            fp,
+            ", %s position %u of %u\n",
+            kind == 'C' ? "changing" : "deleting",
+            focus_position,
+            length);
+    }
+
+    // Every position is checked at once, without branching on each, since which of them match is
+    // hard to predict
+    fprintf(fp, "static inline char rule_%u_matches(const struct segment *window) {\n", x);
+    if (op_starts[length] == op_starts[0]) {
+        // Every position matches anything
+        fputs("    (void) window;\n    return 1;\n}\n", fp);
+    } else {
+        fputs("    return (", fp);
+        unsigned int written = 0;
+        for (uint32_t y = 0; y < length; y++) {
+            char operand[32];
+            snprintf(operand, sizeof(operand), "window[%u]", y);
+            written = emit_mismatch(
+                fp, r->ops + op_starts[y], op_starts[y + 1] - op_starts[y], operand, written);
+        }
+        fputs(") == 0;\n}\n", fp);
+    }
+
+    if (kind == 'I') {
+        fprintf(fp, "static const struct segment rule_%u_inserted = ", x);
+        emit_fmatrix(
+            fp,
+            r->matrices + ((size_t) r->matrix_starts[x] + length) * g->fmatrix_length,
+            g->fmatrix_length);
+        fputs(";\n", fp);
+    } else if (kind == 'C') {
+        fprintf(fp, "static inline void rule_%u_apply(struct segment *focus) {\n", x);
+        const struct fmatrix_op *ops = r->ops + op_starts[length];
+        unsigned int count = op_starts[length + 1] - op_starts[length];
+        if (!count) {
+            fputs("    (void) focus;\n", fp);
+        }
+        for (unsigned int y = 0; y < count; y++) {
+            unsigned long long specified = ops[y].specified;
+            unsigned long long value = ops[y].value;
+            fprintf(fp, "    focus->w[%u] |= 0x%llxull;\n", ops[y].word, specified);
+            fprintf(
+                fp,
+                "    focus->w[%u] = (focus->w[%u] & ~0x%llxull) | 0x%llxull;\n",
+                ops[y].word + 1,
+                ops[y].word + 1,
+                specified,
+                value);
+        }
+        fputs("}\n", fp);
+    }
+
+    if (kind != 'C') {
+        fprintf(fp, "static char rule_%u(struct word *w) {\n", x);
+        fprintf(
+            fp,
+            "    return edit(w, rule_%u_matches, %u, %u, %d, ",
+            x,
+            length,
+            focus_position,
+            reversed);
+        if (kind == 'I') {
+            fprintf(fp, "&rule_%u_inserted);\n}\n\n", x);
+        } else {
+            fputs("NULL);\n}\n\n", fp);
+        }
+        return;
+    }
+    // A single pass over the word, which is the whole rule unless it's applied until the word
+    // stops changing
+    fprintf(fp, "static char rule_%u%s(struct word *w) {\n", x, r->pass_limits[x] ? "_scan" : "");
+    fputs("    struct segment *word = w->segments;\n", fp);
+    fputs("    char applied = 0;\n", fp);
+    if (reversed) {
+        fprintf(fp, "    for (long x = w->length - %u; x >= 0; x--) {\n", length);
+    } else {
+        fprintf(fp, "    for (long x = 0; x <= w->length - %u; x++) {\n", length);
+    }
+    fprintf(fp, "        if (rule_%u_matches(word + x)) {\n", x);
+    fprintf(fp, "            rule_%u_apply(word + x + %u);\n", x, focus_position);
+    fputs("            applied = 1;\n", fp);
+    fputs("        }\n", fp);
+    fputs("    }\n", fp);
+    fputs("    return applied;\n", fp);
+    fputs("}\n", fp);
+    if (r->pass_limits[x]) {
+        fprintf(fp, "static char rule_%u(struct word *w) {\n", x);
+        fprintf(
+            fp,
+            "    return iterate(\n"
+            "        w, rule_%u_scan, rule_%u_matches, rule_%u_apply, %u, %u, %d, %u, %u);\n",
+            x,
+            x,
+            x,
+            length,
+            focus_position,
+            reversed,
+            r->pass_limits[x],
+            r->line_numbers[x]);
+        fputs("}\n", fp);
+    }
+    fputc('\n', fp);
+}
+
+// Writes the table of every rule, in order, with what it takes for each to possibly apply to a word
+static void emit_rule_table(const struct grammar *g, FILE *fp) {
+    const struct rule_set *r = &g->rules;
+    fprintf(fp, "#define RULE_COUNT %u\n\n", r->count);
+    fputs("static const struct rule rules[RULE_COUNT] = {\n", fp);
+    for (unsigned int x = 0; x < r->count; x++) {
+        fprintf(fp, "    {%u, ", r->context_lengths[x]);
+        emit_fmatrix(fp, r->requirements + (size_t) x * g->fmatrix_length, g->fmatrix_length);
+        fprintf(fp, ", rule_%u},\n", x);
+    }
+    fputs("};\n\n", fp);
+}
+
+void grammar_emit_c(const struct grammar *g, FILE *fp, const char *path) {
+    fputs(
+        "// Generated by phonologen --emit-c, as a standalone program that derives words on stdin\n"
+        "// to stdout exactly as phonologen does with the grammar it was generated from\n"
+        "// Compile with cc -O3 -march=native; defining CACHE_SIZE sets the budget in bytes for\n"
+        "// memoized words (0 turns memoization off)\n\n"
+        "#include <stdio.h>\n"
+        "#include <stdlib.h>\n"
+        "#include <stdint.h>\n"
+        "#include <string.h>\n\n",
+        fp);
+    fprintf(fp, "#define FEATURE_COUNT %u\n", g->feature_count);
+    fputs("// Number of fword_ts in every feature matrix (two per 64 features, rounded up)\n", fp);
+    fprintf(fp, "#define FMATRIX_LENGTH %u\n", g->fmatrix_length);
+    fputs(
+        "#ifndef CACHE_SIZE\n"
+        "#define CACHE_SIZE ((size_t) 64 << 20)\n"
+        "#endif\n"
+        "// Bytes of input read at a time\n"
+        "#define BLOCK_SIZE ((size_t) 1 << 20)\n\n"
+        "typedef uint64_t fword_t;\n\n"
+        "// Feature matrix of a segment: a pair of words per 64 features, a \"specified\" bitmask\n"
+        "// (set for + or -) followed by a \"value\" bitmask (set for +)\n"
+        "struct segment {\n"
+        "    fword_t w[FMATRIX_LENGTH];\n"
+        "};\n\n",
+        fp);
+    emit_tables(g, fp);
+    emit_lines(fp, RUNTIME_SUPPORT);
+    fputc('\n', fp);
+    for (unsigned int x = 0; x < g->rules.count; x++) {
+        emit_rule(g, fp, x);
+    }
+    emit_rule_table(g, fp);
+    emit_lines(fp, RUNTIME_MAIN);
+    fail_if(fflush(fp) || ferror(fp), "Error writing C file %s\n", path);
+}
@@ -0,0 +1,17 @@
+#ifndef EMIT_H
+#define EMIT_H
+
+#include <stdio.h>
+
+#include "structures.h"
+
+// Writes a grammar as the C source of a standalone program, to a file open for writing whose path
+// is given for messages
+// The program derives words on stdin to stdout exactly as phonologen does with the grammar, with
+// the chart and segmentation trie as constant tables, a constant feature matrix length, and every
+// rule as a function of its own, with its feature masks, context length, focus position and
+// direction built in; it needs nothing but a C99 compiler and its standard library
+// Prints errors to stderr and exits on failure
+void grammar_emit_c(const struct grammar *, FILE *, const char *);
+
+#endif
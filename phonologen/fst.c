@@ -0,0 +1,73 @@
+// Transducers applying runs of context-free rules in a single pass over each word
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "structures.h"
+#include "derive.h"
+#include "fst.h"
+#include "util.h"
+
+void fst_init(
+        struct fst *f,
+        const struct rule_set *rules,
+        unsigned int first_index,
+        unsigned int rule_count,
+        uint32_t transition_budget) {
+    memset(f, 0, sizeof(*f));
+    f->rules = rules;
+    f->rule_count = rule_count;
+    f->first_index = first_index;
+    f->transition_budget = transition_budget;
+}
+
+// Returns what the rules turn an ID into, applying them one at a time
+static fmatrix_id_t fst_apply(struct fst *f, struct derivation *d, fmatrix_id_t id) {
+    for (unsigned int x = f->first_index; x < f->first_index + f->rule_count; x++) {
+        if (derivation_matches(d, x, &id, 0)) {
+            id = derivation_apply(d, x, id);
+        }
+    }
+    return id;
+}
+
+// Builds the transition on an ID, unless that would take more transitions than the budget allows
+// Returns what the rules turn the ID into
+static fmatrix_id_t fst_build_transition(struct fst *f, struct derivation *d, fmatrix_id_t id) {
+    fmatrix_id_t output = fst_apply(f, d, id);
+    if (f->transition_count >= f->transition_budget) {
+        f->fallbacks++;
+        return output;
+    }
+    if (id >= f->output_length) {
+        uint32_t length = f->output_length ? f->output_length : 64;
+        while (length <= id) {
+            length *= 2;
+        }
+        fmatrix_id_t *outputs = realloc(f->outputs, length * sizeof(*outputs));
+        fail_if(!outputs, "Error: unable to allocate memory\n");
+        // FMATRIX_NONE is all ones
+        memset(outputs + f->output_length, 0xff, (length - f->output_length) * sizeof(*outputs));
+        f->outputs = outputs;
+        f->output_length = length;
+    }
+    f->outputs[id] = output;
+    f->transition_count++;
+    return output;
+}
+
+void fst_run(struct fst *f, struct derivation *d, fmatrix_id_t *word, long len) {
+    f->words++;
+    for (long x = 0; x < len; x++) {
+        fmatrix_id_t output = word[x] < f->output_length ? f->outputs[word[x]] : FMATRIX_NONE;
+        word[x] = output != FMATRIX_NONE ? output : fst_build_transition(f, d, word[x]);
+    }
+}
+
+size_t fst_bytes(const struct fst *f) {
+    return f->output_length * sizeof(*f->outputs);
+}
+
+void fst_free(struct fst *f) {
+    free(f->outputs);
+}
@@ -0,0 +1,52 @@
+#ifndef FST_H
+#define FST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "structures.h"
+
+struct derivation;
+
+// Default number of transitions each transducer may grow to, past which segments are taken through
+// its rules one at a time
+#define FST_DEFAULT_TRANSITIONS (1 << 16)
+
+// Transducer that applies a run of consecutive context-free rules (ones changing a single segment
+// with no context around it) in one pass over a word instead of one pass per rule
+// Each segment is changed by such rules regardless of its neighbours or the direction they're
+// applied in, so the minimal transducer for any run of them has a single state, and its
+// transitions just map every segment to what the whole run turns it into
+// Transitions are built lazily as words reach them, since the input alphabet (interned IDs) isn't
+// even known up front, as rules keep deriving new matrices
+struct fst {
+    // Every rule of the grammar, and which of them this applies: rule_count of them, in order,
+    // starting from the first_index-th
+    const struct rule_set *rules;
+    unsigned int rule_count;
+    unsigned int first_index;
+    // What the rules turn every ID into, or FMATRIX_NONE if not built yet, as long as the highest
+    // ID seen needs (rounded up to a power of two)
+    fmatrix_id_t *outputs;
+    uint32_t output_length;
+    uint32_t transition_count;
+    uint32_t transition_budget;
+    // Statistics, for reporting at exit
+    unsigned long long words;
+    unsigned long long fallbacks;
+};
+
+// Sets up a transducer for the rules of a grammar from the first_index-th on, rule_count of them,
+// all context-free, allowed to grow to transition_budget transitions
+void fst_init(struct fst *, const struct rule_set *, unsigned int, unsigned int, uint32_t);
+// Runs len IDs of a word through the transducer in place, building any transitions that are needed
+// along the way using the derivation's tables; IDs past the budget are taken through the rules one
+// at a time instead
+// Prints errors to stderr and exits on failure
+void fst_run(struct fst *, struct derivation *, fmatrix_id_t *, long);
+// Returns roughly how many bytes the transducer takes up
+size_t fst_bytes(const struct fst *);
+// Frees everything the transducer owns
+void fst_free(struct fst *);
+
+#endif
@@ -0,0 +1,543 @@
+// Compiled grammar files, holding a parsed chart and rules so processes can start without parsing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define GRAMMAR_MMAP
+#endif
+
+#include "structures.h"
+#include "grammar.h"
+#include "util.h"
+
+// First bytes of every compiled grammar file
+static const char GRAMMAR_MAGIC[8] = {'P', 'H', 'O', 'N', 'G', 'R', 'A', 'M'};
+// Written natively, so files from machines of the other byte order don't match it
+#define GRAMMAR_BYTE_ORDER 0x01020304
+// Offset into the names that stands for no string
+#define GRAMMAR_NO_STRING UINT32_MAX
+
+// Start of every compiled grammar file, followed by the payload
+struct grammar_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    // Size of struct fmatrix_op, which compiled rule matrices are stored as, so builds that lay it
+    // out differently reject the file
+    uint32_t op_size;
+    uint32_t padding;
+    uint64_t payload_size;
+    // grammar_checksum of the whole payload
+    uint64_t checksum;
+};
+// Start of the payload, with the size of every section after it
+// Every section is padded with zeros to a multiple of 8 bytes, so they all stay aligned
+struct grammar_counts {
+    uint32_t feature_count;
+    uint32_t fmatrix_length;
+    uint32_t fmatrix_count;
+    uint32_t rule_count;
+    uint32_t rule_matrix_count;
+    uint32_t rule_op_count;
+    uint64_t names_size;
+    uint64_t feature_table_capacity;
+    uint64_t segment_table_capacity;
+    uint64_t fmatrix_table_capacity;
+    uint32_t trie_class_count;
+    uint32_t trie_node_count;
+};
+// string_table slot, with its key as an offset into the names (GRAMMAR_NO_STRING for empty slots)
+struct grammar_string_slot {
+    uint64_t hash;
+    uint64_t value;
+    uint32_t key;
+    uint32_t padding;
+};
+
+// Returns a checksum of size bytes of data
+// Payloads are hashed in four independent lanes, so it runs at memory speed rather than waiting
+// on one long chain of multiplies
+static uint64_t grammar_checksum(const char *data, size_t size) {
+    uint64_t lanes[4] = {size, 1, 2, 3};
+    uint64_t word;
+    for (; size >= 4 * sizeof(word); data += 4 * sizeof(word), size -= 4 * sizeof(word)) {
+        for (unsigned int x = 0; x < 4; x++) {
+            memcpy(&word, data + x * sizeof(word), sizeof(word));
+            lanes[x] = (lanes[x] ^ word) * 0x9e3779b97f4a7c15ULL;
+            lanes[x] = lanes[x] << 31 | lanes[x] >> 33;
+        }
+    }
+    uint64_t result = hash_string(data, size);
+    for (unsigned int x = 0; x < 4; x++) {
+        result = hash_mix(result ^ lanes[x]);
+    }
+    return result;
+}
+
+void grammar_unload(struct grammar *g) {
+#ifdef GRAMMAR_MMAP
+    if (g->file_mapped) {
+        munmap(g->file, g->file_size);
+        g->file = NULL;
+        g->file_mapped = 0;
+        return;
+    }
+#endif
+    free(g->file);
+    g->file = NULL;
+}
+
+// Appends a section to the payload, padded to a multiple of 8 bytes
+static void grammar_write(struct byte_buffer *payload, const void *data, size_t size) {
+    static const char zeros[8];
+    if (size) {
+        byte_buffer_append(payload, data, size);
+    }
+    byte_buffer_append(payload, zeros, -size & 7);
+}
+
+// Appends a string to the names, returning its offset
+static uint32_t grammar_add_name(struct byte_buffer *names, const char *name) {
+    fail_if(names->length >= GRAMMAR_NO_STRING, "Error compiling grammar: too many names\n");
+    uint32_t offset = names->length;
+    byte_buffer_append(names, name, strlen(name) + 1);
+    return offset;
+}
+
+// Appends the slots of a string table, given the offset in the names of the key of every value
+static void grammar_write_string_table(
+        struct byte_buffer *payload, const struct string_table *table, const uint32_t *offsets) {
+    for (size_t x = 0; x < table->capacity; x++) {
+        struct grammar_string_slot slot;
+        memset(&slot, 0, sizeof(slot));
+        slot.key = GRAMMAR_NO_STRING;
+        if (table->slots[x].key) {
+            slot.hash = table->slots[x].hash;
+            slot.value = table->slots[x].value;
+            slot.key = offsets[table->slots[x].value];
+        }
+        grammar_write(payload, &slot, sizeof(slot));
+    }
+}
+
+// Every buffer a compiled grammar is built in
+struct grammar_scratch {
+    // Every feature name, then the name of every matrix that has one, then the spelling of every
+    // one that doesn't
+    struct byte_buffer names;
+    struct byte_buffer payload;
+    uint32_t *feature_offsets;
+    uint32_t *name_offsets;
+    uint32_t *spelling_offsets;
+    uint32_t *spelling_lengths;
+    // Every op of every rule, with zeros for padding
+    struct fmatrix_op *ops;
+};
+
+// Builds the payload of a compiled grammar, in buffers that are all in scratch so they can be freed
+// whether or not this succeeds
+// Prints errors to stderr and exits on failure
+static void grammar_build(const struct grammar *g, struct grammar_scratch *scratch) {
+    struct grammar_counts counts;
+    memset(&counts, 0, sizeof(counts));
+    counts.feature_count = g->feature_count;
+    counts.fmatrix_length = g->fmatrix_length;
+    counts.fmatrix_count = g->fmatrix_count;
+    counts.rule_count = g->rules.count;
+    counts.rule_matrix_count = g->rules.matrix_count;
+    counts.rule_op_count = g->rules.op_count;
+    counts.feature_table_capacity = g->feature_lookup_table.capacity;
+    counts.segment_table_capacity = g->segment_lookup_table.capacity;
+    counts.fmatrix_table_capacity = g->fmatrix_cache.capacity;
+    counts.trie_class_count = g->segment_trie.class_count;
+    counts.trie_node_count = g->segment_trie.node_count;
+
+    struct byte_buffer *names = &scratch->names;
+    uint32_t *feature_offsets = scratch->feature_offsets = malloc(
+        (g->feature_count + 1) * sizeof(*feature_offsets));
+    uint32_t *name_offsets = scratch->name_offsets = malloc(
+        (g->fmatrix_count + 1) * sizeof(*name_offsets));
+    uint32_t *spelling_offsets = scratch->spelling_offsets = malloc(
+        (g->fmatrix_count + 1) * sizeof(*spelling_offsets));
+    uint32_t *spelling_lengths = scratch->spelling_lengths = malloc(
+        (g->fmatrix_count + 1) * sizeof(*spelling_lengths));
+    fail_if(
+        !feature_offsets || !name_offsets || !spelling_offsets || !spelling_lengths,
+        "Error compiling grammar: unable to allocate memory\n");
+    for (unsigned int x = 0; x < g->feature_count; x++) {
+        feature_offsets[x] = grammar_add_name(names, g->feature_names[x]);
+    }
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count; id++) {
+        unsigned int length;
+        const char *spelling = fmatrix_spelling(g, id, &length);
+        name_offsets[id] = fmatrix_name(g, id) ? grammar_add_name(names, fmatrix_name(g, id))
+            : GRAMMAR_NO_STRING;
+        spelling_offsets[id] = fmatrix_name(g, id) ? name_offsets[id]
+            : grammar_add_name(names, spelling);
+        spelling_lengths[id] = length;
+    }
+    counts.names_size = names->length;
+
+    struct byte_buffer *payload = &scratch->payload;
+    grammar_write(payload, &counts, sizeof(counts));
+    grammar_write(payload, names->data, names->length);
+    grammar_write(payload, feature_offsets, g->feature_count * sizeof(*feature_offsets));
+    for (fmatrix_id_t id = 0; id < g->fmatrix_count; id += FMATRIX_CHUNK_SIZE) {
+        size_t count = g->fmatrix_count - id < FMATRIX_CHUNK_SIZE ? g->fmatrix_count - id
+            : FMATRIX_CHUNK_SIZE;
+        grammar_write(
+            payload,
+            g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS]->matrices,
+            count * g->fmatrix_length * sizeof(fword_t));
+    }
+    grammar_write(payload, name_offsets, g->fmatrix_count * sizeof(*name_offsets));
+    grammar_write(payload, spelling_offsets, g->fmatrix_count * sizeof(*spelling_offsets));
+    grammar_write(payload, spelling_lengths, g->fmatrix_count * sizeof(*spelling_lengths));
+    grammar_write(
+        payload,
+        g->fmatrix_cache.slots,
+        g->fmatrix_cache.capacity * sizeof(*g->fmatrix_cache.slots));
+    // Feature table values are indices into feature_names, and segment table values are IDs
+    grammar_write_string_table(payload, &g->feature_lookup_table, feature_offsets);
+    grammar_write_string_table(payload, &g->segment_lookup_table, name_offsets);
+    grammar_write(payload, g->segment_trie.byte_class, sizeof(g->segment_trie.byte_class));
+    grammar_write(
+        payload,
+        g->segment_trie.transitions,
+        (size_t) g->segment_trie.node_count * g->segment_trie.class_count
+            * sizeof(*g->segment_trie.transitions));
+    grammar_write(
+        payload,
+        g->segment_trie.values,
+        g->segment_trie.node_count * sizeof(*g->segment_trie.values));
+    // Every array of the rules is a section of its own, so they can be used right where they are
+    const struct rule_set *r = &g->rules;
+    size_t matrix_size = g->fmatrix_length * sizeof(fword_t);
+    grammar_write(payload, r->requirements, r->count * matrix_size);
+    grammar_write(payload, r->matrices, r->matrix_count * matrix_size);
+    // Copied field by field so the padding is zeros, and files come out the same every time
+    struct fmatrix_op *ops = scratch->ops = calloc(r->op_count + 1, sizeof(*ops));
+    fail_if(!ops, "Error compiling grammar: unable to allocate memory\n");
+    for (uint32_t x = 0; x < r->op_count; x++) {
+        ops[x].word = r->ops[x].word;
+        ops[x].specified = r->ops[x].specified;
+        ops[x].value = r->ops[x].value;
+    }
+    grammar_write(payload, ops, r->op_count * sizeof(*ops));
+    grammar_write(payload, r->context_lengths, r->count * sizeof(*r->context_lengths));
+    grammar_write(payload, r->focus_positions, r->count * sizeof(*r->focus_positions));
+    grammar_write(payload, r->matrix_starts, (r->count + 1) * sizeof(*r->matrix_starts));
+    grammar_write(payload, r->op_starts, (r->matrix_count + 1) * sizeof(*r->op_starts));
+    grammar_write(payload, r->pass_limits, r->count * sizeof(*r->pass_limits));
+    grammar_write(payload, r->line_numbers, r->count * sizeof(*r->line_numbers));
+    grammar_write(payload, r->directions, r->count);
+    grammar_write(payload, r->kinds, r->count);
+}
+
+// Frees every buffer of a compiled grammar being built
+static void grammar_scratch_free(struct grammar_scratch *scratch) {
+    free(scratch->names.data);
+    free(scratch->payload.data);
+    free(scratch->feature_offsets);
+    free(scratch->name_offsets);
+    free(scratch->spelling_offsets);
+    free(scratch->spelling_lengths);
+    free(scratch->ops);
+}
+
+void grammar_compile(const struct grammar *g, FILE *fp, const char *path) {
+    struct grammar_scratch scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        grammar_scratch_free(&scratch);
+        fail_rethrow(&trap);
+    }
+    grammar_build(g, &scratch);
+    fail_trap_clear(&trap);
+    const struct byte_buffer *payload = &scratch.payload;
+    struct grammar_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GRAMMAR_MAGIC, sizeof(header.magic));
+    header.version = GRAMMAR_VERSION;
+    header.byte_order = GRAMMAR_BYTE_ORDER;
+    header.op_size = sizeof(struct fmatrix_op);
+    header.payload_size = payload->length;
+    header.checksum = grammar_checksum(payload->data, payload->length);
+    char failed = fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(payload->data, 1, payload->length, fp) != payload->length
+        || fflush(fp);
+    grammar_scratch_free(&scratch);
+    fail_if(failed, "Error writing grammar file %s\n", path);
+}
+
+// Payload of a compiled grammar being loaded, read one section at a time
+struct grammar_reader {
+    const char *data;
+    size_t size;
+    size_t position;
+};
+
+// Returns the next section of the payload, which is size bytes long
+// Prints errors to stderr and exits on failure
+static const void *grammar_read(struct grammar_reader *reader, size_t size) {
+    size_t padded = (size + 7) & ~(size_t) 7;
+    fail_if(
+        padded < size || padded > reader->size - reader->position,
+        "Error loading grammar: file is truncated\n");
+    const void *data = reader->data + reader->position;
+    reader->position += padded;
+    return data;
+}
+
+// Returns a copy of the next section of the payload, which is size bytes long, in a new heap block
+// Prints errors to stderr and exits on failure
+static void *grammar_read_copy(struct grammar_reader *reader, size_t size) {
+    // Never 0 bytes, so failure is always NULL
+    void *copy = malloc(size + 1);
+    fail_if(!copy, "Error loading grammar: unable to allocate memory\n");
+    memcpy(copy, grammar_read(reader, size), size);
+    return copy;
+}
+
+// Returns the string at an offset into the names, or NULL if the offset is GRAMMAR_NO_STRING
+static const char *grammar_name(const char *names, uint64_t names_size, uint32_t offset) {
+    if (offset == GRAMMAR_NO_STRING) {
+        return NULL;
+    }
+    fail_if(offset >= names_size, "Error loading grammar: name out of bounds\n");
+    return names + offset;
+}
+
+// Fills a string table from its slots in the payload, with keys pointing into the names
+static void grammar_read_string_table(
+        struct grammar_reader *reader,
+        struct string_table *table,
+        uint64_t capacity,
+        const char *names,
+        uint64_t names_size) {
+    fail_if(capacity & (capacity - 1), "Error loading grammar: malformed hash table\n");
+    const struct grammar_string_slot *slots = grammar_read(reader, capacity * sizeof(*slots));
+    table->capacity = capacity;
+    table->count = 0;
+    table->slots = calloc(capacity + 1, sizeof(*table->slots));
+    fail_if(!table->slots, "Error loading grammar: unable to allocate memory\n");
+    for (size_t x = 0; x < capacity; x++) {
+        table->slots[x].key = grammar_name(names, names_size, slots[x].key);
+        table->slots[x].hash = slots[x].hash;
+        table->slots[x].value = slots[x].value;
+        table->count += !!table->slots[x].key;
+    }
+}
+
+// Reads a whole compiled grammar file into the grammar, either mapping it or reading it into a heap
+// block
+// Prints errors to stderr and exits on failure
+static void grammar_read_file(struct grammar *g, FILE *fp, const char *path) {
+#ifdef GRAMMAR_MMAP
+    struct stat st;
+    if (!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        // All of it gets read right away for the checksum, so fault it all in at once
+        flags |= MAP_POPULATE;
+#endif
+        void *map = mmap(NULL, st.st_size, PROT_READ, flags, fileno(fp), 0);
+        if (map != MAP_FAILED) {
+            g->file = map;
+            g->file_size = st.st_size;
+            g->file_mapped = 1;
+            return;
+        }
+    }
+#endif
+    // Heap blocks are aligned enough for every section
+    size_t capacity = 1 << 16;
+    g->file = malloc(capacity);
+    fail_if(!g->file, "Error loading grammar: unable to allocate memory\n");
+    size_t read;
+    while ((read = fread(g->file + g->file_size, 1, capacity - g->file_size, fp))) {
+        g->file_size += read;
+        if (g->file_size == capacity) {
+            capacity *= 2;
+            char *grown = realloc(g->file, capacity);
+            fail_if(!grown, "Error loading grammar: unable to allocate memory\n");
+            g->file = grown;
+        }
+    }
+    fail_if(ferror(fp), "Error reading grammar file %s\n", path);
+}
+
+void grammar_load(struct grammar *g, FILE *fp, const char *path) {
+    grammar_read_file(g, fp, path);
+    const char *file = g->file;
+    size_t file_size = g->file_size;
+    struct grammar_header header;
+    fail_if(
+        file_size < sizeof(header) || memcmp(file, GRAMMAR_MAGIC, sizeof(GRAMMAR_MAGIC)),
+        "Error loading grammar: %s is not a compiled grammar\n",
+        path);
+    memcpy(&header, file, sizeof(header));
+    fail_if(
+        header.version != GRAMMAR_VERSION,
+        "Error loading grammar: %s is version %u, but this program reads version %u; compile it "
+            "again\n",
+        path,
+        header.version,
+        GRAMMAR_VERSION);
+    fail_if(
+        header.byte_order != GRAMMAR_BYTE_ORDER,
+        "Error loading grammar: %s was compiled on a machine of the other byte order\n",
+        path);
+    fail_if(
+        header.op_size != sizeof(struct fmatrix_op),
+        "Error loading grammar: %s was compiled by a build with a different layout\n",
+        path);
+    fail_if(
+        header.payload_size != file_size - sizeof(header)
+            || header.checksum != grammar_checksum(file + sizeof(header), header.payload_size),
+        "Error loading grammar: %s is corrupt (checksum mismatch)\n",
+        path);
+    struct grammar_reader reader = {file + sizeof(header), header.payload_size, 0};
+
+    struct grammar_counts counts;
+    memcpy(&counts, grammar_read(&reader, sizeof(counts)), sizeof(counts));
+    fail_if(
+        !counts.feature_count
+            || counts.fmatrix_length != (counts.feature_count + FWORD_BITS - 1) / FWORD_BITS * 2
+            || counts.fmatrix_count > (fmatrix_id_t) FMATRIX_MAX_CHUNKS * FMATRIX_CHUNK_SIZE
+            || counts.fmatrix_table_capacity & (counts.fmatrix_table_capacity - 1)
+            || counts.fmatrix_table_capacity < counts.fmatrix_count
+            || !counts.trie_class_count
+            || !counts.trie_node_count,
+        "Error loading grammar: malformed counts\n");
+    g->feature_count = counts.feature_count;
+    g->fmatrix_length = counts.fmatrix_length;
+    size_t matrix_size = g->fmatrix_length * sizeof(fword_t);
+
+    // All the names go in one block of the arena
+    char *names = arena_alloc(&g->arena, counts.names_size + 1);
+    memcpy(names, grammar_read(&reader, counts.names_size), counts.names_size);
+    names[counts.names_size] = 0;
+    const uint32_t *feature_offsets = grammar_read(
+        &reader, g->feature_count * sizeof(*feature_offsets));
+    g->feature_names = arena_alloc(&g->arena, g->feature_count * sizeof(*g->feature_names));
+    for (unsigned int x = 0; x < g->feature_count; x++) {
+        g->feature_names[x] = grammar_name(names, counts.names_size, feature_offsets[x]);
+        fail_if(!g->feature_names[x], "Error loading grammar: missing feature name\n");
+    }
+
+    for (fmatrix_id_t id = 0; id < counts.fmatrix_count; id += FMATRIX_CHUNK_SIZE) {
+        size_t count = counts.fmatrix_count - id < FMATRIX_CHUNK_SIZE ? counts.fmatrix_count - id
+            : FMATRIX_CHUNK_SIZE;
+        struct fmatrix_chunk *chunk = malloc(sizeof(*chunk));
+        fail_if(!chunk, "Error loading grammar: unable to allocate memory\n");
+        // Room for the whole chunk, since matrices are interned after it's loaded
+        chunk->matrices = malloc(FMATRIX_CHUNK_SIZE * matrix_size);
+        if (!chunk->matrices) {
+            free(chunk);
+            fail_if(1, "Error loading grammar: unable to allocate memory\n");
+        }
+        g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS] = chunk;
+        memcpy(chunk->matrices, grammar_read(&reader, count * matrix_size), count * matrix_size);
+    }
+    const uint32_t *name_offsets = grammar_read(
+        &reader, counts.fmatrix_count * sizeof(*name_offsets));
+    const uint32_t *spelling_offsets = grammar_read(
+        &reader, counts.fmatrix_count * sizeof(*spelling_offsets));
+    const uint32_t *spelling_lengths = grammar_read(
+        &reader, counts.fmatrix_count * sizeof(*spelling_lengths));
+    for (fmatrix_id_t id = 0; id < counts.fmatrix_count; id++) {
+        struct fmatrix_chunk *chunk = g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS];
+        unsigned int index = id & (FMATRIX_CHUNK_SIZE - 1);
+        chunk->names[index] = grammar_name(names, counts.names_size, name_offsets[id]);
+        const char *spelling = grammar_name(names, counts.names_size, spelling_offsets[id]);
+        fail_if(
+            !spelling || strlen(spelling) != spelling_lengths[id],
+            "Error loading grammar: malformed spelling\n");
+        chunk->spelling_lengths[index] = spelling_lengths[id];
+        chunk->spellings[index] = spelling;
+    }
+    g->fmatrix_count = counts.fmatrix_count;
+    g->fmatrix_cache.slots = grammar_read_copy(
+        &reader, counts.fmatrix_table_capacity * sizeof(*g->fmatrix_cache.slots));
+    g->fmatrix_cache.capacity = counts.fmatrix_table_capacity;
+    g->fmatrix_cache.count = counts.fmatrix_count;
+
+    grammar_read_string_table(
+        &reader, &g->feature_lookup_table, counts.feature_table_capacity, names, counts.names_size);
+    grammar_read_string_table(
+        &reader, &g->segment_lookup_table, counts.segment_table_capacity, names, counts.names_size);
+
+    struct segment_trie *t = &g->segment_trie;
+    // Set first, so the trie is never freed as if it had been built
+    t->borrowed = 1;
+    memcpy(t->byte_class, grammar_read(&reader, sizeof(t->byte_class)), sizeof(t->byte_class));
+    t->class_count = counts.trie_class_count;
+    t->node_count = t->node_capacity = counts.trie_node_count;
+    size_t transition_count = (size_t) t->node_count * t->class_count;
+    // Discard the const qualifier; the trie is never changed once built
+    t->transitions = (uint32_t *) grammar_read(&reader, transition_count * sizeof(*t->transitions));
+    t->values = (fmatrix_id_t *) grammar_read(&reader, t->node_count * sizeof(*t->values));
+    // Every node and ID in the trie must be in bounds, since segmentation doesn't check; these are
+    // checked all at once, so the loops stay branch-free
+    char malformed = 0;
+    for (size_t x = 0; x < transition_count; x++) {
+        malformed |= t->transitions[x] >= t->node_count;
+    }
+    for (unsigned int x = 0; x < t->node_count; x++) {
+        // FMATRIX_NONE wraps around to 0
+        malformed |= t->values[x] + 1 > g->fmatrix_count;
+    }
+    for (unsigned int x = 0; x < 256; x++) {
+        malformed |= t->byte_class[x] >= t->class_count;
+    }
+    fail_if(malformed, "Error loading grammar: malformed trie\n");
+
+    // Rules are used right where they are in the file too, once every offset and op in them is
+    // checked to be in bounds
+    struct rule_set *r = &g->rules;
+    r->count = counts.rule_count;
+    r->matrix_count = counts.rule_matrix_count;
+    r->op_count = counts.rule_op_count;
+    r->requirements = grammar_read(&reader, r->count * matrix_size);
+    r->matrices = grammar_read(&reader, r->matrix_count * matrix_size);
+    r->ops = grammar_read(&reader, r->op_count * sizeof(*r->ops));
+    r->context_lengths = grammar_read(&reader, r->count * sizeof(*r->context_lengths));
+    r->focus_positions = grammar_read(&reader, r->count * sizeof(*r->focus_positions));
+    r->matrix_starts = grammar_read(&reader, (r->count + 1) * sizeof(*r->matrix_starts));
+    r->op_starts = grammar_read(&reader, (r->matrix_count + 1) * sizeof(*r->op_starts));
+    r->pass_limits = grammar_read(&reader, r->count * sizeof(*r->pass_limits));
+    r->line_numbers = grammar_read(&reader, r->count * sizeof(*r->line_numbers));
+    r->directions = grammar_read(&reader, r->count);
+    r->kinds = grammar_read(&reader, r->count);
+    // Each rule's matrices are its context followed by its output, right after the last rule's
+    malformed = r->matrix_starts[0] != 0 || r->matrix_starts[r->count] != r->matrix_count;
+    for (unsigned int x = 0; x < r->count; x++) {
+        // The focus of a rule that inserts segments may come after every position; any other
+        // rule's focus is one of them
+        malformed |= !r->context_lengths[x]
+            || r->focus_positions[x] + (r->kinds[x] != 'I') > r->context_lengths[x]
+            || (r->directions[x] != 'L' && r->directions[x] != 'R')
+            || (r->kinds[x] != 'C' && r->kinds[x] != 'I' && r->kinds[x] != 'D')
+            || (r->kinds[x] != 'C' && r->pass_limits[x])
+            || (uint64_t) r->matrix_starts[x] + r->context_lengths[x] + 1
+                != r->matrix_starts[x + 1];
+    }
+    malformed |= r->op_starts[0] != 0 || r->op_starts[r->matrix_count] != r->op_count;
+    for (uint32_t x = 0; x < r->matrix_count; x++) {
+        malformed |= r->op_starts[x] > r->op_starts[x + 1];
+    }
+    for (uint32_t x = 0; x < r->op_count; x++) {
+        malformed |= r->ops[x].word + 1 >= g->fmatrix_length;
+    }
+    fail_if(malformed, "Error loading grammar: malformed rules\n");
+    fail_if(reader.position != reader.size, "Error loading grammar: trailing data\n");
+}
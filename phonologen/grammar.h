@@ -0,0 +1,31 @@
+#ifndef GRAMMAR_H
+#define GRAMMAR_H
+
+#include <stdio.h>
+
+#include "structures.h"
+
+// Version of the compiled grammar format; files of any other version are rejected as stale, so this
+// must be bumped whenever what gets written changes
+#define GRAMMAR_VERSION 5
+
+// Writes everything parse_features and parse_rules set up in a grammar (the chart, its lookup
+// tables and segmentation trie, and the compiled rules) to a compiled grammar file open for
+// writing, whose path is given for messages
+// Everything is stored as offsets and counts rather than pointers, so the file can be loaded by any
+// process, behind a header with the format version and a checksum of the rest
+// Prints errors to stderr and exits on failure
+void grammar_compile(const struct grammar *, FILE *, const char *);
+// Sets up an empty grammar from a compiled grammar file open for reading, whose path is given for
+// messages, in place of parse_features and parse_rules
+// The file is memory-mapped where possible and kept for as long as the grammar: the segmentation
+// trie and the rules are used right where they are, and every other table is copied out of it in
+// bulk, with no parsing or hashing
+// Rejects files of other versions, from machines of the other byte order, or whose checksum doesn't
+// match their contents
+// Prints errors to stderr and exits on failure
+void grammar_load(struct grammar *, FILE *, const char *);
+// Unmaps or frees the compiled grammar file a grammar was loaded from, if any
+void grammar_unload(struct grammar *);
+
+#endif
@@ -0,0 +1,610 @@
+// Library interface to phonologen; see libphonologen.h
+// Every entry point runs the internals inside a failure trap (see util.h), so failures that would
+// otherwise print and exit unwind back here instead, and are returned as statuses
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "libphonologen.h"
+#include "structures.h"
+#include "parsing.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "stream.h"
+#include "parallel.h"
+#include "server.h"
+#include "grammar.h"
+#include "emit.h"
+#include "checkpoint.h"
+#include "variants.h"
+#include "pipeline.h"
+#include "util.h"
+
+// Number of bytes of input derived at a time on one thread
+#define CHUNK_SIZE (1 << 20)
+
+struct phonologen_grammar {
+    struct grammar grammar;
+    // Seconds spent parsing features (or loading a compiled grammar) and parsing rules, for
+    // statistics
+    double seconds[2];
+};
+
+struct phonologen_context {
+    struct phonologen_grammar *grammar;
+    struct derivation derivation;
+    struct word_cache cache;
+    // Reused for every word
+    struct word word;
+    // Surface forms of the last words derived, each NUL-terminated, and where each one starts
+    struct byte_buffer output;
+    size_t *starts;
+    size_t starts_capacity;
+};
+
+// Key for each thread's last failure message, allocated the first time it's needed
+static pthread_key_t error_key;
+static pthread_once_t error_key_once = PTHREAD_ONCE_INIT;
+
+static void error_key_create(void) {
+    pthread_key_create(&error_key, free);
+}
+
+// Records a formatted message as the calling thread's last failure
+// Returns the given status, for returning right away
+static enum phonologen_status fail_with(enum phonologen_status status, const char *fmt, ...) {
+    pthread_once(&error_key_once, error_key_create);
+    char *message = pthread_getspecific(error_key);
+    if (!message) {
+        message = malloc(FAIL_MESSAGE_SIZE);
+        // Nowhere to record the message; the status will have to do
+        if (!message || pthread_setspecific(error_key, message)) {
+            free(message);
+            return status;
+        }
+    }
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(message, FAIL_MESSAGE_SIZE, fmt, args);
+    va_end(args);
+    return status;
+}
+
+const char *phonologen_error(void) {
+    pthread_once(&error_key_once, error_key_create);
+    const char *message = pthread_getspecific(error_key);
+    return message ? message : "";
+}
+
+// Returns seconds on a monotonic clock
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void phonologen_options_init(struct phonologen_options *options) {
+    memset(options, 0, sizeof(*options));
+    options->cache_size = PHONOLOGEN_DEFAULT_CACHE_SIZE;
+    options->threads = 1;
+}
+
+// Copies options (or the defaults if NULL) to settings, checking that they're in range
+static enum phonologen_status options_read(
+        const struct phonologen_options *options, struct phonologen_options *settings) {
+    if (options) {
+        *settings = *options;
+    } else {
+        phonologen_options_init(settings);
+    }
+    if (!settings->threads) {
+        return fail_with(PHONOLOGEN_ERROR_ARGUMENT, "Error: invalid thread count 0");
+    }
+    if (settings->fst_transitions > INT32_MAX) {
+        return fail_with(
+            PHONOLOGEN_ERROR_ARGUMENT, "Error: invalid transition count %lu",
+            (unsigned long) settings->fst_transitions);
+    }
+    if (settings->batch_words > PHONOLOGEN_MAX_BATCH_WORDS) {
+        return fail_with(
+            PHONOLOGEN_ERROR_ARGUMENT, "Error: invalid batch size %zu", settings->batch_words);
+    }
+    if (settings->pipeline_depth > PHONOLOGEN_MAX_PIPELINE_DEPTH) {
+        return fail_with(
+            PHONOLOGEN_ERROR_ARGUMENT, "Error: invalid pipeline depth %zu",
+            settings->pipeline_depth);
+    }
+    if (settings->pipeline_depth && (settings->threads > 1 || settings->checkpoints)) {
+        return fail_with(
+            PHONOLOGEN_ERROR_ARGUMENT,
+            "Error: pipelined derivation is only on one thread, without checkpoints");
+    }
+    if (settings->batch_words && settings->fst_transitions) {
+        return fail_with(
+            PHONOLOGEN_ERROR_ARGUMENT, "Error: words derived in batches can't use transducers");
+    }
+    if (settings->checkpoints
+            && (settings->threads > 1 || settings->fst_transitions || settings->batch_words)) {
+        return fail_with(
+            PHONOLOGEN_ERROR_ARGUMENT,
+            "Error: checkpointed derivation is only on one thread, without transducers or "
+            "batches");
+    }
+    return PHONOLOGEN_OK;
+}
+
+// Reads one file into a grammar, depending on the status to fail with: the features .csv file for
+// PHONOLOGEN_ERROR_FEATURES, the rules .txt file for PHONOLOGEN_ERROR_RULES, or a compiled grammar
+// file for PHONOLOGEN_ERROR_GRAMMAR
+static enum phonologen_status grammar_read(
+        struct grammar *g, const char *path, enum phonologen_status status) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return fail_with(
+            PHONOLOGEN_ERROR_IO,
+            status == PHONOLOGEN_ERROR_FEATURES ? "Error opening features .csv file %s"
+            : status == PHONOLOGEN_ERROR_RULES ? "Error opening rules .txt file %s"
+            : "Error opening grammar file %s",
+            path);
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        char read_failed = ferror(fp) != 0;
+        fclose(fp);
+        return fail_with(read_failed ? PHONOLOGEN_ERROR_IO : status, "%s", trap.message);
+    }
+    if (status == PHONOLOGEN_ERROR_FEATURES) {
+        parse_features(g, fp);
+    } else if (status == PHONOLOGEN_ERROR_RULES) {
+        parse_rules(g, fp);
+    } else {
+        grammar_load(g, fp, path);
+    }
+    fail_trap_clear(&trap);
+    fclose(fp);
+    return PHONOLOGEN_OK;
+}
+
+// Allocates an empty grammar
+static enum phonologen_status grammar_new(struct phonologen_grammar **out) {
+    *out = malloc(sizeof(**out));
+    if (!*out) {
+        return fail_with(PHONOLOGEN_ERROR_MEMORY, "Error: unable to allocate memory");
+    }
+    grammar_init(&(*out)->grammar);
+    memset((*out)->seconds, 0, sizeof((*out)->seconds));
+    return PHONOLOGEN_OK;
+}
+
+enum phonologen_status phonologen_grammar_parse(
+        const char *features_path, const char *rules_path, struct phonologen_grammar **out) {
+    struct phonologen_grammar *grammar;
+    enum phonologen_status status = grammar_new(&grammar);
+    *out = NULL;
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    double start = now();
+    status = grammar_read(&grammar->grammar, features_path, PHONOLOGEN_ERROR_FEATURES);
+    grammar->seconds[0] = now() - start;
+    if (status == PHONOLOGEN_OK) {
+        start = now();
+        status = grammar_read(&grammar->grammar, rules_path, PHONOLOGEN_ERROR_RULES);
+        grammar->seconds[1] = now() - start;
+    }
+    if (status != PHONOLOGEN_OK) {
+        phonologen_grammar_free(grammar);
+        return status;
+    }
+    *out = grammar;
+    return PHONOLOGEN_OK;
+}
+
+enum phonologen_status phonologen_grammar_load(const char *path, struct phonologen_grammar **out) {
+    struct phonologen_grammar *grammar;
+    enum phonologen_status status = grammar_new(&grammar);
+    *out = NULL;
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    double start = now();
+    status = grammar_read(&grammar->grammar, path, PHONOLOGEN_ERROR_GRAMMAR);
+    grammar->seconds[0] = now() - start;
+    if (status != PHONOLOGEN_OK) {
+        phonologen_grammar_free(grammar);
+        return status;
+    }
+    *out = grammar;
+    return PHONOLOGEN_OK;
+}
+
+enum phonologen_status phonologen_grammar_compile(
+        const struct phonologen_grammar *grammar, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return fail_with(PHONOLOGEN_ERROR_IO, "Error opening grammar file %s", path);
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        fclose(fp);
+        return fail_with(PHONOLOGEN_ERROR_IO, "%s", trap.message);
+    }
+    grammar_compile(&grammar->grammar, fp, path);
+    fail_trap_clear(&trap);
+    if (fclose(fp)) {
+        return fail_with(PHONOLOGEN_ERROR_IO, "Error writing grammar file %s", path);
+    }
+    return PHONOLOGEN_OK;
+}
+
+enum phonologen_status phonologen_grammar_emit_c(
+        const struct phonologen_grammar *grammar, const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        return fail_with(PHONOLOGEN_ERROR_IO, "Error opening C file %s", path);
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        fclose(fp);
+        return fail_with(PHONOLOGEN_ERROR_IO, "%s", trap.message);
+    }
+    grammar_emit_c(&grammar->grammar, fp, path);
+    fail_trap_clear(&trap);
+    if (fclose(fp)) {
+        return fail_with(PHONOLOGEN_ERROR_IO, "Error writing C file %s", path);
+    }
+    return PHONOLOGEN_OK;
+}
+
+void phonologen_grammar_free(struct phonologen_grammar *grammar) {
+    if (!grammar) {
+        return;
+    }
+    grammar_free(&grammar->grammar);
+    free(grammar);
+}
+
+enum phonologen_status phonologen_context_new(
+        struct phonologen_grammar *grammar,
+        const struct phonologen_options *options,
+        struct phonologen_context **out) {
+    *out = NULL;
+    struct phonologen_options settings;
+    enum phonologen_status status = options_read(options, &settings);
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    struct phonologen_context *context = calloc(1, sizeof(*context));
+    if (!context) {
+        return fail_with(PHONOLOGEN_ERROR_MEMORY, "Error: unable to allocate memory");
+    }
+    context->grammar = grammar;
+    // Zeroed, so freeing is safe whatever has been set up
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        phonologen_context_free(context);
+        return fail_with(PHONOLOGEN_ERROR_MEMORY, "%s", trap.message);
+    }
+    derivation_init(&context->derivation, &grammar->grammar);
+    context->derivation.warnings = settings.warnings;
+    if (settings.fst_transitions) {
+        derivation_use_fst(&context->derivation, settings.fst_transitions);
+    }
+    word_cache_init(&context->cache, settings.cache_size);
+    fail_trap_clear(&trap);
+    *out = context;
+    return PHONOLOGEN_OK;
+}
+
+void phonologen_context_free(struct phonologen_context *context) {
+    if (!context) {
+        return;
+    }
+    derivation_free(&context->derivation);
+    word_cache_free(&context->cache);
+    free(context->word.ids);
+    free(context->output.data);
+    free(context->starts);
+    free(context);
+}
+
+enum phonologen_status phonologen_derive(
+        struct phonologen_context *context,
+        const char *const words[],
+        size_t count,
+        const char *out[]) {
+    if (count > context->starts_capacity) {
+        size_t *starts = realloc(context->starts, count * sizeof(*starts));
+        if (!starts) {
+            return fail_with(PHONOLOGEN_ERROR_MEMORY, "Error: unable to allocate memory");
+        }
+        context->starts = starts;
+        context->starts_capacity = count;
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        return fail_with(PHONOLOGEN_ERROR_DERIVE, "%s", trap.message);
+    }
+    context->output.length = 0;
+    for (size_t x = 0; x < count; x++) {
+        context->starts[x] = context->output.length;
+        size_t length = strlen(words[x]);
+        if (length) {
+            derive_spelling(
+                &context->derivation, &context->cache, &context->word, words[x], length,
+                &context->output);
+        }
+        byte_buffer_append(&context->output, "", 1);
+    }
+    fail_trap_clear(&trap);
+    // Only now that the output buffer has stopped moving
+    for (size_t x = 0; x < count; x++) {
+        out[x] = context->output.data + context->starts[x];
+    }
+    return PHONOLOGEN_OK;
+}
+
+// Prints every statistic in the given format, with the seconds taken by each phase (deriving input
+// being serving requests, for a server), how many rules the variants of a grammar's rules have in
+// all and once shared, unless variants is NULL, and how a pipeline's stages kept up with each
+// other, unless pipeline is NULL
+static void print_stats(
+        FILE *fp,
+        char json,
+        const struct phonologen_grammar *grammar,
+        double derive_seconds,
+        const struct variant_trie *variants,
+        const struct pipeline_stats *pipeline,
+        const struct word_cache *cache,
+        const struct derivation_stats *derivation) {
+    if (!json) {
+        fprintf(
+            fp,
+            "phases: %.6f s parsing features, %.6f s parsing rules, %.6f s deriving input\n",
+            grammar->seconds[0],
+            grammar->seconds[1],
+            derive_seconds);
+        if (variants) {
+            fprintf(
+                fp,
+                "variants: %u, with %zu rules in all, %u once shared prefixes are merged\n",
+                variants->variant_count,
+                variants->rule_total,
+                grammar->grammar.rules.count);
+        }
+        if (pipeline) {
+            pipeline_stats_print(pipeline, fp);
+        }
+        word_cache_print_stats(cache, fp);
+        derivation_stats_print(derivation, &grammar->grammar, fp);
+        return;
+    }
+    fprintf(
+        fp,
+        "{\n  \"phases\": {\"parse_features\": %.6f, \"parse_rules\": %.6f, \"main_loop\": %.6f},\n",
+        grammar->seconds[0],
+        grammar->seconds[1],
+        derive_seconds);
+    if (variants) {
+        fprintf(
+            fp,
+            "  \"variants\": {\"count\": %u, \"rules\": %zu, \"merged_rules\": %u},\n",
+            variants->variant_count,
+            variants->rule_total,
+            grammar->grammar.rules.count);
+    }
+    if (pipeline) {
+        fputs("  \"pipeline\": ", fp);
+        pipeline_stats_print_json(pipeline, fp);
+        fputs(",\n", fp);
+    }
+    fputs("  \"word_cache\": ", fp);
+    word_cache_print_stats_json(cache, fp);
+    fputs(",\n  \"derivation\": ", fp);
+    derivation_stats_print_json(derivation, &grammar->grammar, fp);
+    fputs("\n}\n", fp);
+}
+
+// Totals of every thread's statistics, kept together so they can be freed after a failure
+struct stream_totals {
+    struct word_cache cache;
+    struct derivation_stats derivation;
+    struct pipeline_stats pipeline;
+};
+
+enum phonologen_status phonologen_derive_stream(
+        struct phonologen_grammar *grammar,
+        const struct phonologen_options *options,
+        FILE *in,
+        FILE *out) {
+    struct phonologen_options settings;
+    enum phonologen_status status = options_read(options, &settings);
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    struct stream_totals *totals = calloc(1, sizeof(*totals));
+    if (!totals) {
+        return fail_with(PHONOLOGEN_ERROR_MEMORY, "Error: unable to allocate memory");
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        derivation_stats_free(&totals->derivation);
+        free(totals);
+        return fail_with(
+            ferror(in) || ferror(out) ? PHONOLOGEN_ERROR_IO : PHONOLOGEN_ERROR_DERIVE,
+            "%s",
+            trap.message);
+    }
+    double start = now();
+    if (settings.checkpoints) {
+        derive_checkpointed(
+            &grammar->grammar, in, out, settings.checkpoints, settings.changes,
+            settings.warnings, &totals->derivation);
+    } else if (settings.threads > 1) {
+        derive_parallel(
+            &grammar->grammar, in, out, settings.threads, settings.cache_size,
+            settings.fst_transitions, settings.batch_words, settings.warnings, &totals->cache,
+            &totals->derivation);
+    } else if (settings.pipeline_depth) {
+        derive_pipelined(
+            &grammar->grammar, in, out, settings.pipeline_depth, settings.cache_size,
+            settings.fst_transitions, settings.batch_words, settings.warnings, &totals->cache,
+            &totals->derivation, &totals->pipeline);
+    } else {
+        derive_serial(
+            &grammar->grammar, in, out, CHUNK_SIZE, settings.cache_size, settings.fst_transitions,
+            settings.batch_words, settings.warnings, &totals->cache, &totals->derivation);
+    }
+    fail_if(fflush(out) || ferror(out), "Error writing output\n");
+    if (settings.stats) {
+        print_stats(
+            settings.stats, settings.stats_json, grammar, now() - start, NULL,
+            settings.pipeline_depth ? &totals->pipeline : NULL, &totals->cache,
+            &totals->derivation);
+    }
+    fail_trap_clear(&trap);
+    derivation_stats_free(&totals->derivation);
+    free(totals);
+    return PHONOLOGEN_OK;
+}
+
+// Everything phonologen_derive_variants sets up besides its grammar, kept together so it can be
+// freed after a failure
+struct variants_totals {
+    // Every variant's rules, as parsed
+    struct rule_set *sets;
+    struct variant_trie trie;
+    struct word_cache cache;
+    struct derivation_stats derivation;
+};
+
+// Frees everything phonologen_derive_variants set up
+static void variants_totals_free(
+        struct variants_totals *totals, struct phonologen_grammar *grammar) {
+    variant_trie_free(&totals->trie);
+    derivation_stats_free(&totals->derivation);
+    free(totals->sets);
+    free(totals);
+    phonologen_grammar_free(grammar);
+}
+
+enum phonologen_status phonologen_derive_variants(
+        const char *features_path,
+        const char *const rules_paths[],
+        unsigned int count,
+        const struct phonologen_options *options,
+        FILE *in,
+        FILE *out) {
+    struct phonologen_options settings;
+    enum phonologen_status status = options_read(options, &settings);
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    if (!count) {
+        return fail_with(PHONOLOGEN_ERROR_ARGUMENT, "Error: no rules files given");
+    }
+    struct phonologen_grammar *grammar;
+    status = grammar_new(&grammar);
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    struct variants_totals *totals = calloc(1, sizeof(*totals));
+    if (totals) {
+        totals->sets = malloc(count * sizeof(*totals->sets));
+    }
+    if (!totals || !totals->sets) {
+        free(totals);
+        phonologen_grammar_free(grammar);
+        return fail_with(PHONOLOGEN_ERROR_MEMORY, "Error: unable to allocate memory");
+    }
+    double start = now();
+    status = grammar_read(&grammar->grammar, features_path, PHONOLOGEN_ERROR_FEATURES);
+    grammar->seconds[0] = now() - start;
+    start = now();
+    // Every rules file replaces the grammar's rules, but they stay in its arena
+    for (unsigned int x = 0; x < count && status == PHONOLOGEN_OK; x++) {
+        status = grammar_read(&grammar->grammar, rules_paths[x], PHONOLOGEN_ERROR_RULES);
+        totals->sets[x] = grammar->grammar.rules;
+        if (status == PHONOLOGEN_ERROR_RULES) {
+            // Say which file, since line numbers alone don't
+            char message[FAIL_MESSAGE_SIZE];
+            snprintf(message, sizeof(message), "%s", phonologen_error());
+            fail_with(status, "%s (in %s)", message, rules_paths[x]);
+        }
+    }
+    if (status != PHONOLOGEN_OK) {
+        variants_totals_free(totals, grammar);
+        return status;
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        variants_totals_free(totals, grammar);
+        return fail_with(
+            ferror(in) || ferror(out) ? PHONOLOGEN_ERROR_IO : PHONOLOGEN_ERROR_DERIVE,
+            "%s",
+            trap.message);
+    }
+    variant_trie_build(&totals->trie, &grammar->grammar, totals->sets, count);
+    grammar->seconds[1] = now() - start;
+    start = now();
+    derive_variants(
+        &grammar->grammar, &totals->trie, rules_paths, in, out, settings.cache_size,
+        settings.warnings, &totals->cache, &totals->derivation);
+    fail_if(fflush(out) || ferror(out), "Error writing output\n");
+    if (settings.stats) {
+        print_stats(
+            settings.stats, settings.stats_json, grammar, now() - start, &totals->trie, NULL,
+            &totals->cache, &totals->derivation);
+    }
+    fail_trap_clear(&trap);
+    variants_totals_free(totals, grammar);
+    return PHONOLOGEN_OK;
+}
+
+enum phonologen_status phonologen_serve(
+        struct phonologen_grammar *grammar,
+        const struct phonologen_options *options,
+        const char *path,
+        volatile sig_atomic_t *stop) {
+    struct phonologen_options settings;
+    enum phonologen_status status = options_read(options, &settings);
+    if (status != PHONOLOGEN_OK) {
+        return status;
+    }
+    struct stream_totals *totals = calloc(1, sizeof(*totals));
+    if (!totals) {
+        return fail_with(PHONOLOGEN_ERROR_MEMORY, "Error: unable to allocate memory");
+    }
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        derivation_stats_free(&totals->derivation);
+        free(totals);
+        return fail_with(PHONOLOGEN_ERROR_IO, "%s", trap.message);
+    }
+    double start = now();
+    serve(
+        &grammar->grammar, path, settings.threads, settings.cache_size, settings.fst_transitions,
+        settings.batch_words, settings.warnings, stop, &totals->cache, &totals->derivation);
+    if (settings.stats) {
+        print_stats(
+            settings.stats, settings.stats_json, grammar, now() - start, NULL, NULL,
+            &totals->cache, &totals->derivation);
+    }
+    fail_trap_clear(&trap);
+    derivation_stats_free(&totals->derivation);
+    free(totals);
+    return PHONOLOGEN_OK;
+}
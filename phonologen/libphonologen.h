@@ -0,0 +1,161 @@
+#ifndef LIBPHONOLOGEN_H
+#define LIBPHONOLOGEN_H
+
+// Library interface to phonologen, for deriving words from other programs
+// Grammars are parsed from a features .csv and rules .txt file (or loaded from a compiled grammar
+// file) into opaque grammar objects, which share nothing with each other, so any number of them
+// can be used at once; words are derived with contexts, each used by one thread at a time, any
+// number of which can share one grammar
+// Nothing here prints anything or exits: every function that can fail returns a status other than
+// PHONOLOGEN_OK, and phonologen_error describes the failure
+// Link with build/libphonologen.a or build/libphonologen.so (make lib) and -lpthread
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+// Default byte budget for memoized words, and transition budget of each transducer
+#define PHONOLOGEN_DEFAULT_CACHE_SIZE (64 << 20)
+#define PHONOLOGEN_DEFAULT_FST_TRANSITIONS (1 << 16)
+// Default number of distinct words derived together when deriving rule by rule, and the most
+// allowed
+#define PHONOLOGEN_DEFAULT_BATCH_WORDS 4096
+#define PHONOLOGEN_MAX_BATCH_WORDS (1 << 24)
+// Default number of batches of input each queue between the stages of a pipelined derivation holds,
+// and the most allowed
+#define PHONOLOGEN_DEFAULT_PIPELINE_DEPTH 8
+#define PHONOLOGEN_MAX_PIPELINE_DEPTH (1 << 16)
+
+enum phonologen_status {
+    PHONOLOGEN_OK,
+    // A file couldn't be opened, read or written
+    PHONOLOGEN_ERROR_IO,
+    // The features .csv file is malformed
+    PHONOLOGEN_ERROR_FEATURES,
+    // The rules .txt file is malformed, or names features or segments the chart doesn't have
+    PHONOLOGEN_ERROR_RULES,
+    // A compiled grammar file is of another version, corrupt, or from an incompatible build
+    PHONOLOGEN_ERROR_GRAMMAR,
+    // A word couldn't be derived, since part of it matches no segment in the chart
+    PHONOLOGEN_ERROR_DERIVE,
+    // Options are out of range
+    PHONOLOGEN_ERROR_ARGUMENT,
+    // There was no memory for a grammar or context object itself; memory running out partway
+    // through anything else fails with the status for what was being done
+    PHONOLOGEN_ERROR_MEMORY
+};
+
+// Grammar: a feature chart and rules, along with every feature matrix derived from them so far
+struct phonologen_grammar;
+// Everything one thread needs to derive words with a grammar: lookup tables filled in as rules are
+// applied, memoized words and transducers
+struct phonologen_context;
+
+// How words are derived
+struct phonologen_options {
+    // Byte budget for memoized words of each context (split between threads when deriving a
+    // stream); 0 disables memoization
+    size_t cache_size;
+    // Transition budget of each transducer applying a run of context-free rules in one pass, past
+    // which segments are taken through the rules one at a time; 0 applies rules one at a time
+    // Experimental: this only pays off for grammars with long runs of context-free rules
+    // Up to INT32_MAX
+    uint32_t fst_transitions;
+    // Number of distinct words phonologen_derive_stream and phonologen_serve gather up and derive
+    // together, applying each rule to all of them before the next rule rather than taking one word
+    // through every rule at a time; 0 derives words one at a time
+    // Up to PHONOLOGEN_MAX_BATCH_WORDS, and only without transducers
+    size_t batch_words;
+    // Threads phonologen_derive_stream and phonologen_serve derive words on
+    unsigned int threads;
+    // Number of batches of input phonologen_derive_stream lets each stage of a pipeline get ahead
+    // of the next by, when deriving on one thread with input read and output written on two more
+    // threads of their own; 0 reads, derives and writes on one thread
+    // Up to PHONOLOGEN_MAX_PIPELINE_DEPTH, and only on one thread without checkpoints
+    size_t pipeline_depth;
+    // Where phonologen_derive_stream and phonologen_serve print statistics once they're done, or
+    // NULL for nowhere, and whether as JSON rather than text
+    FILE *stats;
+    char stats_json;
+    // Checkpoint file phonologen_derive_stream resumes from and then rewrites, for deriving a
+    // corpus again quickly while its rules are being edited (see README.md), or NULL; words are
+    // then derived on one thread, without memoization, so this needs one thread and no
+    // transducers, batches or pipeline
+    const char *checkpoints;
+    // Where surface forms that changed since the last run with the checkpoint file are reported,
+    // along with a summary, or NULL for nowhere
+    FILE *changes;
+    // Where words are reported that were still changing when a rule reached the pass limit its line
+    // gives (as in L*50), and were left as they were then, or NULL for nowhere
+    FILE *warnings;
+};
+
+// Sets options to the defaults: PHONOLOGEN_DEFAULT_CACHE_SIZE, no transducers, words derived one
+// at a time, one thread, no pipeline, no statistics, no checkpoints and no warnings
+void phonologen_options_init(struct phonologen_options *);
+// Returns a message describing the last failure on the calling thread (with no trailing newline),
+// or an empty string if there hasn't been one
+// The message stays valid until the next failure on the same thread
+const char *phonologen_error(void);
+
+// Parses a features .csv file and a rules .txt file into a new grammar, written to the last
+// parameter (or NULL on failure)
+enum phonologen_status phonologen_grammar_parse(
+    const char *, const char *, struct phonologen_grammar **);
+// Loads a compiled grammar file into a new grammar, written to the last parameter (or NULL on
+// failure)
+enum phonologen_status phonologen_grammar_load(const char *, struct phonologen_grammar **);
+// Writes a grammar to a compiled grammar file, for phonologen_grammar_load
+// Must not be called while any context is deriving words with the grammar
+enum phonologen_status phonologen_grammar_compile(const struct phonologen_grammar *, const char *);
+// Writes a grammar as the C source of a standalone program, which derives words on stdin to stdout
+// exactly as phonologen_derive_stream does with the grammar, once compiled with any C99 compiler
+// Must not be called while any context is deriving words with the grammar
+enum phonologen_status phonologen_grammar_emit_c(const struct phonologen_grammar *, const char *);
+// Frees a grammar, once every context using it has been freed
+void phonologen_grammar_free(struct phonologen_grammar *);
+
+// Sets up a new context for deriving words with a grammar, with the given options (or the defaults
+// if NULL), written to the last parameter (or NULL on failure)
+// Contexts may be used from any thread, but by only one thread at a time
+enum phonologen_status phonologen_context_new(
+    struct phonologen_grammar *, const struct phonologen_options *, struct phonologen_context **);
+// Frees a context
+void phonologen_context_free(struct phonologen_context *);
+// Derives count words, each a NUL-terminated string of segments with no whitespace, writing the
+// surface form of every one to the same index of the output array
+// Surface forms are owned by the context, and stay valid until its next call
+// On failure, none of the output array is written
+enum phonologen_status phonologen_derive(
+    struct phonologen_context *, const char *const [], size_t, const char *[]);
+
+// Derives every word read from one file, writing its text to another with every word replaced by
+// its surface form, exactly as the phonologen command does with stdin and stdout
+// Words are derived on options->threads threads, each with its own context; statistics are printed
+// afterwards if options->stats is set
+enum phonologen_status phonologen_derive_stream(
+    struct phonologen_grammar *, const struct phonologen_options *, FILE *, FILE *);
+// Parses a features .csv file and count rules .txt files, each a variant of the same grammar's
+// rules, and derives every word read from one file with every variant at once, writing to another
+// every line of input once for each variant in turn, as it derives it, after the variant's rules
+// file path and a tab (every line ends with a newline, even the last if the input didn't)
+// Rules that variants start with in common are only applied once for all of them, and every word
+// is only segmented and looked up in the word cache once
+// Words are derived on one thread, with options->cache_size bytes of word cache; statistics are
+// printed afterwards if options->stats is set, and all other options are ignored
+enum phonologen_status phonologen_derive_variants(
+    const char *, const char *const [], unsigned int, const struct phonologen_options *, FILE *,
+    FILE *);
+// Listens on a Unix domain socket at the given path, and answers derivation requests from any
+// number of clients at once until the flag given becomes nonzero, then unlinks the socket
+// The flag is checked at least every 100 ms, so it can be set by a signal handler or another thread
+// Requests are framed text, derived exactly as phonologen_derive_stream would; see README.md for
+// the protocol
+// Requests are derived on options->threads threads, each with its own context; statistics are
+// printed afterwards if options->stats is set
+enum phonologen_status phonologen_serve(
+    struct phonologen_grammar *, const struct phonologen_options *, const char *,
+    volatile sig_atomic_t *);
+
+#endif
@@ -0,0 +1,340 @@
+// Multithreaded derivation of words from a file, with output kept in input order
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include "structures.h"
+#include "parsing.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "stream.h"
+#include "parallel.h"
+#include "util.h"
+
+// Number of bytes of input read into each batch (more if a word is longer than this)
+#define BATCH_BYTES (64 << 10)
+// Number of batches per worker that may be read but not yet written, which bounds memory use
+#define BATCHES_PER_WORKER 4
+
+// A chunk of consecutive words of input, derived by one worker
+struct batch {
+    struct input_chunk input;
+    // The chunk with every word replaced by its surface form, exactly as it'll be written out
+    struct byte_buffer output;
+    // Set by the worker once output is complete, or deriving it failed; protected by the pool lock
+    char done;
+    // Set if deriving the batch failed, with the message it failed with
+    char failed;
+    char error[FAIL_MESSAGE_SIZE];
+    // Next batch in input order
+    struct batch *next;
+};
+
+struct pool;
+
+// One worker thread and everything it owns
+struct worker {
+    pthread_t thread;
+    struct pool *pool;
+    // Batches queued for this worker, as a ring buffer; the worker takes them from the front (oldest
+    // first, since output has to wait for those) and other workers steal them from the back
+    struct batch **queue;
+    size_t queue_head;
+    size_t queue_count;
+    pthread_mutex_t queue_lock;
+    struct derivation derivation;
+    struct word_cache cache;
+    // Reused for every word this worker derives
+    struct word word;
+    // Used instead of deriving words one at a time if its word limit isn't 0
+    struct text_batch text_batch;
+};
+
+struct pool {
+    struct grammar *grammar;
+    struct worker *workers;
+    unsigned int worker_count;
+    // Number of workers whose threads were started
+    unsigned int started;
+    // Capacity of every worker's queue; no more batches than this are ever in flight
+    size_t max_in_flight;
+    // Protects queued, shutting_down and every batch's done flag
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t batch_done;
+    // Number of batches sitting in any queue
+    size_t queued;
+    char shutting_down;
+    // Batches that have been queued but not written yet, oldest first; only touched by the thread
+    // reading input
+    struct batch *oldest;
+    struct batch *newest;
+    size_t in_flight;
+    struct input_reader reader;
+};
+
+// Removes and returns the batch at the front of this worker's queue (if own) or at the back of it
+// (if stolen), or NULL if it's empty
+static struct batch *queue_take(struct worker *w, char own) {
+    struct batch *b = NULL;
+    pthread_mutex_lock(&w->queue_lock);
+    if (w->queue_count) {
+        size_t capacity = w->pool->max_in_flight;
+        if (own) {
+            b = w->queue[w->queue_head];
+            w->queue_head = (w->queue_head + 1) % capacity;
+        } else {
+            b = w->queue[(w->queue_head + w->queue_count - 1) % capacity];
+        }
+        w->queue_count--;
+    }
+    pthread_mutex_unlock(&w->queue_lock);
+    return b;
+}
+
+// Adds a batch to the back of a worker's queue and wakes up a worker to take it
+static void queue_push(struct worker *w, struct batch *b) {
+    // Counted before it's queued and uncounted after it's taken, so queued is never too low (which
+    // would let workers sleep or exit while there's work left)
+    pthread_mutex_lock(&w->pool->lock);
+    w->pool->queued++;
+    pthread_mutex_unlock(&w->pool->lock);
+    pthread_mutex_lock(&w->queue_lock);
+    w->queue[(w->queue_head + w->queue_count) % w->pool->max_in_flight] = b;
+    w->queue_count++;
+    pthread_mutex_unlock(&w->queue_lock);
+    pthread_mutex_lock(&w->pool->lock);
+    pthread_cond_signal(&w->pool->work_available);
+    pthread_mutex_unlock(&w->pool->lock);
+}
+
+// Finds a batch to work on, from this worker's own queue first and then from everyone else's
+// Returns NULL if every queue is empty
+static struct batch *worker_find_batch(struct worker *w) {
+    struct pool *pool = w->pool;
+    struct batch *b = queue_take(w, 1);
+    unsigned int self = w - pool->workers;
+    for (unsigned int x = 1; !b && x < pool->worker_count; x++) {
+        b = queue_take(pool->workers + (self + x) % pool->worker_count, 0);
+    }
+    if (b) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return b;
+}
+
+// Derives a batch, recording any failure in it rather than exiting
+static void worker_derive(struct worker *w, struct batch *b) {
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        b->failed = 1;
+        memcpy(b->error, trap.message, sizeof(b->error));
+        return;
+    }
+    if (w->text_batch.word_limit) {
+        derive_text_batched(
+            &w->derivation, &w->cache, &w->word, &w->text_batch, b->input.text, b->input.length,
+            &b->output);
+    } else {
+        derive_text(
+            &w->derivation, &w->cache, &w->word, b->input.text, b->input.length, &b->output);
+    }
+    fail_trap_clear(&trap);
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+    for (;;) {
+        struct batch *b = worker_find_batch(w);
+        if (!b) {
+            pthread_mutex_lock(&pool->lock);
+            while (!pool->queued && !pool->shutting_down) {
+                pthread_cond_wait(&pool->work_available, &pool->lock);
+            }
+            char finished = !pool->queued && pool->shutting_down;
+            pthread_mutex_unlock(&pool->lock);
+            if (finished) {
+                return NULL;
+            }
+            continue;
+        }
+        worker_derive(w, b);
+        pthread_mutex_lock(&pool->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&pool->batch_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Waits for the oldest batch to be derived, then writes its output to a file and frees it
+// Prints errors to stderr and exits on failure, if deriving the batch failed
+static void pool_write_oldest(struct pool *pool, FILE *out) {
+    struct batch *b = pool->oldest;
+    pthread_mutex_lock(&pool->lock);
+    while (!b->done) {
+        pthread_cond_wait(&pool->batch_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    // Output of a batch that failed goes as far as the word that failed; the batch is left queued,
+    // so it's freed along with every other batch
+    byte_buffer_write(&b->output, out);
+    fail_if(b->failed, "%s\n", b->error);
+    pool->oldest = b->next;
+    if (!pool->oldest) {
+        pool->newest = NULL;
+    }
+    pool->in_flight--;
+    input_chunk_free(&b->input);
+    free(b->output.data);
+    free(b);
+}
+
+// Starts every worker, then reads every batch of input, queues it, and writes it out in order
+// Prints errors to stderr and exits on failure
+static void pool_run(
+        struct pool *pool,
+        FILE *out,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings) {
+    unsigned int threads = pool->worker_count;
+    for (unsigned int x = 0; x < threads; x++) {
+        struct worker *w = pool->workers + x;
+        w->pool = pool;
+        w->queue = malloc(pool->max_in_flight * sizeof(*w->queue));
+        fail_if(!w->queue, "Error: unable to allocate memory\n");
+        derivation_init(&w->derivation, pool->grammar);
+        w->derivation.warnings = warnings;
+        if (fst_transitions) {
+            derivation_use_fst(&w->derivation, fst_transitions);
+        }
+        word_cache_init(&w->cache, cache_size / threads);
+        if (batch_words) {
+            text_batch_init(&w->text_batch, batch_words);
+        }
+    }
+    for (; pool->started < threads; pool->started++) {
+        struct worker *w = pool->workers + pool->started;
+        fail_if(
+            pthread_create(&w->thread, NULL, worker_run, w),
+            "Error: unable to start thread\n");
+    }
+
+    unsigned int next_worker = 0;
+    for (;;) {
+        struct batch *b = calloc(1, sizeof(*b));
+        fail_if(!b, "Error: unable to allocate memory\n");
+        if (!input_reader_next(&pool->reader, &b->input)) {
+            free(b);
+            break;
+        }
+        if (pool->newest) {
+            pool->newest->next = b;
+        } else {
+            pool->oldest = b;
+        }
+        pool->newest = b;
+        pool->in_flight++;
+        // Make room for this batch before queueing it, so no queue can overflow; it's the newest,
+        // so it's never the one written
+        if (pool->in_flight > pool->max_in_flight) {
+            pool_write_oldest(pool, out);
+        }
+        queue_push(pool->workers + next_worker, b);
+        next_worker = (next_worker + 1) % threads;
+    }
+    while (pool->oldest) {
+        pool_write_oldest(pool, out);
+    }
+}
+
+// Stops every worker that was started, then frees everything in the pool, adding the statistics
+// of every worker to the totals if they're given
+static void pool_free(
+        struct pool *pool,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+    // Every worker has to be gone before any queue is torn down, since workers steal from each other
+    for (unsigned int x = 0; x < pool->started; x++) {
+        pthread_join(pool->workers[x].thread, NULL);
+    }
+    // Whatever wasn't written, if something failed
+    while (pool->oldest) {
+        struct batch *b = pool->oldest;
+        pool->oldest = b->next;
+        input_chunk_free(&b->input);
+        free(b->output.data);
+        free(b);
+    }
+    input_reader_free(&pool->reader);
+    for (unsigned int x = 0; x < pool->worker_count; x++) {
+        struct worker *w = pool->workers + x;
+        if (cache_totals) {
+            word_cache_add_stats(cache_totals, &w->cache);
+            derivation_stats_add(derivation_totals, &w->derivation);
+        }
+        free(w->word.ids);
+        text_batch_free(&w->text_batch);
+        word_cache_free(&w->cache);
+        derivation_free(&w->derivation);
+        pthread_mutex_destroy(&w->queue_lock);
+        free(w->queue);
+    }
+    free(pool->workers);
+    pthread_cond_destroy(&pool->batch_done);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void derive_parallel(
+        struct grammar *g,
+        FILE *in,
+        FILE *out,
+        unsigned int threads,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals) {
+    // On the heap, so nothing about it is lost if a failure jumps back here
+    struct pool *pool = calloc(1, sizeof(*pool));
+    fail_if(!pool, "Error: unable to allocate memory\n");
+    pool->workers = calloc(threads, sizeof(*pool->workers));
+    if (!pool->workers) {
+        free(pool);
+        fail_if(1, "Error: unable to allocate memory\n");
+    }
+    pool->grammar = g;
+    pool->worker_count = threads;
+    pool->max_in_flight = (size_t) threads * BATCHES_PER_WORKER;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->batch_done, NULL);
+    for (unsigned int x = 0; x < threads; x++) {
+        pthread_mutex_init(&pool->workers[x].queue_lock, NULL);
+    }
+    input_reader_init(&pool->reader, in, BATCH_BYTES);
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        pool_free(pool, NULL, NULL);
+        fail_rethrow(&trap);
+    }
+    pool_run(pool, out, cache_size, fst_transitions, batch_words, warnings);
+    fail_trap_clear(&trap);
+    pool_free(pool, cache_totals, derivation_totals);
+}
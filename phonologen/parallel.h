@@ -0,0 +1,35 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "derive.h"
+#include "wordcache.h"
+
+// Derives every word read from one file with a pool of worker threads, writing surface forms to
+// another in input order, exactly as deriving them one at a time would
+// Words are read in batches, which are spread across the workers' queues; idle workers steal
+// batches queued for others
+// Every worker has its own derivation tables and a word cache of cache_size / threads bytes, and its
+// own transducers of up to fst_transitions transitions each unless that's 0; workers derive words
+// in text batches of up to batch_words distinct words instead, unless that's 0
+// Words still changing when a rule reaches the pass limit its line gives are reported to warnings,
+// unless that's NULL
+// Adds the statistics of every worker's word cache and derivation to the totals given
+// Prints errors to stderr and exits on failure (including failures on workers, once every worker
+// has stopped), having freed everything it set up
+void derive_parallel(
+    struct grammar *,
+    FILE *,
+    FILE *,
+    unsigned int threads,
+    size_t cache_size,
+    uint32_t fst_transitions,
+    size_t batch_words,
+    FILE *warnings,
+    struct word_cache *,
+    struct derivation_stats *);
+
+#endif
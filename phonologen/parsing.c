@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <setjmp.h>
 
 #include "structures.h"
 #include "parsing.h"
@@ -12,6 +14,9 @@
 #define LINE_LIMIT 2048
 
 static const char DELIMS[] = " \t\n";
+// Empty set sign, written in place of the input of rules that insert segments, or the output of
+// those that delete them
+static const char EMPTY[] = "\xe2\x88\x85";
 
 // Moves char *s towards the middle of a string, until they're no longer whitespace
 // Overwrites new end of string with NUL, returns left side of string
@@ -25,22 +30,23 @@ static inline char *l_r_strip(char *l, char *r) {
 
 // Parses first row of features UTF-8 .csv file from FILE *
 // The first row of the .csv file must be an empty cell followed by any number of feature names
-static inline void parse_feature_names(FILE *fp, char delimiter) {
+static inline void parse_feature_names(struct grammar *g, FILE *fp, char delimiter) {
     char line[LINE_LIMIT];
     fail_if(!fgets(line, LINE_LIMIT, fp), "Error parsing .csv: missing feature names\n");
     // Pass 1: count delimiters, and add 1, to get number of features
-    g_feature_count = 1;
+    unsigned int feature_count = 1;
     char *lscan;
-    for (lscan = line; *lscan; g_feature_count += (*lscan++ == delimiter));
+    for (lscan = line; *lscan; feature_count += (*lscan++ == delimiter));
     // Un-NUL-terminate the string and replace with delimiter
     *lscan = delimiter;
-    // Use calloc so it's always safe to free all the entries in this table
-    g_feature_names = calloc(g_feature_count, sizeof(*g_feature_names));
-    fail_if(!g_feature_names, "Error parsing .csv: unable to allocate memory\n");
+    const char **feature_names = arena_alloc(&g->arena, feature_count * sizeof(*feature_names));
+    g->feature_names = feature_names;
+    g->feature_count = feature_count;
+    g->fmatrix_length = (feature_count + FWORD_BITS - 1) / FWORD_BITS * 2;
     // Pass 2: lstrip and rstrip feature names, and put tokens in memory
     // strtok not used for this, because it would be harder
     lscan = line;
-    for (unsigned int x = 0; x < g_feature_count; x++) {
+    for (unsigned int x = 0; x < feature_count; x++) {
         char *tokend = strchr(lscan, delimiter);
         // It's impossible that tokend is NULL, because we counted earlier
         lscan = l_r_strip(lscan, tokend);
@@ -48,16 +54,13 @@ static inline void parse_feature_names(FILE *fp, char delimiter) {
         // l_r_strip, but this is fine
         tokend++;
         fail_if(tokend - lscan < 2, "Error parsing .csv: feature names must not be empty\n");
-        g_feature_names[x] = malloc(tokend - lscan + 1);
-        fail_if(!g_feature_names[x], "Error parsing .csv: unable to allocate memory\n");
-        strcpy(g_feature_names[x], lscan);
+        feature_names[x] = arena_add_string(&g->arena, lscan);
         lscan = tokend;
-        // The casts aren't ideal, but it's a good idea here to use void * as the value type
-        hash_table_strkey_add(g_feature_lookup_table, g_feature_names[x], (void *) (uintptr_t) x);
+        string_table_add(&g->feature_lookup_table, feature_names[x], x);
     }
 }
 
-void parse_features(FILE *fp) {
+void parse_features(struct grammar *g, FILE *fp) {
     char delimiter = fgetc(fp);
     // Short-circuiting to check these three bytes
     if (delimiter == '\xef' && (char) fgetc(fp) == '\xbb' && (char) fgetc(fp) == '\xbf') {
@@ -69,23 +72,24 @@ void parse_features(FILE *fp) {
         delimiter != ';' && delimiter != '\t' && delimiter != ',',
         "Error parsing .csv: empty first cell required\n");
     // This will advance FP so we can parse the table afterward
-    parse_feature_names(fp, delimiter);
+    parse_feature_names(g, fp, delimiter);
     // Parse table by getting segment, allocating a string for it
     unsigned int line_number = 2;
     char line[LINE_LIMIT];
+    // Every row's matrix is built here, then interned
+    fword_t new_fmatrix[g->fmatrix_length];
     while (fgets(line, LINE_LIMIT, fp)) {
         char *tokend = strchr(line, delimiter);
         fail_if(!tokend, "Error parsing .csv: malformed line %u\n", line_number);
         char *feature_value_reader = tokend;
         char *lscan = l_r_strip(line, tokend);
-        char *segment_name = malloc(tokend - lscan + 1);
-        feature_t *new_fmatrix = malloc(g_feature_count * sizeof(*new_fmatrix));
-        fail_if(!segment_name || !new_fmatrix, "Error parsing .csv: unable to allocate memory\n");
-        strcpy(segment_name, lscan);
+        const char *segment_name = arena_add_string(&g->arena, lscan);
+        // Start all features at ZERO
+        memset(new_fmatrix, 0, sizeof(new_fmatrix));
         // We put a NUL where we now expect a delimiter maybe
         *tokend = delimiter;
         // We should see delimiter, value, delimiter, value... for every feature exactly
-        for (unsigned int x = 0; x < g_feature_count; x++) {
+        for (unsigned int x = 0; x < g->feature_count; x++) {
             fail_if(
                 *feature_value_reader != delimiter,
                 "Error parsing .csv: unexpected character '%c' on line %u\n",
@@ -95,15 +99,15 @@ void parse_features(FILE *fp) {
                 case '0':
                 case ' ':
                 case 'z':
-                    new_fmatrix[x] = ZERO;
+                    // Already ZERO
                     break;
                 case '+':
                 case 'p':
-                    new_fmatrix[x] = PLUS;
+                    fmatrix_set(new_fmatrix, x, PLUS);
                     break;
                 case '-':
                 case 'm':
-                    new_fmatrix[x] = MINUS;
+                    fmatrix_set(new_fmatrix, x, MINUS);
                     break;
                 case '\n':
                 case '\r':
@@ -136,33 +140,49 @@ void parse_features(FILE *fp) {
             *feature_value_reader != '\n' && *feature_value_reader != '\r' && *feature_value_reader,
             "Error parsing .csv: too many features on line %u\n",
             line_number);
-        hash_table_strkey_add(g_segment_lookup_table, segment_name, new_fmatrix);
-        // This one will be the owner of new_fmatrix
-        fmatrix_cache_add(new_fmatrix, segment_name);
-        // This one will be the owner of segment_name
-        linked_list_strkey_add(&g_segment_list, segment_name, new_fmatrix);
+        // fmatrix_chunks keep their own copy of new_fmatrix
+        fmatrix_id_t id = fmatrix_cache_add(g, new_fmatrix, segment_name);
+        string_table_add(&g->segment_lookup_table, segment_name, id);
         line_number++;
     }
+    segment_trie_build(g);
 }
 
-// Parses one segment, either a string from the features.csv file or a feature matrix directly
-// Returns NULL if an underscore is found instead of a segment
+// Rules parsed so far, one growing array per array of struct rule_set, until they're all packed
+// into the grammar's arena
+struct rule_builder {
+    struct byte_buffer context_lengths;
+    struct byte_buffer focus_positions;
+    struct byte_buffer directions;
+    struct byte_buffer kinds;
+    struct byte_buffer pass_limits;
+    struct byte_buffer requirements;
+    struct byte_buffer matrix_starts;
+    struct byte_buffer matrices;
+    struct byte_buffer op_starts;
+    struct byte_buffer ops;
+    struct byte_buffer line_numbers;
+};
+
+// Parses one segment, either a string from the features.csv file or a feature matrix directly, into
+// the fmatrix_length fword_ts given
+// Returns 0 if an underscore is found instead of a segment, or else 1
 // line_number used for printing error messages
-// MAY CALL strtok AGAIN! This means it's only used within parse_rule, and carefully!
-static inline feature_t *parse_segment(char *token, unsigned int line_number) {
+// MAY CALL strtok_r AGAIN with save! This means it's only used within parse_rule, and carefully!
+static inline char parse_segment(
+        struct grammar *g, char *token, char **save, unsigned int line_number, fword_t fmatrix[]) {
     if (*token == '_') {
         // Assume this is one or more underscores, don't worry about strange exceptions
-        return NULL;
+        return 0;
     }
     // Start all features at ZERO
-    feature_t *new_fmatrix = calloc(g_feature_count, sizeof(*new_fmatrix));
-    fail_if(!new_fmatrix, "Error parsing .txt: unable to allocate memory\n");
+    memset(fmatrix, 0, g->fmatrix_length * sizeof(*fmatrix));
     if (*token == '[') {
         fail_if(
             strlen(token) > 1,
             "Error parsing .txt: malformed feature matrix on line %u\n",
             line_number);
-        while ((token = strtok(NULL, DELIMS))) {
+        while ((token = strtok_r(NULL, DELIMS, save))) {
             feature_t value = 0;
             switch (*token) {
                 case '[':
@@ -173,7 +193,7 @@ static inline feature_t *parse_segment(char *token, unsigned int line_number) {
                         "Error parsing .txt: malformed feature matrix on line %u\n",
                         line_number);
                     // We hit a '[', read all the values and feature names, and hit a ']', so done
-                    return new_fmatrix;
+                    return 1;
                 case '0':
                     // We shouldn't allow this, just because that's how it is by default
                     fail_if(1, "Error parsing .txt: zero-valued feature on line %u\n", line_number);
@@ -185,146 +205,276 @@ static inline feature_t *parse_segment(char *token, unsigned int line_number) {
                 case '-':
                     value = MINUS;
             }
-            unsigned int index = (unsigned int) (uintptr_t) hash_table_strkey_find(
-                g_feature_lookup_table, token + 1);
-            new_fmatrix[index] = value;
+            unsigned int index = string_table_find(&g->feature_lookup_table, token + 1);
+            fmatrix_set(fmatrix, index, value);
         }
         // We got an unexpected NULL before the closing ']'
         fail_if(1, "Error parsing .txt: unclosed feature matrix on line %u\n", line_number);
     } else {
-        // Copy into new_fmatrix what the features for token are
-        memcpy(
-            new_fmatrix,
-            hash_table_strkey_find(g_segment_lookup_table, token),
-            g_feature_count * sizeof(*new_fmatrix));
+        // Copy into fmatrix what the features for token are
+        fmatrix_id_t id = string_table_find(&g->segment_lookup_table, token);
+        memcpy(fmatrix, fmatrix_of(g, id), g->fmatrix_length * sizeof(*fmatrix));
     }
     // Unreachable from if-branch, but that's ok
-    return new_fmatrix;
+    return 1;
+}
+
+// Appends a uint32_t to a byte buffer
+static inline void append_uint32(struct byte_buffer *b, size_t value) {
+    uint32_t field = value;
+    byte_buffer_append(b, &field, sizeof(field));
 }
 
-// Parses one line of rules UTF-8 .txt file
+// Parses one line of rules UTF-8 .txt file, appending the rule to the builder
 // Prints errors to stderr and exits on failure (this is what line_number is used for)
 // Format: D P > P / P P ... _ P P ...
-// Where D is either L (for left-to-right application) or R (for the opposite) and P is either a
-// segment defined in the features .csv file or a feature matrix in the format [ +f -f 0f ... ]
-// Returns pointer to new heap-allocated struct rule representing the rule for the current line
-static inline struct rule *parse_rule(char *line, unsigned int line_number) {
-    struct rule *new = malloc(sizeof(*new));
-    fail_if(!new, "Error parsing .txt: unable to allocate memory\n");
-    new->next = NULL;
+// Where D is either L (for left-to-right application) or R (for the opposite), followed by * if the
+// rule is applied again until the word stops changing, and optionally the most passes it may take
+// to, and P is either a segment defined in the features .csv file or a feature matrix in the format
+// [ +f -f 0f ... ]
+// The input may be an empty set sign (U+2205) instead, to insert the output as a segment where
+// the _ is, or the output, to delete the input; these rules can't be applied until the word stops
+// changing
+static inline void parse_rule(
+        struct grammar *g, struct rule_builder *b, char *line, unsigned int line_number) {
+    size_t fmatrix_size = g->fmatrix_length * sizeof(fword_t);
     char *tok;
+    // Where strtok_r is in the line
+    char *save;
     // First, the direction
-    tok = strtok(line, DELIMS);
+    tok = strtok_r(line, DELIMS, &save);
     fail_if(
         // "Left" and "Right" are also okay
         !tok || (*tok != 'L' && *tok != 'R'),
         "Error parsing .txt: invalid direction on line %u\n",
         line_number);
-    new->direction = *tok;
+    char direction = *tok;
+    uint32_t pass_limit = 0;
+    if (tok[1] == '*') {
+        pass_limit = RULE_DEFAULT_PASS_LIMIT;
+        if (tok[2]) {
+            char *end;
+            unsigned long limit = strtoul(tok + 2, &end, 10);
+            fail_if(
+                *end || tok[2] < '0' || tok[2] > '9' || !limit || limit > UINT32_MAX,
+                "Error parsing .txt: invalid pass limit on line %u\n",
+                line_number);
+            pass_limit = limit;
+        }
+    }
     // Then, the input
-    tok = strtok(NULL, DELIMS);
+    char kind = 'C';
+    tok = strtok_r(NULL, DELIMS, &save);
     fail_if(!tok, "Error parsing .txt: incomplete line %u\n", line_number);
-    feature_t *focus = parse_segment(tok, line_number);
-    fail_if(!focus, "Error parsing .txt: _ as input on line %u\n", line_number);
+    fword_t focus[g->fmatrix_length];
+    if (!strcmp(tok, EMPTY)) {
+        kind = 'I';
+    } else {
+        fail_if(
+            !parse_segment(g, tok, &save, line_number, focus),
+            "Error parsing .txt: _ as input on line %u\n",
+            line_number);
+    }
     // >
-    tok = strtok(NULL, DELIMS);
+    tok = strtok_r(NULL, DELIMS, &save);
     fail_if(!tok || strcmp(tok, ">"), "Error parsing .txt: expected '>' on line %u\n", line_number);
     // Then, the output
-    tok = strtok(NULL, DELIMS);
+    tok = strtok_r(NULL, DELIMS, &save);
     fail_if(!tok, "Error parsing .txt: incomplete line %u\n", line_number);
-    new->output = parse_segment(tok, line_number);
-    fail_if(!new->output, "Error parsing .txt: _ as output on line %u\n", line_number);
+    fword_t output[g->fmatrix_length];
+    if (!strcmp(tok, EMPTY)) {
+        fail_if(
+            kind == 'I',
+            "Error parsing .txt: %s as input and output on line %u\n",
+            EMPTY,
+            line_number);
+        kind = 'D';
+        memset(output, 0, sizeof(output));
+    } else {
+        fail_if(
+            !parse_segment(g, tok, &save, line_number, output),
+            "Error parsing .txt: _ as output on line %u\n",
+            line_number);
+    }
+    fail_if(
+        kind != 'C' && pass_limit,
+        "Error parsing .txt: insertion or deletion applied until the word stops changing on line "
+        "%u\n",
+        line_number);
     // /
-    tok = strtok(NULL, DELIMS);
+    tok = strtok_r(NULL, DELIMS, &save);
     fail_if(!tok || strcmp(tok, "/"), "Error parsing .txt: expected '/' on line %u\n", line_number);
+    // Every context matrix goes straight onto the end of the pool, with the focus in its place
+    size_t first_matrix = b->matrices.length / fmatrix_size;
+    append_uint32(&b->matrix_starts, first_matrix);
     // Set this to an invalid value
-    new->focus_position = -1;
-    short context_length = 0;
-    while ((tok = strtok(NULL, DELIMS))) {
-        fail_if(
-            context_length >= MAX_CONTEXT_LENGTH,
-            "Error parsing .txt: context too long on line %u\n",
-            line_number);
-        feature_t *contextfm = parse_segment(tok, line_number);
-        if (contextfm) {
-            new->context[context_length++] = contextfm;
+    long focus_position = -1;
+    uint32_t context_length = 0;
+    fword_t contextfm[g->fmatrix_length];
+    while ((tok = strtok_r(NULL, DELIMS, &save))) {
+        if (parse_segment(g, tok, &save, line_number, contextfm)) {
+            byte_buffer_append(&b->matrices, contextfm, fmatrix_size);
         } else {
             fail_if(
-                new->focus_position >= 0,
+                focus_position >= 0,
                 "Error parsing .txt: multiple _ on line %u\n",
                 line_number);
-            new->focus_position = context_length;
-            new->context[context_length++] = focus;
+            focus_position = context_length;
+            if (kind == 'I') {
+                // Nothing to match where a segment is inserted
+                continue;
+            }
+            byte_buffer_append(&b->matrices, focus, fmatrix_size);
         }
+        context_length++;
     }
-    new->context_length = context_length;
+    fail_if(focus_position == -1, "Error parsing .txt: no _ on line %u\n", line_number);
     fail_if(
-        new->focus_position == -1,
-        "Error parsing .txt: no _ on line %u\n",
-        line_number);
-    return new;
+        !context_length, "Error parsing .txt: insertion with no context on line %u\n", line_number);
+    byte_buffer_append(&b->matrices, output, fmatrix_size);
+    // Compile the context and output, in that order, and summarize the context
+    const fword_t *matrices = (const fword_t *) b->matrices.data + first_matrix * g->fmatrix_length;
+    struct fmatrix_op ops[g->fmatrix_length / 2];
+    fword_t requirement[g->fmatrix_length];
+    memset(requirement, 0, fmatrix_size);
+    for (uint32_t x = 0; x <= context_length; x++) {
+        const fword_t *fmatrix = matrices + (size_t) x * g->fmatrix_length;
+        append_uint32(&b->op_starts, b->ops.length / sizeof(*ops));
+        unsigned int count = fmatrix_compile(fmatrix, g->fmatrix_length, ops);
+        byte_buffer_append(&b->ops, ops, count * sizeof(*ops));
+        if (x < context_length) {
+            fmatrix_summarize(fmatrix, g->fmatrix_length, requirement);
+        }
+    }
+    byte_buffer_append(&b->requirements, requirement, fmatrix_size);
+    append_uint32(&b->context_lengths, context_length);
+    append_uint32(&b->focus_positions, focus_position);
+    byte_buffer_append(&b->directions, &direction, 1);
+    byte_buffer_append(&b->kinds, &kind, 1);
+    append_uint32(&b->pass_limits, pass_limit);
+    append_uint32(&b->line_numbers, line_number);
 }
 
-void parse_rules(FILE *fp) {
-    char line[LINE_LIMIT];
-    fail_if(!fgets(line, LINE_LIMIT, fp), "Error parsing .txt: empty file");
-    struct rule *tail = parse_rule(line, 1);
-    g_rules = tail;
-    unsigned int line_number = 2;
-    while (fgets(line, LINE_LIMIT, fp)) {
-        struct rule *new = parse_rule(line, line_number);
-        tail->next = new;
-        tail = new;
-        line_number++;
+// Copies a byte buffer to space, moving space past it
+// Returns where it was copied
+static const void *rule_builder_take(char **space, const struct byte_buffer *b) {
+    const void *copy = *space;
+    if (b->length) {
+        memcpy(*space, b->data, b->length);
     }
+    *space += b->length;
+    return copy;
 }
 
+// Frees every buffer of a rule builder
+static void rule_builder_free(struct rule_builder *b) {
+    free(b->context_lengths.data);
+    free(b->focus_positions.data);
+    free(b->directions.data);
+    free(b->kinds.data);
+    free(b->pass_limits.data);
+    free(b->requirements.data);
+    free(b->matrix_starts.data);
+    free(b->matrices.data);
+    free(b->op_starts.data);
+    free(b->ops.data);
+    free(b->line_numbers.data);
+    free(b);
+}
 
-// Returns the length of substr if it matches str (up until its end, but not the end of str),
-// zero if not
-static inline size_t strmatch(const char *str, const char *substr) {
-    register size_t match = 0;
-    while (*substr) {
-        if (*str++ != *substr++) {
-            return 0;
-        }
-        match++;
+void parse_rules(struct grammar *g, FILE *fp) {
+    struct rule_builder *b = calloc(1, sizeof(*b));
+    fail_if(!b, "Error: unable to allocate memory\n");
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        rule_builder_free(b);
+        fail_rethrow(&trap);
     }
-    return match;
+    char line[LINE_LIMIT];
+    fail_if(!fgets(line, LINE_LIMIT, fp), "Error parsing .txt: empty file");
+    unsigned int line_number = 1;
+    do {
+        // Contexts may be as long as a line allows, so a line that doesn't fit is an error rather
+        // than a rule cut in two
+        fail_if(
+            !strchr(line, '\n') && !feof(fp),
+            "Error parsing .txt: line %u is longer than %d bytes\n",
+            line_number,
+            LINE_LIMIT - 2);
+        parse_rule(g, b, line, line_number++);
+    } while (fgets(line, LINE_LIMIT, fp));
+    size_t fmatrix_size = g->fmatrix_length * sizeof(fword_t);
+    append_uint32(&b->matrix_starts, b->matrices.length / fmatrix_size);
+    append_uint32(&b->op_starts, b->ops.length / sizeof(struct fmatrix_op));
+    fail_if(
+        b->matrices.length / fmatrix_size >= UINT32_MAX
+            || b->ops.length / sizeof(struct fmatrix_op) >= UINT32_MAX,
+        "Error parsing .txt: too many rules\n");
+
+    // Pack everything into one block, widest elements first so each array stays aligned
+    struct rule_set *r = &g->rules;
+    char *space = arena_alloc(
+        &g->arena,
+        b->requirements.length + b->matrices.length + b->ops.length + b->context_lengths.length
+            + b->focus_positions.length + b->matrix_starts.length + b->op_starts.length
+            + b->pass_limits.length + b->line_numbers.length + b->directions.length
+            + b->kinds.length);
+    r->count = b->directions.length;
+    r->matrix_count = b->matrices.length / fmatrix_size;
+    r->op_count = b->ops.length / sizeof(struct fmatrix_op);
+    r->requirements = rule_builder_take(&space, &b->requirements);
+    r->matrices = rule_builder_take(&space, &b->matrices);
+    r->ops = rule_builder_take(&space, &b->ops);
+    r->context_lengths = rule_builder_take(&space, &b->context_lengths);
+    r->focus_positions = rule_builder_take(&space, &b->focus_positions);
+    r->matrix_starts = rule_builder_take(&space, &b->matrix_starts);
+    r->op_starts = rule_builder_take(&space, &b->op_starts);
+    r->pass_limits = rule_builder_take(&space, &b->pass_limits);
+    r->line_numbers = rule_builder_take(&space, &b->line_numbers);
+    r->directions = rule_builder_take(&space, &b->directions);
+    r->kinds = rule_builder_take(&space, &b->kinds);
+    fail_trap_clear(&trap);
+    rule_builder_free(b);
 }
 
-feature_t **parse_word(char *word, long *output_len) {
-    // Our strategy will be: while word isn't empty, look through the entire g_segment_list for the
-    // longest matching segment that does match completely, then remove that, emit its feature
-    // matrix, and keep going
+void parse_word(
+        const struct grammar *g, const char *word, size_t word_length, struct word *output) {
+    // Our strategy will be: while word isn't empty, walk the segment trie from the root for as long
+    // as the word allows, remembering the last node where a segment name ended; that is the
+    // longest matching segment, so remove that, emit its feature matrix ID, and keep going
     // There should be no two strings that match at the beginning and have the same length; that
     // would imply duplicate segments, which we have checked for already
-    // TODO If g_segment_list were sorted in descending order of size, this would be much faster
-    // TODO If everything is fully implemented, and this is still a good idea, change it
-    // TODO It may also be a good idea to have one linked list per starting character, all desc.
-    // Good upper bound so we don't need to realloc, and it doesn't use that much RAM anyways
-    feature_t **output = malloc(strlen(word) * sizeof(*output));
-    fail_if(!output, "Error parsing word: unable to allocate memory\n");
-    register long segments = 0;
-    while (*word) {
-        const feature_t *max_length_fmatrix = NULL;
+    // Good upper bound so we never need to check for room while parsing
+    if (word_length > output->capacity) {
+        free(output->ids);
+        output->ids = malloc(word_length * 2 * sizeof(*output->ids));
+        output->capacity = output->ids ? word_length * 2 : 0;
+        fail_if(!output->ids, "Error parsing word: unable to allocate memory\n");
+    }
+    register fmatrix_id_t *ids = output->ids;
+    const struct segment_trie *trie = &g->segment_trie;
+    const char *end = word + word_length;
+    while (word < end) {
+        fmatrix_id_t max_length_id = FMATRIX_NONE;
         size_t max_length = 0;
-        for (struct hash_table_node *l_iter = g_segment_list; l_iter; l_iter = l_iter->next) {
-            register size_t match_length = strmatch(word, l_iter->key);
-            if (match_length > max_length) {
-                max_length = match_length;
-                max_length_fmatrix = l_iter->value;
+        register uint32_t node = 0;
+        register size_t rest = end - word;
+        for (register size_t x = 0; x < rest && (node = segment_trie_next(trie, node, word[x]));
+                x++) {
+            if (trie->values[node] != FMATRIX_NONE) {
+                max_length = x + 1;
+                max_length_id = trie->values[node];
             }
         }
-        fail_if(!max_length, "Error parsing word: nothing matches the start of %s\n", word);
-        // We need copies of existing feature matrices; these need to be modified by rules
-        feature_t *copy = malloc(g_feature_count * sizeof(*copy));
-        fail_if(!copy, "Error parsing word: unable to allocate memory\n");
-        // Copy into copy what the features for token are
-        memcpy(copy, max_length_fmatrix, g_feature_count * sizeof(*copy));
-        output[segments++] = copy;
+        fail_if(
+            !max_length,
+            "Error parsing word: nothing matches the start of %.*s\n",
+            (int) (end - word),
+            word);
+        // Rules never modify interned feature matrices, so no copy is needed
+        *ids++ = max_length_id;
         word += max_length;
     }
-    *output_len = segments;
-    return output;
+    output->length = ids - output->ids;
 }
@@ -5,28 +5,27 @@
 
 #include "structures.h"
 
-// Parses features UTF-8 .csv file from FILE *
+// Parses features UTF-8 .csv file from FILE * into an empty grammar
 // Prints errors to stderr and exits on failure
 // The first row of the .csv file must be an empty cell followed by any number of feature names
 // Every subsequent row must be a phonetic segment followed by '+', '-', or '0' for each feature
 // ' ' and 'z' also accepted for 0, 'p' for +, and 'm' for -
 // Uppercase capital letters (denoting archiphonemes) are the only phonetic segments where it is
 // permissible to have overlap in description with other sounds in the table
-void parse_features(FILE *);
-// Parses rules UTF-8 .txt file from FILE *
+void parse_features(struct grammar *, FILE *);
+// Parses rules UTF-8 .txt file from FILE * into a grammar whose features are already parsed
 // Prints errors to stderr and exits on failure
 // Format: D P > P / P P ... _ P P ...
 // Where D is either L (for left-to-right application) or R (for the opposite) and P is either a
 // segment defined in the features .csv file or a feature matrix in the format [ +f -f 0f ... ]
-void parse_rules(FILE *);
-// Parses UTF-8 word, where segments are adjacent to each other (parses segments greedily, which
-// may lead to unexpected outcomes in case of ambiguity)
-// Outputs dynamically allocated feature matrix array of the proper size (one feature matrix per
-// segment in the word)
-// Writes the size of this new array to the output_len parameter
-// This is a long rather than size_t for subtraction to yield a negative
+void parse_rules(struct grammar *, FILE *);
+// Parses UTF-8 word of the given length in bytes into segments of the grammar, where segments are adjacent to each other
+// (parses segments greedily, which may lead to unexpected outcomes in case of ambiguity)
+// The word needn't be NUL-terminated, so it can be parsed right where it was read
+// Replaces the contents of struct word with one feature matrix ID per segment in the word, growing
+// its buffer if needed
 // Prints errors to stderr and exits on failure
-// Assumes input word is not NULL and not an empty string
-feature_t **parse_word(char *, long *);
+// Assumes input word is not NULL and not empty
+void parse_word(const struct grammar *, const char *, size_t, struct word *);
 
 #endif
@@ -1,93 +1,217 @@
 // Command-line utility to simulate the application of phonological rules to segments
 // See project README.txt for details
 
+// Everything is done through the library interface in libphonologen.h
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <signal.h>
 
-#include "structures.h"
-#include "parsing.h"
+#include "libphonologen.h"
 #include "util.h"
 
-// Returns whether rule matches (applies) to the feature matrices given by environment
-// Assumes environment points to an array of pointers exactly r->context_length long
-// Thus, this must be called a number of times proportional to the length of the input string per
-// rule application
-static inline char rule_matches(const struct rule *r, feature_t *const *environment) {
-    for (register short x = 0; x < r->context_length; x++) {
-        enum set_relation sr = fmatrix_compare(r->context[x], environment[x]);
-        // Exact match is good; superset is also good (the rule is a superset of the de facto
-        // environment)
-        if (sr == NONE || sr == SUBSET) {
-            return 0;
-        }
-    }
-    return 1;
+#define USAGE \
+    "Usage: phonologen [-j threads] [--cache-size bytes] [--fst] [--fst-transitions count]\n" \
+    "                  [--batch] [--batch-words count] [--stats]\n" \
+    "                  [--pipeline] [--pipeline-depth count]\n" \
+    "                  [--serve socket-path | --checkpoints file]\n" \
+    "                  (features-file rules-file | --grammar grammar-file)\n" \
+    "       phonologen --compile-grammar grammar-file features-file rules-file\n" \
+    "       phonologen --emit-c c-file (features-file rules-file | --grammar grammar-file)\n" \
+    "       phonologen [--cache-size bytes] [--stats] --variants features-file rules-file...\n" \
+    "  -j threads          derive words on this many threads (default 1)\n" \
+    "  --cache-size bytes  memory budget for memoized words (K, M and G suffixes allowed;\n" \
+    "                      0 disables memoization; default 64M)\n" \
+    "  --fst               experimental: apply runs of context-free rules with transducers, in\n" \
+    "                      one pass\n" \
+    "  --fst-transitions count\n" \
+    "                      transition budget of each transducer, past which segments are\n" \
+    "                      taken through its rules one at a time (implies --fst; default 65536)\n" \
+    "  --batch             derive words in batches, applying each rule to every word of a\n" \
+    "                      batch before the next rule (not with --fst)\n" \
+    "  --batch-words count distinct words in each batch (implies --batch; default 4096)\n" \
+    "  --pipeline          read input and write output on threads of their own, passing\n" \
+    "                      batches to and from the thread deriving them (not with -j,\n" \
+    "                      --serve or --checkpoints)\n" \
+    "  --pipeline-depth count\n" \
+    "                      batches each stage may get ahead of the next by (implies\n" \
+    "                      --pipeline; default 8)\n" \
+    "  --stats[=format]    print statistics to stderr at exit, as text (the default) or json;\n" \
+    "                      per-rule counters are included when built with make STATS=1\n" \
+    "  --serve path        answer requests from other processes on a Unix domain socket at this\n" \
+    "                      path, derived on -j threads, instead of deriving stdin; stops on\n" \
+    "                      SIGINT or SIGTERM\n" \
+    "  --checkpoints file  keep every word's form after each rule in this file, and on later\n" \
+    "                      runs derive words again only from the first rule that changed,\n" \
+    "                      reporting surface forms that changed to stderr (not with -j,\n" \
+    "                      --fst, --batch or --pipeline)\n" \
+    "  --grammar file      load features and rules from a compiled grammar file instead\n" \
+    "  --compile-grammar file\n" \
+    "                      parse features-file and rules-file, write them to a compiled grammar\n" \
+    "                      file, and exit\n" \
+    "  --emit-c file       write the grammar as the C source of a standalone program that\n" \
+    "                      derives stdin to stdout just as phonologen would, and exit\n" \
+    "  --variants          derive stdin with every rules file at once, sharing the rules they\n" \
+    "                      start with in common, writing every line once per rules file, after\n" \
+    "                      its path and a tab (one thread only)\n"
+
+// Set by SIGINT and SIGTERM to stop serving
+static volatile sig_atomic_t stop_serving;
+
+static void handle_stop(int signal) {
+    (void) signal;
+    stop_serving = 1;
 }
 
-// Applies mask fmatrix to changed fmatrix (for every PLUS or MINUS in mask, sets that in changed)
-static inline void fmatrix_apply(const feature_t mask[], feature_t *changed) {
-    for (register unsigned int f = 0; f < g_feature_count; f++) {
-        if (mask[f] == PLUS) {
-            changed[f] = PLUS;
-        } else if (mask[f] == MINUS) {
-            changed[f] = MINUS;
-        }
+// Parses a byte count with an optional K, M or G suffix (powers of 1024)
+// Prints errors to stderr and exits on failure
+static size_t parse_size(const char *arg) {
+    // strtoull would skip leading whitespace and negate a leading -, turning -1 into a huge size
+    fail_if(!isdigit((unsigned char) arg[0]), "Error: invalid size %s\n", arg);
+    char *end;
+    errno = 0;
+    unsigned long long size = strtoull(arg, &end, 10);
+    fail_if(errno == ERANGE || size > SIZE_MAX, "Error: invalid size %s\n", arg);
+    // Each suffix multiplies by 1024 once more than the one before it
+    static const char suffixes[] = "KMG";
+    const char *suffix = *end ? strchr(suffixes, toupper((unsigned char) *end)) : NULL;
+    unsigned int shift = 0;
+    if (suffix) {
+        shift = 10 * (suffix - suffixes + 1);
+        end++;
     }
+    fail_if(*end || size > SIZE_MAX >> shift, "Error: invalid size %s\n", arg);
+    return size << shift;
 }
 
-// Parses command-line arguments, reads in features .csv and rule order .txt, and does mainloop
+// Parses command-line arguments, reads in features .csv and rule order .txt (or a compiled
+// grammar), and derives stdin to stdout or serves requests on a socket
 // Returns EXIT_SUCCESS on success, EXIT_FAILURE on failure
 int main(int argc, char *argv[]) {
-    fail_if(argc != 3, "Usage: phonologen features-file rules-file\n");
-
-    // If this fails, program need not error out; we'll just leak memory
-    atexit(free_global_structures);
-
-    FILE *fp;
-    char parse_success;
-
-    // Global data structures in structures.h are set here
-    // Globals are necessary because there would be too many output parameters, and they'll be
-    // used everywhere
-    fp = fopen(argv[1], "rb");
-    fail_if(!fp, "Error opening features .csv file %s\n", argv[1]);
-    parse_features(fp);
-    fclose(fp);
-
-    fp = fopen(argv[2], "rb");
-    fail_if(!fp, "Error opening rules .txt file %s\n", argv[2]);
-    parse_rules(fp);
-    fclose(fp);
-
-    char next_word[256];
-    while (scanf("%255s", next_word) != EOF) {
-        long len;
-        // This tokenizes next_word, messing it up
-        feature_t **next_word_fmatrices = parse_word(next_word, &len);
-        for (struct rule *r = g_rules; r; r = r->next) {
-            // Use long rather than size_t so it can become negative
-            if (r->direction == 'L') {
-                for (long x = 0; x <= len - r->context_length; x++) {
-                    if (rule_matches(r, next_word_fmatrices + x)) {
-                        fmatrix_apply(r->output, next_word_fmatrices[x + r->focus_position]);
-                    }
-                }
-            } else {
-                // r->direction == 'R'
-                for (long x = len - r->context_length; x >= 0; x--) {
-                    if (rule_matches(r, next_word_fmatrices + x)) {
-                        fmatrix_apply(r->output, next_word_fmatrices[x + r->focus_position]);
-                    }
-                }
+    struct phonologen_options options;
+    phonologen_options_init(&options);
+    options.warnings = stderr;
+    // Compiled grammar to load, or to write and exit
+    const char *grammar_file = NULL;
+    const char *compile_file = NULL;
+    // C source of a standalone program to write and exit
+    const char *emit_file = NULL;
+    // Socket to serve requests on instead of deriving stdin
+    const char *socket_file = NULL;
+    // Whether to derive stdin with several rules files at once
+    char variants = 0;
+    int arg;
+    for (arg = 1; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (!strcmp(argv[arg], "-j") && arg + 1 < argc) {
+            char *end;
+            unsigned long threads = strtoul(argv[++arg], &end, 10);
+            fail_if(*end || !threads || threads > 1024, "Error: invalid thread count %s\n", argv[arg]);
+            options.threads = threads;
+        } else if (!strcmp(argv[arg], "--cache-size") && arg + 1 < argc) {
+            options.cache_size = parse_size(argv[++arg]);
+        } else if (!strcmp(argv[arg], "--fst")) {
+            if (!options.fst_transitions) {
+                options.fst_transitions = PHONOLOGEN_DEFAULT_FST_TRANSITIONS;
             }
+        } else if (!strcmp(argv[arg], "--fst-transitions") && arg + 1 < argc) {
+            char *end;
+            unsigned long fst_transitions = strtoul(argv[++arg], &end, 10);
+            fail_if(
+                *end || !fst_transitions || fst_transitions > INT32_MAX,
+                "Error: invalid transition count %s\n",
+                argv[arg]);
+            options.fst_transitions = fst_transitions;
+        } else if (!strcmp(argv[arg], "--batch")) {
+            if (!options.batch_words) {
+                options.batch_words = PHONOLOGEN_DEFAULT_BATCH_WORDS;
+            }
+        } else if (!strcmp(argv[arg], "--batch-words") && arg + 1 < argc) {
+            char *end;
+            unsigned long batch_words = strtoul(argv[++arg], &end, 10);
+            fail_if(
+                *end || !batch_words || batch_words > PHONOLOGEN_MAX_BATCH_WORDS,
+                "Error: invalid batch size %s\n",
+                argv[arg]);
+            options.batch_words = batch_words;
+        } else if (!strcmp(argv[arg], "--pipeline")) {
+            if (!options.pipeline_depth) {
+                options.pipeline_depth = PHONOLOGEN_DEFAULT_PIPELINE_DEPTH;
+            }
+        } else if (!strcmp(argv[arg], "--pipeline-depth") && arg + 1 < argc) {
+            char *end;
+            unsigned long pipeline_depth = strtoul(argv[++arg], &end, 10);
+            fail_if(
+                *end || !pipeline_depth || pipeline_depth > PHONOLOGEN_MAX_PIPELINE_DEPTH,
+                "Error: invalid pipeline depth %s\n",
+                argv[arg]);
+            options.pipeline_depth = pipeline_depth;
+        } else if (!strcmp(argv[arg], "--stats") || !strcmp(argv[arg], "--stats=text")) {
+            options.stats = stderr;
+            options.stats_json = 0;
+        } else if (!strcmp(argv[arg], "--stats=json")) {
+            options.stats = stderr;
+            options.stats_json = 1;
+        } else if (!strcmp(argv[arg], "--serve") && arg + 1 < argc) {
+            socket_file = argv[++arg];
+        } else if (!strcmp(argv[arg], "--checkpoints") && arg + 1 < argc) {
+            options.checkpoints = argv[++arg];
+            options.changes = stderr;
+        } else if (!strcmp(argv[arg], "--grammar") && arg + 1 < argc) {
+            grammar_file = argv[++arg];
+        } else if (!strcmp(argv[arg], "--compile-grammar") && arg + 1 < argc) {
+            compile_file = argv[++arg];
+        } else if (!strcmp(argv[arg], "--emit-c") && arg + 1 < argc) {
+            emit_file = argv[++arg];
+        } else if (!strcmp(argv[arg], "--variants")) {
+            variants = 1;
+        } else {
+            fail_if(1, USAGE);
         }
-        for (size_t x = 0; x < len; x++) {
-            fputs(fmatrix_cache_find(next_word_fmatrices[x]), stdout);
-            free(next_word_fmatrices[x]);
-        }
-        putchar(' ');
-        free(next_word_fmatrices);
     }
+    fail_if(
+        (variants
+            ? argc - arg < 2 || grammar_file || compile_file || emit_file || socket_file
+                || options.checkpoints || options.fst_transitions || options.batch_words
+                || options.threads > 1 || options.pipeline_depth
+            : argc - arg != (grammar_file ? 0 : 2))
+            || (compile_file && (grammar_file || socket_file))
+            || (emit_file && (compile_file || socket_file || options.checkpoints))
+            || (options.checkpoints
+                && (compile_file || socket_file || options.threads > 1 || options.fst_transitions
+                    || options.batch_words))
+            || (options.batch_words && options.fst_transitions)
+            || (options.pipeline_depth
+                && (options.threads > 1 || socket_file || options.checkpoints)),
+        USAGE);
+
+    if (variants) {
+        enum phonologen_status status = phonologen_derive_variants(
+            argv[arg], (const char *const *) argv + arg + 1, argc - arg - 1, &options, stdin,
+            stdout);
+        fail_if(status != PHONOLOGEN_OK, "%s\n", phonologen_error());
+        return EXIT_SUCCESS;
+    }
+    struct phonologen_grammar *grammar;
+    enum phonologen_status status = grammar_file
+        ? phonologen_grammar_load(grammar_file, &grammar)
+        : phonologen_grammar_parse(argv[arg], argv[arg + 1], &grammar);
+    fail_if(status != PHONOLOGEN_OK, "%s\n", phonologen_error());
+    if (compile_file) {
+        status = phonologen_grammar_compile(grammar, compile_file);
+    } else if (emit_file) {
+        status = phonologen_grammar_emit_c(grammar, emit_file);
+    } else if (socket_file) {
+        signal(SIGINT, handle_stop);
+        signal(SIGTERM, handle_stop);
+        status = phonologen_serve(grammar, &options, socket_file, &stop_serving);
+    } else {
+        status = phonologen_derive_stream(grammar, &options, stdin, stdout);
+    }
+    phonologen_grammar_free(grammar);
+    fail_if(status != PHONOLOGEN_OK, "%s\n", phonologen_error());
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,447 @@
+// Derivation of words from a file on one thread, while input is read and output written on others
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "structures.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "util.h"
+
+// Number of bytes of input read into each batch (more if a word is longer than this)
+#define PIPELINE_BATCH_BYTES (64 << 10)
+// Number of times a stage checks a queue again before going to sleep until it's woken
+#define PIPELINE_SPINS 4096
+// Size of a cache line, which fields written by different threads are kept apart by
+#define CACHE_LINE_SIZE 64
+
+// A chunk of consecutive words of input, and its text with every word replaced by its surface
+// form, exactly as it'll be written out
+struct pipeline_batch {
+    struct input_chunk input;
+    struct byte_buffer output;
+};
+
+// Bounded queue of batches from one thread to another, which neither takes a lock to add or take a
+// batch; a NULL batch marks the end of input
+// A thread that has to wait for the queue checks it again for a while before sleeping until the
+// other thread wakes it, which it only does if the count of sleepers says it has to
+struct pipeline_queue {
+    struct pipeline_batch **slots;
+    size_t depth;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    // Number of threads waiting for the queue asleep; both can be for a moment, since one that's
+    // been woken may not have noticed yet by the time the other has to wait
+    atomic_int sleepers;
+    // Number of batches ever taken, written only by the consumer
+    char head_padding[CACHE_LINE_SIZE];
+    atomic_size_t head;
+    // Number of batches ever added, written only by the producer
+    char tail_padding[CACHE_LINE_SIZE];
+    atomic_size_t tail;
+    // Sum of how many batches the queue held just after every batch was added, and the most it
+    // ever held; kept by the producer
+    unsigned long long depth_total;
+    size_t depth_max;
+};
+
+// Everything derive_pipelined sets up, so it can all be freed whether or not deriving succeeds
+struct pipeline {
+    struct grammar *grammar;
+    // Queues from the reader to derivation, and from derivation to the writer
+    struct pipeline_queue queues[2];
+    // Set when derivation fails, so the reader and writer stop
+    atomic_char stopping;
+    struct input_reader reader;
+    FILE *out;
+    pthread_t reader_thread;
+    pthread_t writer_thread;
+    char reader_started;
+    char writer_started;
+    // Batch the reader has read but not queued yet, and the batch being derived
+    struct pipeline_batch *reading;
+    struct pipeline_batch *deriving;
+    // Set if reading input failed, with the message it failed with; only read once the reader has
+    // queued the end of input
+    char read_failed;
+    char error[FAIL_MESSAGE_SIZE];
+    struct derivation derivation;
+    struct word_cache cache;
+    // Reused for every word
+    struct word word;
+    // Used instead of deriving words one at a time if its word limit isn't 0
+    struct text_batch text_batch;
+    // Every stage only adds to its own stall time, and the queues keep their own depths
+    struct pipeline_stats stats;
+};
+
+// Returns seconds on a monotonic clock
+static double seconds_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns whether a queue has room for another batch (if room is set) or a batch to take
+static inline char queue_ready(struct pipeline_queue *q, char room) {
+    if (room) {
+        return atomic_load_explicit(&q->tail, memory_order_relaxed)
+            - atomic_load_explicit(&q->head, memory_order_acquire) < q->depth;
+    }
+    return atomic_load_explicit(&q->tail, memory_order_acquire)
+        != atomic_load_explicit(&q->head, memory_order_relaxed);
+}
+
+// Waits until a queue has room for another batch (if room is set) or a batch to take, or the
+// pipeline is stopping
+// Returns the seconds spent waiting
+static double queue_wait(struct pipeline *p, struct pipeline_queue *q, char room) {
+    if (queue_ready(q, room)) {
+        return 0;
+    }
+    double start = seconds_now();
+    for (unsigned int x = 0; x < PIPELINE_SPINS; x++) {
+        if (queue_ready(q, room) || atomic_load_explicit(&p->stopping, memory_order_relaxed)) {
+            return seconds_now() - start;
+        }
+    }
+    pthread_mutex_lock(&q->lock);
+    // This thread is counted before the queue is checked again, and the other thread changes the
+    // queue before checking the count, so either this sees the change or that sees the count
+    atomic_fetch_add(&q->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!queue_ready(q, room) && !atomic_load(&p->stopping)) {
+        pthread_cond_wait(&q->wake, &q->lock);
+    }
+    atomic_fetch_sub(&q->sleepers, 1);
+    pthread_mutex_unlock(&q->lock);
+    return seconds_now() - start;
+}
+
+// Wakes any thread sleeping on a queue once the queue has changed
+static inline void queue_notify(struct pipeline_queue *q) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->sleepers, memory_order_relaxed)) {
+        pthread_mutex_lock(&q->lock);
+        pthread_cond_broadcast(&q->wake);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+// Adds a batch to a queue, which must have room for it
+static void queue_push(struct pipeline_queue *q, struct pipeline_batch *b) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    q->slots[tail % q->depth] = b;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    size_t depth = tail + 1 - atomic_load_explicit(&q->head, memory_order_relaxed);
+    q->depth_total += depth;
+    if (depth > q->depth_max) {
+        q->depth_max = depth;
+    }
+    queue_notify(q);
+}
+
+// Takes the oldest batch from a queue, which must have one
+static struct pipeline_batch *queue_pop(struct pipeline_queue *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct pipeline_batch *b = q->slots[head % q->depth];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    queue_notify(q);
+    return b;
+}
+
+// Frees a batch and everything it owns
+static void pipeline_batch_free(struct pipeline_batch *b) {
+    if (b) {
+        input_chunk_free(&b->input);
+        free(b->output.data);
+        free(b);
+    }
+}
+
+// Reads every batch of input and queues it for derivation, followed by the end of input, recording
+// any failure rather than exiting
+static void *pipeline_read(void *arg) {
+    struct pipeline *p = arg;
+    struct pipeline_queue *q = p->queues;
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        p->read_failed = 1;
+        memcpy(p->error, trap.message, sizeof(p->error));
+        pipeline_batch_free(p->reading);
+        p->reading = NULL;
+    } else {
+        for (;;) {
+            p->reading = calloc(1, sizeof(*p->reading));
+            fail_if(!p->reading, "Error: unable to allocate memory\n");
+            if (!input_reader_next(&p->reader, &p->reading->input)) {
+                free(p->reading);
+                p->reading = NULL;
+                break;
+            }
+            p->stats.reader_stalled += queue_wait(p, q, 1);
+            if (atomic_load(&p->stopping)) {
+                fail_trap_clear(&trap);
+                return NULL;
+            }
+            queue_push(q, p->reading);
+            p->reading = NULL;
+        }
+        fail_trap_clear(&trap);
+    }
+    p->stats.reader_stalled += queue_wait(p, q, 1);
+    if (!atomic_load(&p->stopping)) {
+        queue_push(q, NULL);
+    }
+    return NULL;
+}
+
+// Writes out every derived batch in the order they were queued, until the end of input
+static void *pipeline_write(void *arg) {
+    struct pipeline *p = arg;
+    struct pipeline_queue *q = p->queues + 1;
+    for (;;) {
+        p->stats.writer_stalled += queue_wait(p, q, 0);
+        if (atomic_load(&p->stopping)) {
+            return NULL;
+        }
+        struct pipeline_batch *b = queue_pop(q);
+        if (!b) {
+            return NULL;
+        }
+        byte_buffer_write(&b->output, p->out);
+        pipeline_batch_free(b);
+    }
+}
+
+// Sets up an empty queue of the given depth, with no slots yet
+static void queue_init(struct pipeline_queue *q, size_t depth) {
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->wake, NULL);
+    atomic_init(&q->sleepers, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->depth = depth;
+}
+
+// Frees every batch left in a queue, and then the queue
+static void queue_free(struct pipeline_queue *q) {
+    if (q->slots) {
+        size_t tail = atomic_load(&q->tail);
+        for (size_t x = atomic_load(&q->head); x != tail; x++) {
+            pipeline_batch_free(q->slots[x % q->depth]);
+        }
+    }
+    free(q->slots);
+    pthread_cond_destroy(&q->wake);
+    pthread_mutex_destroy(&q->lock);
+}
+
+// Starts the reader and writer, then derives every batch the reader queues and queues it for the
+// writer, until the end of input
+// Prints errors to stderr and exits on failure
+static void pipeline_run(
+        struct pipeline *p,
+        size_t depth,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings) {
+    for (unsigned int x = 0; x < 2; x++) {
+        p->queues[x].slots = malloc(depth * sizeof(*p->queues[x].slots));
+        fail_if(!p->queues[x].slots, "Error: unable to allocate memory\n");
+    }
+    derivation_init(&p->derivation, p->grammar);
+    p->derivation.warnings = warnings;
+    if (fst_transitions) {
+        derivation_use_fst(&p->derivation, fst_transitions);
+    }
+    word_cache_init(&p->cache, cache_size);
+    if (batch_words) {
+        text_batch_init(&p->text_batch, batch_words);
+    }
+    fail_if(
+        pthread_create(&p->reader_thread, NULL, pipeline_read, p),
+        "Error: unable to start thread\n");
+    p->reader_started = 1;
+    fail_if(
+        pthread_create(&p->writer_thread, NULL, pipeline_write, p),
+        "Error: unable to start thread\n");
+    p->writer_started = 1;
+    for (;;) {
+        p->stats.input_stalled += queue_wait(p, p->queues, 0);
+        struct pipeline_batch *b = p->deriving = queue_pop(p->queues);
+        if (b) {
+            if (p->text_batch.word_limit) {
+                derive_text_batched(
+                    &p->derivation, &p->cache, &p->word, &p->text_batch, b->input.text,
+                    b->input.length, &b->output);
+            } else {
+                derive_text(
+                    &p->derivation, &p->cache, &p->word, b->input.text, b->input.length,
+                    &b->output);
+            }
+            // Not needed by the writer
+            input_chunk_free(&b->input);
+            b->input.block = NULL;
+            p->stats.batches++;
+        }
+        p->stats.output_stalled += queue_wait(p, p->queues + 1, 1);
+        queue_push(p->queues + 1, b);
+        p->deriving = NULL;
+        if (!b) {
+            break;
+        }
+    }
+    pthread_join(p->reader_thread, NULL);
+    p->reader_started = 0;
+    pthread_join(p->writer_thread, NULL);
+    p->writer_started = 0;
+    fail_if(p->read_failed, "%s\n", p->error);
+}
+
+// Once deriving a batch has failed, has the writer write out every batch before it and then the
+// failed batch's output, as far as the word that failed, before it stops
+static void pipeline_finish_writing(struct pipeline *p) {
+    if (!p->writer_started || !p->deriving) {
+        return;
+    }
+    struct pipeline_queue *q = p->queues + 1;
+    queue_wait(p, q, 1);
+    queue_push(q, p->deriving);
+    p->deriving = NULL;
+    queue_wait(p, q, 1);
+    queue_push(q, NULL);
+    pthread_join(p->writer_thread, NULL);
+    p->writer_started = 0;
+}
+
+// Stops the reader and writer if they're still running, then frees everything in the pipeline,
+// adding its statistics to the totals if they're given
+// A reader blocked reading input only stops once the read returns
+static void pipeline_free(
+        struct pipeline *p,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals,
+        struct pipeline_stats *pipeline_totals) {
+    atomic_store(&p->stopping, 1);
+    for (unsigned int x = 0; x < 2; x++) {
+        pthread_mutex_lock(&p->queues[x].lock);
+        pthread_cond_broadcast(&p->queues[x].wake);
+        pthread_mutex_unlock(&p->queues[x].lock);
+    }
+    if (p->reader_started) {
+        pthread_join(p->reader_thread, NULL);
+    }
+    if (p->writer_started) {
+        pthread_join(p->writer_thread, NULL);
+    }
+    if (cache_totals) {
+        word_cache_add_stats(cache_totals, &p->cache);
+        derivation_stats_add(derivation_totals, &p->derivation);
+        struct pipeline_stats *totals = pipeline_totals;
+        totals->batches += p->stats.batches;
+        totals->depth = p->queues[0].depth;
+        for (unsigned int x = 0; x < 2; x++) {
+            totals->depth_totals[x] += p->queues[x].depth_total;
+            if (p->queues[x].depth_max > totals->depth_maxima[x]) {
+                totals->depth_maxima[x] = p->queues[x].depth_max;
+            }
+        }
+        totals->reader_stalled += p->stats.reader_stalled;
+        totals->input_stalled += p->stats.input_stalled;
+        totals->output_stalled += p->stats.output_stalled;
+        totals->writer_stalled += p->stats.writer_stalled;
+    }
+    queue_free(p->queues);
+    queue_free(p->queues + 1);
+    pipeline_batch_free(p->reading);
+    pipeline_batch_free(p->deriving);
+    input_reader_free(&p->reader);
+    free(p->word.ids);
+    text_batch_free(&p->text_batch);
+    word_cache_free(&p->cache);
+    derivation_free(&p->derivation);
+    free(p);
+}
+
+void derive_pipelined(
+        struct grammar *g,
+        FILE *in,
+        FILE *out,
+        size_t depth,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals,
+        struct pipeline_stats *pipeline_totals) {
+    // On the heap, so nothing about it is lost if a failure jumps back here, and the other threads
+    // can get at it
+    struct pipeline *p = calloc(1, sizeof(*p));
+    fail_if(!p, "Error: unable to allocate memory\n");
+    atomic_init(&p->stopping, 0);
+    p->grammar = g;
+    p->out = out;
+    queue_init(p->queues, depth);
+    queue_init(p->queues + 1, depth);
+    input_reader_init(&p->reader, in, PIPELINE_BATCH_BYTES);
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        pipeline_finish_writing(p);
+        pipeline_free(p, NULL, NULL, NULL);
+        fail_rethrow(&trap);
+    }
+    pipeline_run(p, depth, cache_size, fst_transitions, batch_words, warnings);
+    fail_trap_clear(&trap);
+    pipeline_free(p, cache_totals, derivation_totals, pipeline_totals);
+}
+
+void pipeline_stats_print(const struct pipeline_stats *stats, FILE *fp) {
+    unsigned long long pushes = stats->batches + 1;
+    fprintf(
+        fp,
+        "pipeline: %llu batches; queue depth %.1f on average (at most %zu) for input and %.1f "
+        "(at most %zu) for output, of %zu; stalls: reader %.3f s, derivation %.3f s for input "
+        "and %.3f s for output, writer %.3f s\n",
+        stats->batches,
+        (double) stats->depth_totals[0] / pushes,
+        stats->depth_maxima[0],
+        (double) stats->depth_totals[1] / pushes,
+        stats->depth_maxima[1],
+        stats->depth,
+        stats->reader_stalled,
+        stats->input_stalled,
+        stats->output_stalled,
+        stats->writer_stalled);
+}
+
+void pipeline_stats_print_json(const struct pipeline_stats *stats, FILE *fp) {
+    unsigned long long pushes = stats->batches + 1;
+    fprintf(
+        fp,
+        "{\"batches\": %llu, \"depth\": %zu, \"input_depth_mean\": %.3f, \"input_depth_max\": %zu, "
+        "\"output_depth_mean\": %.3f, \"output_depth_max\": %zu, \"reader_stalled\": %.6f, "
+        "\"input_stalled\": %.6f, \"output_stalled\": %.6f, \"writer_stalled\": %.6f}",
+        stats->batches,
+        stats->depth,
+        (double) stats->depth_totals[0] / pushes,
+        stats->depth_maxima[0],
+        (double) stats->depth_totals[1] / pushes,
+        stats->depth_maxima[1],
+        stats->reader_stalled,
+        stats->input_stalled,
+        stats->output_stalled,
+        stats->writer_stalled);
+}
@@ -0,0 +1,58 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "derive.h"
+#include "wordcache.h"
+
+// Statistics of a pipelined derivation, for tuning its queue depth
+struct pipeline_stats {
+    // Batches of input that went through the pipeline, and how many each queue holds at most
+    unsigned long long batches;
+    size_t depth;
+    // For the queue from the reader to derivation and the queue from derivation to the writer, the
+    // sum of how many batches it held just after every batch was added, and the most it ever held
+    unsigned long long depth_totals[2];
+    size_t depth_maxima[2];
+    // Seconds the reader waited for room in its queue, derivation waited for input and for room
+    // for output, and the writer waited for output
+    double reader_stalled;
+    double input_stalled;
+    double output_stalled;
+    double writer_stalled;
+};
+
+// Derives every word read from one file, writing surface forms to another in input order, with
+// reading, deriving and writing on three threads of their own so none waits on the others: a
+// reader thread reads the input a batch at a time, the calling thread derives each batch's words
+// (looked up in a word cache of cache_size bytes, with transducers of up to fst_transitions
+// transitions each unless that's 0, or in text batches of up to batch_words distinct words unless
+// that's 0), and a writer thread writes them out
+// Words still changing when a rule reaches the pass limit its line gives are reported to warnings,
+// unless that's NULL
+// The stages pass batches through two bounded lock-free queues of depth batches each; a stage that
+// gets ahead of the next waits for room, which bounds memory use
+// Adds the statistics of the word cache, derivation and pipeline to the totals given
+// Prints errors to stderr and exits on failure (including failures reading input, once the other
+// threads have stopped), having freed everything it set up
+void derive_pipelined(
+    struct grammar *,
+    FILE *,
+    FILE *,
+    size_t depth,
+    size_t cache_size,
+    uint32_t fst_transitions,
+    size_t batch_words,
+    FILE *warnings,
+    struct word_cache *,
+    struct derivation_stats *,
+    struct pipeline_stats *);
+// Prints how full the pipeline's queues got and how long each stage waited to FILE *
+void pipeline_stats_print(const struct pipeline_stats *, FILE *);
+// Prints the same statistics to FILE * as a JSON object (with no trailing newline)
+void pipeline_stats_print_json(const struct pipeline_stats *, FILE *);
+
+#endif
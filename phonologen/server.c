@@ -0,0 +1,718 @@
+// Server answering derivation requests over a Unix domain socket with a pool of worker threads
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "libphonologen.h"
+#include "structures.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "stream.h"
+#include "server.h"
+#include "util.h"
+
+// Milliseconds between checks of the stop flag
+#define POLL_MILLISECONDS 100
+// Milliseconds a response may wait for its client to make room for it, before the client is dropped
+#define WRITE_TIMEOUT_MILLISECONDS 10000
+// Number of bytes of responses a connection may have waiting for its client to make room for them,
+// past which no more of its requests are read until the client catches up
+#define OUTPUT_LIMIT (1 << 20)
+// Number of requests per worker that may be read but not yet taken by a worker, which bounds memory
+// use; past this, connections aren't read from until workers catch up
+#define JOBS_PER_WORKER 16
+// Number of bytes read from a connection at a time
+#define READ_BYTES (64 << 10)
+
+// One client connection
+struct connection {
+    int fd;
+    // One reference held while the connection is polled, plus one for each of its requests not
+    // answered yet; protected by the server lock
+    unsigned int references;
+    // Protects output, output_since and broken, so responses are never interleaved
+    pthread_mutex_t write_lock;
+    // Responses (or what's left of them) the client hasn't made room for yet, which the thread
+    // reading requests sends as it does, and when the first of them was added or last made progress
+    struct byte_buffer output;
+    double output_since;
+    // Set once writing to the client failed or timed out, so nothing more is written
+    char broken;
+    // Bytes read that don't make up a whole request yet, or that do but weren't queued since the
+    // job queue was full, in which case pending is set, and whether requests are no longer read
+    // from the connection (it stays open until every response is sent); only touched by the thread
+    // reading requests
+    struct byte_buffer input;
+    char pending;
+    char closed;
+};
+
+// One request, waiting to be taken by a worker
+struct job {
+    struct connection *connection;
+    uint32_t id;
+    // PHONOLOGEN_OK for a request to derive the text, or else the status of a failure to respond
+    // with, the text being its message
+    uint32_t status;
+    size_t length;
+    // Next job in the order requests were read
+    struct job *next;
+    char text[];
+};
+
+struct server;
+
+// One worker thread and everything it owns
+struct server_worker {
+    pthread_t thread;
+    struct server *server;
+    struct derivation derivation;
+    struct word_cache cache;
+    // Reused for every word this worker derives
+    struct word word;
+    // Used instead of deriving words one at a time if its word limit isn't 0
+    struct text_batch text_batch;
+    // Reused for the payload of every response
+    struct byte_buffer output;
+    // Message of the last request that failed
+    char error[FAIL_MESSAGE_SIZE];
+};
+
+struct server {
+    struct grammar *grammar;
+    const char *path;
+    // Listening socket, or -1 if not open yet; path is only unlinked if bound is set
+    int listener;
+    char bound;
+    struct server_worker *workers;
+    unsigned int worker_count;
+    // Number of workers whose threads were started
+    unsigned int started;
+    // Protects the job queue, reader_paused, shutting_down and every connection's references
+    pthread_mutex_t lock;
+    pthread_cond_t job_available;
+    // Jobs not yet taken by any worker, oldest first
+    struct job *first_job;
+    struct job *last_job;
+    size_t job_count;
+    size_t max_jobs;
+    // Set when the thread reading requests found the job queue full and stopped reading, so the
+    // next worker to take a job wakes it by writing to the pipe, as workers also do when a client
+    // can't take a response yet; the pipe's ends are -1 until opened
+    char reader_paused;
+    int wake[2];
+    char shutting_down;
+    // Open connections, and what to poll them with (after the listening socket and the pipe);
+    // only touched by the thread reading requests
+    struct connection **connections;
+    size_t connection_count;
+    size_t connection_capacity;
+    struct pollfd *polls;
+};
+
+// Drops a reference to a connection, closing and freeing it once nothing refers to it
+static void connection_release(struct server *server, struct connection *c) {
+    pthread_mutex_lock(&server->lock);
+    char last = !--c->references;
+    pthread_mutex_unlock(&server->lock);
+    if (!last) {
+        return;
+    }
+    close(c->fd);
+    pthread_mutex_destroy(&c->write_lock);
+    free(c->input.data);
+    free(c->output.data);
+    free(c);
+}
+
+// Returns seconds on a monotonic clock
+static double server_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Marks a connection broken, throwing away whatever it has left to send, and shuts it down, so
+// reading from it stops as well; its write_lock must be held
+static void connection_break(struct connection *c) {
+    c->broken = 1;
+    c->output.length = 0;
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+// Sends as much of a connection's output as the client has room for without waiting, breaking the
+// connection if sending fails; its write_lock must be held
+static void connection_flush(struct connection *c) {
+    size_t sent = 0;
+    while (sent < c->output.length && !c->broken) {
+        ssize_t n = send(c->fd, c->output.data + sent, c->output.length - sent, MSG_NOSIGNAL);
+        if (n >= 0) {
+            sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            connection_break(c);
+        }
+    }
+    if (sent && !c->broken) {
+        memmove(c->output.data, c->output.data + sent, c->output.length - sent);
+        c->output.length -= sent;
+        c->output_since = server_now();
+    }
+}
+
+// Appends a response to a connection's output and sends as much of it as the client has room for,
+// without waiting for more; running out of memory for it breaks the connection, since failing
+// another client's requests would be no better
+// Returns whether any of the connection's output is still waiting to be sent
+static char connection_respond(
+        struct connection *c, uint32_t id, uint32_t status, const char *payload, size_t length) {
+    unsigned char header[SERVER_RESPONSE_HEADER];
+    server_put32(header, length);
+    server_put32(header + 4, id);
+    server_put32(header + 8, status);
+    pthread_mutex_lock(&c->write_lock);
+    if (!c->broken) {
+        struct byte_buffer *b = &c->output;
+        size_t needed = b->length + sizeof(header) + length;
+        if (needed > b->capacity) {
+            size_t capacity = b->capacity ? b->capacity : 4096;
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+            char *data = realloc(b->data, capacity);
+            if (data) {
+                b->data = data;
+                b->capacity = capacity;
+            }
+        }
+        if (needed > b->capacity) {
+            connection_break(c);
+        } else {
+            if (!b->length) {
+                c->output_since = server_now();
+            }
+            memcpy(b->data + b->length, header, sizeof(header));
+            memcpy(b->data + b->length + sizeof(header), payload, length);
+            b->length = needed;
+            connection_flush(c);
+        }
+    }
+    char waiting = c->output.length != 0;
+    pthread_mutex_unlock(&c->write_lock);
+    return waiting;
+}
+
+// Sends whatever a connection has left to send before it's closed, waiting as long as its client
+// keeps making room
+static void connection_finish(struct connection *c) {
+    pthread_mutex_lock(&c->write_lock);
+    connection_flush(c);
+    while (c->output.length) {
+        struct pollfd p = {c->fd, POLLOUT, 0};
+        if (poll(&p, 1, WRITE_TIMEOUT_MILLISECONDS) <= 0) {
+            connection_break(c);
+            break;
+        }
+        connection_flush(c);
+    }
+    pthread_mutex_unlock(&c->write_lock);
+}
+
+// Returns how many bytes of a connection's output are still waiting to be sent, first breaking the
+// connection if its client hasn't made room for any of them in too long
+static size_t connection_waiting(struct connection *c, double now) {
+    pthread_mutex_lock(&c->write_lock);
+    if (c->output.length && now - c->output_since > WRITE_TIMEOUT_MILLISECONDS / 1000.0) {
+        connection_break(c);
+    }
+    size_t waiting = c->output.length;
+    pthread_mutex_unlock(&c->write_lock);
+    return waiting;
+}
+
+// Derives a job's text into the worker's output buffer
+// Returns 1 on success, or 0 with the worker's error set on failure
+static char worker_derive(struct server_worker *w, const struct job *job) {
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        memcpy(w->error, trap.message, sizeof(w->error));
+        return 0;
+    }
+    w->output.length = 0;
+    if (w->text_batch.word_limit) {
+        derive_text_batched(
+            &w->derivation, &w->cache, &w->word, &w->text_batch, job->text, job->length,
+            &w->output);
+    } else {
+        derive_text(&w->derivation, &w->cache, &w->word, job->text, job->length, &w->output);
+    }
+    fail_if(w->output.length > UINT32_MAX, "Error: response too long\n");
+    fail_trap_clear(&trap);
+    return 1;
+}
+
+// Wakes the thread reading requests from its poll
+static void server_wake(struct server *server) {
+    // If the pipe is full, the reader has plenty to wake it already
+    ssize_t written = write(server->wake[1], "", 1);
+    (void) written;
+}
+
+static void *worker_run(void *arg) {
+    struct server_worker *w = arg;
+    struct server *server = w->server;
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (!server->first_job && !server->shutting_down) {
+            pthread_cond_wait(&server->job_available, &server->lock);
+        }
+        // Jobs still queued are answered before shutting down
+        struct job *job = server->first_job;
+        if (job) {
+            server->first_job = job->next;
+            if (!server->first_job) {
+                server->last_job = NULL;
+            }
+            server->job_count--;
+        }
+        char wake = job && server->reader_paused;
+        if (wake) {
+            server->reader_paused = 0;
+        }
+        pthread_mutex_unlock(&server->lock);
+        if (wake) {
+            server_wake(server);
+        }
+        if (!job) {
+            return NULL;
+        }
+        if (job->status != PHONOLOGEN_OK) {
+            wake = connection_respond(
+                job->connection, job->id, job->status, job->text, job->length);
+        } else if (worker_derive(w, job)) {
+            wake = connection_respond(
+                job->connection, job->id, PHONOLOGEN_OK, w->output.data, w->output.length);
+        } else {
+            wake = connection_respond(
+                job->connection, job->id, PHONOLOGEN_ERROR_DERIVE, w->error, strlen(w->error));
+        }
+        // The rest of the response is left to the reader, to send once the client makes room
+        if (wake) {
+            server_wake(server);
+        }
+        connection_release(server, job->connection);
+        free(job);
+    }
+}
+
+// Returns whether the job queue is full, in which case the next worker to take a job wakes the
+// thread reading requests
+static char server_full(struct server *server) {
+    pthread_mutex_lock(&server->lock);
+    char full = server->job_count >= server->max_jobs;
+    server->reader_paused = full;
+    pthread_mutex_unlock(&server->lock);
+    return full;
+}
+
+// Queues a job for the workers to respond to a request on a connection with, with the given status
+// and text (to derive, or the message of the failure)
+// Never waits, so the queue may go past its limit by the failures queued
+// Prints errors to stderr and exits on failure
+static void server_push(
+        struct server *server,
+        struct connection *c,
+        uint32_t id,
+        uint32_t status,
+        const void *text,
+        size_t length) {
+    struct job *job = malloc(sizeof(*job) + length);
+    fail_if(!job, "Error: unable to allocate memory\n");
+    job->connection = c;
+    job->id = id;
+    job->status = status;
+    job->length = length;
+    job->next = NULL;
+    memcpy(job->text, text, length);
+    pthread_mutex_lock(&server->lock);
+    job->connection->references++;
+    if (server->last_job) {
+        server->last_job->next = job;
+    } else {
+        server->first_job = job;
+    }
+    server->last_job = job;
+    server->job_count++;
+    pthread_cond_signal(&server->job_available);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Stops polling a connection (by its index), which is closed once every request read from it has
+// been answered
+static void server_drop(struct server *server, size_t index) {
+    struct connection *c = server->connections[index];
+    server->connections[index] = server->connections[--server->connection_count];
+    connection_release(server, c);
+}
+
+// Returns whether a connection no longer read from has nothing left to do: every request read from
+// it has been answered, and every response sent (or the connection broke)
+static char server_finished(struct server *server, struct connection *c) {
+    if (!c->closed) {
+        return 0;
+    }
+    pthread_mutex_lock(&server->lock);
+    char answered = c->references == 1;
+    pthread_mutex_unlock(&server->lock);
+    // No worker can be writing to the connection once its requests are all answered
+    return answered && !c->output.length;
+}
+
+// Accepts every connection waiting on the listening socket
+static void server_accept(struct server *server) {
+    for (;;) {
+        int fd = accept(server->listener, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        if (server->connection_count == server->connection_capacity) {
+            size_t capacity = server->connection_capacity ? server->connection_capacity * 2 : 16;
+            struct connection **connections =
+                realloc(server->connections, capacity * sizeof(*connections));
+            if (connections) {
+                server->connections = connections;
+                struct pollfd *polls = realloc(server->polls, (capacity + 2) * sizeof(*polls));
+                if (polls) {
+                    server->polls = polls;
+                    server->connection_capacity = capacity;
+                }
+            }
+        }
+        // Running out of memory (or anything else) with one client is no reason to stop serving
+        // everyone else, so the client is just hung up on
+        struct connection *c = server->connection_count < server->connection_capacity
+            ? calloc(1, sizeof(*c))
+            : NULL;
+        if (!c || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->fd = fd;
+        c->references = 1;
+        pthread_mutex_init(&c->write_lock, NULL);
+        server->connections[server->connection_count++] = c;
+    }
+}
+
+// Queues every whole request in a connection's (by its index) input for as long as the job queue
+// has room, setting the connection's pending flag if it's left with any
+// A request over the limit is refused, and nothing more is read from the connection
+// Prints errors to stderr and exits on failure
+static void server_parse(struct server *server, size_t index) {
+    struct connection *c = server->connections[index];
+    const unsigned char *data = (const unsigned char *) c->input.data;
+    size_t position = 0;
+    c->pending = 0;
+    while (c->input.length - position >= SERVER_REQUEST_HEADER) {
+        uint32_t length = server_get32(data + position);
+        uint32_t id = server_get32(data + position + 4);
+        if (length > SERVER_MAX_REQUEST) {
+            char message[FAIL_MESSAGE_SIZE];
+            snprintf(
+                message, sizeof(message), "Error: request of %lu bytes is over the limit of %d",
+                (unsigned long) length, SERVER_MAX_REQUEST);
+            server_push(server, c, id, PHONOLOGEN_ERROR_ARGUMENT, message, strlen(message));
+            c->closed = 1;
+            c->input.length = 0;
+            return;
+        }
+        if (c->input.length - position - SERVER_REQUEST_HEADER < length) {
+            break;
+        }
+        if (server_full(server)) {
+            c->pending = 1;
+            break;
+        }
+        server_push(
+            server, c, id, PHONOLOGEN_OK, data + position + SERVER_REQUEST_HEADER, length);
+        position += SERVER_REQUEST_HEADER + length;
+    }
+    memmove(c->input.data, c->input.data + position, c->input.length - position);
+    c->input.length -= position;
+}
+
+// Reads whatever has arrived on a connection (by its index), and queues every whole request there's
+// room for
+// Prints errors to stderr and exits on failure
+static void server_read(struct server *server, size_t index) {
+    struct connection *c = server->connections[index];
+    char buffer[READ_BYTES];
+    ssize_t n = read(c->fd, buffer, sizeof(buffer));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    // The client hung up (or the connection broke), though responses may still be owed
+    if (n <= 0) {
+        c->closed = 1;
+        c->input.length = 0;
+        return;
+    }
+    byte_buffer_append(&c->input, buffer, n);
+    server_parse(server, index);
+}
+
+// Opens the listening socket at the server's path
+// Prints errors to stderr and exits on failure
+static void server_listen(struct server *server) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    fail_if(
+        strlen(server->path) >= sizeof(address.sun_path),
+        "Error: socket path %s is too long\n",
+        server->path);
+    strcpy(address.sun_path, server->path);
+    server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    fail_if(server->listener < 0, "Error creating socket %s\n", server->path);
+    // A socket left behind by a server that didn't shut down cleanly would make binding fail, but
+    // one that a server is still listening on mustn't be taken over
+    struct stat st;
+    if (!lstat(server->path, &st) && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        char live = probe >= 0 && !connect(probe, (struct sockaddr *) &address, sizeof(address));
+        if (probe >= 0) {
+            close(probe);
+        }
+        fail_if(live, "Error: socket %s is already in use\n", server->path);
+        unlink(server->path);
+    }
+    fail_if(
+        bind(server->listener, (struct sockaddr *) &address, sizeof(address)),
+        "Error binding socket %s\n",
+        server->path);
+    server->bound = 1;
+    fail_if(
+        listen(server->listener, SOMAXCONN)
+            || fcntl(server->listener, F_SETFL, fcntl(server->listener, F_GETFL) | O_NONBLOCK),
+        "Error listening on socket %s\n",
+        server->path);
+}
+
+// Starts every worker, opens the socket, then reads requests until stop is set
+// Prints errors to stderr and exits on failure
+static void server_run(
+        struct server *server,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings,
+        volatile sig_atomic_t *stop) {
+    unsigned int threads = server->worker_count;
+    for (unsigned int x = 0; x < threads; x++) {
+        struct server_worker *w = server->workers + x;
+        w->server = server;
+        derivation_init(&w->derivation, server->grammar);
+        w->derivation.warnings = warnings;
+        if (fst_transitions) {
+            derivation_use_fst(&w->derivation, fst_transitions);
+        }
+        word_cache_init(&w->cache, cache_size / threads);
+        if (batch_words) {
+            text_batch_init(&w->text_batch, batch_words);
+        }
+    }
+    server->polls = malloc(2 * sizeof(*server->polls));
+    fail_if(!server->polls, "Error: unable to allocate memory\n");
+    fail_if(pipe(server->wake), "Error: unable to create pipe\n");
+    for (unsigned int x = 0; x < 2; x++) {
+        fail_if(
+            fcntl(server->wake[x], F_SETFL, fcntl(server->wake[x], F_GETFL) | O_NONBLOCK),
+            "Error: unable to create pipe\n");
+    }
+    server_listen(server);
+    // Signals are left to the thread reading requests, so stopping on one interrupts its poll
+    sigset_t blocked;
+    sigset_t old;
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_SETMASK, &blocked, &old);
+    for (; server->started < threads; server->started++) {
+        struct server_worker *w = server->workers + server->started;
+        if (pthread_create(&w->thread, NULL, worker_run, w)) {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fail_if(server->started < threads, "Error: unable to start thread\n");
+
+    while (!*stop) {
+        // Backwards, since dropping a connection moves the last one into its place
+        for (size_t x = server->connection_count; x-- > 0;) {
+            if (server_finished(server, server->connections[x])) {
+                server_drop(server, x);
+            }
+        }
+        // Requests left over when the job queue filled up go first, while there's room for them
+        for (size_t x = 0; x < server->connection_count; x++) {
+            if (server->connections[x]->pending) {
+                server_parse(server, x);
+            }
+        }
+        // Nothing is read from connections while the queue is full, and the reader waits for a
+        // worker to wake it instead, or from those whose clients are too far behind on reading
+        // their responses; connections with nothing to poll for are skipped (poll skips negative
+        // descriptors)
+        char full = server_full(server);
+        double now = server_now();
+        struct pollfd *polls = server->polls;
+        polls[0].fd = server->listener;
+        polls[0].events = POLLIN;
+        polls[1].fd = server->wake[0];
+        polls[1].events = POLLIN;
+        for (size_t x = 0; x < server->connection_count; x++) {
+            struct connection *c = server->connections[x];
+            size_t waiting = connection_waiting(c, now);
+            short events = waiting ? POLLOUT : 0;
+            if (!c->closed && !c->pending && !full && waiting < OUTPUT_LIMIT) {
+                events |= POLLIN;
+            }
+            polls[x + 2].fd = events ? c->fd : -1;
+            polls[x + 2].events = events;
+        }
+        int ready = poll(polls, server->connection_count + 2, POLL_MILLISECONDS);
+        fail_if(ready < 0 && errno != EINTR, "Error waiting for requests\n");
+        if (ready <= 0) {
+            continue;
+        }
+        if (polls[1].revents) {
+            char drained[64];
+            while (read(server->wake[0], drained, sizeof(drained)) > 0);
+        }
+        for (size_t x = 0; x < server->connection_count; x++) {
+            struct connection *c = server->connections[x];
+            if (polls[x + 2].fd < 0 || !polls[x + 2].revents) {
+                continue;
+            }
+            if (polls[x + 2].events & POLLOUT) {
+                pthread_mutex_lock(&c->write_lock);
+                connection_flush(c);
+                pthread_mutex_unlock(&c->write_lock);
+            }
+            if (polls[x + 2].events & POLLIN) {
+                server_read(server, x);
+            }
+        }
+        if (polls[0].revents) {
+            server_accept(server);
+        }
+    }
+}
+
+// Stops every worker that was started once every queued request is answered, then sends what's
+// left of every response and closes every connection and the socket and frees everything in the server, adding the statistics of every
+// worker to the totals if they're given
+static void server_free(
+        struct server *server,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals) {
+    pthread_mutex_lock(&server->lock);
+    server->shutting_down = 1;
+    pthread_cond_broadcast(&server->job_available);
+    pthread_mutex_unlock(&server->lock);
+    for (unsigned int x = 0; x < server->started; x++) {
+        pthread_join(server->workers[x].thread, NULL);
+    }
+    // Whatever no worker was left to answer, if starting them failed
+    while (server->first_job) {
+        struct job *job = server->first_job;
+        server->first_job = job->next;
+        connection_release(server, job->connection);
+        free(job);
+    }
+    while (server->connection_count) {
+        connection_finish(server->connections[server->connection_count - 1]);
+        server_drop(server, server->connection_count - 1);
+    }
+    if (server->listener >= 0) {
+        close(server->listener);
+    }
+    for (unsigned int x = 0; x < 2; x++) {
+        if (server->wake[x] >= 0) {
+            close(server->wake[x]);
+        }
+    }
+    if (server->bound) {
+        unlink(server->path);
+    }
+    for (unsigned int x = 0; x < server->worker_count; x++) {
+        struct server_worker *w = server->workers + x;
+        if (cache_totals) {
+            word_cache_add_stats(cache_totals, &w->cache);
+            derivation_stats_add(derivation_totals, &w->derivation);
+        }
+        free(w->word.ids);
+        free(w->output.data);
+        text_batch_free(&w->text_batch);
+        word_cache_free(&w->cache);
+        derivation_free(&w->derivation);
+    }
+    free(server->workers);
+    free(server->connections);
+    free(server->polls);
+    pthread_cond_destroy(&server->job_available);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
+
+void serve(
+        struct grammar *g,
+        const char *path,
+        unsigned int threads,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings,
+        volatile sig_atomic_t *stop,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals) {
+    // On the heap, so nothing about it is lost if a failure jumps back here
+    struct server *server = calloc(1, sizeof(*server));
+    fail_if(!server, "Error: unable to allocate memory\n");
+    server->workers = calloc(threads, sizeof(*server->workers));
+    if (!server->workers) {
+        free(server);
+        fail_if(1, "Error: unable to allocate memory\n");
+    }
+    server->grammar = g;
+    server->path = path;
+    server->listener = -1;
+    server->wake[0] = -1;
+    server->wake[1] = -1;
+    server->worker_count = threads;
+    server->max_jobs = (size_t) threads * JOBS_PER_WORKER;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->job_available, NULL);
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        server_free(server, NULL, NULL);
+        fail_rethrow(&trap);
+    }
+    server_run(server, cache_size, fst_transitions, batch_words, warnings, stop);
+    fail_trap_clear(&trap);
+    server_free(server, cache_totals, derivation_totals);
+}
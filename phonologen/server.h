@@ -0,0 +1,66 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+
+#include "structures.h"
+#include "derive.h"
+#include "wordcache.h"
+
+// Protocol spoken over the socket: every message is a frame made of a header of 32-bit big-endian
+// fields followed by a payload
+// Requests: payload length, request ID (anything the client likes), then the payload, which is text
+// to derive exactly as phonologen reads it from stdin
+// Responses: payload length, the ID of the request being answered, a status (one of enum
+// phonologen_status in libphonologen.h), then the payload, which is the text with every word
+// replaced by its surface form, or the failure message if the status isn't PHONOLOGEN_OK
+// Clients may send any number of requests without waiting for responses; requests are derived in
+// parallel, so responses on one connection may come back in any order, and are matched up by ID
+// A request with a payload over SERVER_MAX_REQUEST bytes is answered with
+// PHONOLOGEN_ERROR_ARGUMENT, and the connection is closed
+#define SERVER_REQUEST_HEADER 8
+#define SERVER_RESPONSE_HEADER 12
+#define SERVER_MAX_REQUEST (16 << 20)
+
+// Reads a 32-bit big-endian header field
+static inline uint32_t server_get32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// Writes a 32-bit big-endian header field
+static inline void server_put32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+// Listens on a Unix domain socket at the given path and answers requests from any number of
+// clients until the flag given becomes nonzero (it's checked at least every 100 ms, so it can be set
+// by a signal handler), then unlinks the socket
+// Requests are derived by a pool of worker threads, each with its own derivation tables, a word
+// cache of cache_size / threads bytes, and its own transducers of up to fst_transitions transitions
+// each unless that's 0; workers derive the words of each request in text batches of up to
+// batch_words distinct words instead, unless that's 0
+// Words still changing when a rule reaches the pass limit its line gives are reported to warnings,
+// unless that's NULL
+// Responses are held for clients that aren't reading them yet, so workers never wait on a client;
+// past a limit, no more requests are read from such a client, and those that stop reading for too
+// long are disconnected
+// Adds the statistics of every worker's word cache and derivation to the totals given
+// Prints errors to stderr and exits on failure, having freed everything it set up
+void serve(
+    struct grammar *,
+    const char *,
+    unsigned int threads,
+    size_t cache_size,
+    uint32_t fst_transitions,
+    size_t batch_words,
+    FILE *warnings,
+    volatile sig_atomic_t *,
+    struct word_cache *,
+    struct derivation_stats *);
+
+#endif
@@ -0,0 +1,477 @@
+// Block-wise reading of words from a file, and derivation of whole chunks of text
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define STREAM_MMAP
+#endif
+
+#include "structures.h"
+#include "parsing.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "stream.h"
+#include "util.h"
+
+void input_reader_init(struct input_reader *reader, FILE *in, size_t chunk_size) {
+    memset(reader, 0, sizeof(*reader));
+    reader->in = in;
+    reader->chunk_size = chunk_size;
+#ifdef STREAM_MMAP
+    // Map regular files in full, starting wherever the file currently is; nothing can have been
+    // buffered from it yet
+    struct stat st;
+    int fd = fileno(in);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && offset >= 0 && st.st_size > offset) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            // Only a hint; failure doesn't matter
+            posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            reader->map = map;
+            reader->map_length = st.st_size;
+            reader->position = offset;
+        }
+    }
+#endif
+}
+
+// Returns the next chunk of memory-mapped input
+static char input_reader_next_mapped(struct input_reader *reader, struct input_chunk *chunk) {
+    size_t start = reader->position;
+    if (start == reader->map_length) {
+        return 0;
+    }
+    size_t end = start + reader->chunk_size;
+    if (end > reader->map_length) {
+        end = reader->map_length;
+    }
+    // Carry on to the end of the word the chunk would otherwise cut off
+    while (end < reader->map_length && !is_separator(reader->map[end - 1])) {
+        end++;
+    }
+    chunk->text = reader->map + start;
+    chunk->length = end - start;
+    chunk->block = NULL;
+    reader->position = end;
+    return 1;
+}
+
+char input_reader_next(struct input_reader *reader, struct input_chunk *chunk) {
+    if (reader->map) {
+        return input_reader_next_mapped(reader, chunk);
+    }
+    if (reader->eof && !reader->carry.length) {
+        return 0;
+    }
+    // The block starts with whatever was cut off last time, and is filled up with fread; it grows
+    // for as long as it holds nothing but one unfinished word
+    size_t capacity = reader->carry.length + reader->chunk_size;
+    char *block = malloc(capacity);
+    fail_if(!block, "Error: unable to allocate memory\n");
+    if (reader->carry.length) {
+        memcpy(block, reader->carry.data, reader->carry.length);
+    }
+    size_t length = reader->carry.length;
+    reader->carry.length = 0;
+    size_t end = 0;
+    while (!end) {
+        if (!reader->eof) {
+            if (length == capacity) {
+                capacity *= 2;
+                char *grown = realloc(block, capacity);
+                if (!grown) {
+                    free(block);
+                    fail_if(1, "Error: unable to allocate memory\n");
+                }
+                block = grown;
+            }
+            size_t read = fread(block + length, 1, capacity - length, reader->in);
+            if (ferror(reader->in)) {
+                free(block);
+                fail_if(1, "Error reading input\n");
+            }
+            reader->eof = read < capacity - length;
+            length += read;
+        }
+        if (reader->eof) {
+            end = length;
+            break;
+        }
+        // End the chunk just after its last separator
+        for (end = length; end && !is_separator(block[end - 1]); end--);
+    }
+    if (!length) {
+        free(block);
+        return 0;
+    }
+    byte_buffer_append(&reader->carry, block + end, length - end);
+    chunk->text = block;
+    chunk->length = end;
+    chunk->block = block;
+    return 1;
+}
+
+void input_chunk_free(struct input_chunk *chunk) {
+    free(chunk->block);
+}
+
+void input_reader_free(struct input_reader *reader) {
+#ifdef STREAM_MMAP
+    if (reader->map) {
+        munmap(reader->map, reader->map_length);
+    }
+#endif
+    free(reader->carry.data);
+}
+
+void derive_spelling(
+        struct derivation *d,
+        struct word_cache *cache,
+        struct word *word,
+        const char *text,
+        size_t length,
+        struct byte_buffer *out) {
+    const struct grammar *g = d->grammar;
+    long len;
+    d->words++;
+    const fmatrix_id_t *ids = word_cache_find(cache, text, length, &len);
+    if (!ids) {
+        parse_word(g, text, length, word);
+        derive_word(d, word);
+        word_cache_add(cache, text, length, word->ids, word->length);
+        ids = word->ids;
+        len = word->length;
+    }
+    for (long x = 0; x < len; x++) {
+        unsigned int spelling_length;
+        const char *spelling = fmatrix_spelling(g, ids[x], &spelling_length);
+        byte_buffer_append(out, spelling, spelling_length);
+    }
+}
+
+void derive_text(
+        struct derivation *d,
+        struct word_cache *cache,
+        struct word *word,
+        const char *text,
+        size_t length,
+        struct byte_buffer *out) {
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    const char *end = text + length;
+    while (text < end) {
+        // Whitespace, copied as is
+        const char *start = text;
+        while (text < end && is_separator(*text)) {
+            text++;
+        }
+        byte_buffer_append(out, start, text - start);
+        if (text == end) {
+            break;
+        }
+        // Then a word, replaced by its surface form
+        start = text;
+        while (text < end && !is_separator(*text)) {
+            text++;
+        }
+        derive_spelling(d, cache, word, start, text - start, out);
+    }
+    derivation_add_time(d, &start_time);
+}
+
+void text_batch_init(struct text_batch *batch, size_t word_limit) {
+    memset(batch, 0, sizeof(*batch));
+    batch->word_limit = word_limit;
+    // Enough for every distinct word to be repeated a few times, as they are in most text
+    batch->occurrence_limit = word_limit * 4;
+    batch->slot_count = 16;
+    while (batch->slot_count < word_limit * 2) {
+        batch->slot_count *= 2;
+    }
+    batch->starts = malloc((word_limit + 1) * sizeof(*batch->starts));
+    batch->texts = malloc(word_limit * sizeof(*batch->texts));
+    batch->text_lengths = malloc(word_limit * sizeof(*batch->text_lengths));
+    batch->slots = calloc(batch->slot_count, sizeof(*batch->slots));
+    batch->occurrences = malloc(batch->occurrence_limit * sizeof(*batch->occurrences));
+    fail_if(
+        !batch->starts || !batch->texts || !batch->text_lengths || !batch->slots
+            || !batch->occurrences,
+        "Error: unable to allocate memory\n");
+    batch->starts[0] = 0;
+}
+
+// Returns the slot of the batch's table holding a word of the given length, or else the empty slot
+// it would go in
+static size_t text_batch_slot(const struct text_batch *batch, const char *text, size_t length) {
+    size_t mask = batch->slot_count - 1;
+    size_t slot = hash_string(text, length) & mask;
+    for (; batch->slots[slot]; slot = (slot + 1) & mask) {
+        size_t x = batch->slots[slot] - 1;
+        if (batch->text_lengths[x] == length && !memcmp(batch->texts[x], text, length)) {
+            break;
+        }
+    }
+    return slot;
+}
+
+// Adds a word of the given length to those the batch derives, parsed with the reusable word, at
+// the empty slot of the batch's table that text_batch_slot found for it
+// Returns its index among them
+// Prints errors to stderr and exits on failure
+static size_t text_batch_add(
+        const struct grammar *g,
+        struct word *word,
+        struct text_batch *batch,
+        size_t slot,
+        const char *text,
+        size_t length) {
+    parse_word(g, text, length, word);
+    if (batch->id_count + word->length > batch->id_capacity) {
+        size_t capacity = batch->id_capacity ? batch->id_capacity : 4096;
+        while (batch->id_count + word->length > capacity) {
+            capacity *= 2;
+        }
+        fmatrix_id_t *ids = realloc(batch->ids, capacity * sizeof(*ids));
+        fail_if(!ids, "Error: unable to allocate memory\n");
+        batch->ids = ids;
+        batch->id_capacity = capacity;
+    }
+    memcpy(batch->ids + batch->id_count, word->ids, word->length * sizeof(*word->ids));
+    batch->id_count += word->length;
+    size_t x = batch->word_count++;
+    batch->starts[x + 1] = batch->id_count;
+    batch->texts[x] = text;
+    batch->text_lengths[x] = length;
+    batch->slots[slot] = x + 1;
+    return x;
+}
+
+// Empties the batch of words to derive and words of text
+static void text_batch_empty(struct text_batch *batch) {
+    batch->id_count = 0;
+    batch->word_count = 0;
+    batch->occurrence_count = 0;
+    memset(batch->slots, 0, batch->slot_count * sizeof(*batch->slots));
+}
+
+// Derives every word the batch has gathered, rule by rule, and appends every word of text gathered
+// so far to the byte buffer, then adds the words derived to the word cache and empties the batch
+// Prints errors to stderr and exits on failure
+static void text_batch_flush(
+        struct derivation *d,
+        struct word_cache *cache,
+        struct text_batch *batch,
+        struct byte_buffer *out) {
+    const struct grammar *g = d->grammar;
+    derive_batch(d, &batch->ids, &batch->id_capacity, batch->starts, batch->word_count);
+    // Cached IDs stay valid until the first word is added to the cache, so that comes last
+    for (size_t x = 0; x < batch->occurrence_count; x++) {
+        const struct batch_occurrence *o = batch->occurrences + x;
+        byte_buffer_append(out, o->space, o->space_length);
+        const fmatrix_id_t *ids = o->cached;
+        long len = o->cached_length;
+        if (!ids) {
+            ids = batch->ids + batch->starts[o->word];
+            len = batch->starts[o->word + 1] - batch->starts[o->word];
+        }
+        for (long y = 0; y < len; y++) {
+            unsigned int spelling_length;
+            const char *spelling = fmatrix_spelling(g, ids[y], &spelling_length);
+            byte_buffer_append(out, spelling, spelling_length);
+        }
+    }
+    for (size_t x = 0; x < batch->word_count; x++) {
+        word_cache_add(
+            cache,
+            batch->texts[x],
+            batch->text_lengths[x],
+            batch->ids + batch->starts[x],
+            batch->starts[x + 1] - batch->starts[x]);
+    }
+    text_batch_empty(batch);
+}
+
+void derive_text_batched(
+        struct derivation *d,
+        struct word_cache *cache,
+        struct word *word,
+        struct text_batch *batch,
+        const char *text,
+        size_t length,
+        struct byte_buffer *out) {
+    // Left over if the last call failed partway
+    if (batch->occurrence_count) {
+        text_batch_empty(batch);
+    }
+    // Set while a word is added to the batch, so that if it doesn't parse, every word of text
+    // before it is still derived and appended first, as it would be if words were derived one at a
+    // time; the batch is left as it was before the word
+    volatile char adding = 0;
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        if (adding) {
+            const struct batch_occurrence *failed = batch->occurrences + --batch->occurrence_count;
+            text_batch_flush(d, cache, batch, out);
+            byte_buffer_append(out, failed->space, failed->space_length);
+        }
+        fail_rethrow(&trap);
+    }
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    const char *end = text + length;
+    while (text < end) {
+        // Whitespace, copied as is once the word after it is
+        const char *start = text;
+        while (text < end && is_separator(*text)) {
+            text++;
+        }
+        if (text == end) {
+            text = start;
+            break;
+        }
+        struct batch_occurrence *o = batch->occurrences + batch->occurrence_count++;
+        o->space = start;
+        o->space_length = text - start;
+        // Then a word, which is either already in the batch, cached, or added to the batch
+        start = text;
+        while (text < end && !is_separator(*text)) {
+            text++;
+        }
+        d->words++;
+        size_t slot = text_batch_slot(batch, start, text - start);
+        o->cached = NULL;
+        if (batch->slots[slot]) {
+            o->word = batch->slots[slot] - 1;
+        } else {
+            o->cached = word_cache_find(cache, start, text - start, &o->cached_length);
+            if (!o->cached) {
+                adding = 1;
+                o->word = text_batch_add(d->grammar, word, batch, slot, start, text - start);
+                adding = 0;
+            }
+        }
+        if (batch->word_count == batch->word_limit
+                || batch->occurrence_count == batch->occurrence_limit) {
+            text_batch_flush(d, cache, batch, out);
+        }
+    }
+    // Words point into the text, so none can be left in the batch
+    if (batch->occurrence_count) {
+        text_batch_flush(d, cache, batch, out);
+    }
+    byte_buffer_append(out, text, end - text);
+    fail_trap_clear(&trap);
+    derivation_add_time(d, &start_time);
+}
+
+void text_batch_free(struct text_batch *batch) {
+    free(batch->ids);
+    free(batch->starts);
+    free(batch->texts);
+    free(batch->text_lengths);
+    free(batch->slots);
+    free(batch->occurrences);
+}
+
+// Everything derive_serial sets up, so it can all be freed whether or not deriving succeeds
+struct serial_state {
+    struct derivation derivation;
+    struct word_cache cache;
+    // Reused for every word
+    struct word word;
+    // Used instead of deriving words one at a time if its word limit isn't 0
+    struct text_batch batch;
+    struct input_reader reader;
+    struct input_chunk chunk;
+    struct byte_buffer output;
+};
+
+// Derives every word the reader reads, writing surface forms to a file a chunk at a time
+// Prints errors to stderr and exits on failure
+static void serial_run(struct serial_state *state, FILE *out, size_t chunk_size) {
+    struct byte_buffer *output = &state->output;
+    while (input_reader_next(&state->reader, &state->chunk)) {
+        if (state->batch.word_limit) {
+            derive_text_batched(
+                &state->derivation,
+                &state->cache,
+                &state->word,
+                &state->batch,
+                state->chunk.text,
+                state->chunk.length,
+                output);
+        } else {
+            derive_text(
+                &state->derivation,
+                &state->cache,
+                &state->word,
+                state->chunk.text,
+                state->chunk.length,
+                output);
+        }
+        input_chunk_free(&state->chunk);
+        state->chunk.block = NULL;
+        if (output->length >= chunk_size) {
+            byte_buffer_write(output, out);
+        }
+    }
+    byte_buffer_write(output, out);
+}
+
+// Frees everything derive_serial set up
+static void serial_state_free(struct serial_state *state) {
+    input_chunk_free(&state->chunk);
+    free(state->output.data);
+    input_reader_free(&state->reader);
+    free(state->word.ids);
+    text_batch_free(&state->batch);
+    word_cache_free(&state->cache);
+    derivation_free(&state->derivation);
+}
+
+void derive_serial(
+        struct grammar *g,
+        FILE *in,
+        FILE *out,
+        size_t chunk_size,
+        size_t cache_size,
+        uint32_t fst_transitions,
+        size_t batch_words,
+        FILE *warnings,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals) {
+    struct serial_state state;
+    memset(&state, 0, sizeof(state));
+    input_reader_init(&state.reader, in, chunk_size);
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        // Everything derived before the failure is still written out
+        byte_buffer_write(&state.output, out);
+        serial_state_free(&state);
+        fail_rethrow(&trap);
+    }
+    derivation_init(&state.derivation, g);
+    state.derivation.warnings = warnings;
+    if (fst_transitions) {
+        derivation_use_fst(&state.derivation, fst_transitions);
+    }
+    word_cache_init(&state.cache, cache_size);
+    if (batch_words) {
+        text_batch_init(&state.batch, batch_words);
+    }
+    serial_run(&state, out, chunk_size);
+    word_cache_add_stats(cache_totals, &state.cache);
+    derivation_stats_add(derivation_totals, &state.derivation);
+    fail_trap_clear(&trap);
+    serial_state_free(&state);
+}
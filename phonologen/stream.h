@@ -0,0 +1,140 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "structures.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "util.h"
+
+// Returns whether a byte separates words; these are the bytes scanf's %s skips in the C locale
+static inline char is_separator(char c) {
+    switch (c) {
+        case ' ':
+        case '\t':
+        case '\n':
+        case '\v':
+        case '\f':
+        case '\r':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// A run of input text that ends just after whitespace or at the end of input, so no word is ever
+// split between two chunks
+struct input_chunk {
+    const char *text;
+    size_t length;
+    // Heap block that text points into, or NULL if text points into memory-mapped input
+    char *block;
+};
+
+// Reads a file a chunk at a time, without any limit on the length of words
+// If the file is a regular file it's memory-mapped instead, and chunks point right into it
+struct input_reader {
+    FILE *in;
+    size_t chunk_size;
+    // Memory-mapped input, or NULL if reading blocks with fread
+    char *map;
+    size_t map_length;
+    // Next byte of map to return
+    size_t position;
+    // Start of a word that was cut off at the end of the last block, to begin the next block with
+    struct byte_buffer carry;
+    char eof;
+};
+
+// Sets up a reader for a file, from wherever it currently is, that returns chunks of about
+// chunk_size bytes (more if a word is longer than that)
+void input_reader_init(struct input_reader *, FILE *, size_t);
+// Reads the next chunk of input
+// Returns 0 at the end of input, in which case the chunk is left untouched
+// Prints errors to stderr and exits on failure
+char input_reader_next(struct input_reader *, struct input_chunk *);
+// Frees a chunk once it's no longer needed
+void input_chunk_free(struct input_chunk *);
+// Unmaps the file and frees the reader's buffers
+void input_reader_free(struct input_reader *);
+
+// A word of text gathered into a text batch, and where its surface form will come from
+struct batch_occurrence {
+    // Whitespace before the word, copied as is
+    const char *space;
+    size_t space_length;
+    // Surface form IDs found in the word cache, or NULL if the word is derived in the batch
+    const fmatrix_id_t *cached;
+    long cached_length;
+    // Index of the word among those derived in the batch, if not cached
+    size_t word;
+};
+
+// Words of text gathered by derive_text_batched to be derived together, rule by rule (see
+// derive_batch); reused from one call to the next
+struct text_batch {
+    // Most distinct words derived together, and most words of text gathered before they are
+    size_t word_limit;
+    size_t occurrence_limit;
+    // IDs of every distinct word to derive, one after another, and where each starts, with
+    // word_count + 1 entries
+    fmatrix_id_t *ids;
+    size_t id_count;
+    size_t id_capacity;
+    size_t *starts;
+    size_t word_count;
+    // Text of every word to derive, and its length
+    const char **texts;
+    size_t *text_lengths;
+    // Open-addressing table of the words to derive by text, holding their indices plus one (0 for
+    // empty slots); slot_count is a power of two at least twice word_limit
+    uint32_t *slots;
+    size_t slot_count;
+    // Every word of text since the words to derive were last derived, in order
+    struct batch_occurrence *occurrences;
+    size_t occurrence_count;
+};
+
+// Derives one word of the given length, which needn't be NUL-terminated, appending its surface
+// form to the byte buffer
+// The word is looked up in the word cache before being parsed into struct word and derived
+// Prints errors to stderr and exits on failure
+void derive_spelling(
+    struct derivation *, struct word_cache *, struct word *, const char *, size_t,
+    struct byte_buffer *);
+// Derives every word in text of the given length, appending that text to the byte buffer with every
+// word replaced by its surface form; whitespace between words is copied as is, so output lines
+// match input lines
+// Prints errors to stderr and exits on failure
+void derive_text(
+    struct derivation *, struct word_cache *, struct word *, const char *, size_t,
+    struct byte_buffer *);
+// Sets up an empty text batch that derives up to word_limit distinct words together
+// Prints errors to stderr and exits on failure, leaving the batch safe to free
+void text_batch_init(struct text_batch *, size_t);
+// Derives every word in text of the given length just as derive_text does, but gathers words not
+// in the word cache into the text batch and derives them together, rule by rule, whenever the
+// batch fills up and at the end of the text
+// Prints errors to stderr and exits on failure
+void derive_text_batched(
+    struct derivation *, struct word_cache *, struct word *, struct text_batch *, const char *,
+    size_t, struct byte_buffer *);
+// Frees a text batch's buffers
+void text_batch_free(struct text_batch *);
+// Derives every word read from one file on the calling thread, writing surface forms to another
+// in input order, with the words of chunk_size bytes of input derived at a time
+// Uses a word cache of cache_size bytes, and transducers of up to fst_transitions transitions each
+// unless that's 0; words are derived in text batches of up to batch_words distinct words instead,
+// unless that's 0
+// Words still changing when a rule reaches the pass limit its line gives are reported to the last
+// FILE *, unless that's NULL
+// Adds the statistics of the word cache and derivation to the totals given
+// Prints errors to stderr and exits on failure, having freed everything it set up
+void derive_serial(
+    struct grammar *, FILE *, FILE *, size_t, size_t, uint32_t, size_t, FILE *,
+    struct word_cache *, struct derivation_stats *);
+
+#endif
@@ -2,250 +2,457 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 #include "structures.h"
+#include "grammar.h"
 #include "util.h"
 
-unsigned int g_feature_count;
-char **g_feature_names;
-struct hash_table_node *g_segment_list;
-struct hash_table_node *g_feature_lookup_table[HASH_TABLE_SIZE];
-struct hash_table_node *g_segment_lookup_table[HASH_TABLE_SIZE];
-struct hash_table_node *g_fmatrix_cache[HASH_TABLE_SIZE];
-struct rule *g_rules;
+// Smallest number of slots in a hash table, and the smallest block of an arena
+#define MIN_TABLE_CAPACITY 64
+#define MIN_ARENA_BLOCK 4096
+// Alignment of every arena allocation, enough for fword_ts, pointers and struct fmatrix_op
+#define ARENA_ALIGNMENT 8
 
-uint16_t hash_string(const char *string) {
+uint64_t hash_string(const char *string, size_t length) {
     // This must be fast, but it does need to hash the entire string for uniqueness; some segments
     // can be long but differ only in a few bits
-    // We assume strlen(string) >= 1
-    // Not an extremely good hash algorithm, but better ones are slightly slower
-    register uint32_t result = string[1];
-    register unsigned char c;
-    while ((c = *string++)) {
-        result = (result << 3) ^ c;
+    // Names are short, so eight bytes are mixed in at a time, with the final partial word padded
+    // with zeros (the length is mixed in up front, so padding can't collide with real bytes)
+    uint64_t result = hash_mix(length);
+    uint64_t word;
+    for (; length >= sizeof(word); string += sizeof(word), length -= sizeof(word)) {
+        memcpy(&word, string, sizeof(word));
+        result = hash_mix(result ^ word);
     }
-    result ^= result >> 16;
-    return result;
+    word = 0;
+    memcpy(&word, string, length);
+    return hash_mix(result ^ word);
 }
 
-uint16_t hash_fmatrix(const feature_t fmatrix[]) {
+uint64_t hash_fmatrix(const fword_t fmatrix[], unsigned int length) {
     // This must be fast, but it does need to hash the entire matrix for uniqueness; some matrices
     // can differ only in a few bits
-    // Not an extremely good hash algorithm, but better ones are slightly slower
-    register uint32_t result = fmatrix[1];
-    register feature_t c;
-    while ((c = *fmatrix++)) {
-        // Only two bits per value are relevant
-        result = ((result << 1) + result) ^ c;
-    }
-    result ^= result >> 16;
-    return result;
-}
-
-void linked_list_strkey_add(struct hash_table_node **list_ptr, const char *key, const void *value) {
-    // next_ptr is indirect so malloc can be used to set start of list and end of it
-    while (*list_ptr) {
-        struct hash_table_node *node = *list_ptr;
-        fail_if(!strcmp(node->key, key), "Error parsing .csv: duplicate string %s\n", key);
-        list_ptr = &(node->next);
-    }
-    // Make a new node and add the key and value to it
-    *list_ptr = malloc(sizeof(**list_ptr));
-    fail_if(!*list_ptr, "Error parsing .csv: unable to allocate memory\n");
-    (*list_ptr)->next = NULL;
-    (*list_ptr)->key = key;
-    (*list_ptr)->value = value;
-}
-
-void hash_table_strkey_add(struct hash_table_node *table[], const char *key, const void *value) {
-    // kh can be used as the bucket directly due to our 64k hash tables
-    uint16_t kh = hash_string(key);
-    linked_list_strkey_add(table + kh, key, value);
-}
-
-void fmatrix_cache_add(const feature_t key[], const char *value) {
-    // kh can be used as the bucket directly due to our 64k hash tables
-    uint16_t kh = hash_fmatrix(key);
-    // next_ptr is indirect so malloc can be used to set start of hash table list and end of it
-    struct hash_table_node **next_ptr = g_fmatrix_cache + kh;
-    while (*next_ptr) {
-        struct hash_table_node *node = *next_ptr;
-        fail_if(fmatrix_compare(node->key, key) == EQUAL, "Error: duplicate feature matrix");
-        next_ptr = &(node->next);
-    }
-    // Make a new node and add the key and value to it
-    *next_ptr = malloc(sizeof(**next_ptr));
-    fail_if(!*next_ptr, "Error: unable to allocate memory\n");
-    (*next_ptr)->next = NULL;
-    (*next_ptr)->key = key;
-    (*next_ptr)->value = value;
-}
-
-const void *hash_table_strkey_find(struct hash_table_node *table[], const char *key) {
-    // kh can be used as the bucket directly due to our 64k hash tables
-    uint16_t kh = hash_string(key);
-    struct hash_table_node *bucket = table[kh];
-    while (bucket) {
-        if (!strcmp(bucket->key, key)) {
-            return bucket->value;
+    // Feature charts rarely go past one or two pairs of words, so a multiply-rotate per word with
+    // one full mix at the end is cheap enough
+    register uint64_t result = length;
+    for (register unsigned int w = 0; w < length; w++) {
+        result = (result ^ fmatrix[w]) * 0x9e3779b97f4a7c15ULL;
+        result = result << 31 | result >> 33;
+    }
+    return hash_mix(result);
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    // Keep the next allocation aligned as well
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    struct arena_block *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        // Allocations bigger than a block get a block of their own
+        size_t block_size = size > MIN_ARENA_BLOCK ? size : MIN_ARENA_BLOCK;
+        block = malloc(sizeof(*block) + block_size);
+        fail_if(!block, "Error: unable to allocate memory\n");
+        block->next = arena->blocks;
+        block->used = 0;
+        block->size = block_size;
+        arena->blocks = block;
+    }
+    char *space = block->data + block->used;
+    block->used += size;
+    return space;
+}
+
+const char *arena_add_string(struct arena *arena, const char *string) {
+    size_t size = strlen(string) + 1;
+    char *copy = arena_alloc(arena, size);
+    memcpy(copy, string, size);
+    return copy;
+}
+
+void arena_free(struct arena *arena) {
+    while (arena->blocks) {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+// Puts a key known not to be in the table into the first free slot after its hash
+static inline void string_table_insert(
+        struct string_table *table, const char *key, uint64_t hash, uintptr_t value) {
+    size_t slot = hash & (table->capacity - 1);
+    while (table->slots[slot].key) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    table->slots[slot].key = key;
+    table->slots[slot].hash = hash;
+    table->slots[slot].value = value;
+}
+
+void string_table_add(struct string_table *table, const char *key, uintptr_t value) {
+    // Keep the table at most half full, so probes stay short
+    if ((table->count + 1) * 2 > table->capacity) {
+        struct string_table_slot *old_slots = table->slots;
+        size_t old_capacity = table->capacity;
+        size_t capacity = old_capacity ? old_capacity * 2 : MIN_TABLE_CAPACITY;
+        struct string_table_slot *slots = calloc(capacity, sizeof(*slots));
+        fail_if(!slots, "Error parsing .csv: unable to allocate memory\n");
+        table->slots = slots;
+        table->capacity = capacity;
+        for (size_t x = 0; x < old_capacity; x++) {
+            if (old_slots[x].key) {
+                string_table_insert(table, old_slots[x].key, old_slots[x].hash, old_slots[x].value);
+            }
+        }
+        free(old_slots);
+    }
+    uint64_t hash = hash_string(key, strlen(key));
+    for (size_t slot = hash & (table->capacity - 1); table->slots[slot].key;
+            slot = (slot + 1) & (table->capacity - 1)) {
+        fail_if(
+            table->slots[slot].hash == hash && !strcmp(table->slots[slot].key, key),
+            "Error parsing .csv: duplicate string %s\n",
+            key);
+    }
+    string_table_insert(table, key, hash, value);
+    table->count++;
+}
+
+uintptr_t string_table_find(const struct string_table *table, const char *key) {
+    uint64_t hash = hash_string(key, strlen(key));
+    // An empty table has no slots to probe
+    for (size_t slot = hash & (table->capacity - 1); table->capacity && table->slots[slot].key;
+            slot = (slot + 1) & (table->capacity - 1)) {
+        if (table->slots[slot].hash == hash && !strcmp(table->slots[slot].key, key)) {
+            return table->slots[slot].value;
         }
-        bucket = bucket->next;
     }
     // Always fail, we didn't find the string which should never happen
     fail_if(1, "Error: unknown string %s\n", key);
     // Unreachable, needed to silence compiler warnings
-    return NULL;
+    return 0;
 }
 
-const char *fmatrix_cache_find(const feature_t key[]) {
-    // kh can be used as the bucket directly due to our 64k hash tables
-    uint16_t kh = hash_fmatrix(key);
-    struct hash_table_node *bucket = g_fmatrix_cache[kh];
-    while (bucket) {
-        if (fmatrix_compare(bucket->key, key) == EQUAL) {
-            return bucket->value;
+void string_table_free(struct string_table *table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = table->count = 0;
+}
+
+void grammar_init(struct grammar *g) {
+    memset(g, 0, sizeof(*g));
+    pthread_mutex_init(&g->fmatrix_lock, NULL);
+}
+
+// Puts an ID known not to be in a table into the first free slot after its hash
+static inline void fmatrix_table_insert(
+        struct fmatrix_table *table, uint64_t hash, fmatrix_id_t id) {
+    size_t slot = hash & (table->capacity - 1);
+    while (table->slots[slot].id != FMATRIX_NONE) {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    table->slots[slot].hash = hash >> 32;
+    table->slots[slot].id = id;
+}
+
+// Appends a feature matrix to the grammar's fmatrix_chunks under a new ID, along with its name
+// The caller must hold fmatrix_lock and have made sure the matrix isn't already interned
+// Everything is allocated before anything is changed, so the grammar stays consistent on failure
+// Prints errors to stderr and exits on failure
+static fmatrix_id_t fmatrix_pool_add(struct grammar *g, const fword_t fmatrix[], const char *name) {
+    fmatrix_id_t id = g->fmatrix_count;
+    // Keep the table at most half full, so probes stay short; rehashing means hashing every
+    // matrix again, but tables only double, so that's cheap overall
+    struct fmatrix_table *table = &g->fmatrix_cache;
+    if ((table->count + 1) * 2 > table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : MIN_TABLE_CAPACITY;
+        struct fmatrix_table_slot *slots = malloc(capacity * sizeof(*slots));
+        fail_if(!slots, "Error: unable to allocate memory\n");
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+        // Every ID is FMATRIX_NONE, which is all ones
+        memset(table->slots, 0xff, table->capacity * sizeof(*table->slots));
+        for (fmatrix_id_t x = 0; x < id; x++) {
+            fmatrix_table_insert(table, hash_fmatrix(fmatrix_of(g, x), g->fmatrix_length), x);
         }
-        bucket = bucket->next;
-    }
-    return NULL;
-}
-
-enum set_relation fmatrix_compare(const feature_t a[], const feature_t b[]) {
-    // They could be equal at the start
-    char is_super = 1;
-    char is_sub = 1;
-    for (register unsigned int f = 0; f < g_feature_count; f++) {
-        // For optimal performance, verify that (on x86) this compiles to movb into the high and
-        // low byte registers (h and l) of a larger register, and then use a 514-pointer jump table
-        // Inline assembly not used for compatibility
-        register uint16_t sv = (a[f] << 8) + b[f];
-        switch (sv) {
-            //    af           bf
-            case (ZERO << 8) + ZERO:
-            case (PLUS << 8) + PLUS:
-            case (MINUS << 8) + MINUS:
-                // They're the same; no change
-                break;
-            case (ZERO << 8) + PLUS:
-            case (ZERO << 8) + MINUS:
-                // a could no longer be a subset of b
-                is_sub = 0;
-                if (!is_super) {
-                    return NONE;
-                }
-                break;
-            case (PLUS << 8) + ZERO:
-            case (MINUS << 8) + ZERO:
-                is_super = 0;
-                if (!is_sub) {
-                    return NONE;
-                }
-                break;
-            case (PLUS << 8) + MINUS:
-            case (MINUS << 8) + PLUS:
-                return NONE;
+    }
+    const char *spelling = name;
+    if (!spelling) {
+        char *string = fmatrix_to_string(g, fmatrix, 1);
+        spelling = arena_add_string(&g->arena, string);
+        free(string);
+    }
+    struct fmatrix_chunk *chunk = g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS];
+    unsigned int index = id & (FMATRIX_CHUNK_SIZE - 1);
+    if (!index) {
+        fail_if(id >> FMATRIX_CHUNK_BITS >= FMATRIX_MAX_CHUNKS, "Error: too many feature matrices\n");
+        chunk = malloc(sizeof(*chunk));
+        if (chunk) {
+            chunk->matrices =
+                malloc(FMATRIX_CHUNK_SIZE * g->fmatrix_length * sizeof(*chunk->matrices));
+            if (!chunk->matrices) {
+                free(chunk);
+                chunk = NULL;
+            }
         }
+        fail_if(!chunk, "Error: unable to allocate memory\n");
+        g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS] = chunk;
+    }
+    memcpy(
+        chunk->matrices + (size_t) index * g->fmatrix_length,
+        fmatrix,
+        g->fmatrix_length * sizeof(*fmatrix));
+    chunk->names[index] = name;
+    chunk->spellings[index] = spelling;
+    chunk->spelling_lengths[index] = strlen(spelling);
+    // There are no duplicates to look for
+    fmatrix_table_insert(table, hash_fmatrix(fmatrix, g->fmatrix_length), id);
+    table->count++;
+    // Only counted once everything about it is in place
+    g->fmatrix_count++;
+    return id;
+}
+
+// Calls fmatrix_pool_add, releasing fmatrix_lock before any failure goes past it
+static fmatrix_id_t fmatrix_pool_add_locked(
+        struct grammar *g, const fword_t fmatrix[], const char *name) {
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        pthread_mutex_unlock(&g->fmatrix_lock);
+        fail_rethrow(&trap);
+    }
+    fmatrix_id_t id = fmatrix_pool_add(g, fmatrix, name);
+    fail_trap_clear(&trap);
+    return id;
+}
+
+fmatrix_id_t fmatrix_cache_add(struct grammar *g, const fword_t key[], const char *value) {
+    pthread_mutex_lock(&g->fmatrix_lock);
+    char duplicate = fmatrix_cache_find(g, key) != FMATRIX_NONE;
+    fmatrix_id_t id = duplicate ? FMATRIX_NONE : fmatrix_pool_add_locked(g, key, value);
+    pthread_mutex_unlock(&g->fmatrix_lock);
+    fail_if(duplicate, "Error: duplicate feature matrix");
+    return id;
+}
+
+fmatrix_id_t fmatrix_intern(struct grammar *g, const fword_t key[]) {
+    pthread_mutex_lock(&g->fmatrix_lock);
+    fmatrix_id_t id = fmatrix_cache_find(g, key);
+    if (id == FMATRIX_NONE) {
+        // Any chart segment with this matrix would have been found already
+        id = fmatrix_pool_add_locked(g, key, NULL);
+    }
+    pthread_mutex_unlock(&g->fmatrix_lock);
+    return id;
+}
+
+fmatrix_id_t fmatrix_cache_find(const struct grammar *g, const fword_t key[]) {
+    const struct fmatrix_table *table = &g->fmatrix_cache;
+    if (!table->capacity) {
+        return FMATRIX_NONE;
+    }
+    uint64_t hash = hash_fmatrix(key, g->fmatrix_length);
+    for (size_t slot = hash & (table->capacity - 1); table->slots[slot].id != FMATRIX_NONE;
+            slot = (slot + 1) & (table->capacity - 1)) {
+        // Interned matrices are canonical, so equal matrices are bitwise equal
+        fmatrix_id_t id = table->slots[slot].id;
+        if (table->slots[slot].hash == (uint32_t) (hash >> 32)
+                && !memcmp(fmatrix_of(g, id), key, g->fmatrix_length * sizeof(*key))) {
+            return id;
+        }
+    }
+    return FMATRIX_NONE;
+}
+
+// Returns a new trie node with no transitions, growing the trie's tables if needed
+static inline uint32_t segment_trie_add_node(struct segment_trie *t) {
+    if (t->node_count == t->node_capacity) {
+        t->node_capacity = t->node_capacity ? t->node_capacity * 2 : 64;
+        uint32_t *transitions = realloc(
+            t->transitions, t->node_capacity * t->class_count * sizeof(*t->transitions));
+        fail_if(!transitions, "Error parsing .csv: unable to allocate memory\n");
+        t->transitions = transitions;
+        fmatrix_id_t *values = realloc(t->values, t->node_capacity * sizeof(*t->values));
+        fail_if(!values, "Error parsing .csv: unable to allocate memory\n");
+        t->values = values;
+    }
+    memset(
+        t->transitions + t->node_count * t->class_count,
+        0,
+        t->class_count * sizeof(*t->transitions));
+    t->values[t->node_count] = FMATRIX_NONE;
+    return t->node_count++;
+}
+
+void segment_trie_build(struct grammar *g) {
+    struct segment_trie *t = &g->segment_trie;
+    // Pass 1: number every byte that occurs in a segment name
+    t->class_count = 1;
+    const struct string_table *segments = &g->segment_lookup_table;
+    for (size_t x = 0; x < segments->capacity; x++) {
+        if (!segments->slots[x].key) {
+            continue;
+        }
+        for (const unsigned char *c = (const unsigned char *) segments->slots[x].key; *c; c++) {
+            if (!t->byte_class[*c]) {
+                t->byte_class[*c] = t->class_count++;
+            }
+        }
+    }
+    // Pass 2: insert every name, starting from the root
+    segment_trie_add_node(t);
+    for (size_t x = 0; x < segments->capacity; x++) {
+        const unsigned char *c = (const unsigned char *) segments->slots[x].key;
+        // Empty segment names can never match anything, as before
+        if (!c || !*c) {
+            continue;
+        }
+        uint32_t node = 0;
+        for (; *c; c++) {
+            uint32_t next = segment_trie_next(t, node, *c);
+            if (!next) {
+                // Must not index t->transitions across this call; it may be reallocated
+                next = segment_trie_add_node(t);
+                t->transitions[node * t->class_count + t->byte_class[*c]] = next;
+            }
+            node = next;
+        }
+        // Duplicate names were already rejected when segment_lookup_table was built
+        t->values[node] = segments->slots[x].value;
+    }
+}
+
+enum set_relation fmatrix_compare(const fword_t a[], const fword_t b[], unsigned int length) {
+    // Bits for features a doesn't specify but b does, and the opposite
+    register fword_t not_sub = 0;
+    register fword_t not_super = 0;
+    for (register unsigned int w = 0; w < length; w += 2) {
+        // Both specify a feature, but with different values
+        if (a[w] & b[w] & (a[w + 1] ^ b[w + 1])) {
+            return NONE;
+        }
+        // a could no longer be a subset of b
+        not_sub |= b[w] & ~a[w];
+        // a could no longer be a superset of b
+        not_super |= a[w] & ~b[w];
     }
     const enum set_relation outcomes[] = {NONE, SUBSET, SUPERSET, EQUAL};
-    return outcomes[is_super * 2 + is_sub];
+    return outcomes[!not_super * 2 + !not_sub];
 }
 
-void fmatrix_print(const feature_t fmatrix[], char include_names) {
-    fputs("[ ", stdout);
+unsigned int fmatrix_compile(const fword_t fmatrix[], unsigned int length, struct fmatrix_op *ops) {
+    unsigned int count = 0;
+    for (unsigned int w = 0; w < length; w += 2) {
+        if (fmatrix[w]) {
+            ops[count].word = w;
+            ops[count].specified = fmatrix[w];
+            ops[count].value = fmatrix[w + 1];
+            count++;
+        }
+    }
+    return count;
+}
+
+char *fmatrix_to_string(const struct grammar *g, const fword_t fmatrix[], char include_names) {
+    // "[ ", then value, name and ' ' for every feature, then "]"
+    size_t length = 3;
+    for (register unsigned int f = 0; f < g->feature_count; f++) {
+        length += 2 + (include_names ? strlen(g->feature_names[f]) : 0);
+    }
+    char *string = malloc(length + 1);
+    fail_if(!string, "Error: unable to allocate memory\n");
+    char *end = string;
+    *end++ = '[';
+    *end++ = ' ';
     const char mappings[] = {'0', '+', '-'};
-    for (register unsigned int f = 0; f < g_feature_count; f++) {
-        putchar(mappings[fmatrix[f]]);
+    for (register unsigned int f = 0; f < g->feature_count; f++) {
+        *end++ = mappings[(int) fmatrix_get(fmatrix, f)];
         if (include_names) {
-            fputs(g_feature_names[f], stdout);
+            strcpy(end, g->feature_names[f]);
+            end += strlen(end);
         }
-        putchar(' ');
+        *end++ = ' ';
     }
-    putchar(']');
+    *end++ = ']';
+    *end = 0;
+    return string;
+}
+
+void fmatrix_print(const struct grammar *g, const fword_t fmatrix[], char include_names) {
+    char *string = fmatrix_to_string(g, fmatrix, include_names);
+    fputs(string, stdout);
+    free(string);
 }
 
 // If a feature matrix is found in the cache, print the symbol for it,
 // otherwise print the feature matrix
 // This allows printing phonological rules much more easily
-static inline void segment_print(const feature_t fmatrix[]) {
-    const char *fname = fmatrix_cache_find(fmatrix);
+static inline void segment_print(const struct grammar *g, const fword_t fmatrix[]) {
+    fmatrix_id_t id = fmatrix_cache_find(g, fmatrix);
+    const char *fname = id == FMATRIX_NONE ? NULL : fmatrix_name(g, id);
     if (fname) {
         fputs(fname, stdout);
     } else {
-        fmatrix_print(fmatrix, 1);
+        fmatrix_print(g, fmatrix, 1);
     }
 }
 
-void rule_print(struct rule *rule) {
-    if (!rule) {
-        puts("END");
-        return;
-    }
-    const feature_t *focus = rule->context[rule->focus_position];
-    segment_print(focus);
-    fputs(" > ", stdout);
-    segment_print(rule->output);
-    fputs(" /", stdout);
-    for (short x = 0; x < rule->context_length; x++) {
-        putchar(' ');
-        if (x == rule->focus_position) {
-            putchar('_');
+void rule_print(const struct grammar *g, unsigned int first) {
+    const struct rule_set *r = &g->rules;
+    for (unsigned int rule = first; rule < r->count; rule++) {
+        const fword_t *context = r->matrices + (size_t) r->matrix_starts[rule] * g->fmatrix_length;
+        uint32_t length = r->context_lengths[rule];
+        uint32_t focus_position = r->focus_positions[rule];
+        char kind = r->kinds[rule];
+        if (kind == 'I') {
+            fputs("\xe2\x88\x85", stdout);
         } else {
-            segment_print(rule->context[x]);
+            segment_print(g, context + (size_t) focus_position * g->fmatrix_length);
         }
-    }
-    putchar('\n');
-    rule_print(rule->next);
-}
-
-// Frees the nodes in one single linked list (though doesn't free the list itself; this is static)
-// If free_keys, keys will be freed as well
-static inline void free_linked_list(struct hash_table_node *list, char free_keys) {
-    while (list) {
-        struct hash_table_node *next = list->next;
-        if (free_keys) {
-            // Discard the const qualifier, we're freeing this
-            free((void *) (list->key));
+        fputs(" > ", stdout);
+        if (kind == 'D') {
+            fputs("\xe2\x88\x85", stdout);
+        } else {
+            segment_print(g, context + (size_t) length * g->fmatrix_length);
         }
-        free(list);
-        list = next;
+        fputs(" /", stdout);
+        // The focus of a rule that inserts segments comes before the position it's numbered with
+        for (uint32_t x = 0; x <= length; x++) {
+            if (x == focus_position) {
+                fputs(" _", stdout);
+                if (kind != 'I') {
+                    continue;
+                }
+            }
+            if (x < length) {
+                putchar(' ');
+                segment_print(g, context + (size_t) x * g->fmatrix_length);
+            }
+        }
+        putchar('\n');
     }
+    puts("END");
 }
 
-// Frees the nodes in one single hash table (though doesn't free the table itself; these are static)
-// If free_keys, keys will be freed as well
-static inline void free_hash_table(struct hash_table_node *table[], char free_keys) {
-    uint16_t index = 0;
-    do {
-        free_linked_list(table[index], free_keys);
-    } while (--index);
-}
-
-// Frees everything included in the rule
-static inline void free_rule(struct rule *rule) {
-    while (rule) {
-        struct rule *next = rule->next;
-        free(rule->output);
-        for (short x = 0; x < rule->context_length; x++) {
-            free(rule->context[x]);
-        }
-        // No free rule->context, it's an array
-        free(rule);
-        rule = next;
-    }
-}
-
-void free_global_structures() {
-    // The freeing of its contents is below
-    free_hash_table(g_feature_lookup_table, 0);
-    if (g_feature_names) {
-        for (unsigned int x = 0; x < g_feature_count; free(g_feature_names[x++]));
-        free(g_feature_names);
-    }
-    free_hash_table(g_segment_lookup_table, 0);
-    // This table is where the keys of the above table (its inverse) are freed
-    free_hash_table(g_fmatrix_cache, 1);
-    // Note that all the values (feature matrices) have already been freed! Do not touch these
-    // The segment names are all freed here
-    free_linked_list(g_segment_list, 1);
-    free_rule(g_rules);
+void grammar_free(struct grammar *g) {
+    string_table_free(&g->feature_lookup_table);
+    string_table_free(&g->segment_lookup_table);
+    free(g->fmatrix_cache.slots);
+    // Chunks are allocated in order, and a chunk can be allocated before any ID in it is counted
+    for (unsigned int x = 0; x < FMATRIX_MAX_CHUNKS && g->fmatrix_chunks[x]; x++) {
+        free(g->fmatrix_chunks[x]->matrices);
+        free(g->fmatrix_chunks[x]);
+    }
+    if (!g->segment_trie.borrowed) {
+        free(g->segment_trie.transitions);
+        free(g->segment_trie.values);
+    }
+    // Every name, spelling and rule is freed here, and anything left points into the file
+    arena_free(&g->arena);
+    grammar_unload(g);
+    pthread_mutex_destroy(&g->fmatrix_lock);
+    memset(g, 0, sizeof(*g));
 }
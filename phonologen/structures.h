@@ -1,125 +1,374 @@
 #ifndef STRUCTURES_H
 #define STRUCTURES_H
 
+#include <stddef.h>
 #include <stdint.h>
-
-// This is needed because hash functions output uint16_t
-#define HASH_TABLE_SIZE (UINT16_MAX + 1)
-// This will make our struct rule 128 bytes long including padding
-#define MAX_CONTEXT_LENGTH 13
+#include <pthread.h>
 
 // This is unfortunately required for one-byte enums
+// Used for single feature values; whole feature matrices are bit-packed (see fword_t)
 typedef char feature_t;
 // Feature 0 is 0 for faster comparisons
 // The redefinition is required so the lower two bits are the only significant ones
 enum feature {
     ZERO, PLUS, MINUS
 };
-// Note that feature_t [] (feature matrices) must be a zero-padded to 16-byte alignment normally
+
+// Feature matrices are arrays of fmatrix_length fword_ts (see struct grammar), bit-packed so that every 64 features
+// take up one pair of words: a "specified" bitmask (set for PLUS or MINUS) followed by a "value"
+// bitmask (set for PLUS)
+// Value bits of unspecified features are always clear, so equal matrices are bitwise equal
+// Bits past the grammar's feature_count are always clear as well
+typedef uint64_t fword_t;
+#define FWORD_BITS 64
+
+// Every distinct feature matrix that can appear in a word (those of segments in the chart, and
+// those that rules derive from them) is interned to a dense ID, so words are arrays of IDs
+typedef uint32_t fmatrix_id_t;
+// No feature matrix; used for "unknown" in tables indexed by ID
+#define FMATRIX_NONE UINT32_MAX
+// Interned feature matrices are stored FMATRIX_CHUNK_SIZE at a time, in up to FMATRIX_MAX_CHUNKS
+// chunks
+#define FMATRIX_CHUNK_BITS 12
+#define FMATRIX_CHUNK_SIZE (1 << FMATRIX_CHUNK_BITS)
+#define FMATRIX_MAX_CHUNKS 4096
 
 enum set_relation {
     NONE, EQUAL, SUPERSET, SUBSET
 };
 
-// Node of a hash-table-internal linked list
-// Also used by g_segment_list
-// Note that key and value are not usually owned by the hash tables; they must usually be allocated
-// and freed separately
-// Also, key and value are unfortunately represented as void *
-struct hash_table_node {
-    struct hash_table_node *next;
-    const void *key;
-    const void *value;
+// Block of an arena, holding allocations back to back in data
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+// Owner of many small allocations (names, and everything rules are made of), carved out of large
+// blocks so they cost no allocation each and are all freed at once
+// Allocations never move, and are aligned for any of the types stored in them
+// Zero-initialize before first use
+struct arena {
+    struct arena_block *blocks;
+};
+// Slot of a string_table; key is NULL for empty slots
+struct string_table_slot {
+    const char *key;
+    uint64_t hash;
+    uintptr_t value;
+};
+// Open-addressing hash table with linear probing, mapping strings to integers
+// capacity is a power of two, doubled whenever the table would get more than half full, so tables
+// stay sized to their contents; every slot keeps its key's full hash, so probes rarely compare
+// strings that don't match
+// Keys are not owned by the table; they must be allocated and freed separately
+// Zero-initialize before first use
+struct string_table {
+    struct string_table_slot *slots;
+    size_t capacity;
+    size_t count;
+};
+// Slot of an fmatrix_table: an interned ID (FMATRIX_NONE for empty slots) and the upper bits of
+// the hash of its matrix
+struct fmatrix_table_slot {
+    uint32_t hash;
+    fmatrix_id_t id;
+};
+// Open-addressing hash table with linear probing, holding interned feature matrix IDs by matrix
+// Grows the same way as string_table; the matrices themselves live in the grammar's fmatrix_chunks
+// Zero-initialize before first use
+struct fmatrix_table {
+    struct fmatrix_table_slot *slots;
+    size_t capacity;
+    size_t count;
+};
+// One instruction of a compiled feature matrix: a pair of fword_ts (at index word and word + 1)
+// in which the matrix specifies at least one feature, with its specified and value bits
+// Matrices compile to one op per such pair, so unspecified features cost nothing to test or set
+struct fmatrix_op {
+    unsigned int word;
+    fword_t specified;
+    fword_t value;
+};
+// Pass limit of a rule written to be applied until the word stops changing (L* or R*) when its line
+// doesn't give one; such a rule stops after at most as many passes as the word is long anyway
+#define RULE_DEFAULT_PASS_LIMIT UINT32_MAX
+
+// Every phonological rule of a grammar, in the order they're applied, stored flat: parallel arrays
+// indexed by rule, so the fields every rule checks are read in order down the cascade rather than
+// chased through pointers, with the variable-length parts of every rule in pools shared by all of
+// them
+// Rule x's context is written C _A_ D rather than A > B / C _ D: matrix_starts[x] is where its
+// context_lengths[x] context matrices (the focus among them) start in the matrix pool, followed by
+// its output (whose specified values get set in the focus)
+// Everything belongs to one block of the grammar's arena, or to the compiled grammar file it was
+// loaded from, and is never changed once parsed
+struct rule_set {
+    unsigned int count;
+    // Number of positions in each rule's context, including the focus (but for rules that insert
+    // segments, whose focus is between two positions, or at either end)
+    const uint32_t *context_lengths;
+    // Which position of each rule's context is the focus, or for rules that insert segments, how
+    // many positions come before it
+    const uint32_t *focus_positions;
+    // Either L for left-to-right, or R for right-to-left, for each rule
+    const char *directions;
+    // What each rule does at its focus: C to change the segment there by the rule's output, I to
+    // insert the output as a segment of its own, or D to delete the segment there
+    const char *kinds;
+    // For each rule, 0 if it's applied in a single pass, or else the most passes it may make over a
+    // word, applying itself again until the word stops changing
+    const uint32_t *pass_limits;
+    // Every feature value each rule's context needs, as a feature summary (see fmatrix_summarize),
+    // fmatrix_length fword_ts per rule; a rule can't apply to a word whose summary lacks any of
+    // these
+    const fword_t *requirements;
+    // Where each rule's matrices start in matrices, with one more entry for where they all end, so
+    // rule x's run up to matrix_starts[x + 1]
+    const uint32_t *matrix_starts;
+    // Every context and output matrix of every rule, fmatrix_length fword_ts apart (the output of a
+    // rule that deletes segments is empty)
+    const fword_t *matrices;
+    uint32_t matrix_count;
+    // Every matrix compiled (see fmatrix_compile), in the same order: ops of matrix y run from
+    // op_starts[y] up to op_starts[y + 1]
+    const uint32_t *op_starts;
+    const struct fmatrix_op *ops;
+    uint32_t op_count;
+    // Line of the rules .txt file each rule is on, for reporting
+    const uint32_t *line_numbers;
+};
+// FMATRIX_CHUNK_SIZE consecutively numbered interned feature matrices
+struct fmatrix_chunk {
+    // FMATRIX_CHUNK_SIZE matrices, fmatrix_length fword_ts apart
+    fword_t *matrices;
+    // Segment name for every matrix, or NULL if no segment in the chart has exactly that matrix
+    // Does not own the segment names
+    const char *names[FMATRIX_CHUNK_SIZE];
+    // How every matrix is written in output: its segment name, or else its feature matrix in
+    // [ ... ] notation (which is in the grammar's arena)
+    const char *spellings[FMATRIX_CHUNK_SIZE];
+    unsigned int spelling_lengths[FMATRIX_CHUNK_SIZE];
+};
+// Segments of one word being derived, as feature matrix IDs
+// The buffer is reused from word to word rather than freed, and only ever grows (to fit the longest
+// word seen so far), so deriving a word allocates nothing once it's big enough
+// Zero-initialize before first use
+struct word {
+    fmatrix_id_t *ids;
+    long length;
+    size_t capacity;
 };
-// Phonological rule, with pointer to the next rule that should be applied
-struct rule {
-    // An array of feature matrices for surrounding context for the input, including the input itself
-    feature_t *context[MAX_CONTEXT_LENGTH];
-    // What gets changed about input (here, any nonzero values are set in the focus)
-    feature_t *output;
-    struct rule *next;
-    short context_length;
-    // Which position of the context the input is (so rather than A > B / C _ D, > B / C _A_ D in
-    // representation)
-    short focus_position;
-    // Either L for left-to-right, or R for right-to-left
-    char direction;
+// Byte trie over every segment name, used for greedy longest-match segmentation of words
+// Transitions are a dense table with one row per node and one column per byte class, where byte
+// classes number only the bytes that occur in some segment name so rows stay short
+// Node 0 is the root, which is never a transition target, so 0 also means "no transition"
+struct segment_trie {
+    // Byte class of every byte value, 0 for bytes that occur in no segment name
+    unsigned char byte_class[256];
+    // Number of columns in each row, including the unused column for class 0
+    unsigned int class_count;
+    unsigned int node_count;
+    unsigned int node_capacity;
+    uint32_t *transitions;
+    // Feature matrix ID of the segment whose name ends at each node, or FMATRIX_NONE
+    fmatrix_id_t *values;
+    // Nonzero if transitions and values are borrowed from a loaded compiled grammar, rather than
+    // heap blocks owned by the trie
+    char borrowed;
 };
 
-// All global data structures zero- and NULL-initialized by default
-// All hash tables are arrays HASH_TABLE_SIZE big of pointers to heads of linked lists
-// Note that hash tables need no initialization
-extern unsigned int g_feature_count;
-// Array of char *s, each pointing to one heap-allocated feature name
-// Owns all the feature names
-extern char **g_feature_names;
-// We unfortunately can't use a decision tree to store nodes in a way that would make it easy to
-// see related feature matrices, so instead we'll use a linked list of segment names and their
-// feature matrices and check them all by going through it
-// Owns all the segment names, though it does not own all the feature matrices
-extern struct hash_table_node *g_segment_list;
-// All hash table keys and values are reinterpreted as void * for the table
-// Hash table mapping feature names back to indices in the g_feature_names list
-// Keys: char *; Values: size_t
-// Does not own anything
-extern struct hash_table_node *g_feature_lookup_table[HASH_TABLE_SIZE];
-// Hash table mapping segments to feature matrices
-// Keys: char *; Values: feature_t []
-// Does not own anything
-extern struct hash_table_node *g_segment_lookup_table[HASH_TABLE_SIZE];
-// Hash table mapping feature matrices to segments
-// Keys: feature_t [], Values: char *
-// Inverse of the above table
-// Acts as a cache to store every feature matrix that gets searched for (only when converting
-// from feature matrices to segments in the output text)
-// Note that any feature matrix that is a subset of a segment we have will be displayed as that
-// segment (for example, specifying one of a basic phone like [p]'s 0 features)
-// This add-only cache is fine since probably no more than several hundred symbols need printing
-// Owns all of the feature matrices, though it does not own all the segments
-extern struct hash_table_node *g_fmatrix_cache[HASH_TABLE_SIZE];
-// Linked list of all phonological rules to be applied, in order
-// Owns all of the data structures within it
-extern struct rule *g_rules;
+// Everything parsed from a features .csv and rules .txt file (or loaded from a compiled grammar),
+// which derivations only ever read from, apart from interning new feature matrices
+// Any number of grammars can exist at once; nothing refers to one but what's given it explicitly
+// Set up with grammar_init before parsing into it
+struct grammar {
+    unsigned int feature_count;
+    // Number of fword_ts in every feature matrix (two per 64 features, rounded up)
+    unsigned int fmatrix_length;
+    // Every feature name, segment name and spelling, and every rule
+    // Owns all of them
+    struct arena arena;
+    // Array of const char *s, each pointing to one feature name in the arena
+    const char **feature_names;
+    // Trie built from segment_lookup_table once the features .csv has been parsed, for segmenting
+    // words
+    struct segment_trie segment_trie;
+    // Hash table mapping feature names back to indices in the feature_names list
+    // Does not own anything
+    struct string_table feature_lookup_table;
+    // Hash table mapping segment names to feature matrix IDs, in no particular order
+    // Does not own anything
+    struct string_table segment_lookup_table;
+    // Hash table of interned feature matrices
+    // This add-only cache is fine since words only ever contain chart segments and what rules
+    // derive from them, which is probably no more than several hundred matrices
+    // Only touched while holding fmatrix_lock, so threads may intern matrices concurrently
+    struct fmatrix_table fmatrix_cache;
+    // Every interned feature matrix, in chunks indexed by the upper bits of its ID
+    // Chunks never move once allocated, so threads can look up IDs while others intern new
+    // matrices
+    // Chart segments are interned first, in the order of the .csv file
+    // Owns all of the chunks
+    struct fmatrix_chunk *fmatrix_chunks[FMATRIX_MAX_CHUNKS];
+    fmatrix_id_t fmatrix_count;
+    // Held while interning, which is the only time fmatrix_cache, fmatrix_chunks and the arena
+    // change after parsing
+    pthread_mutex_t fmatrix_lock;
+    // Every phonological rule to be applied, in order
+    struct rule_set rules;
+    // Compiled grammar file this was loaded from, if any, which rules and the segmentation trie
+    // point into; either memory-mapped or a heap block
+    char *file;
+    size_t file_size;
+    char file_mapped;
+};
 
-// Function for hashing strings, prioritizing speed
-// Assumes string is not empty or NULL
-uint16_t hash_string(const char *);
-// Function for hashing feature matrices, keeping in mind that they're strings of 0, 1, and 2
-// Does not bounds-check feature matrix, array must be g_feature_count long
-uint16_t hash_fmatrix(const feature_t []);
-// Adds key-value pair to linked list, where key is a string
-// Causes error on duplicates (there should be none for everything that uses this function)
-// This is called within a hash table, but also on its own
-// The reason the first parameter is indirect is so it can modify variables in-place
-void linked_list_strkey_add(struct hash_table_node **, const char *, const void *);
+// Mixes the bits of a 64-bit value, so that every input bit affects every output bit
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+// Function for hashing strings of the given length, prioritizing speed
+uint64_t hash_string(const char *, size_t);
+// Function for hashing feature matrices of the given length in fword_ts
+uint64_t hash_fmatrix(const fword_t [], unsigned int);
+// Returns room for the given number of bytes in the arena
+// Prints errors to stderr and exits on failure
+void *arena_alloc(struct arena *, size_t);
+// Copies a string into the arena, returning the copy
+// Prints errors to stderr and exits on failure
+const char *arena_add_string(struct arena *, const char *);
+// Frees everything in the arena, leaving it empty
+void arena_free(struct arena *);
 // Adds key-value pair to hash table, where key is a string
 // Causes error on duplicates (there should be none for both of the applicable hash tables)
-void hash_table_strkey_add(struct hash_table_node *[], const char *, const void *);
-// Adds key-value pair to g_fmatrix_cache
-// Causes error on duplicates (there should be none)
-void fmatrix_cache_add(const feature_t [], const char *);
-// Finds hash table the value pointed to by key
+void string_table_add(struct string_table *, const char *, uintptr_t);
+// Finds in hash table the value of a string key
 // Causes error on value not found (nonexistent features)
-const void *hash_table_strkey_find(struct hash_table_node *[], const char *);
-// Finds in g_fmatrix_cache the char * mapped to a feature matrix
-// Returns NULL if matrix isn't found
-const char *fmatrix_cache_find(const feature_t []);
+uintptr_t string_table_find(const struct string_table *, const char *);
+// Frees the slots of a hash table (though not its keys), leaving it empty
+void string_table_free(struct string_table *);
 
-// Returns how first feature matrix relates to second feature matrix
-// Does not bounds-check feature matrices; note that their size must be g_feature_count
-enum set_relation fmatrix_compare(const feature_t [], const feature_t []);
+// Sets up an empty grammar, ready to be parsed or loaded into
+void grammar_init(struct grammar *);
+// Frees everything a grammar owns, however far parsing or loading got
+void grammar_free(struct grammar *);
+// Interns a feature matrix from the chart under a segment name, returning its new ID
+// Causes error on duplicates (there should be none)
+fmatrix_id_t fmatrix_cache_add(struct grammar *, const fword_t [], const char *);
+// Finds in the grammar's fmatrix_cache the ID of a feature matrix
+// Returns FMATRIX_NONE if matrix isn't found
+fmatrix_id_t fmatrix_cache_find(const struct grammar *, const fword_t []);
+// Returns the ID of a feature matrix, interning a copy of it first if it hasn't been seen yet
+// Matrices interned this way are nameless unless they equal a chart segment, which would already
+// have been interned
+// Safe to call from several threads at once
+fmatrix_id_t fmatrix_intern(struct grammar *, const fword_t []);
+// Returns the interned feature matrix for an ID
+static inline const fword_t *fmatrix_of(const struct grammar *g, fmatrix_id_t id) {
+    return g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS]->matrices
+        + (size_t) (id & (FMATRIX_CHUNK_SIZE - 1)) * g->fmatrix_length;
+}
+// Returns the segment name for an ID, or NULL if its matrix isn't a segment in the chart
+static inline const char *fmatrix_name(const struct grammar *g, fmatrix_id_t id) {
+    return g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS]->names[id & (FMATRIX_CHUNK_SIZE - 1)];
+}
+// Returns how an ID is written in output, writing the length of that to the last parameter
+static inline const char *fmatrix_spelling(
+        const struct grammar *g, fmatrix_id_t id, unsigned int *length) {
+    const struct fmatrix_chunk *chunk = g->fmatrix_chunks[id >> FMATRIX_CHUNK_BITS];
+    *length = chunk->spelling_lengths[id & (FMATRIX_CHUNK_SIZE - 1)];
+    return chunk->spellings[id & (FMATRIX_CHUNK_SIZE - 1)];
+}
+
+// Returns the value of one feature in a feature matrix
+static inline feature_t fmatrix_get(const fword_t fmatrix[], unsigned int f) {
+    fword_t bit = (fword_t) 1 << (f % FWORD_BITS);
+    const fword_t *pair = fmatrix + f / FWORD_BITS * 2;
+    return (pair[0] & bit) ? ((pair[1] & bit) ? PLUS : MINUS) : ZERO;
+}
+// Sets one feature in a feature matrix to value
+static inline void fmatrix_set(fword_t fmatrix[], unsigned int f, feature_t value) {
+    fword_t bit = (fword_t) 1 << (f % FWORD_BITS);
+    fword_t *pair = fmatrix + f / FWORD_BITS * 2;
+    pair[0] = value == ZERO ? pair[0] & ~bit : pair[0] | bit;
+    pair[1] = value == PLUS ? pair[1] | bit : pair[1] & ~bit;
+}
+// Compiles a feature matrix of the given length in fword_ts into ops, written to the array given,
+// which needs room for half that many of them
+// Returns the number of ops written
+unsigned int fmatrix_compile(const fword_t [], unsigned int, struct fmatrix_op *);
+// Adds every feature value in a feature matrix of the given length to a feature summary, which is
+// just as long, but with a pair of words per 64 features that are the features seen as MINUS
+// followed by those seen as PLUS
+// Summaries of several matrices are built by starting from all zeros and adding each of them
+static inline void fmatrix_summarize(
+        const fword_t fmatrix[], unsigned int length, fword_t summary[]) {
+    for (unsigned int w = 0; w < length; w += 2) {
+        summary[w] |= fmatrix[w] & ~fmatrix[w + 1];
+        summary[w + 1] |= fmatrix[w + 1];
+    }
+}
+// Returns whether the first feature summary has every feature value in the second, both of the
+// given length
+static inline char summary_covers(
+        const fword_t summary[], const fword_t required[], unsigned int length) {
+    fword_t missing = 0;
+    for (unsigned int w = 0; w < length; w++) {
+        missing |= required[w] & ~summary[w];
+    }
+    return !missing;
+}
+// Returns whether a feature matrix specifies every feature a compiled one does, with the same
+// values; this is fmatrix_compare returning EQUAL or SUPERSET for the compiled matrix first
+static inline char fmatrix_ops_match(
+        const struct fmatrix_op *ops, unsigned int count, const fword_t fmatrix[]) {
+    for (unsigned int x = 0; x < count; x++) {
+        const fword_t *pair = fmatrix + ops[x].word;
+        if ((pair[0] & ops[x].specified) != ops[x].specified
+                || (pair[1] & ops[x].specified) != ops[x].value) {
+            return 0;
+        }
+    }
+    return 1;
+}
+// Sets every feature a compiled feature matrix specifies in another feature matrix
+static inline void fmatrix_ops_apply(
+        const struct fmatrix_op *ops, unsigned int count, fword_t fmatrix[]) {
+    for (unsigned int x = 0; x < count; x++) {
+        fword_t *pair = fmatrix + ops[x].word;
+        pair[0] |= ops[x].specified;
+        pair[1] = (pair[1] & ~ops[x].specified) | ops[x].value;
+    }
+}
+// Builds the grammar's segment_trie from every segment in its segment_lookup_table
+// Prints errors to stderr and exits on failure
+void segment_trie_build(struct grammar *);
+// Returns the trie node reached from node by byte c, or 0 if there is none
+static inline uint32_t segment_trie_next(
+        const struct segment_trie *t, uint32_t node, unsigned char c) {
+    return t->transitions[node * t->class_count + t->byte_class[c]];
+}
+
+// Returns how first feature matrix relates to second feature matrix, both of the given length
+enum set_relation fmatrix_compare(const fword_t [], const fword_t [], unsigned int);
 
+// Returns a feature matrix of the grammar in [valuename valuename ...] format as a heap-allocated
+// string
+// name will be omitted if include_names is false
+// Prints errors to stderr and exits on failure
+char *fmatrix_to_string(const struct grammar *, const fword_t [], char);
 // FOR DEBUGGING PURPOSES(?)
-// Prints a feature matrix in [valuename valuename ...] format to stdout
+// Prints a feature matrix of the grammar in [valuename valuename ...] format to stdout
 // name will be omitted if include_names is false
-// Does not bounds-check feature matrices; note that their size must be g_feature_count
-void fmatrix_print(const feature_t [], char);
-// Prints a rule to stdout followed by a newline
-// Recursively prints any rules attached to it afterwards, also followed by newlines
-// If rule is none, prints "END\n"
-void rule_print(struct rule *);
-
-// Frees all global data structures' allocated data before exit
-void free_global_structures(void);
+void fmatrix_print(const struct grammar *, const fword_t [], char);
+// Prints every rule of the grammar from the one at the given index on to stdout, each followed by a
+// newline, then prints "END\n"
+void rule_print(const struct grammar *, unsigned int);
 
 #endif
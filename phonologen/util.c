@@ -1,15 +1,84 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 #include "util.h"
 
+// Innermost fail_trap set on each thread, if any
+static pthread_key_t fail_trap_key;
+static pthread_once_t fail_trap_key_once = PTHREAD_ONCE_INIT;
+
+static void fail_trap_key_create(void) {
+    pthread_key_create(&fail_trap_key, NULL);
+}
+
 inline void fail_if(char condition, const char *fmt, ...) {
     if (condition) {
         va_list args;
         va_start(args, fmt);
+        pthread_once(&fail_trap_key_once, fail_trap_key_create);
+        struct fail_trap *trap = pthread_getspecific(fail_trap_key);
+        if (trap) {
+            vsnprintf(trap->message, sizeof(trap->message), fmt, args);
+            va_end(args);
+            size_t length = strlen(trap->message);
+            if (length && trap->message[length - 1] == '\n') {
+                trap->message[length - 1] = 0;
+            }
+            // Failures while handling this one go to the trap outside it
+            pthread_setspecific(fail_trap_key, trap->outer);
+            longjmp(trap->jump, 1);
+        }
         vfprintf(stderr, fmt, args);
         va_end(args);
         exit(EXIT_FAILURE);
     }
 }
+
+void fail_trap_set(struct fail_trap *trap) {
+    pthread_once(&fail_trap_key_once, fail_trap_key_create);
+    trap->message[0] = 0;
+    trap->outer = pthread_getspecific(fail_trap_key);
+    pthread_setspecific(fail_trap_key, trap);
+}
+
+void fail_trap_clear(struct fail_trap *trap) {
+    pthread_setspecific(fail_trap_key, trap->outer);
+}
+
+void fail_rethrow(const struct fail_trap *trap) {
+    fail_if(1, "%s\n", trap->message);
+}
+
+void byte_buffer_reserve(struct byte_buffer *buffer, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity;
+        while (buffer->length + length > capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+        }
+        char *grown = realloc(buffer->data, capacity);
+        fail_if(!grown, "Error: unable to allocate memory\n");
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+}
+
+void byte_buffer_append(struct byte_buffer *buffer, const void *data, size_t length) {
+    // An empty buffer may have no data, and memcpy isn't defined on NULL even for nothing
+    if (!length) {
+        return;
+    }
+    byte_buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void byte_buffer_write(struct byte_buffer *buffer, FILE *fp) {
+    if (buffer->length) {
+        fwrite(buffer->data, 1, buffer->length, fp);
+        buffer->length = 0;
+    }
+}
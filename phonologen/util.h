@@ -1,10 +1,52 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+
+// Longest message a fail_trap keeps, including the NUL; longer ones are cut short
+#define FAIL_MESSAGE_SIZE 512
+
+// Growable array of bytes, empty when zero-initialized
+struct byte_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Where fail_if goes on a thread instead of exiting, so failures can be returned to a caller rather
+// than ending the whole process
+struct fail_trap {
+    jmp_buf jump;
+    // What fail_if would have printed, without its trailing newline
+    char message[FAIL_MESSAGE_SIZE];
+    // Trap that was set on the thread before this one, or NULL
+    struct fail_trap *outer;
+};
 
 // If char condition is false, prints the remaining args to stderr (one format
 // string followed by its variable arguments) and exits with EXIT_FAILURE
+// If a fail_trap is set on the calling thread, the message is saved in it instead, the trap is
+// cleared, and fail_if longjmps to it (so its setjmp returns 1)
 void fail_if(char, const char *, ...);
+// Sets a trap for every fail_if on the calling thread, until it's sprung or cleared
+// The trap's jump must be set with setjmp right after this, in a function that stays active until
+// fail_trap_clear is called, and traps nest: each remembers the one set before it
+void fail_trap_set(struct fail_trap *);
+// Clears a trap that hasn't been sprung, restoring the one set before it
+void fail_trap_clear(struct fail_trap *);
+// Fails again with the message of a trap that was sprung, for code that only trapped a failure to
+// clean up after it
+void fail_rethrow(const struct fail_trap *);
+// Grows a byte buffer, if needed, so the given number of bytes can be appended without moving it
+// Prints errors to stderr and exits on failure
+void byte_buffer_reserve(struct byte_buffer *, size_t);
+// Appends bytes to the end of a byte buffer, growing it as needed
+// Prints errors to stderr and exits on failure
+void byte_buffer_append(struct byte_buffer *, const void *, size_t);
+// Writes everything in a byte buffer to a file, and empties it
+void byte_buffer_write(struct byte_buffer *, FILE *);
 
 #endif
@@ -0,0 +1,527 @@
+// Several variants of a grammar's rules evaluated together, sharing the rules their prefixes have
+// in common
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include "structures.h"
+#include "parsing.h"
+#include "derive.h"
+#include "wordcache.h"
+#include "stream.h"
+#include "variants.h"
+#include "util.h"
+
+// Number of bytes of input derived at a time
+#define VARIANTS_CHUNK_SIZE (1 << 20)
+
+// Returns whether rule x of one rule set is rule y of another in everything but its line number;
+// requirements and compiled matrices follow from the matrices, so they needn't be compared
+static char rule_equal(
+        const struct grammar *g,
+        const struct rule_set *a,
+        unsigned int x,
+        const struct rule_set *b,
+        unsigned int y) {
+    uint32_t count = a->matrix_starts[x + 1] - a->matrix_starts[x];
+    return a->context_lengths[x] == b->context_lengths[y]
+        && a->focus_positions[x] == b->focus_positions[y]
+        && a->directions[x] == b->directions[y]
+        && a->kinds[x] == b->kinds[y]
+        && a->pass_limits[x] == b->pass_limits[y]
+        && count == b->matrix_starts[y + 1] - b->matrix_starts[y]
+        && !memcmp(
+            a->matrices + (size_t) a->matrix_starts[x] * g->fmatrix_length,
+            b->matrices + (size_t) b->matrix_starts[y] * g->fmatrix_length,
+            (size_t) count * g->fmatrix_length * sizeof(fword_t));
+}
+
+// Adds a node with no children or variants ending at it to a trie, for count rules of a variant
+// from the start-th on
+// Returns its index
+// Prints errors to stderr and exits on failure
+static uint32_t variant_trie_add(
+        struct variant_trie *t, uint32_t variant, uint32_t start, uint32_t count) {
+    if (t->node_count == t->node_capacity) {
+        fail_if(t->node_capacity >= UINT32_MAX / 2, "Error: too many rules\n");
+        uint32_t capacity = t->node_capacity ? t->node_capacity * 2 : 16;
+        struct variant_node *nodes = realloc(t->nodes, capacity * sizeof(*nodes));
+        fail_if(!nodes, "Error: unable to allocate memory\n");
+        t->nodes = nodes;
+        t->node_capacity = capacity;
+    }
+    struct variant_node *n = t->nodes + t->node_count;
+    n->first_child = VARIANT_NONE;
+    n->next_sibling = VARIANT_NONE;
+    n->variant = variant;
+    n->start = start;
+    n->count = count;
+    n->first_ending = VARIANT_NONE;
+    return t->node_count++;
+}
+
+// Adds the rules of one variant to a trie, following the runs of nodes for as long as they're the
+// same rules, splitting a node's run where they stop being, and adding a node for whatever is left
+// Prints errors to stderr and exits on failure
+static void variant_trie_insert(
+        struct variant_trie *t, const struct grammar *g, const struct rule_set sets[], uint32_t v) {
+    const struct rule_set *r = sets + v;
+    uint32_t node = 0;
+    unsigned int x = 0;
+    while (x < r->count) {
+        // Child whose run starts with the next rule, if any, and the child before it
+        uint32_t child = t->nodes[node].first_child;
+        uint32_t last = VARIANT_NONE;
+        while (child != VARIANT_NONE) {
+            const struct variant_node *c = t->nodes + child;
+            if (rule_equal(g, sets + c->variant, c->start, r, x)) {
+                break;
+            }
+            last = child;
+            child = c->next_sibling;
+        }
+        if (child == VARIANT_NONE) {
+            child = variant_trie_add(t, v, x, r->count - x);
+            if (last == VARIANT_NONE) {
+                t->nodes[node].first_child = child;
+            } else {
+                t->nodes[last].next_sibling = child;
+            }
+            node = child;
+            break;
+        }
+        const struct variant_node *c = t->nodes + child;
+        uint32_t same = 1;
+        while (same < c->count && x + same < r->count
+                && rule_equal(g, sets + c->variant, c->start + same, r, x + same)) {
+            same++;
+        }
+        if (same < c->count) {
+            // The rest of the run goes to a node of its own, with everything that was below it
+            uint32_t rest = variant_trie_add(t, c->variant, c->start + same, c->count - same);
+            struct variant_node *split = t->nodes + child;
+            t->nodes[rest].first_child = split->first_child;
+            t->nodes[rest].first_ending = split->first_ending;
+            split->first_child = rest;
+            split->first_ending = VARIANT_NONE;
+            split->count = same;
+        }
+        node = child;
+        x += same;
+    }
+    t->next_ending[v] = t->nodes[node].first_ending;
+    t->nodes[node].first_ending = v;
+}
+
+// Lists every node of a trie in depth-first order, children in the order they were added, and
+// works out the trie's branch depth
+// Prints errors to stderr and exits on failure
+static void variant_trie_order(struct variant_trie *t, uint32_t order[], uint32_t stack[]) {
+    // Number of branching nodes above every node
+    unsigned int *depths = malloc(t->node_count * sizeof(*depths));
+    fail_if(!depths, "Error: unable to allocate memory\n");
+    uint32_t count = 0;
+    uint32_t height = 0;
+    stack[height++] = 0;
+    depths[0] = 0;
+    t->branch_depth = 0;
+    while (height) {
+        uint32_t node = stack[--height];
+        order[count++] = node;
+        const struct variant_node *n = t->nodes + node;
+        char branches = n->first_child != VARIANT_NONE
+            && t->nodes[n->first_child].next_sibling != VARIANT_NONE;
+        if (branches && depths[node] + 1 > t->branch_depth) {
+            t->branch_depth = depths[node] + 1;
+        }
+        // Children are pushed and then reversed, so the first child is visited first
+        uint32_t bottom = height;
+        for (uint32_t child = n->first_child; child != VARIANT_NONE;
+                child = t->nodes[child].next_sibling) {
+            depths[child] = depths[node] + branches;
+            stack[height++] = child;
+        }
+        for (uint32_t x = bottom, y = height; x + 1 < y; x++, y--) {
+            uint32_t swap = stack[x];
+            stack[x] = stack[y - 1];
+            stack[y - 1] = swap;
+        }
+    }
+    free(depths);
+}
+
+// Replaces a grammar's rules with the runs of every node of a trie, in the order given, packed into
+// the grammar's arena just as parse_rules packs them, and points every node at its run there
+// Prints errors to stderr and exits on failure
+static void variant_trie_pack(
+        struct variant_trie *t,
+        struct grammar *g,
+        const struct rule_set sets[],
+        const uint32_t order[]) {
+    unsigned int rule_count = 0;
+    size_t matrix_count = 0;
+    size_t op_count = 0;
+    for (uint32_t x = 0; x < t->node_count; x++) {
+        const struct variant_node *n = t->nodes + x;
+        if (!n->count) {
+            continue;
+        }
+        const struct rule_set *r = sets + n->variant;
+        uint32_t first = r->matrix_starts[n->start];
+        uint32_t end = r->matrix_starts[n->start + n->count];
+        rule_count += n->count;
+        matrix_count += end - first;
+        op_count += r->op_starts[end] - r->op_starts[first];
+    }
+    fail_if(matrix_count >= UINT32_MAX || op_count >= UINT32_MAX, "Error: too many rules\n");
+    size_t fmatrix_size = g->fmatrix_length * sizeof(fword_t);
+    // One block, widest elements first so each array stays aligned
+    char *space = arena_alloc(
+        &g->arena,
+        rule_count * fmatrix_size + matrix_count * fmatrix_size
+            + op_count * sizeof(struct fmatrix_op)
+            + (rule_count * 5 + matrix_count + 2) * sizeof(uint32_t) + rule_count * 2);
+    fword_t *requirements = (fword_t *) space;
+    fword_t *matrices = requirements + (size_t) rule_count * g->fmatrix_length;
+    struct fmatrix_op *ops = (struct fmatrix_op *) (matrices + matrix_count * g->fmatrix_length);
+    uint32_t *context_lengths = (uint32_t *) (ops + op_count);
+    uint32_t *focus_positions = context_lengths + rule_count;
+    uint32_t *matrix_starts = focus_positions + rule_count;
+    uint32_t *op_starts = matrix_starts + rule_count + 1;
+    uint32_t *pass_limits = op_starts + matrix_count + 1;
+    uint32_t *line_numbers = pass_limits + rule_count;
+    char *directions = (char *) (line_numbers + rule_count);
+    char *kinds = directions + rule_count;
+    unsigned int rule = 0;
+    uint32_t matrix = 0;
+    uint32_t op = 0;
+    for (uint32_t x = 0; x < t->node_count; x++) {
+        struct variant_node *n = t->nodes + order[x];
+        if (!n->count) {
+            n->start = rule;
+            continue;
+        }
+        const struct rule_set *r = sets + n->variant;
+        for (uint32_t y = n->start; y < n->start + n->count; y++) {
+            context_lengths[rule] = r->context_lengths[y];
+            focus_positions[rule] = r->focus_positions[y];
+            directions[rule] = r->directions[y];
+            kinds[rule] = r->kinds[y];
+            pass_limits[rule] = r->pass_limits[y];
+            line_numbers[rule] = r->line_numbers[y];
+            memcpy(
+                requirements + (size_t) rule * g->fmatrix_length,
+                r->requirements + (size_t) y * g->fmatrix_length,
+                fmatrix_size);
+            matrix_starts[rule] = matrix;
+            for (uint32_t m = r->matrix_starts[y]; m < r->matrix_starts[y + 1]; m++) {
+                memcpy(
+                    matrices + (size_t) matrix * g->fmatrix_length,
+                    r->matrices + (size_t) m * g->fmatrix_length,
+                    fmatrix_size);
+                uint32_t length = r->op_starts[m + 1] - r->op_starts[m];
+                memcpy(ops + op, r->ops + r->op_starts[m], length * sizeof(*ops));
+                op_starts[matrix++] = op;
+                op += length;
+            }
+            rule++;
+        }
+        n->start = rule - n->count;
+    }
+    matrix_starts[rule] = matrix;
+    op_starts[matrix] = op;
+    struct rule_set *merged = &g->rules;
+    merged->count = rule_count;
+    merged->context_lengths = context_lengths;
+    merged->focus_positions = focus_positions;
+    merged->directions = directions;
+    merged->kinds = kinds;
+    merged->pass_limits = pass_limits;
+    merged->requirements = requirements;
+    merged->matrix_starts = matrix_starts;
+    merged->matrices = matrices;
+    merged->matrix_count = matrix_count;
+    merged->op_starts = op_starts;
+    merged->ops = ops;
+    merged->op_count = op_count;
+    merged->line_numbers = line_numbers;
+}
+
+void variant_trie_build(
+        struct variant_trie *t,
+        struct grammar *g,
+        const struct rule_set sets[],
+        unsigned int count) {
+    memset(t, 0, sizeof(*t));
+    t->variant_count = count;
+    t->next_ending = malloc(count * sizeof(*t->next_ending));
+    fail_if(!t->next_ending, "Error: unable to allocate memory\n");
+    variant_trie_add(t, VARIANT_NONE, 0, 0);
+    for (unsigned int v = 0; v < count; v++) {
+        t->rule_total += sets[v].count;
+        variant_trie_insert(t, g, sets, v);
+    }
+    uint32_t *order = malloc(t->node_count * 2 * sizeof(*order));
+    fail_if(!order, "Error: unable to allocate memory\n");
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        free(order);
+        fail_rethrow(&trap);
+    }
+    variant_trie_order(t, order, order + t->node_count);
+    variant_trie_pack(t, g, sets, order);
+    fail_trap_clear(&trap);
+    free(order);
+}
+
+void variant_trie_free(struct variant_trie *t) {
+    free(t->nodes);
+    free(t->next_ending);
+}
+
+// Everything derive_variants sets up, so it can all be freed whether or not deriving succeeds
+struct variants_state {
+    const struct variant_trie *trie;
+    // Name of every variant, for tagging its lines
+    const char *const *names;
+    struct derivation derivation;
+    struct word_cache cache;
+    // Reused for every word
+    struct word word;
+    // Copies of the word where the trie branches, one for every branching node on the path being
+    // taken
+    struct word *saved;
+    // IDs of the surface forms of the word being derived, in the order they were reached, and
+    // where each variant's starts in them and how long it is
+    struct byte_buffer forms;
+    size_t *form_starts;
+    long *form_lengths;
+    // IDs of every variant's surface form of the word, in order, each followed by FMATRIX_NONE, as
+    // they're cached
+    struct byte_buffer entry;
+    // Every variant's line of output so far, and whether the input line has anything in it yet
+    struct byte_buffer *lines;
+    char line_open;
+    struct input_reader reader;
+    struct input_chunk chunk;
+    struct byte_buffer output;
+};
+
+// Copies the IDs of one word to another, growing its block if need be
+// Prints errors to stderr and exits on failure
+static void word_copy(struct word *to, const struct word *from) {
+    if ((size_t) from->length > to->capacity) {
+        free(to->ids);
+        to->ids = malloc(from->length * 2 * sizeof(*to->ids));
+        to->capacity = to->ids ? from->length * 2 : 0;
+        fail_if(!to->ids, "Error: unable to allocate memory\n");
+    }
+    memcpy(to->ids, from->ids, from->length * sizeof(*to->ids));
+    to->length = from->length;
+}
+
+// Takes the word down the trie from a node, applying the run of rules of every node on the way and
+// recording its form for every variant that ends at one, and copying it where the trie branches
+// so every child starts from the same word
+// depth is the number of branching nodes passed on the way, and fresh is set if the derivation
+// hasn't seen the word as it is yet
+// Prints errors to stderr and exits on failure
+static void variants_visit(
+        struct variants_state *s, uint32_t node, unsigned int depth, char fresh) {
+    const struct variant_trie *t = s->trie;
+    struct word *word = &s->word;
+    // Nodes with only one child are followed without copying anything
+    while (1) {
+        const struct variant_node *n = t->nodes + node;
+        if (n->count) {
+            derive_word_rules(&s->derivation, word, n->start, n->count, fresh);
+            fresh = 0;
+        }
+        for (uint32_t v = n->first_ending; v != VARIANT_NONE; v = t->next_ending[v]) {
+            s->form_starts[v] = s->forms.length / sizeof(*word->ids);
+            s->form_lengths[v] = word->length;
+            byte_buffer_append(&s->forms, word->ids, word->length * sizeof(*word->ids));
+        }
+        node = n->first_child;
+        if (node == VARIANT_NONE || t->nodes[node].next_sibling != VARIANT_NONE) {
+            break;
+        }
+    }
+    if (node == VARIANT_NONE) {
+        return;
+    }
+    struct word *saved = s->saved + depth;
+    word_copy(saved, word);
+    for (uint32_t child = node; child != VARIANT_NONE; child = t->nodes[child].next_sibling) {
+        if (child != node) {
+            word_copy(word, saved);
+            fresh = 1;
+        }
+        variants_visit(s, child, depth + 1, fresh);
+    }
+}
+
+// Derives one word of the given length, which needn't be NUL-terminated, with every variant,
+// appending every variant's surface form to its line of output
+// The word is looked up in the word cache before being parsed and taken down the trie
+// Prints errors to stderr and exits on failure
+static void variants_derive_word(struct variants_state *s, const char *text, size_t length) {
+    const struct grammar *g = s->derivation.grammar;
+    long len;
+    const fmatrix_id_t *ids = word_cache_find(&s->cache, text, length, &len);
+    if (!ids) {
+        parse_word(g, text, length, &s->word);
+        s->forms.length = 0;
+        variants_visit(s, 0, 0, 1);
+        s->entry.length = 0;
+        fmatrix_id_t separator = FMATRIX_NONE;
+        for (unsigned int v = 0; v < s->trie->variant_count; v++) {
+            byte_buffer_append(
+                &s->entry,
+                s->forms.data + s->form_starts[v] * sizeof(*ids),
+                s->form_lengths[v] * sizeof(*ids));
+            byte_buffer_append(&s->entry, &separator, sizeof(separator));
+        }
+        ids = (const fmatrix_id_t *) s->entry.data;
+        len = s->entry.length / sizeof(*ids);
+        word_cache_add(&s->cache, text, length, ids, len);
+    }
+    unsigned int v = 0;
+    for (long x = 0; x < len; x++) {
+        if (ids[x] == FMATRIX_NONE) {
+            v++;
+            continue;
+        }
+        unsigned int spelling_length;
+        const char *spelling = fmatrix_spelling(g, ids[x], &spelling_length);
+        byte_buffer_append(s->lines + v, spelling, spelling_length);
+    }
+}
+
+// Appends every variant's line of output to the output buffer, after its name and a tab, and
+// starts them all over
+// Prints errors to stderr and exits on failure
+static void variants_end_line(struct variants_state *s) {
+    for (unsigned int v = 0; v < s->trie->variant_count; v++) {
+        byte_buffer_append(&s->output, s->names[v], strlen(s->names[v]));
+        byte_buffer_append(&s->output, "\t", 1);
+        byte_buffer_append(&s->output, s->lines[v].data, s->lines[v].length);
+        byte_buffer_append(&s->output, "\n", 1);
+        s->lines[v].length = 0;
+    }
+    s->line_open = 0;
+}
+
+// Derives every word in text of the given length with every variant, copying the whitespace
+// between words to every variant's line of output and writing them all out at every newline
+// Prints errors to stderr and exits on failure
+static void variants_derive_text(struct variants_state *s, const char *text, size_t length) {
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    const char *end = text + length;
+    while (text < end) {
+        if (*text == '\n') {
+            variants_end_line(s);
+            text++;
+            continue;
+        }
+        s->line_open = 1;
+        if (is_separator(*text)) {
+            for (unsigned int v = 0; v < s->trie->variant_count; v++) {
+                byte_buffer_append(s->lines + v, text, 1);
+            }
+            text++;
+            continue;
+        }
+        const char *start = text;
+        while (text < end && !is_separator(*text)) {
+            text++;
+        }
+        s->derivation.words++;
+        variants_derive_word(s, start, text - start);
+    }
+    derivation_add_time(&s->derivation, &start_time);
+}
+
+// Frees everything derive_variants set up
+static void variants_state_free(struct variants_state *s) {
+    input_chunk_free(&s->chunk);
+    input_reader_free(&s->reader);
+    free(s->output.data);
+    free(s->word.ids);
+    if (s->saved) {
+        for (unsigned int x = 0; x < s->trie->branch_depth; x++) {
+            free(s->saved[x].ids);
+        }
+    }
+    free(s->saved);
+    free(s->forms.data);
+    free(s->form_starts);
+    free(s->form_lengths);
+    free(s->entry.data);
+    if (s->lines) {
+        for (unsigned int v = 0; v < s->trie->variant_count; v++) {
+            free(s->lines[v].data);
+        }
+    }
+    free(s->lines);
+    word_cache_free(&s->cache);
+    derivation_free(&s->derivation);
+    free(s);
+}
+
+void derive_variants(
+        struct grammar *g,
+        const struct variant_trie *t,
+        const char *const names[],
+        FILE *in,
+        FILE *out,
+        size_t cache_size,
+        FILE *warnings,
+        struct word_cache *cache_totals,
+        struct derivation_stats *derivation_totals) {
+    struct variants_state *s = calloc(1, sizeof(*s));
+    fail_if(!s, "Error: unable to allocate memory\n");
+    s->trie = t;
+    s->names = names;
+    input_reader_init(&s->reader, in, VARIANTS_CHUNK_SIZE);
+    struct fail_trap trap;
+    fail_trap_set(&trap);
+    if (setjmp(trap.jump)) {
+        // Every line derived with every variant before the failure is still written out
+        byte_buffer_write(&s->output, out);
+        variants_state_free(s);
+        fail_rethrow(&trap);
+    }
+    derivation_init(&s->derivation, g);
+    s->derivation.warnings = warnings;
+    word_cache_init(&s->cache, cache_size);
+    s->saved = calloc(t->branch_depth ? t->branch_depth : 1, sizeof(*s->saved));
+    s->form_starts = malloc(t->variant_count * sizeof(*s->form_starts));
+    s->form_lengths = malloc(t->variant_count * sizeof(*s->form_lengths));
+    s->lines = calloc(t->variant_count, sizeof(*s->lines));
+    fail_if(
+        !s->saved || !s->form_starts || !s->form_lengths || !s->lines,
+        "Error: unable to allocate memory\n");
+    while (input_reader_next(&s->reader, &s->chunk)) {
+        variants_derive_text(s, s->chunk.text, s->chunk.length);
+        input_chunk_free(&s->chunk);
+        s->chunk.block = NULL;
+        if (s->output.length >= VARIANTS_CHUNK_SIZE) {
+            byte_buffer_write(&s->output, out);
+        }
+    }
+    if (s->line_open) {
+        variants_end_line(s);
+    }
+    byte_buffer_write(&s->output, out);
+    word_cache_add_stats(cache_totals, &s->cache);
+    derivation_stats_add(derivation_totals, &s->derivation);
+    fail_trap_clear(&trap);
+    variants_state_free(s);
+}
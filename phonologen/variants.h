@@ -0,0 +1,81 @@
+#ifndef VARIANTS_H
+#define VARIANTS_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "structures.h"
+#include "derive.h"
+#include "wordcache.h"
+
+// Index that stands for no node or variant
+#define VARIANT_NONE UINT32_MAX
+
+// Node of a variant trie, reached from its parent by applying a run of rules
+struct variant_node {
+    // First child and next sibling, or VARIANT_NONE
+    uint32_t first_child;
+    uint32_t next_sibling;
+    // While the trie is being built, the variant whose rules the run was taken from and the index
+    // of its first rule there; afterwards, start is the index of its first rule in the grammar's
+    // rules, and the whole run follows it
+    uint32_t variant;
+    uint32_t start;
+    uint32_t count;
+    // First variant whose rules end here, or VARIANT_NONE, chained through next_ending
+    uint32_t first_ending;
+};
+
+// Several variants of a grammar's rules, with one feature chart, as a trie of rule sequences: the
+// rules every variant starts with are on the path to the node where it ends, so rules in a prefix
+// that several variants share are on one path, applied once for all of them
+struct variant_trie {
+    // Node 0 is the root, which applies no rules
+    struct variant_node *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    unsigned int variant_count;
+    // Next variant ending at the same node as each variant, or VARIANT_NONE
+    uint32_t *next_ending;
+    // Most nodes with more than one child on any path, which is how many copies of a word deriving
+    // it can need at once
+    unsigned int branch_depth;
+    // Rules of all of the variants together, for statistics; the grammar's rules are those left
+    // once prefixes are shared
+    size_t rule_total;
+};
+
+// Builds a trie of the rules of several variants, each a rule set parsed into the same grammar in
+// turn (parse_rules replaces the grammar's rules, but their arrays stay in its arena), and then
+// replaces the grammar's rules with the runs of every node of the trie, one after another, so each
+// node's run is consecutive rules
+// Two rules are the same if everything but their line numbers is
+// Prints errors to stderr and exits on failure, leaving the trie safe to free
+void variant_trie_build(
+    struct variant_trie *, struct grammar *, const struct rule_set *, unsigned int);
+// Frees a variant trie's buffers
+void variant_trie_free(struct variant_trie *);
+// Derives every word read from one file with every variant of a grammar, writing to another every
+// line of input once for each variant in turn, as that variant derives it, after the variant's name
+// and a tab (every line ends with a newline, even the last if the input didn't)
+// Every word is segmented once and then taken down the trie, applying each node's run of rules to
+// it and copying it only where the trie branches
+// Uses a word cache of cache_size bytes, which memoizes every variant's surface form of a word at
+// once
+// Words still changing when a rule reaches the pass limit its line gives are reported to the last
+// FILE *, unless that's NULL
+// Adds the statistics of the word cache and derivation to the totals given
+// Prints errors to stderr and exits on failure, having freed everything it set up
+void derive_variants(
+    struct grammar *,
+    const struct variant_trie *,
+    const char *const [],
+    FILE *,
+    FILE *,
+    size_t,
+    FILE *,
+    struct word_cache *,
+    struct derivation_stats *);
+
+#endif
@@ -0,0 +1,172 @@
+// Bounded memoization of word derivations
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "structures.h"
+#include "wordcache.h"
+#include "util.h"
+
+// Roughly how many bytes of budget to allow per hash bucket
+#define BYTES_PER_BUCKET 128
+
+// Hashes a whole word with 64-bit FNV-1a; words are short, and a full-width hash keeps chains
+// short however big the budget is
+static inline uint64_t hash_word(const char *word, size_t word_length) {
+    register uint64_t result = 0xcbf29ce484222325;
+    for (register size_t x = 0; x < word_length; x++) {
+        result = (result ^ (unsigned char) word[x]) * 0x100000001b3;
+    }
+    return result;
+}
+
+// Returns the underlying form stored after an entry's IDs
+static inline const char *entry_word(const struct word_cache_entry *entry) {
+    return (const char *) (entry->ids + entry->len);
+}
+
+// Returns how many bytes of budget an entry for a word of word_length bytes and len IDs takes
+static inline size_t entry_size(size_t word_length, long len) {
+    return sizeof(struct word_cache_entry) + len * sizeof(fmatrix_id_t) + word_length;
+}
+
+void word_cache_init(struct word_cache *cache, size_t byte_budget) {
+    memset(cache, 0, sizeof(*cache));
+    cache->byte_budget = byte_budget;
+    if (!byte_budget) {
+        return;
+    }
+    cache->bucket_count = 256;
+    while (cache->bucket_count < byte_budget / BYTES_PER_BUCKET && cache->bucket_count < 1 << 20) {
+        cache->bucket_count *= 2;
+    }
+    cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+    fail_if(!cache->buckets, "Error: unable to allocate memory\n");
+}
+
+const fmatrix_id_t *word_cache_find(
+        struct word_cache *cache, const char *word, size_t word_length, long *len) {
+    if (!cache->byte_budget) {
+        cache->misses++;
+        return NULL;
+    }
+    uint64_t hash = hash_word(word, word_length);
+    struct word_cache_entry *entry = cache->buckets[hash & (cache->bucket_count - 1)];
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash
+                && entry->word_length == word_length
+                && !memcmp(entry_word(entry), word, word_length)) {
+            entry->referenced = 1;
+            cache->hits++;
+            *len = entry->len;
+            return entry->ids;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+// Unlinks an entry from its hash chain and frees it
+static void word_cache_evict(struct word_cache *cache, struct word_cache_entry *victim) {
+    struct word_cache_entry **next_ptr = cache->buckets + (victim->hash & (cache->bucket_count - 1));
+    while (*next_ptr != victim) {
+        next_ptr = &((*next_ptr)->next);
+    }
+    *next_ptr = victim->next;
+    cache->bytes_used -= entry_size(victim->word_length, victim->len);
+    cache->evictions++;
+    free(victim);
+}
+
+void word_cache_add(
+        struct word_cache *cache,
+        const char *word,
+        size_t word_length,
+        const fmatrix_id_t *ids,
+        long len) {
+    size_t size = entry_size(word_length, len);
+    if (size > cache->byte_budget) {
+        return;
+    }
+    // Sweep the clock hand until there's room, giving referenced entries a second chance
+    while (cache->bytes_used + size > cache->byte_budget) {
+        struct word_cache_entry *candidate = cache->ring[cache->hand];
+        if (candidate->referenced) {
+            candidate->referenced = 0;
+            cache->hand = (cache->hand + 1) % cache->ring_count;
+            continue;
+        }
+        word_cache_evict(cache, candidate);
+        // Keep the ring dense by moving the last entry into the victim's slot; the hand stays put
+        // so that entry is looked at next
+        cache->ring[cache->hand] = cache->ring[--cache->ring_count];
+        if (cache->hand >= cache->ring_count) {
+            cache->hand = 0;
+        }
+    }
+    if (cache->ring_count == cache->ring_capacity) {
+        cache->ring_capacity = cache->ring_capacity ? cache->ring_capacity * 2 : 256;
+        cache->ring = realloc(cache->ring, cache->ring_capacity * sizeof(*cache->ring));
+        fail_if(!cache->ring, "Error: unable to allocate memory\n");
+    }
+    struct word_cache_entry *entry = malloc(size);
+    fail_if(!entry, "Error: unable to allocate memory\n");
+    entry->hash = hash_word(word, word_length);
+    entry->len = len;
+    entry->word_length = word_length;
+    entry->referenced = 0;
+    memcpy(entry->ids, ids, len * sizeof(*ids));
+    memcpy(entry->ids + len, word, word_length);
+    struct word_cache_entry **bucket = cache->buckets + (entry->hash & (cache->bucket_count - 1));
+    entry->next = *bucket;
+    *bucket = entry;
+    cache->ring[cache->ring_count++] = entry;
+    cache->bytes_used += size;
+}
+
+void word_cache_add_stats(struct word_cache *totals, const struct word_cache *cache) {
+    totals->hits += cache->hits;
+    totals->misses += cache->misses;
+    totals->evictions += cache->evictions;
+    totals->ring_count += cache->ring_count;
+    totals->bytes_used += cache->bytes_used;
+    totals->byte_budget += cache->byte_budget;
+}
+
+void word_cache_print_stats(const struct word_cache *cache, FILE *fp) {
+    unsigned long long lookups = cache->hits + cache->misses;
+    fprintf(
+        fp,
+        "word cache: %llu hits, %llu misses (%.1f%% hit rate), %llu evictions, %zu entries in %zu "
+        "of %zu bytes\n",
+        cache->hits,
+        cache->misses,
+        lookups ? 100.0 * cache->hits / lookups : 0.0,
+        cache->evictions,
+        cache->ring_count,
+        cache->bytes_used,
+        cache->byte_budget);
+}
+
+void word_cache_print_stats_json(const struct word_cache *cache, FILE *fp) {
+    fprintf(
+        fp,
+        "{\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, \"entries\": %zu, "
+        "\"bytes_used\": %zu, \"byte_budget\": %zu}",
+        cache->hits,
+        cache->misses,
+        cache->evictions,
+        cache->ring_count,
+        cache->bytes_used,
+        cache->byte_budget);
+}
+
+void word_cache_free(struct word_cache *cache) {
+    for (size_t x = 0; x < cache->ring_count; x++) {
+        free(cache->ring[x]);
+    }
+    free(cache->ring);
+    free(cache->buckets);
+}
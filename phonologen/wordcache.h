@@ -0,0 +1,66 @@
+#ifndef WORDCACHE_H
+#define WORDCACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "structures.h"
+
+// Cached derivation of one word: its underlying form as typed, and the feature matrix IDs of its
+// surface form
+struct word_cache_entry {
+    struct word_cache_entry *next;
+    uint64_t hash;
+    long len;
+    size_t word_length;
+    // Set whenever the entry is found; the clock hand clears it instead of evicting the entry
+    char referenced;
+    // len IDs, followed by the word_length bytes of the underlying form
+    fmatrix_id_t ids[];
+};
+
+// Memoizes whole derivations (underlying form to surface form), since most words in a corpus are
+// repeats of a few thousand types
+// Bounded by a byte budget, evicting with the CLOCK algorithm (an approximation of LRU that needs no
+// list reordering on hits)
+struct word_cache {
+    // Hash table of entries chained through next; bucket_count is a power of two
+    struct word_cache_entry **buckets;
+    size_t bucket_count;
+    // Circular array of every entry, swept by the clock hand
+    struct word_cache_entry **ring;
+    size_t ring_count;
+    size_t ring_capacity;
+    size_t hand;
+    size_t bytes_used;
+    size_t byte_budget;
+    // Statistics, for reporting at exit
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+};
+
+// Sets up an empty cache that will hold at most byte_budget bytes of entries
+// A budget of 0 disables the cache; word_cache_find then always misses
+// Prints errors to stderr and exits on failure
+void word_cache_init(struct word_cache *, size_t);
+// Returns the surface form IDs cached for a word of the given length in bytes, writing their count
+// to the last parameter, or NULL if the word isn't cached
+// Returned IDs are only valid until the next call to word_cache_add
+const fmatrix_id_t *word_cache_find(struct word_cache *, const char *, size_t, long *);
+// Caches the surface form IDs of a word of the given length in bytes (assumed not to be cached
+// yet), evicting other entries to stay within budget
+// Words too big for the whole budget aren't cached
+// Prints errors to stderr and exits on failure
+void word_cache_add(struct word_cache *, const char *, size_t, const fmatrix_id_t *, long);
+// Adds a cache's statistics and sizes to totals, which start zeroed
+void word_cache_add_stats(struct word_cache *, const struct word_cache *);
+// Prints hit, miss and eviction counts to FILE *
+void word_cache_print_stats(const struct word_cache *, FILE *);
+// Prints the same statistics to FILE * as a JSON object (with no trailing newline)
+void word_cache_print_stats_json(const struct word_cache *, FILE *);
+// Frees all entries and tables
+void word_cache_free(struct word_cache *);
+
+#endif
@@ -0,0 +1,238 @@
+// Regression checks for the library interface in libphonologen.h, run by test/regress.sh
+// Derives a file of words with a grammar in several ways, checking each against a file of the
+// surface forms expected, one per line, and checks that failures are reported rather than fatal
+// Prints every check that failed, and exits nonzero if any did
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libphonologen.h"
+
+#define USAGE \
+    "Usage: api_test features-file rules-file words-file expected-file scratch-directory\n"
+
+// Most words in the words file, and longest path made in the scratch directory
+#define MAX_WORDS 4096
+#define MAX_PATH 4096
+
+static unsigned int checks;
+static unsigned int failures;
+
+// Passes the check named if the condition holds, and otherwise prints the last library error, if
+// there's been one
+static void check(int condition, const char *name) {
+    checks++;
+    if (!condition) {
+        const char *error = phonologen_error();
+        printf(*error ? "FAIL: %s (%s)\n" : "FAIL: %s\n", name, error);
+        failures++;
+    }
+}
+
+// Reads a whole file into a NUL-terminated string, or returns NULL if it can't be read
+static char *read_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    size_t length = 0, capacity = 4096;
+    char *text = malloc(capacity);
+    size_t n;
+    while (text && (n = fread(text + length, 1, capacity - length - 1, fp))) {
+        length += n;
+        if (capacity - length == 1) {
+            capacity *= 2;
+            char *grown = realloc(text, capacity);
+            if (!grown) {
+                free(text);
+            }
+            text = grown;
+        }
+    }
+    fclose(fp);
+    if (text) {
+        text[length] = '\0';
+    }
+    return text;
+}
+
+// Splits text into words at whitespace in place, writing up to MAX_WORDS of them to words
+// Returns how many there were
+static size_t split_words(char *text, const char *words[]) {
+    size_t count = 0;
+    for (char *word = strtok(text, " \t\r\n"); word && count < MAX_WORDS;
+            word = strtok(NULL, " \t\r\n")) {
+        words[count++] = word;
+    }
+    return count;
+}
+
+// Returns whether a context derives every word to its expected surface form
+static int derives_expected(
+        struct phonologen_context *context,
+        const char *const words[],
+        const char *const expected[],
+        size_t count) {
+    static const char *output[MAX_WORDS];
+    if (phonologen_derive(context, words, count, output) != PHONOLOGEN_OK) {
+        return 0;
+    }
+    for (size_t x = 0; x < count; x++) {
+        if (strcmp(output[x], expected[x])) {
+            printf("  %s gave %s, not %s\n", words[x], output[x], expected[x]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns whether a grammar derives every word to its expected surface form, both one word per
+// call and all at once, with a context made with the given options
+static int grammar_derives_expected(
+        struct phonologen_grammar *grammar,
+        const struct phonologen_options *options,
+        const char *const words[],
+        const char *const expected[],
+        size_t count) {
+    struct phonologen_context *context;
+    if (phonologen_context_new(grammar, options, &context) != PHONOLOGEN_OK) {
+        return 0;
+    }
+    int ok = 1;
+    for (size_t x = 0; ok && x < count; x++) {
+        ok = derives_expected(context, words + x, expected + x, 1);
+    }
+    ok = ok && derives_expected(context, words, expected, count);
+    phonologen_context_free(context);
+    return ok;
+}
+
+// Returns whether a grammar derives the words file as a stream, on the given options, to text
+// whose words are the expected surface forms
+static int stream_derives_expected(
+        struct phonologen_grammar *grammar,
+        const struct phonologen_options *options,
+        const char *words_path,
+        const char *const expected[],
+        size_t count) {
+    FILE *in = fopen(words_path, "rb");
+    FILE *out = tmpfile();
+    int ok = in && out
+        && phonologen_derive_stream(grammar, options, in, out) == PHONOLOGEN_OK;
+    if (ok) {
+        rewind(out);
+        char word[256];
+        size_t x = 0;
+        while (ok && fscanf(out, "%255s", word) == 1) {
+            ok = x < count && !strcmp(word, expected[x++]);
+        }
+        ok = ok && x == count;
+    }
+    if (in) {
+        fclose(in);
+    }
+    if (out) {
+        fclose(out);
+    }
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 6) {
+        fprintf(stderr, USAGE);
+        return 2;
+    }
+    char *words_text = read_file(argv[3]);
+    char *expected_text = read_file(argv[4]);
+    if (!words_text || !expected_text) {
+        fprintf(stderr, "Error reading %s or %s\n", argv[3], argv[4]);
+        return 2;
+    }
+    static const char *words[MAX_WORDS], *expected[MAX_WORDS];
+    size_t count = split_words(words_text, words);
+    if (split_words(expected_text, expected) != count) {
+        fprintf(stderr, "Error: %s and %s have different numbers of words\n", argv[3], argv[4]);
+        return 2;
+    }
+
+    struct phonologen_grammar *grammar;
+    check(phonologen_grammar_parse(argv[1], argv[2], &grammar) == PHONOLOGEN_OK, "parse grammar");
+    if (!grammar) {
+        return 1;
+    }
+
+    // Every way of deriving words one context at a time
+    struct phonologen_options options;
+    phonologen_options_init(&options);
+    check(grammar_derives_expected(grammar, NULL, words, expected, count), "derive");
+    options.cache_size = 0;
+    check(grammar_derives_expected(grammar, &options, words, expected, count),
+        "derive without memoization");
+    phonologen_options_init(&options);
+    options.fst_transitions = PHONOLOGEN_DEFAULT_FST_TRANSITIONS;
+    check(grammar_derives_expected(grammar, &options, words, expected, count),
+        "derive with transducers");
+    options.fst_transitions = 3;
+    check(grammar_derives_expected(grammar, &options, words, expected, count),
+        "derive past the transition budget");
+
+    // Streams, on one thread and several, in batches and pipelined
+    phonologen_options_init(&options);
+    check(stream_derives_expected(grammar, &options, argv[3], expected, count), "derive stream");
+    options.threads = 3;
+    check(stream_derives_expected(grammar, &options, argv[3], expected, count),
+        "derive stream on 3 threads");
+    options.batch_words = 7;
+    check(stream_derives_expected(grammar, &options, argv[3], expected, count),
+        "derive stream in batches on 3 threads");
+    options.threads = 1;
+    options.pipeline_depth = 2;
+    check(stream_derives_expected(grammar, &options, argv[3], expected, count),
+        "derive stream in batches, pipelined");
+
+    // A grammar compiled and loaded back derives the same
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/api_test.pgb", argv[5]);
+    check(phonologen_grammar_compile(grammar, path) == PHONOLOGEN_OK, "compile grammar");
+    struct phonologen_grammar *loaded;
+    check(phonologen_grammar_load(path, &loaded) == PHONOLOGEN_OK, "load grammar");
+    if (loaded) {
+        check(grammar_derives_expected(loaded, NULL, words, expected, count),
+            "derive with loaded grammar");
+        phonologen_grammar_free(loaded);
+    }
+
+    // Failures are returned, leave the output alone, and don't spoil the context for later calls
+    struct phonologen_context *context;
+    check(phonologen_context_new(grammar, NULL, &context) == PHONOLOGEN_OK, "new context");
+    if (context) {
+        const char *bad[] = {words[0], "Q"};
+        const char *output[] = {NULL, NULL};
+        check(phonologen_derive(context, bad, 2, output) == PHONOLOGEN_ERROR_DERIVE,
+            "derive word with no segments");
+        check(!output[0] && !output[1] && *phonologen_error(), "failed derivation left no output");
+        check(derives_expected(context, words, expected, count), "derive after a failure");
+        phonologen_context_free(context);
+    }
+    phonologen_options_init(&options);
+    options.batch_words = PHONOLOGEN_MAX_BATCH_WORDS + 1;
+    check(phonologen_context_new(grammar, &options, &context) == PHONOLOGEN_ERROR_ARGUMENT
+        && !context, "batch size out of range");
+    phonologen_options_init(&options);
+    snprintf(path, sizeof(path), "%s/api_test.checkpoints", argv[5]);
+    options.checkpoints = path;
+    options.threads = 2;
+    check(phonologen_derive_stream(grammar, &options, stdin, stdout) == PHONOLOGEN_ERROR_ARGUMENT,
+        "checkpoints on 2 threads");
+    struct phonologen_grammar *missing;
+    snprintf(path, sizeof(path), "%s/missing.pgb", argv[5]);
+    check(phonologen_grammar_load(path, &missing) == PHONOLOGEN_ERROR_IO && !missing,
+        "load missing grammar");
+
+    phonologen_grammar_free(grammar);
+    free(words_text);
+    free(expected_text);
+    printf("%u of %u library checks passed\n", checks - failures, checks);
+    return failures != 0;
+}
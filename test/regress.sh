@@ -0,0 +1,134 @@
+#!/bin/sh
+# Regression checks for phonologen, run by make test from the top directory once it's built
+# Prints every check that failed, and exits nonzero if any did
+
+BIN=build/phonologen
+API=build/api_test
+DIR=test
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+checks=0
+failures=0
+
+# Passes the check named by the first argument if the two files after it are identical
+same() {
+    checks=$((checks + 1))
+    if ! cmp -s "$2" "$3"; then
+        echo "FAIL: $1"
+        diff "$2" "$3" | head -5
+        failures=$((failures + 1))
+    fi
+}
+
+# Passes the check named by the first argument if running phonologen with the rest of the
+# arguments fails
+fails() {
+    name=$1
+    shift
+    checks=$((checks + 1))
+    if "$BIN" "$@" < /dev/null > /dev/null 2>&1; then
+        echo "FAIL: $name"
+        failures=$((failures + 1))
+    fi
+}
+
+# Passes the check named by the first argument if running phonologen with the rest of the
+# arguments on the sample words writes exactly what it does by default
+derives() {
+    name=$1
+    shift
+    "$BIN" "$@" < "$DIR/words.txt" > "$TMP/output.txt" 2> /dev/null
+    same "$name" "$TMP/default.txt" "$TMP/output.txt"
+}
+
+# The sample words derive by default to the surface forms the original engine gave them, which
+# separated words with single spaces rather than keeping the whitespace between them
+"$BIN" features.csv "$DIR/rules.txt" < "$DIR/words.txt" > "$TMP/default.txt"
+tr -s ' \n' '\n' < "$TMP/default.txt" > "$TMP/words.txt"
+same "sample words" "$DIR/expected.txt" "$TMP/words.txt"
+
+# Every other mode derives them exactly the same
+for mode in "--cache-size 0" "--cache-size 1K" "-j 3" --fst "--fst-transitions 3" "-j 3 --fst" \
+        --batch "--batch-words 7" "-j 3 --batch-words 7" --pipeline "--pipeline-depth 1" \
+        "--pipeline --batch-words 7" "--pipeline --fst"; do
+    derives "sample words ($mode)" $mode features.csv "$DIR/rules.txt"
+done
+"$BIN" --compile-grammar "$TMP/rules.pgb" features.csv "$DIR/rules.txt"
+for mode in "" "-j 3 --fst" "--pipeline --batch"; do
+    derives "sample words from compiled grammar ($mode)" $mode --grammar "$TMP/rules.pgb"
+done
+for mode in "" --batch "-j 3" --pipeline; do
+    "$BIN" $mode features.csv "$DIR/rules.txt" < /dev/null > "$TMP/output.txt"
+    same "empty input ($mode)" /dev/null "$TMP/output.txt"
+done
+
+# Checkpoints derive the same on the run that writes them, on one resuming from them, and on one
+# after a rule in the middle was dropped
+sed 8d "$DIR/rules.txt" > "$TMP/edited_rules.txt"
+"$BIN" features.csv "$TMP/edited_rules.txt" < "$DIR/words.txt" > "$TMP/edited.txt"
+derives "checkpoints (first run)" --checkpoints "$TMP/checkpoints" features.csv "$DIR/rules.txt"
+derives "checkpoints (resumed)" --checkpoints "$TMP/checkpoints" features.csv "$DIR/rules.txt"
+"$BIN" --checkpoints "$TMP/checkpoints" features.csv "$TMP/edited_rules.txt" \
+    < "$DIR/words.txt" > "$TMP/output.txt" 2> /dev/null
+same "checkpoints (rule dropped)" "$TMP/edited.txt" "$TMP/output.txt"
+
+# Variants derive every line as their rules do on their own
+"$BIN" --variants features.csv "$DIR/rules.txt" "$TMP/edited_rules.txt" \
+    < "$DIR/words.txt" > "$TMP/variants.txt"
+awk -F '\t' -v rules="$DIR/rules.txt" '$1 == rules' "$TMP/variants.txt" | cut -f 2- \
+    > "$TMP/output.txt"
+same "variants (sample rules)" "$TMP/default.txt" "$TMP/output.txt"
+awk -F '\t' -v rules="$TMP/edited_rules.txt" '$1 == rules' "$TMP/variants.txt" | cut -f 2- \
+    > "$TMP/output.txt"
+same "variants (rule dropped)" "$TMP/edited.txt" "$TMP/output.txt"
+
+# The standalone program a grammar is emitted as derives the same once compiled
+"$BIN" --emit-c "$TMP/rules.c" features.csv "$DIR/rules.txt"
+if "${CC:-cc}" -O1 -o "$TMP/rules" "$TMP/rules.c" 2> /dev/null; then
+    "$TMP/rules" < "$DIR/words.txt" > "$TMP/output.txt"
+    same "emitted C program" "$TMP/default.txt" "$TMP/output.txt"
+else
+    echo "Skipped: emitted C program (${CC:-cc} couldn't compile it)"
+fi
+
+# The library interface derives the sample words the same in every mode, and reports failures
+checks=$((checks + 1))
+if ! "$API" features.csv "$DIR/rules.txt" "$DIR/words.txt" "$DIR/expected.txt" "$TMP" \
+        > "$TMP/api.txt"; then
+    echo "FAIL: library interface"
+    grep -v "checks passed$" "$TMP/api.txt"
+    failures=$((failures + 1))
+fi
+
+# Compiled grammars derive exactly as the files they were compiled from, including insertions at
+# the end of a rule's context
+"$BIN" features.csv "$DIR/insertion_rules.txt" < "$DIR/insertion_words.txt" > "$TMP/text.txt"
+"$BIN" --compile-grammar "$TMP/insertion.pgb" features.csv "$DIR/insertion_rules.txt"
+"$BIN" --grammar "$TMP/insertion.pgb" < "$DIR/insertion_words.txt" > "$TMP/loaded.txt" 2>&1
+same "compiled insertion rules" "$TMP/text.txt" "$TMP/loaded.txt"
+
+# Words are only reported at a rule's pass limit if another pass would still change them
+echo uaaa | "$BIN" features.csv "$DIR/pass_limit_done_rules.txt" 2> "$TMP/warnings.txt" > /dev/null
+same "pass limit reached with nothing left to change" /dev/null "$TMP/warnings.txt"
+echo aaau | "$BIN" features.csv "$DIR/pass_limit_cut_rules.txt" 2> "$TMP/warnings.txt" > /dev/null
+checks=$((checks + 1))
+if ! grep -q "^Warning: rule on line 1 was still changing" "$TMP/warnings.txt"; then
+    echo "FAIL: pass limit reached with the word still changing"
+    failures=$((failures + 1))
+fi
+
+# A word that doesn't parse fails the run, but every word before it is still written out
+printf 'iuubi ugu\nit ' > "$TMP/expected.txt"
+for mode in "" --batch "-j 2" --pipeline; do
+    printf 'ioupi uku\nit Q ioupi\n' | "$BIN" $mode features.csv example_rules.txt \
+        > "$TMP/partial.txt" 2> /dev/null
+    same "output before a failed word ($mode)" "$TMP/expected.txt" "$TMP/partial.txt"
+done
+
+# Sizes that are negative or too big for their suffix are refused
+for size in -1 " 1" 1KB 99999999999G 18446744073709551616; do
+    fails "--cache-size '$size'" --cache-size "$size" features.csv example_rules.txt
+done
+
+echo "$((checks - failures)) of $checks checks passed"
+test "$failures" -eq 0